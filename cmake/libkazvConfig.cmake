@@ -5,6 +5,8 @@ find_dependency(Immer)
 find_dependency(Zug)
 find_dependency(Lager)
 find_dependency(Olm)
+set(THREADS_PREFER_PTHREAD_FLAG ON)
+find_dependency(Threads)
 
 set(_oldCmakeModulePath ${CMAKE_MODULE_PATH})
 set(CMAKE_MODULE_PATH "${CMAKE_CURRENT_LIST_DIR}" ${CMAKE_MODULE_PATH})
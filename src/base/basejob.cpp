@@ -216,6 +216,20 @@ namespace Kazv
         return ret;
     }
 
+    BaseJob BaseJob::withReturnType(ReturnType returnType) &&
+    {
+        auto ret = BaseJob(std::move(*this));
+        ret.m_d->returnType = returnType;
+        return ret;
+    }
+
+    BaseJob BaseJob::withReturnType(ReturnType returnType) const &
+    {
+        auto ret = BaseJob(*this);
+        ret.m_d->returnType = returnType;
+        return ret;
+    }
+
     json BaseJob::dataJson(const std::string &key) const
     {
         return m_d->data.get()[key];
@@ -146,6 +146,15 @@ namespace Kazv
         BaseJob withQueue(std::string id, JobQueuePolicy policy = AlwaysContinue) &&;
         BaseJob withQueue(std::string id, JobQueuePolicy policy = AlwaysContinue) const &;
 
+        /**
+         * Change how the response body should be returned.
+         *
+         * For example, use ReturnType::File to get the unparsed body
+         * of a job that would otherwise return Json.
+         */
+        BaseJob withReturnType(ReturnType returnType) &&;
+        BaseJob withReturnType(ReturnType returnType) const &;
+
         json dataJson(const std::string &key) const;
         std::string dataStr(const std::string &key) const;
         std::string jobId() const;
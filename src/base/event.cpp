@@ -8,6 +8,7 @@
 
 
 #include "event.hpp"
+#include "intern.hpp"
 
 namespace Kazv
 {
@@ -17,7 +18,9 @@ namespace Kazv
                      {"msgtype", "xyz.tusooa.kazv.not.yet.decrypted"},
                      {"body", "**This message has not yet been decrypted.**"}}}}};
 
-    Event::Event() : m_json(json::object()) {}
+    Event::Event() : m_json(json::object()) {
+        updateHeader();
+    }
 
     Event::Event(JsonWrap j)
         : m_json(j) {
@@ -29,6 +32,55 @@ namespace Kazv
                 m_decryptedJson = notYetDecryptedEvent;
             }
         }
+        updateHeader();
+    }
+
+    static InternedString internedFieldOf(const json &j, const char *key)
+    {
+        auto it = j.find(key);
+        if (it != j.end() && it->is_string()) {
+            return intern(it->get_ref<const std::string &>());
+        }
+        return intern("");
+    }
+
+    static std::string ownStringFieldOf(const json &j, const char *key)
+    {
+        auto it = j.find(key);
+        if (it != j.end() && it->is_string()) {
+            return it->get<std::string>();
+        }
+        return "";
+    }
+
+    void Event::updateHeader()
+    {
+        const auto &orig = originalJson().get();
+        const auto &r = raw().get();
+        auto h = Header{};
+
+        if (orig.is_object()) {
+            // the decrypted json does not have an event id
+            h.id = ownStringFieldOf(orig, "event_id");
+            h.sender = internedFieldOf(orig, "sender");
+            h.roomId = ownStringFieldOf(orig, "room_id");
+            auto ts = orig.find("origin_server_ts");
+            if (ts != orig.end() && ts->is_number()) {
+                h.originServerTs = ts->get<Timestamp>();
+            }
+        } else {
+            h.sender = intern("");
+        }
+
+        if (r.is_object()) {
+            h.type = internedFieldOf(r, "type");
+            h.stateKey = ownStringFieldOf(r, "state_key");
+            h.isState = r.contains("state_key");
+        } else {
+            h.type = intern("");
+        }
+
+        m_header = immer::box<Header>(std::move(h));
     }
 
     Event Event::fromSync(Event e, std::string roomId) {
@@ -37,29 +89,24 @@ namespace Kazv
         return Event(j);
     }
 
-    std::string Event::id() const {
-        // the decrypted json does not have an event id
-        return originalJson().get().contains("event_id")
-            ? originalJson().get().at("event_id")
-            : "";
+    const std::string &Event::id() const {
+        return m_header->id;
     }
 
-    std::string Event::sender() const {
-        return originalJson().get().contains("sender")
-            ? originalJson().get().at("sender")
-            : "";
+    const std::string &Event::sender() const {
+        return *(m_header->sender);
     }
 
     Timestamp Event::originServerTs() const {
-        return originalJson().get().contains("origin_server_ts")
-            ? originalJson().get().at("origin_server_ts")
-            : "";
+        return m_header->originServerTs;
+    }
+
+    const std::string &Event::type() const {
+        return *(m_header->type);
     }
 
-    std::string Event::type() const {
-        return raw().get().contains("type")
-            ? raw().get().at("type")
-            : "";
+    const std::string &Event::roomId() const {
+        return m_header->roomId;
     }
 
     JsonWrap Event::content() const {
@@ -68,15 +115,13 @@ namespace Kazv
             : json::object();
     }
 
-    std::string Event::stateKey() const {
-        return raw().get().contains("state_key")
-            ? raw().get().at("state_key")
-            : "";
+    const std::string &Event::stateKey() const {
+        return m_header->stateKey;
     }
 
     bool Event::isState() const
     {
-        return raw().get().contains("state_key");
+        return m_header->isState;
     }
 
     /// returns the decrypted json
@@ -105,6 +150,8 @@ namespace Kazv
         Event e(*this);
         e.m_decryptedJson = decryptedJson;
         e.m_decrypted = decrypted;
+        // type and state key come from the decrypted json
+        e.updateHeader();
         return e;
     }
 
@@ -11,7 +11,10 @@
 #include <string>
 #include <cstdint>
 
+#include <immer/box.hpp>
+
 #include "jsonwrap.hpp"
+#include "intern.hpp"
 
 namespace Kazv
 {
@@ -34,15 +37,18 @@ namespace Kazv
         static Event fromSync(Event e, std::string roomId);
 
         /// returns the id of this event
-        std::string id() const;
+        const std::string &id() const;
 
-        std::string sender() const;
+        const std::string &sender() const;
 
         Timestamp originServerTs() const;
 
-        std::string type() const;
+        const std::string &type() const;
+
+        const std::string &stateKey() const;
 
-        std::string stateKey() const;
+        /// returns the room id in the event json, or empty string if there is none
+        const std::string &roomId() const;
 
         /**
          * @return whether this event is a state event.
@@ -71,13 +77,36 @@ namespace Kazv
         template<class Archive>
         void serialize(Archive &ar, std::uint32_t const /*version*/ ) {
             ar & m_json & m_decryptedJson & m_decrypted & m_encrypted;
+            if constexpr (Archive::is_loading::value) {
+                updateHeader();
+            }
         }
 
     private:
+        /**
+         * The fields read by the accessors, parsed once from the json.
+         *
+         * Type and sender are interned, as there are only
+         * a few distinct values of them.
+         */
+        struct Header
+        {
+            std::string id;
+            InternedString sender;
+            InternedString type;
+            std::string roomId;
+            std::string stateKey;
+            Timestamp originServerTs{0};
+            bool isState{false};
+        };
+
+        void updateHeader();
+
         JsonWrap m_json;
         JsonWrap m_decryptedJson;
         DecryptionStatus m_decrypted{NotDecrypted};
         bool m_encrypted{false};
+        immer::box<Header> m_header;
     };
 
     bool operator==(Event a, Event b);
@@ -7,6 +7,7 @@
 
 #pragma once
 #include "libkazv-config.hpp"
+#include <optional>
 #include "kazvevents.hpp"
 
 namespace Kazv
@@ -16,5 +17,18 @@ namespace Kazv
     public:
         virtual ~EventInterface() = default;
         virtual void emit(KazvEvent e) = 0;
+
+        /**
+         * Get the types of events someone listens to.
+         *
+         * The client will not generate events of the other types.
+         *
+         * @return The types of events someone listens to, or
+         * std::nullopt if unknown, which means all of them are needed.
+         */
+        virtual std::optional<KazvEventTypes> subscribedEvents() const
+        {
+            return std::nullopt;
+        }
     };
 }
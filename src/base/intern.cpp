@@ -0,0 +1,106 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include "libkazv-config.hpp"
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "intern.hpp"
+
+namespace Kazv
+{
+    namespace
+    {
+        // Number of strings each thread keeps alive without asking the pool
+        constexpr std::size_t threadCacheSize = 64;
+
+        struct InternPool
+        {
+            std::shared_mutex mutex;
+            // The keys point into the strings, which are removed
+            // from the map before they are freed
+            std::unordered_map<std::string_view, std::weak_ptr<const std::string>> strings;
+        };
+
+        InternPool &internPool()
+        {
+            // Never destroyed, as interned strings in static
+            // objects may be freed after it
+            static auto pool = new InternPool();
+            return *pool;
+        }
+
+        void releaseInterned(const std::string *s)
+        {
+            auto &pool = internPool();
+            {
+                auto lock = std::unique_lock(pool.mutex);
+                auto it = pool.strings.find(*s);
+                // Someone else may have replaced the entry with a new string
+                // after this one expired
+                if (it != pool.strings.end() && it->first.data() == s->data()) {
+                    pool.strings.erase(it);
+                }
+            }
+            delete s;
+        }
+
+        InternedString internInPool(std::string_view s)
+        {
+            auto &pool = internPool();
+            {
+                auto lock = std::shared_lock(pool.mutex);
+                auto it = pool.strings.find(s);
+                if (it != pool.strings.end()) {
+                    if (auto ret = it->second.lock(); ret) {
+                        return ret;
+                    }
+                }
+            }
+
+            auto lock = std::unique_lock(pool.mutex);
+            // Someone else may have interned it after we released the shared lock
+            auto it = pool.strings.find(s);
+            if (it != pool.strings.end()) {
+                if (auto ret = it->second.lock(); ret) {
+                    return ret;
+                }
+                // It is being freed, and its entry is to be removed
+                // by releaseInterned(), which is waiting for the lock
+                pool.strings.erase(it);
+            }
+            auto ret = InternedString(new const std::string(s), &releaseInterned);
+            pool.strings.emplace(std::string_view(*ret), ret);
+            return ret;
+        }
+    }
+
+    InternedString intern(std::string_view s)
+    {
+        // The keys point into the strings held by the values
+        thread_local std::unordered_map<std::string_view, InternedString> cache;
+        auto it = cache.find(s);
+        if (it != cache.end()) {
+            return it->second;
+        }
+
+        auto ret = internInPool(s);
+        if (cache.size() >= threadCacheSize) {
+            cache.clear();
+        }
+        cache.emplace(std::string_view(*ret), ret);
+        return ret;
+    }
+
+    std::size_t internPoolSize()
+    {
+        auto &pool = internPool();
+        auto lock = std::shared_lock(pool.mutex);
+        return pool.strings.size();
+    }
+}
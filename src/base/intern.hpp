@@ -0,0 +1,49 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include "libkazv-config.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace Kazv
+{
+    /// A string shared by everyone who interned an equal string.
+    using InternedString = std::shared_ptr<const std::string>;
+
+    /**
+     * Intern a string.
+     *
+     * Strings that compare equal are interned to the same object
+     * while it is alive, so they can share the storage.
+     *
+     * The pool only keeps weak references. An interned string is
+     * freed, and removed from the pool, once no one holds it.
+     * Each thread also keeps a few recently interned strings
+     * alive, so that looking them up again does not take the
+     * lock of the pool. Hence the pool holds at most the strings
+     * still in use, plus a small constant number per thread.
+     *
+     * This function is thread-safe.
+     *
+     * @param s The string to intern.
+     *
+     * @return The interned string equal to `s`.
+     */
+    InternedString intern(std::string_view s);
+
+    /**
+     * Get the number of strings in the intern pool.
+     *
+     * This function is thread-safe.
+     *
+     * @return The number of strings in the intern pool.
+     */
+    std::size_t internPoolSize();
+}
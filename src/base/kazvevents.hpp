@@ -7,9 +7,13 @@
 
 #pragma once
 #include "libkazv-config.hpp"
+#include <bitset>
+#include <cstdint>
+#include <type_traits>
 #include <variant>
 #include "types.hpp"
 #include "event.hpp"
+#include "push-rules.hpp"
 #include "basejob.hpp"
 
 namespace Kazv
@@ -31,6 +35,41 @@ namespace Kazv
     {
     };
 
+    /**
+     * How long each phase of applying a sync response took,
+     * and how much work it did.
+     *
+     * It is emitted right before the SyncSuccessful of the same response.
+     * All times are in microseconds.
+     */
+    struct SyncMetrics
+    {
+        std::string nextToken;
+        /// From starting the request to receiving the response. Unless it is
+        /// a streaming sync, this includes parsing the response into json.
+        std::int64_t networkUs{0};
+        /// From receiving the response to starting to apply it.
+        /// Only non-zero in pipelined sync.
+        std::int64_t pendingUs{0};
+        /// Parsing the response in streaming sync, not including loadRoomsUs
+        std::int64_t parseUs{0};
+        std::int64_t loadRoomsUs{0};
+        /// Loading presence, account data and to-device messages
+        std::int64_t loadOthersUs{0};
+        std::int64_t deviceListsUs{0};
+        std::int64_t decryptUs{0};
+
+        std::size_t roomsTouched{0};
+        /// Number of events in the response
+        std::size_t eventsIngested{0};
+        std::size_t eventsDecrypted{0};
+        /// Size of the response body, or 0 if unknown
+        std::size_t bytesReceived{0};
+        /// Number of triggers emitted for the response, this one
+        /// and SyncSuccessful excluded
+        std::size_t triggersEmitted{0};
+    };
+
     struct PostInitialFiltersSuccessful
     {
     };
@@ -53,6 +92,8 @@ namespace Kazv
     struct ReceivingRoomTimelineEvent {
         Event event;
         std::string roomId;
+        /// What the push rules say to do with the event
+        PushAction pushAction;
     };
 
     struct ReceivingRoomAccountDataEvent {
@@ -147,6 +188,33 @@ namespace Kazv
         std::string eventId;
     };
 
+    /**
+     * How long sending an encrypted message with Room::sendMessage()
+     * took, by phase.
+     *
+     * It is emitted right before the SendMessageSuccessful of the same
+     * message. All times are in microseconds. Phases that were not
+     * needed take 0, so that a message sent after
+     * Room::prepareEncryption() only has encryptUs and sendUs.
+     */
+    struct SendMessageMetrics
+    {
+        std::string roomId;
+        std::string eventId;
+        /// Loading the members of the room and querying their keys
+        std::int64_t loadMembersUs{0};
+        std::int64_t encryptUs{0};
+        /// Claiming one-time keys, then encrypting and sending the
+        /// megolm session key to the devices without it
+        std::int64_t shareSessionKeyUs{0};
+        /// The request sending the message
+        std::int64_t sendUs{0};
+        /// From calling Room::sendMessage() to receiving the response
+        std::int64_t totalUs{0};
+        /// Number of devices the megolm session key was sent to
+        std::size_t devicesSentSessionKey{0};
+    };
+
     struct SendMessageFailed
     {
         std::string roomId;
@@ -385,9 +453,43 @@ namespace Kazv
 
         // general
         UnrecognizedResponse,
-        ShouldQueryKeys
+        ShouldQueryKeys,
+
+        // metrics
+        SyncMetrics,
+        SendMessageMetrics
 
         >;
 
     using KazvEventList = immer::flex_vector<KazvEvent>;
+
+    namespace detail
+    {
+        template<class T, class Variant>
+        struct VariantIndexT;
+
+        template<class T, class ...Ts>
+        struct VariantIndexT<T, std::variant<Ts...>>
+        {
+            static constexpr std::size_t value = [] {
+                constexpr bool matches[] = {std::is_same_v<T, Ts>...};
+                for (std::size_t i = 0; i < sizeof...(Ts); ++i) {
+                    if (matches[i]) {
+                        return i;
+                    }
+                }
+                return sizeof...(Ts);
+            }();
+        };
+    }
+
+    /// The index of `T` in KazvEvent, i.e. `KazvEvent(T{}).index()`
+    template<class T>
+    constexpr std::size_t kazvEventIndex = detail::VariantIndexT<T, KazvEvent>::value;
+
+    /// A set of KazvEvent alternatives, indexed by kazvEventIndex
+    using KazvEventTypes = std::bitset<std::variant_size_v<KazvEvent>>;
+
+    /// The set of all KazvEvent alternatives
+    inline const KazvEventTypes allKazvEventTypes = KazvEventTypes{}.set();
 }
@@ -0,0 +1,84 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include "libkazv-config.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+
+#include "worker-pool.hpp"
+
+namespace Kazv
+{
+    /**
+     * Run `func(0)`, ..., `func(numTasks - 1)` on the threads of
+     * `pool` and the current thread.
+     *
+     * No thread is started. Returns once all calls have finished,
+     * even if some threads of `pool` are busy with other work.
+     *
+     * If any of the calls throws, the first exception is rethrown
+     * after all calls have finished.
+     *
+     * @param pool The pool to run on, or nullptr to run on the
+     * current thread only.
+     */
+    template<class Func>
+    void runInParallel(WorkerPool *pool, std::size_t numTasks, Func &&func)
+    {
+        // Shared with the helpers, which may start after all
+        // tasks are done and this function has returned.
+        struct State
+        {
+            std::atomic<std::size_t> nextTask{0};
+            std::mutex mutex;
+            std::condition_variable allFinished;
+            std::size_t numFinished{0};
+            std::exception_ptr exception;
+        };
+        auto state = std::make_shared<State>();
+
+        // `func` is only called for a task not yet finished,
+        // so it is still alive then.
+        auto work =
+            [state, numTasks, &func] {
+                for (auto i = state->nextTask++; i < numTasks; i = state->nextTask++) {
+                    auto exception = std::exception_ptr{};
+                    try {
+                        func(i);
+                    } catch (...) {
+                        exception = std::current_exception();
+                    }
+
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (exception && ! state->exception) {
+                        state->exception = exception;
+                    }
+                    if (++state->numFinished == numTasks) {
+                        state->allFinished.notify_all();
+                    }
+                }
+            };
+
+        auto numHelpers = (pool && numTasks > 1) ? std::min(pool->size(), numTasks - 1) : 0;
+        for (std::size_t i = 0; i < numHelpers; ++i) {
+            pool->post(work);
+        }
+        work();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->allFinished.wait(lock, [&] { return state->numFinished == numTasks; });
+        if (state->exception) {
+            std::rethrow_exception(state->exception);
+        }
+    }
+}
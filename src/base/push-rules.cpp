@@ -0,0 +1,556 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include "libkazv-config.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "debug.hpp"
+
+#include "push-rules.hpp"
+
+namespace Kazv
+{
+    namespace
+    {
+        std::string toLower(std::string s)
+        {
+            std::transform(s.begin(), s.end(), s.begin(),
+                           [](unsigned char c) { return std::tolower(c); });
+            return s;
+        }
+
+        bool isWordChar(unsigned char c)
+        {
+            return std::isalnum(c) || c == '_';
+        }
+
+        /// Split `content.body` into `content` and `body`, where `\.`
+        /// is a literal dot and `\\` is a literal backslash.
+        std::vector<std::string> splitKey(const std::string &key)
+        {
+            auto path = std::vector<std::string>{std::string{}};
+            for (auto i = std::size_t{}; i < key.size(); ++i) {
+                if (key[i] == '\\' && i + 1 < key.size()
+                    && (key[i + 1] == '.' || key[i + 1] == '\\')) {
+                    path.back() += key[++i];
+                } else if (key[i] == '.') {
+                    path.emplace_back();
+                } else {
+                    path.back() += key[i];
+                }
+            }
+            return path;
+        }
+
+        const json *valueAt(const json &j, const std::vector<std::string> &path)
+        {
+            auto cur = &j;
+            for (const auto &k : path) {
+                if (! cur->is_object()) {
+                    return nullptr;
+                }
+                auto it = cur->find(k);
+                if (it == cur->end()) {
+                    return nullptr;
+                }
+                cur = &*it;
+            }
+            return cur;
+        }
+
+        /// A case-insensitive glob, matched against lowercased values
+        class Glob
+        {
+        public:
+            /**
+             * @param pattern The glob, where `*` matches any number of
+             * characters and `?` matches one.
+             * @param wordMatch Whether the glob should match any words in
+             * the value, instead of the whole value.
+             * @param literal Whether `*` and `?` in the pattern are
+             * plain characters.
+             */
+            Glob(const std::string &pattern, bool wordMatch, bool literal = false)
+                : m_pattern(toLower(pattern))
+                , m_wordMatch(wordMatch)
+                , m_literal(literal || m_pattern.find_first_of("*?") == std::string::npos)
+            {
+                if (m_literal) {
+                    m_required = m_pattern;
+                    return;
+                }
+
+                // Any match must contain the longest literal part
+                // of the pattern, which is quick to look for
+                auto start = std::size_t{};
+                while (start < m_pattern.size()) {
+                    auto end = m_pattern.find_first_of("*?", start);
+                    if (end == std::string::npos) {
+                        end = m_pattern.size();
+                    }
+                    if (end - start > m_required.size()) {
+                        m_required = m_pattern.substr(start, end - start);
+                    }
+                    start = end + 1;
+                }
+            }
+
+            bool matches(const std::string &lowerValue) const
+            {
+                if (! m_required.empty() && lowerValue.find(m_required) == std::string::npos) {
+                    return false;
+                }
+
+                if (! m_wordMatch) {
+                    return m_literal
+                        ? lowerValue == m_pattern
+                        : matchesAt(lowerValue, 0);
+                }
+
+                if (m_pattern.empty()) {
+                    return false;
+                }
+
+                if (m_literal) {
+                    for (auto pos = lowerValue.find(m_pattern);
+                         pos != std::string::npos;
+                         pos = lowerValue.find(m_pattern, pos + 1)) {
+                        if (isWordStart(lowerValue, pos) && isWordEnd(lowerValue, pos + m_pattern.size())) {
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+                for (auto pos = std::size_t{}; pos < lowerValue.size(); ++pos) {
+                    if (isWordStart(lowerValue, pos) && matchesAt(lowerValue, pos)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+        private:
+            static bool isWordStart(const std::string &s, std::size_t pos)
+            {
+                return pos == 0 || ! isWordChar(s[pos - 1]) || ! isWordChar(s[pos]);
+            }
+
+            static bool isWordEnd(const std::string &s, std::size_t pos)
+            {
+                return pos == s.size() || ! isWordChar(s[pos]) || (pos > 0 && ! isWordChar(s[pos - 1]));
+            }
+
+            /**
+             * Match the pattern against `s` from `start`, with a `*`
+             * extending one character at a time when what follows
+             * it fails.
+             *
+             * When matching words, the match may end at any word end,
+             * otherwise it must end at the end of `s`.
+             */
+            bool matchesAt(const std::string &s, std::size_t start) const
+            {
+                auto p = std::size_t{};
+                auto i = start;
+                auto starP = std::string::npos;
+                auto starI = std::size_t{};
+
+                while (true) {
+                    if (p == m_pattern.size()
+                        && (m_wordMatch ? isWordEnd(s, i) : i == s.size())) {
+                        return true;
+                    }
+
+                    if (p < m_pattern.size() && m_pattern[p] == '*') {
+                        starP = p++;
+                        starI = i;
+                    } else if (p < m_pattern.size() && i < s.size()
+                               && (m_pattern[p] == '?' || m_pattern[p] == s[i])) {
+                        ++p;
+                        ++i;
+                    } else if (starP != std::string::npos && starI < s.size()) {
+                        p = starP + 1;
+                        i = ++starI;
+                    } else {
+                        return false;
+                    }
+                }
+            }
+
+            std::string m_pattern;
+            bool m_wordMatch;
+            bool m_literal;
+            /// What every value matching the pattern must contain
+            std::string m_required;
+        };
+
+        /// The event being evaluated, with the lowercased strings in it
+        /// computed once for all conditions.
+        class EventView
+        {
+        public:
+            EventView(const Event &e, const json &j) : event(e), j(j) {}
+
+            const std::string &lowerAt(const json *value) const
+            {
+                for (const auto &[v, lower] : m_lowered) {
+                    if (v == value) {
+                        return lower;
+                    }
+                }
+                m_lowered.emplace_back(value, toLower(value->get<std::string>()));
+                return m_lowered.back().second;
+            }
+
+            const Event &event;
+            const json &j;
+
+        private:
+            mutable std::vector<std::pair<const json *, std::string>> m_lowered;
+        };
+
+        struct EventMatchCondition
+        {
+            std::vector<std::string> path;
+            Glob glob;
+
+            bool matches(const EventView &e, const PushRuleContext &) const
+            {
+                auto v = valueAt(e.j, path);
+                return v && v->is_string() && glob.matches(e.lowerAt(v));
+            }
+        };
+
+        struct EventPropertyIsCondition
+        {
+            std::vector<std::string> path;
+            json value;
+
+            bool matches(const EventView &e, const PushRuleContext &) const
+            {
+                auto v = valueAt(e.j, path);
+                return v && *v == value;
+            }
+        };
+
+        struct EventPropertyContainsCondition
+        {
+            std::vector<std::string> path;
+            json value;
+
+            bool matches(const EventView &e, const PushRuleContext &) const
+            {
+                auto v = valueAt(e.j, path);
+                return v && v->is_array()
+                    && std::find(v->begin(), v->end(), value) != v->end();
+            }
+        };
+
+        struct ContainsDisplayNameCondition
+        {
+            std::vector<std::string> path{"content", "body"};
+
+            bool matches(const EventView &e, const PushRuleContext &ctx) const
+            {
+                auto v = valueAt(e.j, path);
+                if (! v || ! v->is_string() || ctx.displayName.empty()) {
+                    return false;
+                }
+                // Display names differ between rooms, so they cannot
+                // be compiled with the rules. They have no wildcards
+                // though, so matching them is only a search.
+                return Glob(ctx.displayName, true, true).matches(e.lowerAt(v));
+            }
+        };
+
+        struct RoomMemberCountCondition
+        {
+            enum Op { Eq, Lt, Gt, Le, Ge };
+            Op op;
+            int count;
+
+            bool matches(const EventView &, const PushRuleContext &ctx) const
+            {
+                switch (op) {
+                case Eq: return ctx.memberCount == count;
+                case Lt: return ctx.memberCount < count;
+                case Gt: return ctx.memberCount > count;
+                case Le: return ctx.memberCount <= count;
+                case Ge: return ctx.memberCount >= count;
+                }
+                return false;
+            }
+        };
+
+        struct SenderNotificationPermissionCondition
+        {
+            std::string key;
+
+            bool matches(const EventView &e, const PushRuleContext &ctx) const
+            {
+                const auto &pl = ctx.powerLevels.get();
+                if (! pl.is_object()) {
+                    return false;
+                }
+
+                auto required = 50;
+                if (pl.contains("notifications") && pl["notifications"].is_object()
+                    && pl["notifications"].contains(key)
+                    && pl["notifications"][key].is_number_integer()) {
+                    required = pl["notifications"][key].get<int>();
+                }
+
+                auto level = 0;
+                const auto &sender = e.event.sender();
+                if (pl.contains("users") && pl["users"].is_object()
+                    && pl["users"].contains(sender)
+                    && pl["users"][sender].is_number_integer()) {
+                    level = pl["users"][sender].get<int>();
+                } else if (pl.contains("users_default") && pl["users_default"].is_number_integer()) {
+                    level = pl["users_default"].get<int>();
+                }
+
+                return level >= required;
+            }
+        };
+
+        using Condition = std::variant<
+            EventMatchCondition,
+            EventPropertyIsCondition,
+            EventPropertyContainsCondition,
+            ContainsDisplayNameCondition,
+            RoomMemberCountCondition,
+            SenderNotificationPermissionCondition
+            >;
+
+        std::optional<RoomMemberCountCondition> memberCountConditionOf(const std::string &is)
+        {
+            using Op = RoomMemberCountCondition::Op;
+            auto op = Op::Eq;
+            auto rest = is;
+            for (auto [prefix, prefixOp] : {
+                    std::pair{"==", Op::Eq}, std::pair{"<=", Op::Le}, std::pair{">=", Op::Ge},
+                    std::pair{"<", Op::Lt}, std::pair{">", Op::Gt}}) {
+                if (is.rfind(prefix, 0) == 0) {
+                    op = prefixOp;
+                    rest = is.substr(std::string(prefix).size());
+                    break;
+                }
+            }
+
+            if (rest.empty() || ! std::all_of(rest.begin(), rest.end(), [](unsigned char c) { return std::isdigit(c); })) {
+                return std::nullopt;
+            }
+            try {
+                return RoomMemberCountCondition{op, std::stoi(rest)};
+            } catch (const std::exception &) {
+                return std::nullopt;
+            }
+        }
+
+        std::string stringField(const json &j, const std::string &key)
+        {
+            return j.contains(key) && j[key].is_string() ? j[key].get<std::string>() : std::string{};
+        }
+
+        /// @return the compiled condition, or std::nullopt if we do not know it
+        std::optional<Condition> conditionOf(const json &c)
+        {
+            if (! c.is_object()) {
+                return std::nullopt;
+            }
+
+            auto kind = stringField(c, "kind");
+            auto key = stringField(c, "key");
+            if (kind == "event_match" && c.contains("pattern") && c["pattern"].is_string()) {
+                // Keep the word matching of content.body that servers use
+                return EventMatchCondition{splitKey(key), Glob(c["pattern"].get<std::string>(), key == "content.body")};
+            } else if (kind == "event_property_is" && c.contains("value")) {
+                return EventPropertyIsCondition{splitKey(key), c["value"]};
+            } else if (kind == "event_property_contains" && c.contains("value")) {
+                return EventPropertyContainsCondition{splitKey(key), c["value"]};
+            } else if (kind == "contains_display_name") {
+                return ContainsDisplayNameCondition{};
+            } else if (kind == "room_member_count") {
+                auto cond = memberCountConditionOf(stringField(c, "is"));
+                if (cond) {
+                    return cond.value();
+                }
+            } else if (kind == "sender_notification_permission" && ! key.empty()) {
+                return SenderNotificationPermissionCondition{key};
+            }
+            return std::nullopt;
+        }
+
+        PushAction actionOf(const json &actions)
+        {
+            auto res = PushAction{};
+            if (! actions.is_array()) {
+                return res;
+            }
+            for (const auto &a : actions) {
+                if (a == "notify") {
+                    res.notify = true;
+                } else if (a.is_object() && a.contains("set_tweak")) {
+                    auto tweak = stringField(a, "set_tweak");
+                    if (tweak == "sound") {
+                        auto sound = stringField(a, "value");
+                        if (! sound.empty()) {
+                            res.sound = sound;
+                        }
+                    } else if (tweak == "highlight") {
+                        res.highlight = ! a.contains("value")
+                            || (a["value"].is_boolean() && a["value"].get<bool>());
+                    }
+                }
+            }
+            return res;
+        }
+
+        struct CompiledRule
+        {
+            std::vector<Condition> conditions;
+            PushAction action;
+
+            bool matches(const EventView &e, const PushRuleContext &ctx) const
+            {
+                return std::all_of(
+                    conditions.begin(), conditions.end(),
+                    [&](const auto &c) {
+                        return std::visit([&](const auto &cond) { return cond.matches(e, ctx); }, c);
+                    });
+            }
+        };
+
+        /// @return the compiled rule, or std::nullopt if it can never match
+        std::optional<CompiledRule> ruleOf(const json &r, std::string kind)
+        {
+            if (! r.is_object()
+                || (r.contains("enabled") && r["enabled"] == false)) {
+                return std::nullopt;
+            }
+
+            auto rule = CompiledRule{};
+            rule.action = actionOf(r.contains("actions") ? r["actions"] : json::array());
+            rule.action.ruleId = stringField(r, "rule_id");
+
+            if (kind == "content") {
+                if (! r.contains("pattern") || ! r["pattern"].is_string()) {
+                    return std::nullopt;
+                }
+                rule.conditions.push_back(EventMatchCondition{
+                        {"content", "body"}, Glob(r["pattern"].get<std::string>(), true)});
+            } else if (kind == "override" || kind == "underride") {
+                if (r.contains("conditions") && r["conditions"].is_array()) {
+                    for (const auto &c : r["conditions"]) {
+                        auto cond = conditionOf(c);
+                        if (! cond) {
+                            return std::nullopt;
+                        }
+                        rule.conditions.push_back(std::move(cond.value()));
+                    }
+                }
+            }
+            // Room and sender rules are matched by their ids
+
+            return rule;
+        }
+    }
+
+    struct PushRulesDesc::Private
+    {
+        std::vector<CompiledRule> overrideRules;
+        std::vector<CompiledRule> contentRules;
+        std::unordered_map<std::string, CompiledRule> roomRules;
+        std::unordered_map<std::string, CompiledRule> senderRules;
+        std::vector<CompiledRule> underrideRules;
+    };
+
+    PushRulesDesc::PushRulesDesc()
+        : m_d(std::make_shared<Private>())
+    {
+    }
+
+    PushRulesDesc::PushRulesDesc(const Event &pushRulesEvent)
+    {
+        auto d = std::make_shared<Private>();
+        auto contentWrap = pushRulesEvent.content();
+        const auto &content = contentWrap.get();
+
+        if (content.contains("global") && content["global"].is_object()) {
+            const auto &global = content["global"];
+            auto rulesOf = [&](std::string kind) {
+                auto rules = std::vector<CompiledRule>{};
+                if (global.contains(kind) && global[kind].is_array()) {
+                    for (const auto &r : global[kind]) {
+                        auto rule = ruleOf(r, kind);
+                        if (rule) {
+                            rules.push_back(std::move(rule.value()));
+                        }
+                    }
+                }
+                return rules;
+            };
+
+            d->overrideRules = rulesOf("override");
+            d->contentRules = rulesOf("content");
+            for (auto &r : rulesOf("room")) {
+                auto id = r.action.ruleId;
+                d->roomRules.try_emplace(std::move(id), std::move(r));
+            }
+            for (auto &r : rulesOf("sender")) {
+                auto id = r.action.ruleId;
+                d->senderRules.try_emplace(std::move(id), std::move(r));
+            }
+            d->underrideRules = rulesOf("underride");
+        } else {
+            kzo.base.dbg() << "m.push_rules has no global rules" << std::endl;
+        }
+
+        m_d = std::move(d);
+    }
+
+    PushAction PushRulesDesc::handle(const Event &e, const PushRuleContext &ctx) const
+    {
+        if (e.sender() == ctx.userId) {
+            return PushAction{};
+        }
+
+        auto raw = e.raw();
+        auto view = EventView(e, raw.get());
+        auto firstMatch = [&](const std::vector<CompiledRule> &rules) -> const CompiledRule * {
+            for (const auto &r : rules) {
+                if (r.matches(view, ctx)) {
+                    return &r;
+                }
+            }
+            return nullptr;
+        };
+
+        if (auto r = firstMatch(m_d->overrideRules); r) {
+            return r->action;
+        }
+        if (auto r = firstMatch(m_d->contentRules); r) {
+            return r->action;
+        }
+        if (auto it = m_d->roomRules.find(e.roomId()); it != m_d->roomRules.end()) {
+            return it->second.action;
+        }
+        if (auto it = m_d->senderRules.find(e.sender()); it != m_d->senderRules.end()) {
+            return it->second.action;
+        }
+        if (auto r = firstMatch(m_d->underrideRules); r) {
+            return r->action;
+        }
+        return PushAction{};
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include "libkazv-config.hpp"
+
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "jsonwrap.hpp"
+#include "event.hpp"
+
+namespace Kazv
+{
+    /// What to do with an event, according to the push rules
+    struct PushAction
+    {
+        bool notify{false};
+        bool highlight{false};
+        /// The sound to play when notifying, if any
+        std::optional<std::string> sound;
+        /// The id of the rule that matched, or empty if none did
+        std::string ruleId;
+    };
+
+    inline bool operator==(const PushAction &a, const PushAction &b)
+    {
+        return a.notify == b.notify
+            && a.highlight == b.highlight
+            && a.sound == b.sound
+            && a.ruleId == b.ruleId;
+    }
+
+    inline bool operator!=(const PushAction &a, const PushAction &b)
+    {
+        return !(a == b);
+    }
+
+    /// What the push rules need to know about the room of an event
+    struct PushRuleContext
+    {
+        /// The id of the current user
+        std::string userId;
+        /// The display name of the current user in the room
+        std::string displayName;
+        /// The number of joined members of the room
+        int memberCount{0};
+        /// The content of the `m.room.power_levels` event of the room
+        JsonWrap powerLevels;
+    };
+
+    /**
+     * Push rules compiled for evaluation on the client.
+     *
+     * The rules in an `m.push_rules` account data event are compiled
+     * once into matchers: keys are split into paths, globs are
+     * lowercased, and the longest literal part of each glob is taken
+     * out so that most values can be rejected by a substring search.
+     * Rules that are disabled or have conditions we do not know are
+     * dropped, as they can never match.
+     *
+     * A PushRulesDesc is immutable and cheap to copy.
+     */
+    class PushRulesDesc
+    {
+    public:
+        /// Construct a PushRulesDesc without any rule
+        PushRulesDesc();
+
+        /**
+         * Compile the push rules in an account data event.
+         *
+         * @param pushRulesEvent The `m.push_rules` account data event.
+         */
+        explicit PushRulesDesc(const Event &pushRulesEvent);
+
+        /**
+         * Evaluate the push rules against an event.
+         *
+         * Events sent by the current user never notify.
+         *
+         * @param e The event, which must have its room id set.
+         * @param ctx The context of the room of `e`.
+         *
+         * @return The actions of the first rule that matches `e`.
+         */
+        PushAction handle(const Event &e, const PushRuleContext &ctx) const;
+
+    private:
+        struct Private;
+        std::shared_ptr<const Private> m_d;
+    };
+}
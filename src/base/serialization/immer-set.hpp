@@ -0,0 +1,56 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+
+#pragma once
+
+#include <libkazv-config.hpp>
+
+#include <boost/serialization/nvp.hpp>
+#include <boost/serialization/split_free.hpp>
+
+#include <immer/set.hpp>
+
+namespace boost::serialization
+{
+
+    template <class Archive, class T, class H, class E, class MP>
+    void save(Archive &ar, const immer::set<T, H, E, MP> &set, const unsigned int /* version */)
+    {
+        auto size = set.size();
+        ar << BOOST_SERIALIZATION_NVP(size);
+        for (const auto &v : set) {
+            ar << v;
+        }
+    }
+
+    template <class Archive, class T, class H, class E, class MP>
+    void load(Archive &ar, immer::set<T, H, E, MP> &set, const unsigned int /* version */)
+    {
+        // set transient is not yet implemented
+        using SizeT = decltype(set.size());
+
+        set = {};
+
+        SizeT size{};
+        ar >> BOOST_SERIALIZATION_NVP(size);
+
+        for (auto i = SizeT{}; i < size; ++i) {
+            T v;
+            ar >> v;
+            set = std::move(set).insert(std::move(v));
+        }
+
+        assert(size == set.size());
+    }
+
+    template<class Archive, class T, class H, class E, class MP>
+    inline void serialize(Archive &ar, immer::set<T, H, E, MP> &s, const unsigned int version)
+    {
+        boost::serialization::split_free(ar, s, version);
+    }
+
+}
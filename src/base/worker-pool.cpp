@@ -0,0 +1,71 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include "libkazv-config.hpp"
+
+#include "worker-pool.hpp"
+
+namespace Kazv
+{
+    WorkerPool::WorkerPool(std::size_t numThreads)
+    {
+        m_threads.reserve(numThreads);
+        for (std::size_t i = 0; i < numThreads; ++i) {
+            m_threads.emplace_back([this] { work(); });
+        }
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_hasTasks.notify_all();
+        for (auto &t : m_threads) {
+            t.join();
+        }
+    }
+
+    std::size_t WorkerPool::size() const
+    {
+        return m_threads.size();
+    }
+
+    void WorkerPool::post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_hasTasks.notify_one();
+    }
+
+    void WorkerPool::work()
+    {
+        while (true) {
+            auto task = std::function<void()>{};
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_hasTasks.wait(lock, [this] { return m_stopping || ! m_tasks.empty(); });
+                if (m_tasks.empty()) {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::shared_ptr<WorkerPool> makeWorkerPool(int numThreads)
+    {
+        if (numThreads <= 1) {
+            return nullptr;
+        }
+        return std::make_shared<WorkerPool>(static_cast<std::size_t>(numThreads - 1));
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include "libkazv-config.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Kazv
+{
+    /**
+     * A fixed number of threads that run the tasks posted to them.
+     *
+     * The threads are started in the constructor and live until the
+     * pool is destroyed, so running work on the pool does not start
+     * any thread.
+     *
+     * This class is thread-safe.
+     */
+    class WorkerPool
+    {
+    public:
+        /**
+         * Start a pool.
+         *
+         * @param numThreads The number of threads in the pool.
+         */
+        explicit WorkerPool(std::size_t numThreads);
+
+        /**
+         * Run the tasks already posted, then stop the threads.
+         */
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        /// @return The number of threads in the pool.
+        std::size_t size() const;
+
+        /**
+         * Run `task` on one of the threads in the pool.
+         *
+         * @param task The task to run. It must not throw.
+         */
+        void post(std::function<void()> task);
+
+    private:
+        void work();
+
+        std::mutex m_mutex;
+        std::condition_variable m_hasTasks;
+        std::deque<std::function<void()>> m_tasks;
+        bool m_stopping{false};
+        std::vector<std::thread> m_threads;
+    };
+
+    /**
+     * Make a pool to run work on `numThreads` threads, the thread
+     * running the work included.
+     *
+     * @param numThreads The number of threads to run work on.
+     *
+     * @return A pool of `numThreads - 1` threads, or nullptr
+     * if `numThreads` is at most 1.
+     */
+    std::shared_ptr<WorkerPool> makeWorkerPool(int numThreads);
+}
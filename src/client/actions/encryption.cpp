@@ -6,6 +6,9 @@
 
 #include <libkazv-config.hpp>
 
+#include <algorithm>
+#include <vector>
+
 #include <zug/transducer/filter.hpp>
 #include <zug/transducer/cat.hpp>
 
@@ -173,7 +176,14 @@ namespace Kazv
                 {"body", "**This message cannot be decrypted due to " + reason + ".**"}}}};
     }
 
-    static bool verifyEvent(ClientModel &m, Event e, const json &plainJson)
+    /**
+     * Check that `e`, decrypted into `plainJson`, comes from a device we know.
+     *
+     * If `e` is decrypted by Crypto::decryptBatch(), `batchResult` holds
+     * the checks already made there.
+     */
+    static bool verifyEvent(ClientModel &m, Event e, const json &plainJson,
+                            const BatchDecryptResult *batchResult = nullptr)
     {
         auto crypto = m.crypto.value();
 
@@ -213,8 +223,11 @@ namespace Kazv
                     valid = false;
                 }
             } else if (algo == megOlmAlgo) {
-                if (! (plainJson.at("room_id").get<std::string>() ==
-                       e.originalJson().get().at("room_id").get<std::string>())) {
+                auto roomIdMatches = batchResult
+                    ? batchResult->roomIdMatches
+                    : (plainJson.at("room_id").get<std::string>() ==
+                       e.originalJson().get().at("room_id").get<std::string>());
+                if (! roomIdMatches) {
                     kzo.client.dbg() << "Room id does not match, thus invalid" << std::endl;
                     valid = false;
                 }
@@ -223,7 +236,9 @@ namespace Kazv
                     kzo.client.dbg() << "Device id does not match, thus invalid" << std::endl;
                     valid = false;
                 }
-                auto actualEd25519Key = crypto.getInboundGroupSessionEd25519KeyFromEvent(e.originalJson().get());
+                auto actualEd25519Key = batchResult
+                    ? MaybeString(batchResult->sessionEd25519Key)
+                    : crypto.getInboundGroupSessionEd25519KeyFromEvent(e.originalJson().get());
                 if ((! actualEd25519Key)
                     || deviceInfo.ed25519Key != actualEd25519Key.value()) {
                     kzo.client.dbg() << "sender ed25519 key does not match, thus invalid" << std::endl;
@@ -274,7 +289,132 @@ namespace Kazv
         }
     }
 
-    ClientModel tryDecryptEvents(ClientModel m)
+    static Event applyDecryptResult(ClientModel &m, Event e, const BatchDecryptResult &result)
+    {
+        if (! result.plainJson) {
+            kzo.client.dbg() << "Cannot decrypt: " << result.plainJson.reason() << std::endl;
+            return e.setDecryptedJson(cannotDecryptEvent(result.plainJson.reason()), Event::NotDecrypted);
+        }
+
+        const auto &plainJson = result.plainJson.value();
+        auto valid = verifyEvent(m, e, plainJson, &result);
+        return valid
+            ? e.setDecryptedJson(plainJson, Event::Decrypted)
+            : e.setDecryptedJson(cannotDecryptEvent("invalid event"), Event::NotDecrypted);
+    }
+
+    std::optional<KeyOfGroupSession> groupSessionKeyOf(const Event &e)
+    {
+        try {
+            auto j = e.originalJson();
+            const auto &content = j.get().at("content");
+            if (content.at("algorithm") != megOlmAlgo) {
+                return std::nullopt;
+            }
+            return KeyOfGroupSession{
+                j.get().at("room_id"),
+                content.at("sender_key"),
+                content.at("session_id")
+            };
+        } catch (const std::exception &) {
+            return std::nullopt;
+        }
+    }
+
+    /**
+     * Remove from the index of undecrypted events the entry of `k`,
+     * if any, and add its event ids to `eventIds`.
+     */
+    static void takeOutUndecryptedEvents(ClientModel &m, EventIdsByRoom &eventIds, const KeyOfGroupSession &k)
+    {
+        auto ids = m.undecryptedEvents.find(k);
+        if (! ids) {
+            return;
+        }
+        eventIds = std::move(eventIds)
+            .update(k.roomId, [ids](auto roomEventIds) {
+                                  for (const auto &id : *ids) {
+                                      roomEventIds = std::move(roomEventIds).push_back(id);
+                                  }
+                                  return roomEventIds;
+                              });
+        m.undecryptedEvents = std::move(m.undecryptedEvents).erase(k);
+    }
+
+    static ClientModel tryDecryptRoomEvents(ClientModel m, EventIdsByRoom eventIds, std::size_t *numDecrypted = nullptr)
+    {
+        // Decrypt the events of all rooms in one batch, so that
+        // those of different sessions are decrypted in parallel.
+        auto roomIds = std::vector<std::string>{};
+        auto events = std::vector<EventList>{};
+        auto eventJsons = std::vector<json>{};
+        for (const auto &[roomId, ids] : eventIds) {
+            if (! m.roomList.has(roomId)) {
+                continue;
+            }
+
+            const auto &room = m.roomList.rooms.at(roomId);
+            if (! room.encrypted) {
+                continue;
+            }
+
+            auto roomEvents = EventList{};
+            for (const auto &eventId : ids) {
+                auto eventPtr = room.messages.find(eventId);
+                if (! eventPtr || eventPtr->decrypted() || ! eventPtr->encrypted()) {
+                    continue;
+                }
+                roomEvents = std::move(roomEvents).push_back(*eventPtr);
+                eventJsons.push_back(eventPtr->originalJson().get());
+            }
+            if (roomEvents.empty()) {
+                continue;
+            }
+            roomIds.push_back(roomId);
+            events.push_back(std::move(roomEvents));
+        }
+
+        auto results = eventJsons.empty()
+            ? std::vector<BatchDecryptResult>{}
+            : m.crypto.value().decryptBatch(eventJsons, m.workerPool.get());
+
+        auto resultIndex = std::size_t{};
+        for (std::size_t r = 0; r < roomIds.size(); ++r) {
+            const auto &roomId = roomIds[r];
+            auto room = m.roomList[roomId];
+
+            auto decryptedEvents = EventList{};
+            for (const auto &encrypted : events[r]) {
+                auto e = applyDecryptResult(m, encrypted, results[resultIndex++]);
+                room.messages = std::move(room.messages).set(e.id(), e);
+
+                if (e.decrypted()) {
+                    decryptedEvents = std::move(decryptedEvents).push_back(e);
+                    if (numDecrypted) {
+                        ++*numDecrypted;
+                    }
+                } else {
+                    // Wait for the session key or the device keys
+                    // to arrive and try again then.
+                    auto k = groupSessionKeyOf(e);
+                    if (k) {
+                        m.undecryptedEvents = std::move(m.undecryptedEvents)
+                            .update(k.value(), [&](auto s) { return std::move(s).insert(e.id()); });
+                    }
+                }
+            }
+
+            // The server cannot search encrypted messages, so we do
+            room.searchIndex = SearchIndex::addEvents(std::move(room.searchIndex), decryptedEvents);
+            room.relations = RelationsIndex::addEvents(std::move(room.relations), decryptedEvents);
+            room = applyRedactions(std::move(room), decryptedEvents);
+            m.roomList.rooms = std::move(m.roomList.rooms).set(roomId, room);
+        }
+
+        return m;
+    }
+
+    ClientModel tryDecryptEvents(ClientModel m, EventIdsByRoom newEventIds, std::size_t *numDecrypted)
     {
         if (! m.crypto) {
             kzo.client.dbg() << "We have no encryption enabled--ignoring decryption request" << std::endl;
@@ -286,6 +426,8 @@ namespace Kazv
 
         auto decryptFunc = [&](auto e) { return decryptEvent(m, e); };
 
+        auto newSessions = immer::set<KeyOfGroupSession>{};
+
         auto takeOutRoomKeyEvents =
             [&](auto e) {
                 if (e.type() != "m.room_key") {
@@ -304,6 +446,7 @@ namespace Kazv
                 std::string ed25519Key = e.decryptedJson().get().at("keys").at(ed25519);
 
                 if (crypto.createInboundGroupSession(k, sessionKey, ed25519Key)) {
+                    newSessions = std::move(newSessions).insert(k);
                     return false; // such that this event is removed
                 }
                 return true;
@@ -315,36 +458,37 @@ namespace Kazv
             | zug::filter(takeOutRoomKeyEvents),
             std::move(m.toDevice));
 
-        auto decryptEventInRoom =
-            [&](auto id, auto room) {
-                if (! room.encrypted) {
-                    return;
-                } else {
-                    auto messages = room.messages;
-                    room.messages = merge(
-                        room.messages,
-                        intoImmer(
-                            EventList{},
-                            zug::filter([](auto n) {
-                                            auto e = n.second;
-                                            return e.encrypted();
-                                        })
-                            | zug::map([=](auto n) {
-                                           auto event = n.second;
-                                           return decryptFunc(event);
-                                       }),
-                            std::move(messages)),
-                        keyOfTimeline);
-                    m.roomList.rooms = std::move(m.roomList.rooms).set(id, room);
-                }
-            };
+        // Only the events that just arrived, and those waiting for
+        // the sessions we just received, need to be looked at.
+        auto eventIds = std::move(newEventIds);
+        for (const auto &k : newSessions) {
+            takeOutUndecryptedEvents(m, eventIds, k);
+        }
 
-        auto rooms = m.roomList.rooms;
-        for (auto [id, room]: rooms) {
-            decryptEventInRoom(id, room);
+        return tryDecryptRoomEvents(std::move(m), std::move(eventIds), numDecrypted);
+    }
+
+    ClientModel tryDecryptEventsFromDevices(ClientModel m, immer::set<std::string> curve25519Keys)
+    {
+        if (! m.crypto || curve25519Keys.empty()) {
+            return m;
         }
 
-        return m;
+        // The index is keyed by session, so we need to look
+        // at all of its keys here
+        auto keys = std::vector<KeyOfGroupSession>{};
+        for (const auto &[k, ids] : m.undecryptedEvents) {
+            if (curve25519Keys.count(k.senderKey)) {
+                keys.push_back(k);
+            }
+        }
+
+        auto eventIds = EventIdsByRoom{};
+        for (const auto &k : keys) {
+            takeOutUndecryptedEvents(m, eventIds, k);
+        }
+
+        return tryDecryptRoomEvents(std::move(m), std::move(eventIds));
     }
 
     std::optional<BaseJob> clientPerform(ClientModel m, QueryKeysAction a)
@@ -403,6 +547,7 @@ namespace Kazv
         auto &crypto = m.crypto.value();
 
         auto usersMap = r.deviceKeys();
+        auto newDeviceKeys = immer::set<std::string>{};
 
         for (auto [userId, deviceMap] : usersMap) {
             for (auto [deviceId, deviceInfo] : deviceMap) {
@@ -410,11 +555,28 @@ namespace Kazv
                                  << "/" << deviceId
                                  << ": " << json(deviceInfo).dump()
                                  << std::endl;
-                m.deviceLists.addDevice(userId, deviceId, deviceInfo, crypto);
+                if (m.deviceLists.addDevice(userId, deviceId, deviceInfo, crypto)) {
+                    auto info = m.deviceLists.get(userId, deviceId);
+                    if (info) {
+                        newDeviceKeys = std::move(newDeviceKeys).insert(info.value().curve25519Key);
+                    }
+                }
+            }
+            // The response has all devices of the user, so those
+            // not in it have been logged out
+            for (const auto &[deviceId, info] : m.deviceLists.devicesFor(userId)) {
+                if (! deviceMap.find(deviceId)) {
+                    kzo.client.dbg() << "Device " << userId << "/" << deviceId
+                                     << " is removed" << std::endl;
+                    m.deviceLists.removeDevice(userId, deviceId);
+                }
             }
             m.deviceLists.markUpToDate(userId);
         }
 
+        // Events from these devices could not be verified before
+        m = tryDecryptEventsFromDevices(std::move(m), std::move(newDeviceKeys));
+
         return { std::move(m), lager::noop };
     }
 
@@ -553,6 +715,11 @@ namespace Kazv
     ClientResult updateClient(ClientModel m, EncryptMegOlmEventAction a)
     {
         auto [encryptedEvent, maybeKey] = m.megOlmEncrypt(a.e, a.roomId, a.timeMs, a.random);
+        auto devicesToSend = maybeKey
+            ? m.devicesMissingSessionKey(a.roomId)
+            : ClientModel::UserIdToDeviceIdMap{};
+        // So that no other preparation sends the key to them again
+        m.addSessionKeyPendingRecipients(a.roomId, devicesToSend);
 
         return {
             std::move(m),
@@ -562,25 +729,124 @@ namespace Kazv
                     });
                 if (maybeKey.has_value()) {
                     retJson["key"] = maybeKey.value();
+                    retJson["devicesToSend"] = devicesToSend;
                 }
                 return EffectStatus(/* succ = */ true, retJson);
             }
         };
     }
 
+    ClientResult updateClient(ClientModel m, PrepareMegOlmSessionAction a)
+    {
+        if (a.random.size() < PrepareMegOlmSessionAction::maxRandomSize()) {
+            return {
+                std::move(m),
+                [](auto && /* ctx */) {
+                    return EffectStatus(/* succ = */ false, json{{"reason", "NotEnoughRandom"}});
+                }
+            };
+        }
+
+        auto maybeKey = m.prepareMegOlmSession(a.roomId, a.timeMs, a.random);
+        if (! maybeKey) {
+            return { std::move(m), lager::noop };
+        }
+
+        auto sessionId = m.crypto.value().outboundGroupSessionId(a.roomId);
+        auto devicesToSend = m.devicesMissingSessionKey(a.roomId);
+        // So that no other preparation sends the key to them again
+        m.addSessionKeyPendingRecipients(a.roomId, devicesToSend);
+
+        return {
+            std::move(m),
+            [=](auto && /* ctx */) {
+                return EffectStatus(/* succ = */ true, json{
+                        {"key", maybeKey.value()},
+                        {"sessionId", sessionId},
+                        {"devicesToSend", devicesToSend},
+                    });
+            }
+        };
+    }
+
     ClientResult updateClient(ClientModel m, EncryptOlmEventAction a)
     {
         auto encryptedEvent = m.olmEncrypt(a.e, a.devices, a.random);
 
+        // Devices without a known identity key or an olm session are skipped
+        auto ciphertext = encryptedEvent.originalJson().get()["content"]["ciphertext"];
+        auto encryptedDevices = EncryptOlmEventAction::UserIdToDeviceIdMap{};
+        for (const auto &[userId, deviceIds] : a.devices) {
+            auto encryptedDeviceIds = immer::flex_vector<std::string>{};
+            for (const auto &deviceId : deviceIds) {
+                auto info = m.deviceLists.get(userId, deviceId);
+                if (info && ciphertext.contains(info->curve25519Key)) {
+                    encryptedDeviceIds = std::move(encryptedDeviceIds).push_back(deviceId);
+                }
+            }
+            if (! encryptedDeviceIds.empty()) {
+                encryptedDevices = std::move(encryptedDevices).set(userId, std::move(encryptedDeviceIds));
+            }
+        }
+
         return {
             std::move(m),
             [=](auto && /* ctx */) {
                 auto retJson = json::object({
                         {"encrypted", encryptedEvent.originalJson()},
+                        {"devices", encryptedDevices},
                     });
 
                 return EffectStatus(/* succ = */ true, retJson);
             }
         };
     }
+
+    ClientResult updateClient(ClientModel m, AddSessionKeyRecipientsAction a)
+    {
+        auto room = m.roomList[a.roomId];
+        if (room.outboundSessionId != a.sessionId) {
+            kzo.client.dbg() << "The session " << a.sessionId << " of " << a.roomId
+                             << " has been rotated, not recording its recipients" << std::endl;
+            return { std::move(m), lager::noop };
+        }
+
+        for (const auto &devices : {a.devices, a.attemptedDevices}) {
+            for (const auto &[userId, deviceIds] : devices) {
+                auto pending = room.sessionKeyPendingRecipients[userId];
+                for (const auto &deviceId : deviceIds) {
+                    pending = std::move(pending).erase(deviceId);
+                }
+                room.sessionKeyPendingRecipients = pending.empty()
+                    ? std::move(room.sessionKeyPendingRecipients).erase(userId)
+                    : std::move(room.sessionKeyPendingRecipients).set(userId, std::move(pending));
+            }
+        }
+
+        for (const auto &[userId, deviceIds] : a.devices) {
+            auto recipients = room.sessionKeyRecipients[userId];
+            for (const auto &deviceId : deviceIds) {
+                auto info = m.deviceLists.get(userId, deviceId);
+                if (info) {
+                    recipients = std::move(recipients).set(deviceId, info->curve25519Key);
+                }
+            }
+            room.sessionKeyRecipients = std::move(room.sessionKeyRecipients).set(userId, std::move(recipients));
+        }
+
+        // Only the recipients change, so the membership index stays valid
+        m.roomList.rooms = std::move(m.roomList.rooms).set(a.roomId, room);
+
+        // Devices whose sending failed are missing the key again,
+        // so the session is still to be shared with them
+        if (room.sessionKeyPendingRecipients.empty()
+            && m.devicesMissingSessionKey(a.roomId).empty()) {
+            m.roomList.rooms = std::move(m.roomList.rooms)
+                .update(a.roomId, [](auto r) {
+                                      r.shouldShareSessionKey = false;
+                                      return r;
+                                  });
+        }
+        return { std::move(m), lager::noop };
+    }
 }
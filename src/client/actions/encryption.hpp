@@ -17,7 +17,32 @@ namespace Kazv
     ClientResult updateClient(ClientModel m, GenerateAndUploadOneTimeKeysAction a);
     ClientResult processResponse(ClientModel m, UploadKeysResponse r);
 
-    ClientModel tryDecryptEvents(ClientModel m);
+    using EventIdsByRoom = immer::map<std::string /* roomId */, immer::flex_vector<std::string /* eventId */>>;
+
+    /// @return the megolm session that `e` is encrypted with, if any
+    std::optional<KeyOfGroupSession> groupSessionKeyOf(const Event &e);
+
+    /**
+     * Decrypt to-device messages, and the room events that may have
+     * become decryptable.
+     *
+     * Only the events in `newEventIds`, and those indexed in
+     * `ClientModel::undecryptedEvents` under a megolm session
+     * that we just received, are tried. Events that still cannot be
+     * decrypted are (re-)added to the index.
+     *
+     * @param m The client model.
+     * @param newEventIds The ids of the events just added to each room.
+     * @param numDecrypted If not null, the number of room events
+     * decrypted is added to it.
+     */
+    ClientModel tryDecryptEvents(ClientModel m, EventIdsByRoom newEventIds, std::size_t *numDecrypted = nullptr);
+
+    /**
+     * Retry the undecrypted events sent from the devices with
+     * the given curve25519 keys.
+     */
+    ClientModel tryDecryptEventsFromDevices(ClientModel m, immer::set<std::string> curve25519Keys);
 
     std::optional<BaseJob> clientPerform(ClientModel m, QueryKeysAction a);
     ClientResult updateClient(ClientModel m, QueryKeysAction a);
@@ -28,5 +53,9 @@ namespace Kazv
 
     ClientResult updateClient(ClientModel m, EncryptMegOlmEventAction a);
 
+    ClientResult updateClient(ClientModel m, PrepareMegOlmSessionAction a);
+
     ClientResult updateClient(ClientModel m, EncryptOlmEventAction a);
+
+    ClientResult updateClient(ClientModel m, AddSessionKeyRecipientsAction a);
 }
@@ -11,6 +11,8 @@
 #include <zug/tuplify.hpp>
 #include <zug/transducer/eager.hpp>
 #include <zug/into.hpp>
+#include <zug/transducer/filter.hpp>
+#include <zug/transducer/map.hpp>
 
 #include <lager/util.hpp>
 
@@ -21,9 +23,24 @@
 
 #include <status-utils.hpp>
 #include "paginate.hpp"
+#include "encryption.hpp"
 
 namespace Kazv
 {
+    static ClientModel tryDecryptNewEvents(ClientModel m, std::string roomId, const EventList &events)
+    {
+        if (! m.crypto) {
+            return m;
+        }
+
+        auto encryptedEventIds = intoImmer(
+            immer::flex_vector<std::string>{},
+            zug::filter([](const Event &e) { return e.encrypted(); })
+            | zug::map([](const Event &e) { return e.id(); }),
+            events);
+        return tryDecryptEvents(std::move(m), EventIdsByRoom{}.set(roomId, encryptedEventIds));
+    }
+
     ClientResult updateClient(ClientModel m, PaginateTimelineAction a)
     {
         auto roomId = a.roomId;
@@ -34,6 +51,28 @@ namespace Kazv
             return { m, simpleFail };
         }
 
+        if (a.fromEventId == room.spilledGapEventId) {
+            auto store = m.timelineSpillStore;
+            if (! store) {
+                kzo.client.dbg() << "The events before " << a.fromEventId
+                                 << " are spilled, but there is no store to get them from" << std::endl;
+                return { m, simpleFail };
+            }
+
+            // The events being spilled would be popped, though
+            // they are still in memory
+            if (m.spillingRoomIds.count(roomId)) {
+                kzo.client.dbg() << "The events of " << roomId << " are being spilled, try again later" << std::endl;
+                return { m, simpleFail };
+            }
+
+            return { m, [store, roomId](auto &&ctx) {
+                            auto spilled = store->pop(roomId);
+                            auto hasMore = store->has(roomId);
+                            return ctx.dispatch(RestoreSpilledEventsAction{roomId, std::move(spilled), hasMore});
+                        } };
+        }
+
         auto paginateBackToken = room.timelineGaps[a.fromEventId];
 
         auto job = m.job<GetRoomEventsJob>().make(
@@ -72,12 +111,14 @@ namespace Kazv
             zug::into(events, zug::reversed, chunk);
 
             AddToTimelineAction action
-                {events.persistent(), paginateBackToken, std::nullopt, gapEventId};
+                {events.persistent(), paginateBackToken, std::nullopt, gapEventId, m.userId};
 
             m.roomList = RoomListModel::update(
                 std::move(m.roomList),
                 UpdateRoomAction{roomId, action});
 
+            m = tryDecryptNewEvents(std::move(m), roomId, action.events);
+
             m.addTrigger(PaginateSuccessful{roomId});
 
             return { std::move(m), lager::noop };
@@ -88,4 +129,88 @@ namespace Kazv
             return { std::move(m), simpleFail };
         }
     }
+
+    ClientResult updateClient(ClientModel m, SetTimelineWindowAction a)
+    {
+        m.timelineWindow = a.timelineWindow;
+        m.timelineSpillStore = std::move(a.store);
+        return { std::move(m), lager::noop };
+    }
+
+    ClientResult updateClient(ClientModel m, RestoreSpilledEventsAction a)
+    {
+        auto roomId = a.roomId;
+        if (! m.roomList.has(roomId)) {
+            return { std::move(m), simpleFail };
+        }
+
+        if (! a.spilled) {
+            kzo.client.dbg() << "Cannot read the spilled events of " << roomId << std::endl;
+            m.addTrigger(PaginateFailed{roomId});
+            return { std::move(m), simpleFail };
+        }
+
+        auto room = restoreSpilledEvents(m.roomList[roomId], a.spilled.value(), a.hasMore, m.userId);
+        m.roomList = RoomListModel::setRoom(std::move(m.roomList), std::move(room));
+        m = tryDecryptNewEvents(std::move(m), roomId, a.spilled.value().events);
+
+        m.addTrigger(PaginateSuccessful{roomId});
+
+        return { std::move(m), lager::noop };
+    }
+
+    ClientResult updateClient(ClientModel m, FinishSpillingEventsAction a)
+    {
+        auto roomId = a.roomId;
+        m.spillingRoomIds = std::move(m.spillingRoomIds).erase(roomId);
+        if (! a.saved || ! m.roomList.has(roomId)) {
+            return { std::move(m), simpleFail };
+        }
+
+        auto room = dropSpilledEvents(m.roomList[roomId], a.spilled);
+        if (! room) {
+            // The saved events are still in memory, and are
+            // skipped as duplicates when they are restored
+            kzo.client.dbg() << "The timeline of " << roomId
+                             << " has changed since its events were spilled, keeping them" << std::endl;
+            return { std::move(m), simpleFail };
+        }
+        m.roomList = RoomListModel::setRoom(std::move(m.roomList), std::move(room.value()));
+
+        return { std::move(m), lager::noop };
+    }
+
+    ClientResult spillTimelines(ClientModel m, const std::vector<std::string> &roomIds)
+    {
+        auto store = m.timelineSpillStore;
+        if (! m.timelineWindow || ! store) {
+            return { std::move(m), lager::noop };
+        }
+
+        auto spills = std::vector<std::pair<std::string, SpilledEvents>>{};
+        for (const auto &roomId : roomIds) {
+            // Its events spilled last are not dropped yet
+            if (m.spillingRoomIds.count(roomId)) {
+                continue;
+            }
+            auto spilled = eventsToSpill(m.roomList[roomId], m.timelineWindow);
+            if (! spilled.events.empty()) {
+                m.spillingRoomIds = std::move(m.spillingRoomIds).insert(roomId);
+                spills.emplace_back(roomId, std::move(spilled));
+            }
+        }
+
+        if (spills.empty()) {
+            return { std::move(m), lager::noop };
+        }
+
+        // Drop the events from memory only after they are saved,
+        // or they would be lost
+        return { std::move(m), [store, spills=std::move(spills)](auto &&ctx) {
+                                   for (const auto &[roomId, spilled] : spills) {
+                                       auto saved = store->push(roomId, spilled);
+                                       ctx.dispatch(FinishSpillingEventsAction{roomId, spilled, saved});
+                                   }
+                               } };
+    }
 }
@@ -7,6 +7,9 @@
 #pragma once
 #include <libkazv-config.hpp>
 
+#include <string>
+#include <vector>
+
 #include <csapi/message_pagination.hpp>
 
 #include "client-model.hpp"
@@ -15,4 +18,17 @@ namespace Kazv
 {
     ClientResult updateClient(ClientModel m, PaginateTimelineAction a);
     ClientResult processResponse(ClientModel m, GetRoomEventsResponse a);
+    ClientResult updateClient(ClientModel m, SetTimelineWindowAction a);
+    ClientResult updateClient(ClientModel m, RestoreSpilledEventsAction a);
+    ClientResult updateClient(ClientModel m, FinishSpillingEventsAction a);
+
+    /**
+     * Spill the timelines of the rooms in `roomIds` that are longer
+     * than the timeline window.
+     *
+     * @return The model, and the effect that saves the events into
+     * the store. They are dropped from memory by a
+     * FinishSpillingEventsAction after they are saved.
+     */
+    ClientResult spillTimelines(ClientModel m, const std::vector<std::string> &roomIds);
 }
@@ -9,6 +9,7 @@
 
 #include <debug.hpp>
 #include <types.hpp>
+#include <time-util.hpp>
 
 #include "send.hpp"
 #include "status-utils.hpp"
@@ -20,6 +21,32 @@ namespace Kazv
         return std::to_string(std::stoull(cur) + 1);
     }
 
+    // Keys in the job data for timing a send
+    static const std::string sendStartedUsKey = "sendStartedUs";
+    static const std::string sendMetricsKey = "metrics";
+
+    static json metricsToJson(const SendMessageMetrics &metrics)
+    {
+        return json{
+            {"loadMembersUs", metrics.loadMembersUs},
+            {"encryptUs", metrics.encryptUs},
+            {"shareSessionKeyUs", metrics.shareSessionKeyUs},
+            {"totalUs", metrics.totalUs},
+            {"devicesSentSessionKey", metrics.devicesSentSessionKey},
+        };
+    }
+
+    static SendMessageMetrics metricsFromJson(const json &j)
+    {
+        auto metrics = SendMessageMetrics{};
+        metrics.loadMembersUs = j.at("loadMembersUs").get<std::int64_t>();
+        metrics.encryptUs = j.at("encryptUs").get<std::int64_t>();
+        metrics.shareSessionKeyUs = j.at("shareSessionKeyUs").get<std::int64_t>();
+        metrics.totalUs = j.at("totalUs").get<std::int64_t>();
+        metrics.devicesSentSessionKey = j.at("devicesSentSessionKey").get<std::size_t>();
+        return metrics;
+    }
+
     ClientResult updateClient(ClientModel m, SendMessageAction a)
     {
         auto event = std::move(a.event);
@@ -51,9 +78,15 @@ namespace Kazv
 
         m.nextTxnId = increaseTxnId(m.nextTxnId);
 
+        auto data = json{{"roomId", a.roomId}};
+        if (a.metrics) {
+            data[sendMetricsKey] = metricsToJson(a.metrics.value());
+            data[sendStartedUsKey] = nowUs();
+        }
+
         auto job = m.job<SendMessageJob>()
             .make(a.roomId, type, txnId, content)
-            .withData(json{{"roomId", a.roomId}});
+            .withData(std::move(data));
 
         m.addJob(std::move(job));
 
@@ -69,6 +102,16 @@ namespace Kazv
             return { std::move(m), lager::noop };
         }
 
+        const auto &data = r.extraData.get();
+        if (data.contains(sendMetricsKey)) {
+            auto metrics = metricsFromJson(data[sendMetricsKey]);
+            metrics.roomId = roomId;
+            metrics.eventId = r.eventId();
+            metrics.sendUs = nowUs() - data[sendStartedUsKey].get<std::int64_t>();
+            metrics.totalUs += metrics.sendUs;
+            m.addTrigger(std::move(metrics));
+        }
+
         m.addTrigger(SendMessageSuccessful{roomId, r.eventId()});
         return { std::move(m), lager::noop };
     }
@@ -0,0 +1,493 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <vector>
+
+#include <immer/flex_vector_transient.hpp>
+
+#include <debug.hpp>
+
+#include "sync-parser.hpp"
+
+namespace Kazv
+{
+    namespace
+    {
+        /**
+         * The SAX handler for sync responses.
+         *
+         * The json is walked along the path
+         * `rooms.<membership>.<roomId>.<section>.events[]`. Each event,
+         * and every value off this path, is built into a small DOM
+         * ("captured") and then stored where it belongs.
+         */
+        class SyncSaxHandler
+        {
+        public:
+            explicit SyncSaxHandler(std::function<void(SyncRoomData)> onRoom)
+                : m_onRoom(std::move(onRoom))
+            {}
+
+            bool null() { return value(json(nullptr)); }
+            bool boolean(bool b) { return value(json(b)); }
+            bool number_integer(json::number_integer_t v) { return value(json(v)); }
+            bool number_unsigned(json::number_unsigned_t v) { return value(json(v)); }
+            bool number_float(json::number_float_t v, const json::string_t &) { return value(json(v)); }
+            bool string(json::string_t &s) { return value(json(std::move(s))); }
+            // Json text never contains binary values
+            bool binary(json::binary_t &) { return true; }
+
+            bool start_object(std::size_t)
+            {
+                if (capturing()) {
+                    return startCapturedContainer(json::object());
+                }
+
+                if (m_path.empty() && ! m_started) {
+                    m_started = true;
+                    return true;
+                }
+
+                if (shouldWalkIntoObject()) {
+                    walkInto();
+                    return true;
+                }
+
+                startCapture();
+                return startCapturedContainer(json::object());
+            }
+
+            bool key(json::string_t &k)
+            {
+                m_key = std::move(k);
+                return true;
+            }
+
+            bool end_object()
+            {
+                if (capturing()) {
+                    return endCapturedContainer();
+                }
+
+                if (m_path.empty()) {
+                    // end of the whole response
+                    return true;
+                }
+
+                walkOut();
+                return true;
+            }
+
+            bool start_array(std::size_t)
+            {
+                if (capturing()) {
+                    return startCapturedContainer(json::array());
+                }
+
+                if (depth() == SectionDepth && m_key == "events") {
+                    m_inEvents = true;
+                    return true;
+                }
+
+                startCapture();
+                return startCapturedContainer(json::array());
+            }
+
+            bool end_array()
+            {
+                if (capturing()) {
+                    return endCapturedContainer();
+                }
+
+                m_inEvents = false;
+                return true;
+            }
+
+            bool parse_error(std::size_t position, const std::string &, const json::exception &e)
+            {
+                kzo.client.dbg() << "Cannot parse sync response at " << position
+                                 << ": " << e.what() << std::endl;
+                return false;
+            }
+
+            json rest() &&
+            {
+                return std::move(m_rest);
+            }
+
+        private:
+            // Depth of the object we are in: 1 = the response,
+            // 2 = rooms, 3 = rooms.join etc., 4 = a room, 5 = a section
+            // of the room, like timeline.
+            enum Depth
+            {
+                ResponseDepth = 1,
+                RoomsDepth,
+                MembershipDepth,
+                RoomDepth,
+                SectionDepth,
+            };
+
+            std::size_t depth() const { return m_path.size() + 1; }
+
+            bool capturing() const { return ! m_captureStack.empty(); }
+
+            bool shouldWalkIntoObject() const
+            {
+                switch (depth()) {
+                case ResponseDepth:
+                    return m_key == "rooms";
+                case RoomsDepth:
+                    // Other sections, like knock, are not loaded,
+                    // as in the non-streaming sync
+                    return m_key == "join" || m_key == "invite" || m_key == "leave";
+                case MembershipDepth:
+                case RoomDepth:
+                    return true;
+                default:
+                    return false;
+                }
+            }
+
+            void walkInto()
+            {
+                m_path.push_back(m_key);
+                if (depth() == RoomDepth) {
+                    m_room = SyncRoomData{};
+                    m_room.roomId = m_path[MembershipDepth - 1];
+                    const auto &membership = m_path[RoomsDepth - 1];
+                    m_room.membership =
+                        membership == "join" ? RoomMembership::Join
+                        : membership == "invite" ? RoomMembership::Invite
+                        : RoomMembership::Leave;
+                }
+            }
+
+            void walkOut()
+            {
+                if (depth() == RoomDepth) {
+                    // a room is finished
+                    m_onRoom(std::move(m_room));
+                    m_room = SyncRoomData{};
+                }
+                m_path.pop_back();
+            }
+
+            void startCapture()
+            {
+                m_captureKey = m_key;
+            }
+
+            bool startCapturedContainer(json container)
+            {
+                if (m_captureStack.empty()) {
+                    m_captured = std::move(container);
+                    m_captureStack.push_back(&m_captured);
+                    return true;
+                }
+
+                auto &parent = *m_captureStack.back();
+                if (parent.is_object()) {
+                    auto &child = parent[m_key];
+                    child = std::move(container);
+                    m_captureStack.push_back(&child);
+                } else {
+                    parent.push_back(std::move(container));
+                    m_captureStack.push_back(&parent.back());
+                }
+                return true;
+            }
+
+            bool endCapturedContainer()
+            {
+                m_captureStack.pop_back();
+                if (m_captureStack.empty()) {
+                    finishCapture();
+                }
+                return true;
+            }
+
+            bool value(json v)
+            {
+                if (! m_captureStack.empty()) {
+                    auto &parent = *m_captureStack.back();
+                    if (parent.is_object()) {
+                        parent[m_key] = std::move(v);
+                    } else {
+                        parent.push_back(std::move(v));
+                    }
+                    return true;
+                }
+
+                // a scalar off the walked path
+                startCapture();
+                m_captured = std::move(v);
+                finishCapture();
+                return true;
+            }
+
+            void finishCapture()
+            {
+                auto captured = std::move(m_captured);
+                m_captured = json();
+
+                if (depth() == ResponseDepth) {
+                    m_rest[m_captureKey] = std::move(captured);
+                } else if (depth() == SectionDepth && m_inEvents) {
+                    addEvent(std::move(captured));
+                } else if (depth() == SectionDepth) {
+                    addSectionField(m_path[RoomDepth - 1], std::move(captured));
+                }
+                // Anything else is not something we know how to process
+            }
+
+            void addEvent(json e)
+            {
+                if (! e.is_object()) {
+                    return;
+                }
+
+                const auto &section = m_path[RoomDepth - 1];
+
+                auto append = [&](std::optional<EventList> &l, Event e) {
+                                  l = l.value_or(EventList{}).push_back(std::move(e));
+                              };
+
+                if (section == "timeline") {
+                    e["room_id"] = m_room.roomId;
+                    m_room.timelineEvents = std::move(m_room.timelineEvents).push_back(Event(JsonWrap(std::move(e))));
+                } else if (section == "state") {
+                    append(m_room.stateEvents, Event(JsonWrap(std::move(e))));
+                } else if (section == "account_data") {
+                    append(m_room.accountDataEvents, Event(JsonWrap(std::move(e))));
+                } else if (section == "ephemeral") {
+                    append(m_room.ephemeralEvents, Event(JsonWrap(std::move(e))));
+                } else if (section == "invite_state") {
+                    append(m_room.inviteStateEvents, Event(JsonWrap(std::move(e))));
+                }
+            }
+
+            void addSectionField(const std::string &section, json v)
+            {
+                if (section == "timeline") {
+                    if (m_captureKey == "prev_batch" && v.is_string()) {
+                        m_room.prevBatch = v.get<std::string>();
+                    } else if (m_captureKey == "limited" && v.is_boolean()) {
+                        m_room.limited = v.get<bool>();
+                    }
+                } else if (section == "summary") {
+                    if (m_captureKey == "m.heroes" && v.is_array()) {
+                        auto heroes = immer::flex_vector<std::string>{};
+                        for (const auto &hero : v) {
+                            if (hero.is_string()) {
+                                heroes = std::move(heroes).push_back(hero.get<std::string>());
+                            }
+                        }
+                        if (! heroes.empty()) {
+                            m_room.heroes = std::move(heroes);
+                        }
+                    } else if (m_captureKey == "m.joined_member_count" && v.is_number_integer()) {
+                        m_room.joinedMemberCount = v.get<int>();
+                    } else if (m_captureKey == "m.invited_member_count" && v.is_number_integer()) {
+                        m_room.invitedMemberCount = v.get<int>();
+                    }
+                } else if (section == "unread_notifications") {
+                    if (m_captureKey == "highlight_count" && v.is_number_integer()) {
+                        m_room.highlightCount = v.get<int>();
+                    } else if (m_captureKey == "notification_count" && v.is_number_integer()) {
+                        m_room.notificationCount = v.get<int>();
+                    }
+                }
+            }
+
+            std::function<void(SyncRoomData)> m_onRoom;
+
+            bool m_started{false};
+            std::vector<std::string> m_path;
+            std::string m_key;
+            bool m_inEvents{false};
+            SyncRoomData m_room;
+
+            std::vector<json *> m_captureStack;
+            std::string m_captureKey;
+            json m_captured;
+
+            json m_rest{json::object()};
+        };
+
+        /// The SAX handler that only looks for the top-level `next_batch`
+        class NextBatchSaxHandler
+        {
+        public:
+            bool null() { return true; }
+            bool boolean(bool) { return true; }
+            bool number_integer(json::number_integer_t) { return true; }
+            bool number_unsigned(json::number_unsigned_t) { return true; }
+            bool number_float(json::number_float_t, const json::string_t &) { return true; }
+            bool binary(json::binary_t &) { return true; }
+
+            bool string(json::string_t &s)
+            {
+                if (m_depth == 1 && m_key == "next_batch") {
+                    m_nextBatch = std::move(s);
+                    // No need to look further
+                    return false;
+                }
+                return true;
+            }
+
+            bool start_object(std::size_t) { ++m_depth; return true; }
+            bool end_object() { --m_depth; return true; }
+            bool start_array(std::size_t) { ++m_depth; return true; }
+            bool end_array() { --m_depth; return true; }
+
+            bool key(json::string_t &k)
+            {
+                if (m_depth == 1) {
+                    m_key = std::move(k);
+                }
+                return true;
+            }
+
+            bool parse_error(std::size_t position, const std::string &, const json::exception &e)
+            {
+                kzo.client.dbg() << "Cannot parse sync response at " << position
+                                 << ": " << e.what() << std::endl;
+                return false;
+            }
+
+            std::optional<std::string> nextBatch() &&
+            {
+                return std::move(m_nextBatch);
+            }
+
+        private:
+            std::size_t m_depth{0};
+            std::string m_key;
+            std::optional<std::string> m_nextBatch;
+        };
+
+        /// The SAX handler that only builds the top-level `account_data`
+        class AccountDataSaxHandler
+        {
+        public:
+            bool null() { return value(json(nullptr)); }
+            bool boolean(bool b) { return value(json(b)); }
+            bool number_integer(json::number_integer_t v) { return value(json(v)); }
+            bool number_unsigned(json::number_unsigned_t v) { return value(json(v)); }
+            bool number_float(json::number_float_t v, const json::string_t &) { return value(json(v)); }
+            bool string(json::string_t &s) { return value(json(std::move(s))); }
+            bool binary(json::binary_t &) { return true; }
+
+            bool start_object(std::size_t) { return startContainer(json::object()); }
+            bool end_object() { return endContainer(); }
+            bool start_array(std::size_t) { return startContainer(json::array()); }
+            bool end_array() { return endContainer(); }
+
+            bool key(json::string_t &k)
+            {
+                m_key = std::move(k);
+                return true;
+            }
+
+            bool parse_error(std::size_t position, const std::string &, const json::exception &e)
+            {
+                kzo.client.dbg() << "Cannot parse sync response at " << position
+                                 << ": " << e.what() << std::endl;
+                return false;
+            }
+
+            std::optional<json> accountData() &&
+            {
+                // Only complete if parsing got to its end
+                if (! m_done) {
+                    return std::nullopt;
+                }
+                return std::move(m_accountData);
+            }
+
+        private:
+            bool capturing() const { return ! m_captureStack.empty(); }
+
+            bool startContainer(json container)
+            {
+                if (capturing()) {
+                    auto &parent = *m_captureStack.back();
+                    if (parent.is_object()) {
+                        m_captureStack.push_back(&(parent[m_key] = std::move(container)));
+                    } else {
+                        parent.push_back(std::move(container));
+                        m_captureStack.push_back(&parent.back());
+                    }
+                } else if (m_depth == 1 && m_key == "account_data") {
+                    m_accountData = std::move(container);
+                    m_captureStack.push_back(&m_accountData.value());
+                }
+                ++m_depth;
+                return true;
+            }
+
+            bool endContainer()
+            {
+                --m_depth;
+                if (capturing()) {
+                    m_captureStack.pop_back();
+                    if (! capturing()) {
+                        m_done = true;
+                        // No need to look further
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            bool value(json v)
+            {
+                if (capturing()) {
+                    auto &parent = *m_captureStack.back();
+                    if (parent.is_object()) {
+                        parent[m_key] = std::move(v);
+                    } else {
+                        parent.push_back(std::move(v));
+                    }
+                }
+                return true;
+            }
+
+            std::size_t m_depth{0};
+            std::string m_key;
+            std::vector<json *> m_captureStack;
+            std::optional<json> m_accountData;
+            bool m_done{false};
+        };
+    }
+
+    std::optional<json> parseSyncStreaming(const std::string &body, std::function<void(SyncRoomData)> onRoom)
+    {
+        auto handler = SyncSaxHandler(std::move(onRoom));
+        auto ok = json::sax_parse(body, &handler);
+        if (! ok) {
+            return std::nullopt;
+        }
+        return std::move(handler).rest();
+    }
+
+    std::optional<std::string> syncNextBatch(const std::string &body)
+    {
+        auto handler = NextBatchSaxHandler();
+        json::sax_parse(body, &handler);
+        return std::move(handler).nextBatch();
+    }
+
+    std::optional<json> syncAccountData(const std::string &body)
+    {
+        auto handler = AccountDataSaxHandler();
+        json::sax_parse(body, &handler);
+        return std::move(handler).accountData();
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include <libkazv-config.hpp>
+
+#include <functional>
+#include <optional>
+#include <string>
+
+#include <types.hpp>
+#include <event.hpp>
+
+namespace Kazv
+{
+    /**
+     * The data of one room in a sync response.
+     *
+     * The timeline events already have `room_id` set.
+     */
+    struct SyncRoomData
+    {
+        std::string roomId;
+        RoomMembership membership;
+        EventList timelineEvents;
+        std::optional<std::string> prevBatch;
+        std::optional<bool> limited;
+        std::optional<EventList> stateEvents;
+        std::optional<EventList> accountDataEvents;
+        std::optional<EventList> ephemeralEvents;
+        std::optional<EventList> inviteStateEvents;
+        std::optional<immer::flex_vector<std::string>> heroes;
+        std::optional<int> joinedMemberCount;
+        std::optional<int> invitedMemberCount;
+        std::optional<int> highlightCount;
+        std::optional<int> notificationCount;
+    };
+
+    /**
+     * Parse a sync response body without building the DOM of the
+     * whole response.
+     *
+     * Each room is handed to `onRoom` as soon as it is parsed,
+     * and only the events of that room are kept in memory meanwhile.
+     *
+     * @param body The body of the sync response.
+     * @param onRoom The function to call with each room, in the order
+     * they appear in the response.
+     *
+     * @return The rest of the response, i.e. everything except `rooms`,
+     * or std::nullopt if `body` is not valid json.
+     */
+    std::optional<json> parseSyncStreaming(const std::string &body, std::function<void(SyncRoomData)> onRoom);
+
+    /**
+     * Get the `next_batch` of a sync response body without building
+     * any DOM.
+     *
+     * Parsing stops as soon as `next_batch` is found.
+     *
+     * @param body The body of the sync response.
+     *
+     * @return The `next_batch` in `body`, or std::nullopt if `body`
+     * is not valid json or does not contain it.
+     */
+    std::optional<std::string> syncNextBatch(const std::string &body);
+
+    /**
+     * Get the top-level `account_data` of a sync response body
+     * without building the DOM of anything else.
+     *
+     * Parsing stops as soon as `account_data` is parsed. It may come
+     * after `rooms` in the body, so this lets the push rules in it
+     * be loaded before the rooms are streamed.
+     *
+     * @param body The body of the sync response.
+     *
+     * @return The `account_data` in `body`, or std::nullopt if `body`
+     * is not valid json or does not contain it.
+     */
+    std::optional<json> syncAccountData(const std::string &body);
+}
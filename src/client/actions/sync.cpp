@@ -6,6 +6,16 @@
 
 #include <libkazv-config.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include <immer/flex_vector_transient.hpp>
+
 #include <lager/util.hpp>
 #include <zug/transducer/map.hpp>
 #include <zug/transducer/cat.hpp>
@@ -14,16 +24,26 @@
 
 #include <jobinterface.hpp>
 #include <debug.hpp>
+#include <parallel.hpp>
+#include <time-util.hpp>
 
 #include "cursorutil.hpp"
 
 #include "sync.hpp"
+#include "sync-parser.hpp"
 
 #include "encryption.hpp"
+#include "paginate.hpp"
 #include "status-utils.hpp"
 
 namespace Kazv
 {
+    // Keys in the job data for timing a sync
+    static const std::string syncStartedUsKey = "syncStartedUs";
+    static const std::string syncReceivedUsKey = "syncReceivedUs";
+    // Key in the job data for the token a sync started from
+    static const std::string syncSinceKey = "since";
+
     // Atomicity guaranteed: if the sync action is created
     // before an action that reasonably changes Client
     // (e.g. roll back to an earlier state, obtain other
@@ -34,156 +54,426 @@ namespace Kazv
     // from the ClientModel model it is passed.
     ClientResult updateClient(ClientModel m, SyncAction)
     {
+        if (m.pipelinedSync
+            && m.pendingSyncResponses.size() >= static_cast<std::size_t>(m.maxPendingSyncResponses)) {
+            kzo.client.dbg() << "Too many sync responses waiting to be applied, not syncing yet" << std::endl;
+            return {
+                std::move(m),
+                [](auto && /* ctx */) { return EffectStatus(/* succ = */ true, json{{"busy", true}}); }
+            };
+        }
+
+        // With pipelined sync, continue from the responses
+        // we have received but not yet applied
+        auto since = m.sinceToken();
+
         kzo.client.dbg() << "Start syncing with token " <<
-            (m.syncToken ? m.syncToken.value() : "<null>") << std::endl;
+            (since ? since.value() : "<null>") << std::endl;
 
-        bool isInitialSync = ! m.syncToken;
+        bool isInitialSync = ! since;
 
         m.syncing = true;
 
-        std::string filter = m.syncToken ? m.incrementalSyncFilterId : m.initialSyncFilterId;
-        m.addJob(m.job<SyncJob>()
-                 .make(filter,
-                       m.syncToken,
-                       std::nullopt, // fullState
-                       std::nullopt, // setPresence
-                       // Let initial sync return immediately
-                       isInitialSync ? 0 : m.syncTimeoutMs
-                     )
-                 .withData(json{{"is", isInitialSync ? "initial" : "incremental"}}));
+        std::string filter = since ? m.incrementalSyncFilterId : m.initialSyncFilterId;
+        BaseJob job = m.job<SyncJob>()
+            .make(filter,
+                  since,
+                  std::nullopt, // fullState
+                  std::nullopt, // setPresence
+                  // Let initial sync return immediately
+                  isInitialSync ? 0 : m.syncTimeoutMs
+                )
+            .withData(json{
+                    {"is", isInitialSync ? "initial" : "incremental"},
+                    {syncStartedUsKey, nowUs()},
+                    {syncSinceKey, since ? json(since.value()) : json(nullptr)},
+                });
+
+        if (m.streamingSync) {
+            // Get the unparsed body, we will parse it ourselves
+            job = std::move(job).withReturnType(BaseJob::ReturnType::File);
+        }
+
+        m.addJob(std::move(job));
         return { m, lager::noop };
     }
 
 
-    static KazvEventList loadRoomsFromSyncInPlace(ClientModel &m, SyncJob::Rooms rooms)
+    namespace
+    {
+        /// The changes one room in a sync response makes
+        struct RoomUpdatesFromSync
+        {
+            /// To be applied to the room in order
+            immer::flex_vector<RoomAction> actions;
+            KazvEventList triggers;
+        };
+
+        /// What loading rooms from sync needs to know about the client
+        struct RoomLoadParams
+        {
+            /// The types of triggers to generate
+            KazvEventTypes subscribed;
+            PushRulesDesc pushRules;
+            std::string userId;
+        };
+    }
+
+    static RoomLoadParams roomLoadParamsOf(const ClientModel &m)
+    {
+        return RoomLoadParams{m.subscribedTriggers, m.pushRules, m.userId};
+    }
+
+    /**
+     * Get the push rule context of a room as of the end of a sync
+     * response, without applying the response to the room first.
+     */
+    static PushRuleContext pushRuleContextIn(const RoomModel *oldRoom, const SyncRoomData &room, const std::string &userId)
+    {
+        auto ctx = oldRoom ? pushRuleContextOf(*oldRoom, userId) : PushRuleContext{userId, "", 0, JsonWrap()};
+
+        auto applyState = [&](const EventList &events) {
+            for (const auto &e : events) {
+                if (! e.isState()) {
+                    continue;
+                }
+                if (e.type() == "m.room.member" && e.stateKey() == userId) {
+                    auto content = e.content().get();
+                    ctx.displayName = content.contains("displayname") && content["displayname"].is_string()
+                        ? content["displayname"].get<std::string>() : std::string{};
+                } else if (e.type() == "m.room.power_levels" && e.stateKey().empty()) {
+                    ctx.powerLevels = e.content();
+                }
+            }
+        };
+        if (room.stateEvents) {
+            applyState(room.stateEvents.value());
+        }
+        applyState(room.timelineEvents);
+
+        if (room.joinedMemberCount) {
+            ctx.memberCount = room.joinedMemberCount.value();
+        }
+        return ctx;
+    }
+
+    static RoomUpdatesFromSync roomUpdatesFromSync(const RoomModel *oldRoom, const SyncRoomData &room, const RoomLoadParams &params)
     {
-        auto l = std::move(m.roomList);
         auto eventsToEmit = KazvEventList{}.transient();
+        const auto &id = room.roomId;
+
+        // Collect all changes to the room so that they can be applied
+        // at once, and the room is only copied and written back once
+        auto roomActions = immer::flex_vector<RoomAction>{}.transient();
 
         auto updateRoomImpl =
-            [&l](auto id, auto a) {
-                l = RoomListModel::update(
-                    std::move(l),
-                    UpdateRoomAction{std::move(id), std::move(a)});
+            [&roomActions](auto a) {
+                roomActions.push_back(std::move(a));
+            };
+        auto wants =
+            [&params](auto trigger) {
+                return params.subscribed.test(kazvEventIndex<decltype(trigger)>);
+            };
+        auto commitRoomUpdates =
+            [&roomActions, &eventsToEmit] {
+                return RoomUpdatesFromSync{roomActions.persistent(), eventsToEmit.persistent()};
             };
-        auto updateSingleRoom =
-            [&, updateRoomImpl](const auto &id, const auto &room, auto membership) {
-                if (!l.has(id) || l[id].membership != membership) {
-                    eventsToEmit.push_back(RoomMembershipChanged{membership, id});
-                }
-                updateRoomImpl(id, ChangeMembershipAction{membership});
 
-                auto timelineEvents =
+        if (room.membership == RoomMembership::Invite) {
+            updateRoomImpl(ChangeMembershipAction{RoomMembership::Invite});
+            if (room.inviteStateEvents) {
+                updateRoomImpl(ChangeInviteStateAction{room.inviteStateEvents.value()});
+            }
+            return commitRoomUpdates();
+        }
+
+        if ((! oldRoom || oldRoom->membership != room.membership)
+            && wants(RoomMembershipChanged{})) {
+            eventsToEmit.push_back(RoomMembershipChanged{room.membership, id});
+        }
+        updateRoomImpl(ChangeMembershipAction{room.membership});
+
+        const auto &timelineEvents = room.timelineEvents;
+        if (wants(ReceivingRoomTimelineEvent{})) {
+            // Rules are evaluated against the state at the end of the
+            // response, as we do not apply it event by event
+            auto ctx = pushRuleContextIn(oldRoom, room, params.userId);
+            eventsToEmit.append(
+                intoImmer(
+                    KazvEventList{},
+                    zug::map([&](Event e) -> KazvEvent {
+                                 auto pushAction = params.pushRules.handle(e, ctx);
+                                 return ReceivingRoomTimelineEvent{std::move(e), id, std::move(pushAction)};
+                             }),
+                    timelineEvents).transient());
+        }
+        updateRoomImpl(AddToTimelineAction{timelineEvents,
+                room.prevBatch,
+                room.limited,
+                std::nullopt, // we do not have a gapEventId
+                params.userId
+                });
+        if (room.stateEvents) {
+            if (wants(ReceivingRoomStateEvent{})) {
+                eventsToEmit.append(
                     intoImmer(
-                        EventList{},
-                        zug::map([=](Event e) {
-                                     return Event::fromSync(e, id);
+                        KazvEventList{},
+                        zug::map([=](Event e) -> KazvEvent {
+                                     return ReceivingRoomStateEvent{std::move(e), id};
                                  }),
-                        room.timeline.events);
+                        room.stateEvents.value()).transient());
+            }
+            updateRoomImpl(AddStateEventsAction{room.stateEvents.value()});
+        }
+
+        // Process state events in timeline, which should have arrived later
+        // than those in room.state .
+        updateRoomImpl(AddStateEventsAction{
+                intoImmer(EventList{},
+                          zug::filter([=](Event e) {
+                                          return e.isState();
+                                      }),
+                          timelineEvents)});
+
+        if (room.accountDataEvents) {
+            if (wants(ReceivingRoomAccountDataEvent{})) {
                 eventsToEmit.append(
                     intoImmer(
                         KazvEventList{},
                         zug::map([=](Event e) -> KazvEvent {
-                                     return ReceivingRoomTimelineEvent{std::move(e), id};
+                                     return ReceivingRoomAccountDataEvent{std::move(e), id};
                                  }),
-                        timelineEvents).transient());
-                updateRoomImpl(id, AddToTimelineAction{timelineEvents,
-                            room.timeline.prevBatch,
-                            room.timeline.limited,
-                            std::nullopt // we do not have a gapEventId
-                            });
-                if (room.state) {
-                    eventsToEmit.append(
-                        intoImmer(
-                            KazvEventList{},
-                            zug::map([=](Event e) -> KazvEvent {
-                                         return ReceivingRoomStateEvent{std::move(e), id};
-                                     }),
-                            room.state.value().events).transient());
-                    updateRoomImpl(id, AddStateEventsAction{room.state.value().events});
-                }
+                        room.accountDataEvents.value()).transient());
+            }
+            updateRoomImpl(AddAccountDataAction{room.accountDataEvents.value(), params.userId});
+        }
 
-                // Process state events in timeline, which should have arrived later
-                // than those in room.state .
-                updateRoomImpl(id, AddStateEventsAction{
-                        intoImmer(EventList{},
-                                  zug::filter([=](Event e) {
-                                                  return e.isState();
-                                              }),
-                                  timelineEvents)});
-
-                if (room.accountData) {
-                    eventsToEmit.append(
-                        intoImmer(
-                            KazvEventList{},
-                            zug::map([=](Event e) -> KazvEvent {
-                                         return ReceivingRoomAccountDataEvent{std::move(e), id};
-                                     }),
-                            room.state.value().events).transient());
-                    updateRoomImpl(id, AddAccountDataAction{room.accountData.value().events});
-                }
-            };
+        if (room.ephemeralEvents) {
+            updateRoomImpl(AddEphemeralAction{room.ephemeralEvents.value()});
+        }
 
-        auto updateJoinedRoom =
-            [=](const auto &id, const auto &room) {
-                updateSingleRoom(id, room, RoomMembership::Join);
-                if (room.ephemeral) {
-                    updateRoomImpl(id, AddEphemeralAction{room.ephemeral.value().events});
-                }
-                // TODO update other info such as
-                // notification and summary
-            };
+        if (room.heroes || room.joinedMemberCount || room.invitedMemberCount) {
+            updateRoomImpl(UpdateSummaryAction{room.heroes, room.joinedMemberCount, room.invitedMemberCount});
+        }
+
+        if (room.highlightCount || room.notificationCount) {
+            updateRoomImpl(SetUnreadNotificationCountsAction{room.highlightCount, room.notificationCount});
+        }
+
+        return commitRoomUpdates();
+    }
+
+    static KazvEventList loadRoomFromSyncInPlace(RoomListModel &l, SyncRoomData room, const RoomLoadParams &params)
+    {
+        auto [actions, triggers] = roomUpdatesFromSync(l.rooms.find(room.roomId), room, params);
+        l = RoomListModel::update(
+            std::move(l),
+            UpdateRoomBatchAction{room.roomId, std::move(actions)});
+        return triggers;
+    }
 
-        auto updateInvitedRoom =
-            [=](const auto &id, const auto &room) {
-                updateRoomImpl(id, ChangeMembershipAction{RoomMembership::Invite});
-                if (room.inviteState) {
-                    updateRoomImpl(id, ChangeInviteStateAction{room.inviteState.value().events});
+    template<class RoomT>
+    static SyncRoomData syncRoomDataFrom(std::string id, RoomMembership membership, const RoomT &room)
+    {
+        auto data = SyncRoomData{};
+        data.roomId = id;
+        data.membership = membership;
+        data.timelineEvents = intoImmer(
+            EventList{},
+            zug::map([=](Event e) {
+                         return Event::fromSync(e, id);
+                     }),
+            room.timeline.events);
+        data.prevBatch = room.timeline.prevBatch;
+        data.limited = room.timeline.limited;
+        if (room.state) {
+            data.stateEvents = room.state.value().events;
+        }
+        if (room.accountData) {
+            data.accountDataEvents = room.accountData.value().events;
+        }
+        if constexpr (std::is_same_v<RoomT, SyncJob::JoinedRoom>) {
+            if (room.ephemeral) {
+                data.ephemeralEvents = room.ephemeral.value().events;
+            }
+            if (room.summary) {
+                const auto &summary = room.summary.value();
+                if (! summary.mHeroes.empty()) {
+                    data.heroes = immer::flex_vector<std::string>(summary.mHeroes.begin(), summary.mHeroes.end());
                 }
-            };
+                data.joinedMemberCount = summary.mJoinedMemberCount;
+                data.invitedMemberCount = summary.mInvitedMemberCount;
+            }
+            if (room.unreadNotifications) {
+                data.highlightCount = room.unreadNotifications.value().highlightCount;
+                data.notificationCount = room.unreadNotifications.value().notificationCount;
+            }
+        }
+        return data;
+    }
 
-        auto updateLeftRoom =
-            [=](const auto &id, const auto &room) {
-                updateSingleRoom(id, room, RoomMembership::Leave);
-            };
+    static SyncRoomData syncRoomDataFrom(std::string id, RoomMembership membership, const SyncJob::InvitedRoom &room)
+    {
+        auto data = SyncRoomData{};
+        data.roomId = id;
+        data.membership = membership;
+        if (room.inviteState) {
+            data.inviteStateEvents = room.inviteState.value().events;
+        }
+        return data;
+    }
+
+    namespace
+    {
+        /// A room in a sync response that is not converted to SyncRoomData yet
+        struct RoomInSync
+        {
+            std::string roomId;
+            std::function<SyncRoomData()> load;
+        };
+    }
+
+    static std::vector<RoomInSync> roomsInSync(const SyncJob::Rooms &rooms)
+    {
+        auto res = std::vector<RoomInSync>{};
+        res.reserve(rooms.join.size() + rooms.invite.size() + rooms.leave.size());
 
         for (const auto &[id, room]: rooms.join) {
-            updateJoinedRoom(id, room);
+            res.push_back({id, [id=id, &room=room] { return syncRoomDataFrom(id, RoomMembership::Join, room); }});
         }
 
         // TODO update info for invited rooms
         for (const auto &[id, room]: rooms.invite) {
-            updateInvitedRoom(id, room);
+            res.push_back({id, [id=id, &room=room] { return syncRoomDataFrom(id, RoomMembership::Invite, room); }});
         }
 
         for (const auto &[id, room]: rooms.leave) {
-            updateLeftRoom(id, room);
+            res.push_back({id, [id=id, &room=room] { return syncRoomDataFrom(id, RoomMembership::Leave, room); }});
         }
+        return res;
+    }
 
-        m.roomList = std::move(l);
-        return eventsToEmit.persistent();
+    static std::size_t eventCountIn(const SyncRoomData &room)
+    {
+        auto sizeOf = [](const std::optional<EventList> &l) -> std::size_t {
+                          return l ? l.value().size() : 0;
+                      };
+        return room.timelineEvents.size()
+            + sizeOf(room.stateEvents)
+            + sizeOf(room.accountDataEvents)
+            + sizeOf(room.ephemeralEvents)
+            + sizeOf(room.inviteStateEvents);
+    }
+
+    static immer::flex_vector<std::string> encryptedEventIdsIn(const SyncRoomData &room)
+    {
+        return intoImmer(
+            immer::flex_vector<std::string>{},
+            zug::filter([](const Event &e) { return e.encrypted(); })
+            | zug::map([](const Event &e) { return e.id(); }),
+            room.timelineEvents);
+    }
+
+    namespace
+    {
+        /// A room loaded on a worker thread, not yet put into the room list
+        struct LoadedRoom
+        {
+            RoomModel room;
+            KazvEventList triggers;
+            immer::flex_vector<std::string> encryptedEventIds;
+            std::size_t eventCount{0};
+        };
+    }
+
+    /**
+     * Load the rooms in a sync response on the threads of `pool`
+     * and the current thread.
+     *
+     * The same room may appear more than once in a sync response
+     * (e.g. both in `join` and `leave`), so the entries of one room
+     * are loaded one after another on the same thread.
+     *
+     * @return The loaded rooms, in the order each room first appears
+     * in `rooms`.
+     */
+    static std::vector<LoadedRoom> loadRoomsInParallel(const RoomListModel &l, const std::vector<RoomInSync> &rooms, WorkerPool *pool, const RoomLoadParams &params)
+    {
+        auto groups = std::vector<std::vector<const RoomInSync *>>{};
+        auto groupIndices = std::unordered_map<std::string, std::size_t>{};
+        for (const auto &room : rooms) {
+            auto [it, inserted] = groupIndices.try_emplace(room.roomId, groups.size());
+            if (inserted) {
+                groups.emplace_back();
+            }
+            groups[it->second].push_back(&room);
+        }
+
+        auto loaded = std::vector<LoadedRoom>(groups.size());
+
+        runInParallel(
+            pool, groups.size(),
+            [&](std::size_t i) {
+                const auto &roomId = groups[i].front()->roomId;
+                auto oldRoom = l.rooms.find(roomId);
+                auto res = LoadedRoom{oldRoom ? *oldRoom : RoomModel{}, {}, {}, 0};
+                res.room.roomId = roomId; // in case it is a new room
+                auto exists = !! oldRoom;
+
+                for (auto entry : groups[i]) {
+                    auto data = entry->load();
+                    auto [actions, triggers] = roomUpdatesFromSync(exists ? &res.room : nullptr, data, params);
+                    for (auto a : actions) {
+                        res.room = RoomModel::update(std::move(res.room), std::move(a));
+                    }
+                    res.triggers = std::move(res.triggers) + triggers;
+                    res.encryptedEventIds = std::move(res.encryptedEventIds) + encryptedEventIdsIn(data);
+                    res.eventCount += eventCountIn(data);
+                    exists = true;
+                }
+
+                loaded[i] = std::move(res);
+            });
+
+        return loaded;
     }
 
     static KazvEventList loadPresenceFromSyncInPlace(ClientModel &m, EventList presence)
     {
-        auto eventsToEmit = intoImmer(
-            KazvEventList{},
-            zug::map([](Event e) { return ReceivingPresenceEvent{e}; }),
-            presence);
+        auto eventsToEmit = KazvEventList{};
+        if (m.hasSubscribersFor<ReceivingPresenceEvent>()) {
+            eventsToEmit = intoImmer(
+                KazvEventList{},
+                zug::map([](Event e) { return ReceivingPresenceEvent{e}; }),
+                presence);
+        }
         m.presence = merge(std::move(m.presence), presence, keyOfPresence);
         return eventsToEmit;
     }
 
     static KazvEventList loadAccountDataFromSyncInPlace(ClientModel &m, EventList accountData)
     {
-        auto eventsToEmit = intoImmer(
-            KazvEventList{},
-            zug::map([](Event e) { return ReceivingPresenceEvent{e}; }),
-            accountData);
+        auto eventsToEmit = KazvEventList{};
+        if (m.hasSubscribersFor<ReceivingAccountDataEvent>()) {
+            eventsToEmit = intoImmer(
+                KazvEventList{},
+                zug::map([](Event e) { return ReceivingAccountDataEvent{e}; }),
+                accountData);
+        }
         m.accountData = merge(std::move(m.accountData), accountData, keyOfAccountData);
         return eventsToEmit;
     }
 
+    /// Compile the push rules in `accountData` into `m`, if they are there
+    static void loadPushRulesFromSyncInPlace(ClientModel &m, const EventList &accountData)
+    {
+        auto it = std::find_if(accountData.rbegin(), accountData.rend(),
+                               [](const auto &e) { return e.type() == "m.push_rules"; });
+        if (it != accountData.rend()) {
+            m.pushRules = PushRulesDesc(*it);
+        }
+    }
+
     static KazvEventList loadToDeviceFromSyncInPlace(ClientModel &m, JsonWrap toDevice)
     {
         if (toDevice.get().contains("events")) {
@@ -195,6 +485,10 @@ namespace Kazv
 
             m.toDevice = std::move(m.toDevice) + msgs;
 
+            if (! m.hasSubscribersFor<ReceivingToDeviceMessage>()) {
+                return {};
+            }
+
             return intoImmer(
                 KazvEventList{},
                 zug::map([](Event e) { return ReceivingToDeviceMessage{e}; }),
@@ -203,50 +497,159 @@ namespace Kazv
         return {};
     }
 
-    ClientResult processResponse(ClientModel m, SyncResponse r)
+    static std::size_t bodySizeOf(const Response &r)
     {
-        if (! r.success()) {
-            m.addTrigger(SyncFailed{});
-            kzo.client.dbg() << "Sync failed" << std::endl;
-            kzo.client.dbg() << r.statusCode << std::endl;
-            if (isBodyJson(r.body)) {
-                auto j = r.jsonBody();
-                kzo.client.dbg() << "Json says: " << j.get().dump() << std::endl;
+        if (std::holds_alternative<BytesBody>(r.body)) {
+            return std::get<BytesBody>(r.body).size();
+        }
+
+        // The job handler has already parsed the body,
+        // so we can only rely on what the server tells us
+        for (const auto &[name, value] : r.header.get()) {
+            auto lowerName = name;
+            std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(),
+                           [](unsigned char c) { return std::tolower(c); });
+            if (lowerName == "content-length") {
+                try {
+                    return std::stoull(value);
+                } catch (const std::exception &) {
+                    return 0;
+                }
+            }
+        }
+        return 0;
+    }
+
+    static ClientResult applySyncResponse(ClientModel m, SyncResponse r)
+    {
+        auto applyStartUs = nowUs();
+        const auto &data = r.extraData.get();
+        auto receivedUs = data.contains(syncReceivedUsKey)
+            ? data[syncReceivedUsKey].get<std::int64_t>()
+            : applyStartUs;
+        auto numTriggersBefore = m.nextTriggers.size();
+
+        auto metrics = SyncMetrics{};
+        if (data.contains(syncStartedUsKey)) {
+            metrics.networkUs = receivedUs - data[syncStartedUsKey].get<std::int64_t>();
+        }
+        metrics.pendingUs = applyStartUs - receivedUs;
+        metrics.bytesReceived = bodySizeOf(r);
+
+        auto newEncryptedEventIds = EventIdsByRoom{};
+        auto touchedRoomIds = std::vector<std::string>{};
+        auto pushRulesLoaded = false;
+        auto loadRoom =
+            [&](SyncRoomData room) {
+                auto startUs = nowUs();
+                ++metrics.roomsTouched;
+                touchedRoomIds.push_back(room.roomId);
+                metrics.eventsIngested += eventCountIn(room);
+                auto ids = encryptedEventIdsIn(room);
+                if (! ids.empty()) {
+                    // The same room may appear in more than one section
+                    newEncryptedEventIds = std::move(newEncryptedEventIds)
+                        .update(room.roomId, [&](auto prev) { return std::move(prev) + ids; });
+                }
+                m.addTriggers(loadRoomFromSyncInPlace(m.roomList, std::move(room), roomLoadParamsOf(m)));
+                metrics.loadRoomsUs += nowUs() - startUs;
+            };
+
+        if (std::holds_alternative<BytesBody>(r.body)) {
+            // Streaming sync: rooms are loaded as they are parsed,
+            // and we get the DOM of the rest of the response.
+            // Keep the model as it was, in case the response
+            // turns out to be invalid after some rooms are loaded.
+            auto orig = m;
+            auto startUs = nowUs();
+            const auto &body = std::get<BytesBody>(r.body);
+            // Changes to the push rules should apply to the rooms
+            // in the same response, as in the non-streaming sync.
+            // But account_data may come after the rooms, so look
+            // for it before streaming them.
+            if (auto accountData = syncAccountData(body); accountData) {
+                loadPushRulesFromSyncInPlace(m, accountData->get<EventBatch>().events);
+                pushRulesLoaded = true;
+            }
+            auto restOpt = parseSyncStreaming(body, loadRoom);
+            metrics.parseUs = nowUs() - startUs - metrics.loadRoomsUs;
+            if (! restOpt) {
+                kzo.client.dbg() << "Sync response is not valid json" << std::endl;
+                // With pipelined sync, the responses after this one
+                // continue from it, so drop them and sync again
+                // from syncToken.
+                orig.pendingSyncResponses = {};
+                orig.pendingSyncToken = orig.syncToken;
+                orig.addTrigger(SyncFailed{});
+                return { std::move(orig), simpleFail };
+            }
+            r.body = JsonBody(std::move(restOpt.value()));
+        } else {
+            // Changes to the push rules should apply to the rooms
+            // in the same response, so load them first
+            if (auto accountData = r.accountData(); accountData) {
+                loadPushRulesFromSyncInPlace(m, accountData.value().events);
+                pushRulesLoaded = true;
+            }
+
+            auto rooms = r.rooms();
+            auto roomList = rooms ? roomsInSync(rooms.value()) : std::vector<RoomInSync>{};
+            if (m.workerPool && roomList.size() > 1) {
+                auto startUs = nowUs();
+                auto loaded = loadRoomsInParallel(m.roomList, roomList, m.workerPool.get(), roomLoadParamsOf(m));
+                // Put all rooms into the list on this thread, at once
+                for (auto &room : loaded) {
+                    metrics.eventsIngested += room.eventCount;
+                    if (! room.encryptedEventIds.empty()) {
+                        newEncryptedEventIds = std::move(newEncryptedEventIds)
+                            .update(room.room.roomId, [&](auto prev) { return std::move(prev) + room.encryptedEventIds; });
+                    }
+                    m.addTriggers(std::move(room.triggers));
+                    touchedRoomIds.push_back(room.room.roomId);
+                    m.roomList = RoomListModel::setRoom(std::move(m.roomList), std::move(room.room));
+                }
+                metrics.roomsTouched = roomList.size();
+                metrics.loadRoomsUs = nowUs() - startUs;
             } else {
-                kzo.client.dbg() << "Response body: "
-                          << std::get<BaseJob::BytesBody>(r.body) << std::endl;
+                for (const auto &room : roomList) {
+                    loadRoom(room.load());
+                }
             }
-            return { std::move(m), simpleFail };
         }
 
-        kzo.client.dbg() << "Sync successful" << std::endl;
+        auto loadOthersStartUs = nowUs();
 
-        auto rooms = r.rooms();
         auto accountData = r.accountData();
         auto presence = r.presence();
         // load the info that has been sync'd
 
         m.syncToken = r.nextBatch();
 
-        if (rooms) {
-            m.addTriggers(loadRoomsFromSyncInPlace(m, std::move(rooms.value())));
-        }
-
         if (presence) {
+            metrics.eventsIngested += presence.value().events.size();
             m.addTriggers(loadPresenceFromSyncInPlace(m, std::move(presence.value().events)));
         }
 
         if (accountData) {
+            metrics.eventsIngested += accountData.value().events.size();
+            if (! pushRulesLoaded) {
+                loadPushRulesFromSyncInPlace(m, accountData.value().events);
+            }
             m.addTriggers(loadAccountDataFromSyncInPlace(m, std::move(accountData.value().events)));
         }
 
+        auto numToDeviceBefore = m.toDevice.size();
         m.addTriggers(loadToDeviceFromSyncInPlace(m, r.toDevice()));
+        metrics.eventsIngested += m.toDevice.size() - numToDeviceBefore;
+
+        metrics.loadOthersUs = nowUs() - loadOthersStartUs;
 
         auto is = r.dataStr("is");
         auto isInitialSync = is == "initial";
 
         if (m.crypto) {
             kzo.client.dbg() << "E2EE is on. Processing device lists and one-time key counts." << std::endl;
+            auto deviceListsStartUs = nowUs();
             auto &crypto = m.crypto.value();
             // process deviceLists
             if (isInitialSync) {
@@ -276,14 +679,82 @@ namespace Kazv
 
             // deviceOneTimeKeysCount
             crypto.setUploadedOneTimeKeysCount(r.deviceOneTimeKeysCount());
+            metrics.deviceListsUs = nowUs() - deviceListsStartUs;
 
-            auto model = tryDecryptEvents(std::move(m));
+            auto decryptStartUs = nowUs();
+            auto model = tryDecryptEvents(std::move(m), std::move(newEncryptedEventIds), &metrics.eventsDecrypted);
             m = std::move(model);
+            metrics.decryptUs = nowUs() - decryptStartUs;
         }
 
+        metrics.nextToken = r.nextBatch();
+        metrics.triggersEmitted = m.nextTriggers.size() - numTriggersBefore;
+        m.addTrigger(std::move(metrics));
         m.addTrigger(SyncSuccessful{r.nextBatch()});
 
-        return { std::move(m), lager::noop };
+        return spillTimelines(std::move(m), touchedRoomIds);
+    }
+
+    ClientResult processResponse(ClientModel m, SyncResponse r)
+    {
+        if (! r.success()) {
+            m.addTrigger(SyncFailed{});
+            kzo.client.dbg() << "Sync failed" << std::endl;
+            kzo.client.dbg() << r.statusCode << std::endl;
+            if (isBodyJson(r.body)) {
+                auto j = r.jsonBody();
+                kzo.client.dbg() << "Json says: " << j.get().dump() << std::endl;
+            } else {
+                kzo.client.dbg() << "Response body: "
+                          << std::get<BaseJob::BytesBody>(r.body) << std::endl;
+            }
+            return { std::move(m), simpleFail };
+        }
+
+        kzo.client.dbg() << "Sync successful" << std::endl;
+
+        if (m.pipelinedSync) {
+            // Only take the token here, so that the next sync can be
+            // started before this response is applied
+            auto nextBatch = std::holds_alternative<BytesBody>(r.body)
+                ? syncNextBatch(std::get<BytesBody>(r.body))
+                : std::optional<std::string>(r.nextBatch());
+            if (! nextBatch || nextBatch.value().empty()) {
+                kzo.client.dbg() << "Sync response has no next_batch" << std::endl;
+                m.addTrigger(SyncFailed{});
+                return { std::move(m), simpleFail };
+            }
+            auto data = r.extraData.get();
+            if (data.contains(syncSinceKey)) {
+                const auto &since = data[syncSinceKey];
+                auto expected = m.sinceToken();
+                if (since.is_null() ? expected.has_value() : since.get<std::string>() != expected) {
+                    // It was started from a response that failed to apply
+                    kzo.client.dbg() << "Sync response does not continue from the last one, dropping it" << std::endl;
+                    return { std::move(m), simpleFail };
+                }
+            }
+            data[syncReceivedUsKey] = nowUs();
+            r.extraData = std::move(data);
+
+            m.pendingSyncToken = nextBatch;
+            m.pendingSyncResponses = std::move(m.pendingSyncResponses).push_back(std::move(r));
+            return { std::move(m), lager::noop };
+        }
+
+        return applySyncResponse(std::move(m), std::move(r));
+    }
+
+    ClientResult updateClient(ClientModel m, ApplyPendingSyncResponseAction)
+    {
+        if (m.pendingSyncResponses.empty()) {
+            kzo.client.dbg() << "No pending sync response to apply" << std::endl;
+            return { std::move(m), simpleFail };
+        }
+
+        auto r = m.pendingSyncResponses.front();
+        m.pendingSyncResponses = std::move(m.pendingSyncResponses).drop(1);
+        return applySyncResponse(std::move(m), SyncResponse{std::move(r)});
     }
 
     ClientResult updateClient(ClientModel m, SetShouldSyncAction a)
@@ -292,6 +763,30 @@ namespace Kazv
         return { std::move(m), lager::noop };
     }
 
+    ClientResult updateClient(ClientModel m, SetStreamingSyncAction a)
+    {
+        m.streamingSync = a.streamingSync;
+        return { std::move(m), lager::noop };
+    }
+
+    ClientResult updateClient(ClientModel m, SetSyncThreadsAction a)
+    {
+        m.syncThreads = a.syncThreads;
+        // Keep the threads if their number does not change
+        auto numPoolThreads = m.workerPool ? static_cast<int>(m.workerPool->size()) : 0;
+        if (numPoolThreads != std::max(a.syncThreads - 1, 0)) {
+            m.workerPool = makeWorkerPool(a.syncThreads);
+        }
+        return { std::move(m), lager::noop };
+    }
+
+    ClientResult updateClient(ClientModel m, SetPipelinedSyncAction a)
+    {
+        m.pipelinedSync = a.pipelinedSync;
+        m.maxPendingSyncResponses = a.maxPendingSyncResponses;
+        return { std::move(m), lager::noop };
+    }
+
     ClientResult updateClient(ClientModel m, PostInitialFiltersAction)
     {
         if (m.syncing) {
@@ -19,6 +19,13 @@ namespace Kazv
 
     ClientResult updateClient(ClientModel m, SetShouldSyncAction a);
 
+    ClientResult updateClient(ClientModel m, SetStreamingSyncAction a);
+
+    ClientResult updateClient(ClientModel m, SetSyncThreadsAction a);
+
+    ClientResult updateClient(ClientModel m, SetPipelinedSyncAction a);
+    ClientResult updateClient(ClientModel m, ApplyPendingSyncResponseAction a);
+
     ClientResult updateClient(ClientModel m, PostInitialFiltersAction a);
     ClientResult processResponse(ClientModel m, DefineFilterResponse r);
 }
@@ -9,6 +9,7 @@
 #include <immer/algorithm.hpp>
 #include <lager/util.hpp>
 #include <lager/context.hpp>
+#include <algorithm>
 #include <functional>
 
 #include <zug/transducer/filter.hpp>
@@ -35,8 +36,6 @@ namespace Kazv
 {
     auto ClientModel::update(ClientModel m, Action a) -> Result
     {
-        auto oldDeviceLists = m.deviceLists;
-
         auto [newClient, effect] = lager::match(std::move(a))(
             [&](RoomListAction a) -> Result {
                 m.roomList = RoomListModel::update(std::move(m.roomList), a);
@@ -46,6 +45,10 @@ namespace Kazv
                 m.addJob(std::move(a.job));
                 return { std::move(m), lager::noop };
             },
+            [&](SetSubscribedTriggersAction a) -> Result {
+                m.subscribedTriggers = a.subscribedTriggers;
+                return { std::move(m), lager::noop };
+            },
             [&](auto a) -> decltype(updateClient(m, a)) {
                 return updateClient(m, a);
             },
@@ -104,49 +107,68 @@ namespace Kazv
 #undef RESPONSE_FOR
             );
 
-        // Rotate megolm keys for rooms whose users' device list has changed
-        auto changedUsers = newClient.deviceLists.diff(oldDeviceLists);
-        if (! changedUsers.empty()) {
-            auto rooms = newClient.roomList.rooms;
-            for (auto [roomId, room] : rooms) {
-                auto it = std::find_if(changedUsers.begin(), changedUsers.end(),
-                                       [=](auto userId) { return room.hasUser(userId); });
-                if (it != changedUsers.end()) {
-                    newClient.roomList.rooms =
-                        std::move(newClient.roomList.rooms)
-                        .update(roomId, [](auto room) {
+        // Share the megolm keys with the new devices of the users in the
+        // rooms, or rotate them if a device that has them is removed
+        auto changedUsers = newClient.deviceLists.takeChangedUsers();
+        for (const auto &userId : changedUsers) {
+            auto devices = newClient.deviceLists.devicesFor(userId);
+            auto removed = [&](const auto &recipients) {
+                return std::any_of(
+                    recipients.begin(), recipients.end(),
+                    [&](const auto &p) {
+                        auto device = devices.find(p.first);
+                        return ! device || device->curve25519Key != p.second;
+                    });
+            };
+            for (const auto &roomId : newClient.roomList.joinedRoomIdsOf(userId)) {
+                // Only flags the room, so the membership index stays valid
+                newClient.roomList.rooms =
+                    std::move(newClient.roomList.rooms)
+                    .update(roomId, [&](auto room) {
+                                        if (removed(room.sessionKeyRecipients[userId])) {
                                             room.shouldRotateSessionKey = true;
-                                            return room;
-                                        });
-                }
+                                        } else {
+                                            room.shouldShareSessionKey = true;
+                                        }
+                                        return room;
+                                    });
             }
         }
 
         return { std::move(newClient), std::move(effect) };
     }
 
-    std::pair<Event, std::optional<std::string>> ClientModel::megOlmEncrypt(
-        Event e, std::string roomId, Timestamp timeMs, RandomData random)
+    void ClientModel::indexUndecryptedEvents()
     {
-        if (!crypto) {
-            kzo.client.dbg() << "We do not have e2ee, so do not encrypt events" << std::endl;
-            return { e, std::nullopt };
+        undecryptedEvents = {};
+        for (const auto &[roomId, room] : roomList.rooms) {
+            for (const auto &[eventId, e] : room.messages) {
+                if (! e.encrypted() || e.decrypted()) {
+                    continue;
+                }
+                if (auto k = groupSessionKeyOf(e); k) {
+                    undecryptedEvents = std::move(undecryptedEvents)
+                        .update(k.value(), [&eventId=eventId](auto s) { return std::move(s).insert(eventId); });
+                }
+            }
         }
+    }
 
-        if (e.encrypted()) {
-            kzo.client.dbg() << "The event is already encrypted. Ignoring it." << std::endl;
-            return { e, std::nullopt };
+    std::optional<std::string> ClientModel::prepareMegOlmSession(
+        std::string roomId, Timestamp timeMs, RandomData random)
+    {
+        if (!crypto) {
+            kzo.client.dbg() << "We do not have e2ee, so do not prepare megolm sessions" << std::endl;
+            return std::nullopt;
         }
 
         auto &c = crypto.value();
-
-        auto j = e.originalJson().get();
         auto r = roomList[roomId];
 
         if (! r.encrypted) {
             kzo.client.dbg() << "The room " << roomId
-                             << " is not encrypted, so do not encrypt events" << std::endl;
-            return { e, std::nullopt };
+                             << " is not encrypted, so do not prepare megolm sessions" << std::endl;
+            return std::nullopt;
         }
 
         auto desc = r.sessionRotateDesc();
@@ -158,16 +180,63 @@ namespace Kazv
         } else {
             keyOpt = c.rotateMegOlmSessionWithRandomIfNeeded(random, timeMs, roomId, desc);
         }
+        auto rotated = keyOpt.has_value();
 
-        // we no longer need to rotate session
-        // until next time a device change happens
-        roomList.rooms = std::move(roomList.rooms)
-            .update(roomId, [](auto r) { r.shouldRotateSessionKey = false; return r; });
+        if (! rotated && ! devicesMissingSessionKey(roomId).empty()) {
+            kzo.client.dbg() << "We should share this session with new devices." << std::endl;
+            // Taken before encrypting, so that the new devices
+            // can decrypt the next event too
+            keyOpt = c.outboundGroupSessionCurrentKey(roomId);
+        }
+
+        // We no longer need to rotate the session until next time
+        // a device or member change happens. shouldShareSessionKey
+        // is cleared when the new devices get the key.
+        if (rotated) {
+            auto sessionId = c.outboundGroupSessionId(roomId);
+            roomList.rooms = std::move(roomList.rooms)
+                .update(roomId, [&](auto r) {
+                                    r.shouldRotateSessionKey = false;
+                                    r.outboundSessionId = sessionId;
+                                    r.sessionKeyRecipients = {};
+                                    r.sessionKeyPendingRecipients = {};
+                                    return r;
+                                });
+        }
+
+        return keyOpt;
+    }
+
+    std::pair<Event, std::optional<std::string>> ClientModel::megOlmEncrypt(
+        Event e, std::string roomId, Timestamp timeMs, RandomData random)
+    {
+        if (!crypto) {
+            kzo.client.dbg() << "We do not have e2ee, so do not encrypt events" << std::endl;
+            return { e, std::nullopt };
+        }
+
+        if (e.encrypted()) {
+            kzo.client.dbg() << "The event is already encrypted. Ignoring it." << std::endl;
+            return { e, std::nullopt };
+        }
+
+        auto j = e.originalJson().get();
+
+        if (! roomList[roomId].encrypted) {
+            kzo.client.dbg() << "The room " << roomId
+                             << " is not encrypted, so do not encrypt events" << std::endl;
+            return { e, std::nullopt };
+        }
+
+        auto keyOpt = prepareMegOlmSession(roomId, timeMs, std::move(random));
+
+        auto &c = crypto.value();
 
         // so that Crypto::encryptMegOlm() can find room id
         j["room_id"] = roomId;
 
         auto content = c.encryptMegOlm(j);
+
         j["type"] = "m.room.encrypted";
         j["content"] = std::move(content);
         j["content"]["device_id"] = deviceId;
@@ -253,6 +322,42 @@ namespace Kazv
             devices);
     }
 
+    auto ClientModel::devicesMissingSessionKey(std::string roomId) const -> UserIdToDeviceIdMap
+    {
+        auto room = roomList[roomId];
+        auto ret = UserIdToDeviceIdMap{};
+        for (const auto &userId : room.joinedMemberIds()) {
+            auto recipients = room.sessionKeyRecipients[userId];
+            auto pending = room.sessionKeyPendingRecipients[userId];
+            auto devices = intoImmer(
+                immer::flex_vector<std::string>{},
+                zug::filter([&](const auto &deviceId) {
+                                return ! recipients.find(deviceId) && ! pending.count(deviceId);
+                            }),
+                devicesToSendKeys(userId));
+            if (! devices.empty()) {
+                ret = std::move(ret).set(userId, std::move(devices));
+            }
+        }
+        return ret;
+    }
+
+    void ClientModel::addSessionKeyPendingRecipients(std::string roomId, UserIdToDeviceIdMap devices)
+    {
+        roomList.rooms = std::move(roomList.rooms)
+            .update(roomId, [&](auto r) {
+                                for (const auto &[userId, deviceIds] : devices) {
+                                    auto pending = r.sessionKeyPendingRecipients[userId];
+                                    for (const auto &deviceId : deviceIds) {
+                                        pending = std::move(pending).insert(deviceId);
+                                    }
+                                    r.sessionKeyPendingRecipients = std::move(r.sessionKeyPendingRecipients)
+                                        .set(userId, std::move(pending));
+                                }
+                                return r;
+                            });
+    }
+
     std::size_t ClientModel::numOneTimeKeysNeeded() const
     {
         auto &crypto = this->crypto.value();
@@ -269,6 +374,11 @@ namespace Kazv
         return numKeysToGenerate;
     }
 
+    std::optional<std::string> ClientModel::sinceToken() const
+    {
+        return pendingSyncResponses.empty() ? syncToken : pendingSyncToken;
+    }
+
     std::size_t EncryptMegOlmEventAction::maxRandomSize()
     {
         return Crypto::rotateMegOlmSessionRandomSize();
@@ -279,6 +389,11 @@ namespace Kazv
         return 0;
     }
 
+    std::size_t PrepareMegOlmSessionAction::maxRandomSize()
+    {
+        return Crypto::rotateMegOlmSessionRandomSize();
+    }
+
     std::size_t EncryptOlmEventAction::randomSize(EncryptOlmEventAction::UserIdToDeviceIdMap devices)
     {
         auto singleRandomSize = Crypto::encryptOlmMaxRandomSize();
@@ -8,11 +8,14 @@
 #pragma once
 #include <libkazv-config.hpp>
 
+#include <memory>
 #include <tuple>
 #include <variant>
 #include <string>
 #include <optional>
 
+#include <immer/flex_vector_transient.hpp>
+
 #include <lager/context.hpp>
 #include <boost/hana.hpp>
 #include <serialization/std-optional.hpp>
@@ -22,15 +25,18 @@
 
 #include <file-desc.hpp>
 #include <crypto.hpp>
+#include <worker-pool.hpp>
 
 #include <serialization/immer-flex-vector.hpp>
 #include <serialization/immer-box.hpp>
 #include <serialization/immer-map.hpp>
 #include <serialization/immer-array.hpp>
+#include <serialization/immer-set.hpp>
 
 #include "clientfwd.hpp"
 #include "device-list-tracker.hpp"
 #include "room/room-model.hpp"
+#include "timeline-spill-store.hpp"
 
 namespace Kazv
 {
@@ -69,6 +75,30 @@ namespace Kazv
         int retryTimeFactor{2};
         int maxRetryMs{30 * 1000};
         int syncTimeoutMs{20000};
+        /// Whether to parse sync responses as a stream, room by room,
+        /// instead of building the whole json DOM first
+        bool streamingSync{false};
+        /// The number of threads to load the rooms in sync responses on,
+        /// and to decrypt room events on. 0 or 1 means doing so on the
+        /// current thread. Rooms are not loaded in parallel with
+        /// streaming sync.
+        int syncThreads{0};
+        /// The threads besides the current one to load rooms and
+        /// decrypt events on, or nullptr if syncThreads is at most 1.
+        /// Kept for as long as syncThreads is not changed. Not serialized.
+        std::shared_ptr<WorkerPool> workerPool;
+        /// Whether to start the next sync request as soon as a response
+        /// is received, before it is applied. See ApplyPendingSyncResponseAction.
+        bool pipelinedSync{false};
+        /// With pipelined sync, the maximum number of received responses
+        /// that may wait to be applied, counting the one being applied.
+        /// A request is only started if there is room for its response.
+        int maxPendingSyncResponses{2};
+        /// Sync responses received but not yet applied, oldest first.
+        /// syncToken is not updated until they are applied.
+        immer::flex_vector<Response> pendingSyncResponses;
+        /// The next_batch of the latest pending sync response
+        std::optional<std::string> pendingSyncToken;
         std::string initialSyncFilterId;
         std::string incrementalSyncFilterId;
         std::optional<std::string> syncToken;
@@ -76,10 +106,24 @@ namespace Kazv
         RoomListModel roomList;
         immer::map<std::string /* sender */, Event> presence;
         immer::map<std::string /* type */, Event> accountData;
+        /// The push rules in accountData, compiled. Recompiled only
+        /// when the `m.push_rules` account data changes. Not serialized.
+        PushRulesDesc pushRules;
 
         std::string nextTxnId{DEFTXNID};
         immer::flex_vector<BaseJob> nextJobs;
         immer::flex_vector<KazvEvent> nextTriggers;
+        /// The number of timeline events to keep in memory for each room,
+        /// or 0 to keep all of them. Not serialized.
+        std::size_t timelineWindow{0};
+        /// Where the timeline events out of the window go. Not serialized.
+        std::shared_ptr<TimelineSpillStore> timelineSpillStore;
+        /// Rooms whose events are being saved to timelineSpillStore,
+        /// and not yet dropped from memory. Not serialized.
+        immer::set<std::string> spillingRoomIds;
+        /// Types of triggers someone listens to. Triggers of other
+        /// types are not generated. Not serialized.
+        KazvEventTypes subscribedTriggers{allKazvEventTypes};
 
         EventList toDevice;
         std::optional<Crypto> crypto;
@@ -87,8 +131,34 @@ namespace Kazv
 
         DeviceListTracker deviceLists;
 
+        /// Encrypted room events we could not decrypt yet, indexed by
+        /// the megolm session that they need
+        immer::map<KeyOfGroupSession, immer::set<std::string /* eventId */>> undecryptedEvents;
+
+        /// Rebuild `undecryptedEvents` from the messages of all rooms
+        void indexUndecryptedEvents();
+
         immer::flex_vector<std::string /* deviceId */> devicesToSendKeys(std::string userId) const;
 
+        using UserIdToDeviceIdMap = immer::map<std::string, immer::flex_vector<std::string>>;
+        /// @return the devices of the joined members of the room that have
+        /// not been sent, and are not being sent, the key of its current
+        /// outbound megolm session
+        UserIdToDeviceIdMap devicesMissingSessionKey(std::string roomId) const;
+
+        /// Record that the key of the current outbound megolm session
+        /// of the room is being sent to `devices`
+        void addSessionKeyPendingRecipients(std::string roomId, UserIdToDeviceIdMap devices);
+
+        /**
+         * Rotate the outbound megolm session of the room if needed,
+         * and find out whether its key should be shared.
+         *
+         * @return The session key, if the session is rotated or some
+         * devices have not been sent its key, std::nullopt otherwise.
+         */
+        std::optional<std::string> prepareMegOlmSession(std::string roomId, Timestamp timeMs, RandomData random);
+
         std::pair<Event, std::optional<std::string> /* sessionKey */>
         megOlmEncrypt(Event e, std::string roomId, Timestamp timeMs, RandomData random);
         /// precondition: the one-time keys for those devices must already be claimed
@@ -97,6 +167,11 @@ namespace Kazv
         /// @return number of one-time keys we need to generate
         std::size_t numOneTimeKeysNeeded() const;
 
+        /// @return the token to start the next sync from, i.e.
+        /// the next_batch of the latest pending sync response if any,
+        /// or syncToken otherwise
+        std::optional<std::string> sinceToken() const;
+
         // helpers
         template<class Job>
         struct MakeJobT
@@ -134,12 +209,28 @@ namespace Kazv
             return jobs;
         };
 
+        /// @return whether someone listens to triggers of type `Trigger`
+        template<class Trigger>
+        inline bool hasSubscribersFor() const {
+            return subscribedTriggers.test(kazvEventIndex<Trigger>);
+        }
+
         inline void addTrigger(KazvEvent t) {
             addTriggers({t});
         }
 
         inline void addTriggers(immer::flex_vector<KazvEvent> c) {
-            nextTriggers = std::move(nextTriggers) + c;
+            if (subscribedTriggers.all()) {
+                nextTriggers = std::move(nextTriggers) + c;
+                return;
+            }
+            auto t = std::move(nextTriggers).transient();
+            for (auto &&trigger : c) {
+                if (subscribedTriggers.test(trigger.index())) {
+                    t.push_back(trigger);
+                }
+            }
+            nextTriggers = t.persistent();
         }
 
         inline auto popAllTriggers() {
@@ -183,6 +274,15 @@ namespace Kazv
         std::string serverUrl;
     };
 
+    /**
+     * Start a sync request.
+     *
+     * With pipelined sync, if there is no room for another response in
+     * ClientModel::pendingSyncResponses, no request is started and the
+     * action succeeds with `dataJson("busy")` being true. This is flow
+     * control, not a failure: the sync continues once a pending
+     * response is applied.
+     */
     struct SyncAction {};
 
     struct SetShouldSyncAction
@@ -190,6 +290,34 @@ namespace Kazv
         bool shouldSync;
     };
 
+    struct SetStreamingSyncAction
+    {
+        bool streamingSync;
+    };
+
+    struct SetSyncThreadsAction
+    {
+        int syncThreads;
+    };
+
+    struct SetPipelinedSyncAction
+    {
+        bool pipelinedSync;
+        /// See ClientModel::maxPendingSyncResponses. It must be at least
+        /// 2 for a request to start before the last response is applied.
+        int maxPendingSyncResponses{2};
+    };
+
+    /**
+     * Apply the oldest sync response received in pipelined sync.
+     *
+     * With pipelined sync, processing a sync response only records it
+     * in ClientModel::pendingSyncResponses, and it takes this action
+     * to apply it. Client::startSyncing() dispatches this action
+     * once for each response, so they are applied in order.
+     */
+    struct ApplyPendingSyncResponseAction {};
+
     struct PaginateTimelineAction
     {
         std::string roomId;
@@ -198,10 +326,52 @@ namespace Kazv
         std::optional<int> limit;
     };
 
+    /**
+     * Keep at most `timelineWindow` events of each room in memory.
+     *
+     * After each sync, the older events are moved into `store`. They are
+     * put back when paginating back from the room's `spilledGapEventId`.
+     */
+    struct SetTimelineWindowAction
+    {
+        /// 0 means keeping all events in memory
+        std::size_t timelineWindow;
+        std::shared_ptr<TimelineSpillStore> store;
+    };
+
+    /// Put the events spilled last back into the timeline
+    struct RestoreSpilledEventsAction
+    {
+        std::string roomId;
+        /// std::nullopt if they cannot be read from the store
+        std::optional<SpilledEvents> spilled;
+        /// Whether there are events spilled before these
+        bool hasMore;
+    };
+
+    /**
+     * Drop the events saved to the TimelineSpillStore from memory.
+     *
+     * It is taken after the store tries to save the events
+     * from eventsToSpill().
+     */
+    struct FinishSpillingEventsAction
+    {
+        std::string roomId;
+        SpilledEvents spilled;
+        /// Whether the store has saved the events. If not, they
+        /// are kept in memory.
+        bool saved;
+    };
+
     struct SendMessageAction
     {
         std::string roomId;
         Event event;
+        /// If set, the time spent before sending the message. It will
+        /// be completed and emitted as SendMessageMetrics when the
+        /// message is sent.
+        std::optional<SendMessageMetrics> metrics{std::nullopt};
     };
 
     struct SendStateEventAction
@@ -316,6 +486,17 @@ namespace Kazv
         BaseJob job;
     };
 
+    /**
+     * Set the types of triggers someone listens to.
+     *
+     * SdkModel dispatches this when the subscriptions published by
+     * the event emitter change.
+     */
+    struct SetSubscribedTriggersAction
+    {
+        KazvEventTypes subscribedTriggers;
+    };
+
     struct ProcessResponseAction
     {
         Response response;
@@ -374,8 +555,10 @@ namespace Kazv
      * If the action is successful, the result `r` will
      * be such that `r.dataJson("encrypted")` contains the encrypted event *json*.
      *
-     * If the megolm session is rotated, `r.dataStr("key")` will contain the key
-     * of the megolm session. Otherwise, `r.data().contains("key")` will be false.
+     * If the megolm session is rotated, or some devices have not been
+     * sent its key yet, `r.dataStr("key")` will contain the key of the
+     * megolm session, and `r.dataJson("devicesToSend")` the devices to
+     * send it to. Otherwise, `r.data().contains("key")` will be false.
      *
      * The Action may fail due to insufficient random data,
      * when the megolm session needs to be rotated.
@@ -403,12 +586,43 @@ namespace Kazv
         RandomData random;
     };
 
+    /**
+     * The action to get the outbound megolm session of a room ready
+     * before encrypting with it.
+     *
+     * The session is rotated if needed, as in EncryptMegOlmEventAction,
+     * but no event is encrypted.
+     *
+     * If the session is rotated, or some devices have not been sent its
+     * key yet, the result `r` will be such that `r.dataStr("key")`
+     * contains the key of the session, `r.dataStr("sessionId")` its id,
+     * and `r.dataJson("devicesToSend")` the devices to send it to.
+     * Otherwise, `r.data().contains("key")` will be false.
+     *
+     * If `random` is shorter than `maxRandomSize()`, the action fails
+     * and `r.dataStr("reason") == "NotEnoughRandom"`.
+     */
+    struct PrepareMegOlmSessionAction
+    {
+        static std::size_t maxRandomSize();
+
+        /// The id of the room to prepare the session for.
+        std::string roomId;
+        /// The timestamp, to determine whether the session should expire.
+        Timestamp timeMs;
+        /// Random data for the operation. Must be of at least size
+        /// `maxRandomSize()`.
+        RandomData random;
+    };
+
     /**
      * The action to encrypt events with olm for multiple devices.
      *
      * If the action is successful,
      * The result `r` will be such that `r.dataJson("encrypted")`
-     * contains the json of the encrypted event.
+     * contains the json of the encrypted event, and `r.dataJson("devices")`
+     * the devices it is encrypted for. Devices whose identity keys are
+     * unknown, or that we have no olm session with, are left out.
      */
     struct EncryptOlmEventAction
     {
@@ -424,6 +638,30 @@ namespace Kazv
         RandomData random;
     };
 
+    /**
+     * The action to record that the key of an outbound megolm
+     * session has been sent to some devices.
+     *
+     * It is taken whenever sending the key finishes, even if it fails,
+     * so that the devices are no longer considered being sent the key.
+     *
+     * It is ignored if the session is no longer the current one
+     * of the room.
+     */
+    struct AddSessionKeyRecipientsAction
+    {
+        using UserIdToDeviceIdMap = immer::map<std::string, immer::flex_vector<std::string>>;
+
+        /// The id of the room of the session.
+        std::string roomId;
+        /// The id of the session.
+        std::string sessionId;
+        /// The devices the key has been sent to.
+        UserIdToDeviceIdMap devices;
+        /// The devices we tried to send the key to, besides `devices`.
+        UserIdToDeviceIdMap attemptedDevices{};
+    };
+
     struct GetUserProfileAction
     {
         std::string userId;
@@ -440,7 +678,7 @@ namespace Kazv
     };
 
     template<class Archive>
-    void serialize(Archive &ar, ClientModel &m, std::uint32_t const /*version*/)
+    void serialize(Archive &ar, ClientModel &m, std::uint32_t const version)
     {
         bool dummySyncing{false};
         ar
@@ -471,7 +709,39 @@ namespace Kazv
 
             & m.deviceLists
             ;
+
+        if (version >= 1) {
+            ar & m.undecryptedEvents;
+        } else if constexpr (Archive::is_loading::value) {
+            m.indexUndecryptedEvents();
+        }
+
+        if (version >= 2) {
+            ar & m.streamingSync;
+        }
+
+        if (version >= 3) {
+            ar & m.syncThreads;
+        }
+
+        if constexpr (Archive::is_loading::value) {
+            m.workerPool = makeWorkerPool(m.syncThreads);
+        }
+
+        // Pending sync responses are not saved. As syncToken
+        // is not updated until they are applied, they will be
+        // fetched again.
+        if (version >= 4) {
+            ar & m.pipelinedSync
+                & m.maxPendingSyncResponses;
+        }
+
+        if constexpr (Archive::is_loading::value) {
+            if (auto pushRulesEvent = m.accountData.find("m.push_rules"); pushRulesEvent) {
+                m.pushRules = PushRulesDesc(*pushRulesEvent);
+            }
+        }
     }
 }
 
-BOOST_CLASS_VERSION(Kazv::ClientModel, 0)
+BOOST_CLASS_VERSION(Kazv::ClientModel, 4)
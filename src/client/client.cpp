@@ -260,6 +260,13 @@ namespace Kazv
         return p1;
     }
 
+    /// @return whether `stat` is the result of a SyncAction that did not start for lack of room
+    static bool isSyncBusy(const EffectStatus &stat)
+    {
+        const auto &data = stat.data().get();
+        return stat.success() && data.is_object() && data.contains("busy") && data["busy"] == true;
+    }
+
     auto Client::syncForever(std::optional<int> retryTime) const -> void
     {
         KAZV_VERIFY_THREAD_ID();
@@ -267,7 +274,7 @@ namespace Kazv
         // assert (m_deps);
         using namespace CursorOp;
 
-        bool isInitialSync = ! (+clientCursor()[&ClientModel::syncToken]).has_value();
+        bool isInitialSync = ! (+clientCursor()).sinceToken().has_value();
 
         bool shouldSync = +clientCursor()[&ClientModel::shouldSync];
 
@@ -278,11 +285,91 @@ namespace Kazv
 
         auto syncRes = m_ctx.dispatch(SyncAction{});
 
-        auto uploadOneTimeKeysRes = syncRes
-            .then([that=toEventLoop()](auto stat) {
+        if (+clientCursor()[&ClientModel::pipelinedSync]) {
+            syncRes
+                .then([that=toEventLoop(), retryTime, isInitialSync](auto stat) {
+                          if (isSyncBusy(stat)) {
+                              // The pending responses are being applied, and
+                              // the sync continues after the one that filled
+                              // the queue is applied. Not a failure, so no
+                              // backoff either.
+                              return;
+                          }
+
+                          if (! stat.success()) {
+                              that.syncLater(retryTime);
+                              return;
+                          }
+
+                          // The response has been received but not applied.
+                          // Start the next sync now if there is room for
+                          // its response, or after this one is applied.
+                          auto pending = (+that.clientCursor()[&ClientModel::pendingSyncResponses]).size();
+                          auto maxPending = +that.clientCursor()[&ClientModel::maxPendingSyncResponses];
+                          bool syncNow = pending < static_cast<std::size_t>(maxPending);
+                          if (syncNow) {
+                              that.syncForever();
+                          }
+
+                          that.m_ctx.dispatch(ApplyPendingSyncResponseAction{})
+                              .then([that, isInitialSync](auto stat) {
+                                        if (! stat.success()) {
+                                            return that.m_ctx.createResolvedPromise(stat);
+                                        }
+                                        return that.updateKeysAfterSync(isInitialSync);
+                                    })
+                              .then([that, syncNow](auto) {
+                                        if (! syncNow) {
+                                            that.syncForever();
+                                        }
+                                    });
+                      });
+            return;
+        }
+
+        syncRes
+            .then([that=toEventLoop(), isInitialSync](auto stat) {
                       if (! stat.success()) {
                           return that.m_ctx.createResolvedPromise(stat);
                       }
+                      return that.updateKeysAfterSync(isInitialSync);
+                  })
+            .then([that=toEventLoop(), retryTime](auto stat) {
+                      if (stat.success()) {
+                          that.syncForever(); // reset retry time
+                      } else {
+                          that.syncLater(retryTime);
+                      }
+                  });
+    }
+
+    auto Client::syncLater(std::optional<int> retryTime) const -> void
+    {
+        KAZV_VERIFY_THREAD_ID();
+
+        using namespace CursorOp;
+
+        auto firstRetryTime = +clientCursor()[&ClientModel::firstRetryMs];
+        auto retryTimeFactor = +clientCursor()[&ClientModel::retryTimeFactor];
+        auto maxRetryTime = +clientCursor()[&ClientModel::maxRetryMs];
+        auto curRetryTime = retryTime ? retryTime.value() : firstRetryTime;
+        if (curRetryTime > maxRetryTime) { curRetryTime = maxRetryTime; }
+        auto nextRetryTime = curRetryTime * retryTimeFactor;
+
+        kzo.client.warn() << "Sync failed, retrying in " << curRetryTime << "ms" << std::endl;
+        auto &jh = getJobHandler(m_deps.value());
+        jh.setTimeout([that=toEventLoop(), nextRetryTime]() { that.syncForever(nextRetryTime); },
+                      curRetryTime);
+    }
+
+    auto Client::updateKeysAfterSync(bool isInitialSync) const -> PromiseT
+    {
+        KAZV_VERIFY_THREAD_ID();
+
+        using namespace CursorOp;
+
+        auto uploadOneTimeKeysRes = m_ctx.createResolvedPromise(true)
+            .then([that=toEventLoop()](auto) {
                       auto &rg = lager::get<RandomInterface &>(that.m_deps.value());
                       bool hasCrypto{+that.clientCursor()[&ClientModel::crypto]};
                       if (! hasCrypto) {
@@ -295,36 +382,16 @@ namespace Kazv
                           });
                   });
 
-        auto queryKeysRes = syncRes
-            .then([that=toEventLoop(), isInitialSync](auto stat) {
-                      if (! stat.success()) {
-                          return that.m_ctx.createResolvedPromise(stat);
-                      }
+        auto queryKeysRes = m_ctx.createResolvedPromise(true)
+            .then([that=toEventLoop(), isInitialSync](auto) {
                       bool hasCrypto{+that.clientCursor()[&ClientModel::crypto]};
                       return hasCrypto
                           ? that.m_ctx.dispatch(QueryKeysAction{isInitialSync})
                           : that.m_ctx.createResolvedPromise(true);
                   });
 
-        m_ctx.promiseInterface()
-            .all(std::vector<PromiseT>{uploadOneTimeKeysRes, queryKeysRes})
-            .then([that=toEventLoop(), retryTime](auto stat) {
-                      if (stat.success()) {
-                          that.syncForever(); // reset retry time
-                      } else {
-                          auto firstRetryTime = +that.clientCursor()[&ClientModel::firstRetryMs];
-                          auto retryTimeFactor = +that.clientCursor()[&ClientModel::retryTimeFactor];
-                          auto maxRetryTime = +that.clientCursor()[&ClientModel::maxRetryMs];
-                          auto curRetryTime = retryTime ? retryTime.value() : firstRetryTime;
-                          if (curRetryTime > maxRetryTime) { curRetryTime = maxRetryTime; }
-                          auto nextRetryTime = curRetryTime * retryTimeFactor;
-
-                          kzo.client.warn() << "Sync failed, retrying in " << curRetryTime << "ms" << std::endl;
-                          auto &jh = getJobHandler(that.m_deps.value());
-                          jh.setTimeout([that=that.toEventLoop(), nextRetryTime]() { that.syncForever(nextRetryTime); },
-                                        curRetryTime);
-                      }
-                  });
+        return m_ctx.promiseInterface()
+            .all(std::vector<PromiseT>{uploadOneTimeKeysRes, queryKeysRes});
     }
 
     void Client::stopSyncing() const
@@ -138,6 +138,51 @@ namespace Kazv
                          }));
         }
 
+        /**
+         * Get a page of the ids of the rooms, in sorted order.
+         *
+         * The rooms are kept sorted by the reducer, most recently
+         * active first by default. Use SetRoomListOrderAction to
+         * put favourites or rooms with unread notifications first.
+         *
+         * Only the requested page is copied out, and the returned
+         * reader only changes when that page changes.
+         *
+         * @param offset The position of the first room in the page.
+         * @param count The maximum number of rooms in the page.
+         *
+         * @return A lager::reader<immer::flex_vector<std::string>> of
+         * the room ids in the page.
+         */
+        inline auto sortedRoomIds(std::size_t offset, std::size_t count) const {
+            return clientCursor()
+                [&ClientModel::roomList]
+                [&RoomListModel::sortedRooms]
+                .xform(zug::map([=](auto entries) {
+                                    return intoImmer(
+                                        immer::flex_vector<std::string>{},
+                                        zug::map([](auto e) { return e.roomId; }),
+                                        entries.drop(offset).take(count));
+                                }));
+        }
+
+        /**
+         * Search the messages in all rooms.
+         *
+         * @param query The query. See Room::search().
+         * @param limit The maximum number of results.
+         *
+         * @return A lager::reader<immer::flex_vector<SearchHit>> of
+         * the matching events, best first.
+         */
+        inline auto search(std::string query, std::size_t limit) const {
+            return clientCursor()
+                [&ClientModel::roomList]
+                .xform(zug::map([=](const RoomListModel &l) {
+                                    return l.search(query, limit);
+                                }));
+        }
+
         KAZV_WRAP_ATTR(ClientModel, clientCursor(), serverUrl)
         KAZV_WRAP_ATTR(ClientModel, clientCursor(), loggedIn)
         KAZV_WRAP_ATTR(ClientModel, clientCursor(), userId)
@@ -444,6 +489,10 @@ namespace Kazv
 
     private:
         void syncForever(std::optional<int> retryTime = std::nullopt) const;
+        /// Call syncForever() after a delay that grows from `retryTime`
+        void syncLater(std::optional<int> retryTime) const;
+        /// Upload one-time keys and query device keys after a sync, if needed
+        PromiseT updateKeysAfterSync(bool isInitialSync) const;
 
         const lager::reader<SdkModel> &sdkCursor() const;
         lager::reader<ClientModel> clientCursor() const;
@@ -28,8 +28,15 @@ namespace Kazv
     struct GetVersionsAction;
     struct SyncAction;
     struct SetShouldSyncAction;
+    struct SetStreamingSyncAction;
+    struct SetSyncThreadsAction;
+    struct SetPipelinedSyncAction;
+    struct ApplyPendingSyncResponseAction;
     struct PostInitialFiltersAction;
     struct PaginateTimelineAction;
+    struct SetTimelineWindowAction;
+    struct RestoreSpilledEventsAction;
+    struct FinishSpillingEventsAction;
     struct SendMessageAction;
     struct SendStateEventAction;
     struct CreateRoomAction;
@@ -58,13 +65,16 @@ namespace Kazv
     struct QueryKeysAction;
     struct ClaimKeysAction;
     struct EncryptMegOlmEventAction;
+    struct PrepareMegOlmSessionAction;
     struct EncryptOlmEventAction;
+    struct AddSessionKeyRecipientsAction;
 
     struct GetUserProfileAction;
     struct SetAvatarUrlAction;
     struct SetDisplayNameAction;
 
     struct ResubmitJobAction;
+    struct SetSubscribedTriggersAction;
 
     struct ClientModel;
 
@@ -79,9 +89,16 @@ namespace Kazv
 
         SyncAction,
         SetShouldSyncAction,
+        SetStreamingSyncAction,
+        SetSyncThreadsAction,
+        SetPipelinedSyncAction,
+        ApplyPendingSyncResponseAction,
         PostInitialFiltersAction,
 
         PaginateTimelineAction,
+        SetTimelineWindowAction,
+        RestoreSpilledEventsAction,
+        FinishSpillingEventsAction,
         SendMessageAction,
         SendStateEventAction,
         CreateRoomAction,
@@ -111,13 +128,16 @@ namespace Kazv
         QueryKeysAction,
         ClaimKeysAction,
         EncryptMegOlmEventAction,
+        PrepareMegOlmSessionAction,
         EncryptOlmEventAction,
+        AddSessionKeyRecipientsAction,
 
         GetUserProfileAction,
         SetAvatarUrlAction,
         SetDisplayNameAction,
 
-        ResubmitJobAction
+        ResubmitJobAction,
+        SetSubscribedTriggersAction
         >;
 
     using ClientEffect = Effect<ClientAction, lager::deps<>>;
@@ -8,7 +8,6 @@
 
 #include "device-list-tracker.hpp"
 
-#include <algorithm>
 
 #include <zug/transducer/filter.hpp>
 #include <zug/sequence.hpp>
@@ -19,6 +18,32 @@
 
 namespace Kazv
 {
+    using KeyIndexT = immer::map<std::string, DeviceListTracker::KeyOwnersT>;
+
+    static KeyIndexT addKeyOwner(KeyIndexT index, const std::string &key,
+                                 const std::string &userId, const std::string &deviceId)
+    {
+        return std::move(index).update(
+            key, [&](auto owners) { return std::move(owners).set(userId, deviceId); });
+    }
+
+    static KeyIndexT removeKeyOwner(KeyIndexT index, const std::string &key,
+                                    const std::string &userId, const std::string &deviceId)
+    {
+        auto owners = index.find(key);
+        if (! owners) {
+            return index;
+        }
+        auto ownerDevice = owners->find(userId);
+        if (! ownerDevice || *ownerDevice != deviceId) {
+            return index;
+        }
+        auto newOwners = owners->erase(userId);
+        return newOwners.empty()
+            ? std::move(index).erase(key)
+            : std::move(index).set(key, std::move(newOwners));
+    }
+
     immer::flex_vector<std::string> DeviceListTracker::outdatedUsers() const
     {
         return intoImmer(
@@ -61,10 +86,23 @@ namespace Kazv
                 deviceInfo.unsignedData ? deviceInfo.unsignedData.value().deviceDisplayName : std::nullopt
             };
 
+            auto oldInfo = get(userId, deviceId);
+            if (oldInfo == info) {
+                return true;
+            }
+
+            if (oldInfo) {
+                ed25519KeyOwners = removeKeyOwner(std::move(ed25519KeyOwners), oldInfo->ed25519Key, userId, deviceId);
+                curve25519KeyOwners = removeKeyOwner(std::move(curve25519KeyOwners), oldInfo->curve25519Key, userId, deviceId);
+            }
+            ed25519KeyOwners = addKeyOwner(std::move(ed25519KeyOwners), info.ed25519Key, userId, deviceId);
+            curve25519KeyOwners = addKeyOwner(std::move(curve25519KeyOwners), info.curve25519Key, userId, deviceId);
+
             deviceLists = std::move(deviceLists)
                 .update(userId, [=](auto deviceMap) {
                                     return std::move(deviceMap).set(deviceId, info);
                                 });
+            changedUsers = std::move(changedUsers).insert(userId);
             return true;
         }
 
@@ -72,6 +110,22 @@ namespace Kazv
         return false;
     }
 
+    void DeviceListTracker::removeDevice(std::string userId, std::string deviceId)
+    {
+        auto info = get(userId, deviceId);
+        if (! info) {
+            return;
+        }
+
+        ed25519KeyOwners = removeKeyOwner(std::move(ed25519KeyOwners), info->ed25519Key, userId, deviceId);
+        curve25519KeyOwners = removeKeyOwner(std::move(curve25519KeyOwners), info->curve25519Key, userId, deviceId);
+        deviceLists = std::move(deviceLists)
+            .update(userId, [&](auto deviceMap) {
+                                return std::move(deviceMap).erase(deviceId);
+                            });
+        changedUsers = std::move(changedUsers).insert(userId);
+    }
+
     void DeviceListTracker::markUpToDate(std::string userId)
     {
         usersToTrackDeviceLists = std::move(usersToTrackDeviceLists).set(userId, false);
@@ -79,45 +133,43 @@ namespace Kazv
 
     std::optional<DeviceKeyInfo> DeviceListTracker::get(std::string userId, std::string deviceId) const
     {
-        try {
-            return deviceLists.at(userId).at(deviceId);
-        } catch (const std::exception &) {
+        auto devices = deviceLists.find(userId);
+        if (! devices) {
+            return std::nullopt;
+        }
+        auto info = devices->find(deviceId);
+        if (! info) {
+            return std::nullopt;
+        }
+        return *info;
+    }
+
+    /// @return the device of `userId` owning `key` in `index`, if any
+    static std::optional<DeviceKeyInfo> findByKey(
+        const DeviceListTracker &tracker, const KeyIndexT &index,
+        const std::string &userId, const std::string &key)
+    {
+        auto owners = index.find(key);
+        if (! owners) {
             return std::nullopt;
         }
+        auto deviceId = owners->find(userId);
+        if (! deviceId) {
+            return std::nullopt;
+        }
+        return tracker.get(userId, *deviceId);
     }
 
     std::optional<DeviceKeyInfo> DeviceListTracker::findByEd25519Key(
         std::string userId, std::string ed25519Key) const
     {
-        auto devices = deviceLists.at(userId);
-
-        auto it = std::find_if(devices.begin(), devices.end(),
-                               [=](auto n) {
-                                   auto [deviceId, info] = n;
-                                   return info.ed25519Key == ed25519Key;
-                               });
-        if (it != devices.end()) {
-            return it->second;
-        } else {
-            return std::nullopt;
-        }
+        return findByKey(*this, ed25519KeyOwners, userId, ed25519Key);
     }
 
     std::optional<DeviceKeyInfo> DeviceListTracker::findByCurve25519Key(
         std::string userId, std::string curve25519Key) const
     {
-        auto devices = deviceLists.at(userId);
-
-        auto it = std::find_if(devices.begin(), devices.end(),
-                               [=](auto n) {
-                                   auto [deviceId, info] = n;
-                                   return info.curve25519Key == curve25519Key;
-                               });
-        if (it != devices.end()) {
-            return it->second;
-        } else {
-            return std::nullopt;
-        }
+        return findByKey(*this, curve25519KeyOwners, userId, curve25519Key);
     }
 
     immer::flex_vector<std::string> DeviceListTracker::diff(DeviceListTracker that) const
@@ -135,6 +187,25 @@ namespace Kazv
         return changedUsers;
     }
 
+    immer::set<std::string> DeviceListTracker::takeChangedUsers()
+    {
+        auto ret = std::move(changedUsers);
+        changedUsers = {};
+        return ret;
+    }
+
+    void DeviceListTracker::rebuildKeyIndexes()
+    {
+        ed25519KeyOwners = {};
+        curve25519KeyOwners = {};
+        for (const auto &[userId, devices] : deviceLists) {
+            for (const auto &[deviceId, info] : devices) {
+                ed25519KeyOwners = addKeyOwner(std::move(ed25519KeyOwners), info.ed25519Key, userId, deviceId);
+                curve25519KeyOwners = addKeyOwner(std::move(curve25519KeyOwners), info.curve25519Key, userId, deviceId);
+            }
+        }
+    }
+
     auto DeviceListTracker::devicesFor(std::string userId) const -> DeviceMapT
     {
         return deviceLists[userId];
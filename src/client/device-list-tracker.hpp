@@ -9,6 +9,7 @@
 #include <string>
 
 #include <immer/map.hpp>
+#include <immer/set.hpp>
 #include <immer/flex_vector.hpp>
 
 #include <boost/serialization/string.hpp>
@@ -57,8 +58,17 @@ namespace Kazv
     struct DeviceListTracker
     {
         using DeviceMapT = immer::map<std::string /* deviceId */, DeviceKeyInfo>;
+        using KeyOwnersT = immer::map<std::string /* userId */, std::string /* deviceId */>;
         immer::map<std::string /* userId */, bool /* outdated */> usersToTrackDeviceLists;
         immer::map<std::string /* userId */, DeviceMapT> deviceLists;
+        /// The devices owning each ed25519 key, to find devices by key.
+        /// Built from `deviceLists` and not serialized.
+        immer::map<std::string /* ed25519Key */, KeyOwnersT> ed25519KeyOwners;
+        /// The devices owning each curve25519 key, as `ed25519KeyOwners`
+        immer::map<std::string /* curve25519Key */, KeyOwnersT> curve25519KeyOwners;
+        /// The users whose device list changed since the last
+        /// `takeChangedUsers()`. Not serialized.
+        immer::set<std::string /* userId */> changedUsers;
 
         template<class RangeT>
         void track(RangeT &&userIds) {
@@ -79,6 +89,9 @@ namespace Kazv
 
         bool addDevice(std::string userId, std::string deviceId, Api::QueryKeysJob::DeviceInformation deviceInfo, Crypto &crypto);
 
+        /// Remove the device of `userId` with `deviceId`, if it is there
+        void removeDevice(std::string userId, std::string deviceId);
+
         void markUpToDate(std::string userId);
 
         DeviceMapT devicesFor(std::string userId) const;
@@ -90,6 +103,20 @@ namespace Kazv
 
         /// returns a list of users whose device list has changed
         immer::flex_vector<std::string> diff(DeviceListTracker that) const;
+
+        /**
+         * Get the users whose device list changed since the last call,
+         * and forget them.
+         *
+         * Unlike `diff()`, this does not compare the device lists, and
+         * takes time proportional to the number of changed users.
+         *
+         * @return The users whose device list changed.
+         */
+        immer::set<std::string> takeChangedUsers();
+
+        /// Build `ed25519KeyOwners` and `curve25519KeyOwners` from `deviceLists`
+        void rebuildKeyIndexes();
     };
 
     template<class Archive>
@@ -99,6 +126,10 @@ namespace Kazv
             & t.usersToTrackDeviceLists
             & t.deviceLists
             ;
+
+        if constexpr (Archive::is_loading::value) {
+            t.rebuildKeyIndexes();
+        }
     }
 }
 
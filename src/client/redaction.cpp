@@ -0,0 +1,170 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <vector>
+
+#include "redaction.hpp"
+
+namespace Kazv
+{
+    // The latest room version whose redaction algorithm we know
+    static constexpr int latestKnownRoomVersion = 11;
+
+    static bool isStringAt(const json &j, const char *key)
+    {
+        return j.is_object() && j.contains(key) && j[key].is_string();
+    }
+
+    std::optional<std::string> redactedEventIdOf(const Event &e)
+    {
+        if (e.type() != "m.room.redaction") {
+            return std::nullopt;
+        }
+        // Room versions before 11 have it at the top level,
+        // and later ones in the content
+        auto content = e.content().get();
+        if (isStringAt(content, "redacts")) {
+            return content["redacts"].get<std::string>();
+        }
+        auto raw = e.raw().get();
+        if (isStringAt(raw, "redacts")) {
+            return raw["redacts"].get<std::string>();
+        }
+        auto orig = e.originalJson().get();
+        if (isStringAt(orig, "redacts")) {
+            return orig["redacts"].get<std::string>();
+        }
+        return std::nullopt;
+    }
+
+    bool isRedacted(const Event &e)
+    {
+        auto orig = e.originalJson().get();
+        return orig.contains("unsigned")
+            && orig["unsigned"].is_object()
+            && orig["unsigned"].contains("redacted_because");
+    }
+
+    static int intAt(const json &j, const std::string &key, int defaultValue)
+    {
+        return j.is_object() && j.contains(key) && j[key].is_number_integer()
+            ? j[key].get<int>()
+            : defaultValue;
+    }
+
+    bool isRedactionAllowed(const Event &redaction, const std::optional<std::string> &targetSender,
+                            const Event &powerLevels, const Event &createEvent)
+    {
+        const auto &sender = redaction.sender();
+        if (targetSender && targetSender.value() == sender) {
+            return true;
+        }
+
+        // Without a power levels event, the creator has 100 and others 0
+        if (powerLevels.type() != "m.room.power_levels") {
+            return createEvent.type() == "m.room.create" && createEvent.sender() == sender;
+        }
+
+        auto content = powerLevels.content().get();
+        auto users = content.is_object() && content.contains("users") ? content["users"] : json::object();
+        auto level = intAt(users, sender, intAt(content, "users_default", 0));
+        return level >= intAt(content, "redact", 50);
+    }
+
+    static int redactionVersionOf(const std::string &roomVersion)
+    {
+        if (roomVersion.empty()
+            || roomVersion.size() > 3
+            || ! std::all_of(roomVersion.begin(), roomVersion.end(),
+                             [](unsigned char c) { return std::isdigit(c); })) {
+            return latestKnownRoomVersion;
+        }
+        return std::min(std::stoi(roomVersion), latestKnownRoomVersion);
+    }
+
+    static json keepKeys(const json &j, const std::vector<std::string> &keys)
+    {
+        auto ret = json::object();
+        for (const auto &k : keys) {
+            if (j.contains(k)) {
+                ret[k] = j[k];
+            }
+        }
+        return ret;
+    }
+
+    static json prunedContentOf(const std::string &type, const json &content, int version)
+    {
+        if (! content.is_object()) {
+            return json::object();
+        }
+
+        if (type == "m.room.member") {
+            auto keys = std::vector<std::string>{"membership"};
+            if (version >= 9) {
+                keys.push_back("join_authorised_via_users_server");
+            }
+            auto ret = keepKeys(content, keys);
+            if (version >= 11
+                && content.contains("third_party_invite")
+                && content["third_party_invite"].is_object()
+                && content["third_party_invite"].contains("signed")) {
+                ret["third_party_invite"] = json{{"signed", content["third_party_invite"]["signed"]}};
+            }
+            return ret;
+        } else if (type == "m.room.create") {
+            return version >= 11 ? content : keepKeys(content, {"creator"});
+        } else if (type == "m.room.join_rules") {
+            return version >= 8
+                ? keepKeys(content, {"join_rule", "allow"})
+                : keepKeys(content, {"join_rule"});
+        } else if (type == "m.room.power_levels") {
+            auto keys = std::vector<std::string>{
+                "ban", "events", "events_default", "kick", "redact",
+                "state_default", "users", "users_default",
+            };
+            if (version >= 11) {
+                keys.push_back("invite");
+            }
+            return keepKeys(content, keys);
+        } else if (type == "m.room.aliases") {
+            return version <= 5 ? keepKeys(content, {"aliases"}) : json::object();
+        } else if (type == "m.room.history_visibility") {
+            return keepKeys(content, {"history_visibility"});
+        } else if (type == "m.room.redaction") {
+            return version >= 11 ? keepKeys(content, {"redacts"}) : json::object();
+        }
+        return json::object();
+    }
+
+    Event redactedEventOf(const Event &e, const Event &redaction, const std::string &roomVersion)
+    {
+        auto version = redactionVersionOf(roomVersion);
+        auto orig = e.originalJson().get();
+        if (! orig.is_object()) {
+            return e;
+        }
+
+        auto keys = std::vector<std::string>{
+            "event_id", "type", "room_id", "sender", "state_key", "hashes",
+            "signatures", "depth", "prev_events", "auth_events", "origin_server_ts",
+        };
+        if (version < 11) {
+            keys.insert(keys.end(), {"prev_state", "origin", "membership"});
+        }
+
+        auto pruned = keepKeys(orig, keys);
+        auto type = isStringAt(orig, "type") ? orig["type"].get<std::string>() : std::string{};
+        pruned["content"] = prunedContentOf(type, orig.contains("content") ? orig["content"] : json::object(), version);
+        pruned["unsigned"] = json{{"redacted_because", redaction.originalJson().get()}};
+
+        return Event(pruned);
+    }
+}
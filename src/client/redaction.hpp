@@ -0,0 +1,61 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include <libkazv-config.hpp>
+
+#include <optional>
+#include <string>
+
+#include <event.hpp>
+
+namespace Kazv
+{
+    /// @return the id of the event `e` redacts, if `e` is a redaction
+    std::optional<std::string> redactedEventIdOf(const Event &e);
+
+    /// @return whether `e` has been redacted
+    bool isRedacted(const Event &e);
+
+    /**
+     * Check whether a redaction may be applied.
+     *
+     * Servers send redactions to clients without checking whether
+     * the sender may redact the event, so a redaction is only applied
+     * if its sender sent the event, or has the `redact` power level.
+     *
+     * @param redaction The redaction.
+     * @param targetSender The sender of the event it redacts, or
+     * std::nullopt if it is not known.
+     * @param powerLevels The `m.room.power_levels` event of the room,
+     * or an empty Event if there is none.
+     * @param createEvent The `m.room.create` event of the room, whose
+     * sender has the highest power level if there is no `powerLevels`.
+     *
+     * @return Whether the redaction may be applied.
+     */
+    bool isRedactionAllowed(const Event &redaction, const std::optional<std::string> &targetSender,
+                            const Event &powerLevels, const Event &createEvent);
+
+    /**
+     * Redact an event.
+     *
+     * The keys of the event and of its content are pruned as in the
+     * redaction algorithm of `roomVersion`. Versions we do not know
+     * use the algorithm of the latest version we know. The redaction
+     * is put into `unsigned.redacted_because`, as the server does.
+     *
+     * Encrypted events are pruned as they were received, and their
+     * decrypted content is dropped.
+     *
+     * @param e The event to redact.
+     * @param redaction The redaction of `e`.
+     * @param roomVersion The version of the room of `e`.
+     *
+     * @return The redacted event.
+     */
+    Event redactedEventOf(const Event &e, const Event &redaction, const std::string &roomVersion);
+}
@@ -0,0 +1,190 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include "relations-index.hpp"
+
+namespace Kazv
+{
+    static bool isStringAt(const json &j, const char *key)
+    {
+        return j.is_object() && j.contains(key) && j[key].is_string();
+    }
+
+    static json relatesToOf(const Event &e)
+    {
+        auto content = e.content().get();
+        if (content.contains("m.relates_to") && content["m.relates_to"].is_object()) {
+            return content["m.relates_to"];
+        }
+        // m.relates_to is not encrypted, so that servers can aggregate relations
+        if (e.encrypted()) {
+            auto orig = e.originalJson().get();
+            if (orig.contains("content") && orig["content"].contains("m.relates_to")
+                && orig["content"]["m.relates_to"].is_object()) {
+                return orig["content"]["m.relates_to"];
+            }
+        }
+        return json::object();
+    }
+
+    immer::flex_vector<EventRelation> relationsOf(const Event &e)
+    {
+        auto relations = immer::flex_vector<EventRelation>{};
+        auto relatesTo = relatesToOf(e);
+
+        if (isStringAt(relatesTo, "rel_type") && isStringAt(relatesTo, "event_id")) {
+            auto relType = relatesTo["rel_type"].get<std::string>();
+            auto key = (relType == "m.annotation" && isStringAt(relatesTo, "key"))
+                ? relatesTo["key"].get<std::string>()
+                : std::string{};
+            relations = std::move(relations).push_back(
+                EventRelation{relType, relatesTo["event_id"].get<std::string>(), key});
+        }
+
+        if (relatesTo.contains("m.in_reply_to")
+            && isStringAt(relatesTo["m.in_reply_to"], "event_id")) {
+            relations = std::move(relations).push_back(
+                EventRelation{"m.in_reply_to", relatesTo["m.in_reply_to"]["event_id"].get<std::string>(), ""});
+        }
+
+        return relations;
+    }
+
+    immer::flex_vector<std::string> RelationsIndex::childrenOf(const std::string &eventId, const std::string &relType) const
+    {
+        auto relations = children.find(eventId);
+        if (! relations) {
+            return {};
+        }
+        return (*relations)[relType];
+    }
+
+    ReactionCounts RelationsIndex::reactionCountsOf(const std::string &eventId) const
+    {
+        return reactions[eventId];
+    }
+
+    /// @return the first index in `ids` whose key is not less than (ts, id)
+    static std::size_t childLowerBound(const RelationsIndex &index, const immer::flex_vector<std::string> &ids,
+                                       Timestamp ts, const std::string &id)
+    {
+        auto less = [&](const std::string &other) {
+            auto otherTs = index.relatedEvents[other].originServerTs;
+            return otherTs < ts || (otherTs == ts && other < id);
+        };
+
+        // New events usually come last
+        if (ids.empty() || less(ids.back())) {
+            return ids.size();
+        }
+
+        auto lo = std::size_t{};
+        auto hi = ids.size();
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (less(ids[mid])) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    static ReactionCounts addReaction(ReactionCounts counts, const std::string &key, int delta)
+    {
+        auto count = counts[key] + delta;
+        if (count <= 0) {
+            return std::move(counts).erase(key);
+        }
+        return std::move(counts).set(key, count);
+    }
+
+    RelationsIndex RelationsIndex::remove(RelationsIndex index, const std::string &eventId)
+    {
+        auto related = index.relatedEvents.find(eventId);
+        if (! related) {
+            return index;
+        }
+
+        for (const auto &rel : related->relations) {
+            auto relations = index.children[rel.eventId];
+            auto ids = relations[rel.relType];
+            auto i = childLowerBound(index, ids, related->originServerTs, eventId);
+            if (i < ids.size() && ids[i] == eventId) {
+                ids = std::move(ids).erase(i);
+            }
+            relations = ids.empty()
+                ? std::move(relations).erase(rel.relType)
+                : std::move(relations).set(rel.relType, std::move(ids));
+            index.children = relations.empty()
+                ? std::move(index.children).erase(rel.eventId)
+                : std::move(index.children).set(rel.eventId, std::move(relations));
+
+            if (rel.relType == "m.annotation") {
+                auto counts = addReaction(index.reactions[rel.eventId], rel.key, -1);
+                index.reactions = counts.empty()
+                    ? std::move(index.reactions).erase(rel.eventId)
+                    : std::move(index.reactions).set(rel.eventId, std::move(counts));
+            }
+        }
+
+        index.relatedEvents = std::move(index.relatedEvents).erase(eventId);
+        return index;
+    }
+
+    static RelationsIndex addRelatedEvent(RelationsIndex index, const std::string &eventId, RelatedEvent related)
+    {
+        for (const auto &rel : related.relations) {
+            index.children = std::move(index.children).update(
+                rel.eventId,
+                [&](RelationMap relations) {
+                    return std::move(relations).update(
+                        rel.relType,
+                        [&](immer::flex_vector<std::string> ids) {
+                            auto i = childLowerBound(index, ids, related.originServerTs, eventId);
+                            return std::move(ids).insert(i, eventId);
+                        });
+                });
+
+            if (rel.relType == "m.annotation") {
+                index.reactions = std::move(index.reactions).update(
+                    rel.eventId,
+                    [&](ReactionCounts counts) {
+                        return addReaction(std::move(counts), rel.key, 1);
+                    });
+            }
+        }
+
+        index.relatedEvents = std::move(index.relatedEvents).set(eventId, std::move(related));
+        return index;
+    }
+
+    RelationsIndex RelationsIndex::addEvents(RelationsIndex index, const EventList &events)
+    {
+        for (const auto &e : events) {
+            const auto &eventId = e.id();
+            if (eventId.empty()) {
+                continue;
+            }
+
+            auto related = RelatedEvent{e.originServerTs(), relationsOf(e)};
+            auto old = index.relatedEvents.find(eventId);
+            if (old && *old == related) {
+                continue;
+            }
+            if (old) {
+                index = remove(std::move(index), eventId);
+            }
+            if (! related.relations.empty()) {
+                index = addRelatedEvent(std::move(index), eventId, std::move(related));
+            }
+        }
+        return index;
+    }
+}
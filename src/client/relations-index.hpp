@@ -0,0 +1,158 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include <libkazv-config.hpp>
+
+#include <optional>
+#include <string>
+
+#include <boost/serialization/string.hpp>
+
+#include <immer/flex_vector.hpp>
+#include <immer/map.hpp>
+
+#include <serialization/immer-flex-vector.hpp>
+#include <serialization/immer-map.hpp>
+
+#include <event.hpp>
+
+#include "redaction.hpp"
+
+namespace Kazv
+{
+    /// A relation from an event to another, as in its `m.relates_to`
+    struct EventRelation
+    {
+        /// The `rel_type`, or `m.in_reply_to` for replies
+        std::string relType;
+        /// The id of the event related to
+        std::string eventId;
+        /// The `key` of annotations, or empty
+        std::string key;
+    };
+
+    inline bool operator==(const EventRelation &a, const EventRelation &b)
+    {
+        return a.relType == b.relType
+            && a.eventId == b.eventId
+            && a.key == b.key;
+    }
+
+    inline bool operator!=(const EventRelation &a, const EventRelation &b)
+    {
+        return !(a == b);
+    }
+
+    /**
+     * Get the relations of an event.
+     *
+     * For encrypted events, the relations are read from the decrypted
+     * content if it has them, or else from the unencrypted content.
+     *
+     * @param e The event.
+     *
+     * @return The relation in the `m.relates_to` of `e`, if any,
+     * followed by the reply in it, if any.
+     */
+    immer::flex_vector<EventRelation> relationsOf(const Event &e);
+
+    /// An event that relates to others
+    struct RelatedEvent
+    {
+        Timestamp originServerTs{0};
+        immer::flex_vector<EventRelation> relations;
+    };
+
+    inline bool operator==(const RelatedEvent &a, const RelatedEvent &b)
+    {
+        return a.originServerTs == b.originServerTs
+            && a.relations == b.relations;
+    }
+
+    inline bool operator!=(const RelatedEvent &a, const RelatedEvent &b)
+    {
+        return !(a == b);
+    }
+
+    /// relType -> ids of the child events, from oldest to latest
+    using RelationMap = immer::map<std::string, immer::flex_vector<std::string>>;
+
+    /// annotation key -> number of annotations with it
+    using ReactionCounts = immer::map<std::string, int>;
+
+    /**
+     * An index of the relations between the events of one room.
+     *
+     * The children of each event are kept sorted by timestamp, then
+     * by event id, as in the timeline. Annotations are also counted
+     * by their keys.
+     *
+     * Events stay in the index when they are spilled out of the
+     * timeline, and leave it only when they are redacted.
+     */
+    struct RelationsIndex
+    {
+        /// Parent event id -> its children
+        immer::map<std::string, RelationMap> children;
+        /// Child event id -> its relations
+        immer::map<std::string, RelatedEvent> relatedEvents;
+        /// Parent event id -> the counts of annotations of it
+        immer::map<std::string, ReactionCounts> reactions;
+
+        /// @return the ids of the children of `eventId` with `relType`, from oldest to latest
+        immer::flex_vector<std::string> childrenOf(const std::string &eventId, const std::string &relType) const;
+
+        /// @return the counts of the annotations of `eventId` by key
+        ReactionCounts reactionCountsOf(const std::string &eventId) const;
+
+        /**
+         * Add the relations of `events` to `index`.
+         *
+         * Events already in the index are updated if their relations
+         * changed, e.g. after they are decrypted. Redactions are left to
+         * applyRedactions(), which checks whether they may be applied.
+         */
+        static RelationsIndex addEvents(RelationsIndex index, const EventList &events);
+
+        /// Remove the relations of the event with `eventId` from `index`
+        static RelationsIndex remove(RelationsIndex index, const std::string &eventId);
+    };
+
+    inline bool operator==(const RelationsIndex &a, const RelationsIndex &b)
+    {
+        return a.children == b.children
+            && a.relatedEvents == b.relatedEvents
+            && a.reactions == b.reactions;
+    }
+
+    inline bool operator!=(const RelationsIndex &a, const RelationsIndex &b)
+    {
+        return !(a == b);
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, EventRelation &r, std::uint32_t const /*version*/)
+    {
+        ar & r.relType & r.eventId & r.key;
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, RelatedEvent &e, std::uint32_t const /*version*/)
+    {
+        ar & e.originServerTs & e.relations;
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, RelationsIndex &index, std::uint32_t const /*version*/)
+    {
+        ar & index.children & index.relatedEvents & index.reactions;
+    }
+}
+
+BOOST_CLASS_VERSION(Kazv::EventRelation, 0)
+BOOST_CLASS_VERSION(Kazv::RelatedEvent, 0)
+BOOST_CLASS_VERSION(Kazv::RelationsIndex, 0)
@@ -7,6 +7,15 @@
 #include <libkazv-config.hpp>
 
 
+#include <algorithm>
+#include <optional>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+#include <immer/algorithm.hpp>
+#include <immer/flex_vector_transient.hpp>
+
 #include <lager/util.hpp>
 #include <zug/sequence.hpp>
 #include <zug/transducer/map.hpp>
@@ -20,11 +29,480 @@
 
 namespace Kazv
 {
+    static std::string membershipOf(const Event &memberEvent)
+    {
+        auto content = memberEvent.content().get();
+        if (content.contains("membership") && content["membership"].is_string()) {
+            return content["membership"].get<std::string>();
+        }
+        return "";
+    }
+
+    static MembershipMap addMemberships(MembershipMap memberships, const EventList &events)
+    {
+        for (const auto &e : events) {
+            if (e.type() == "m.room.member") {
+                memberships = std::move(memberships).set(e.stateKey(), membershipOf(e));
+            }
+        }
+        return memberships;
+    }
+
+    MembershipMap membershipsFromState(const immer::map<KeyOfState, Event> &stateEvents)
+    {
+        auto memberships = MembershipMap{};
+        for (const auto &[k, e] : stateEvents) {
+            if (k.type == "m.room.member") {
+                memberships = std::move(memberships).set(k.stateKey, membershipOf(e));
+            }
+        }
+        return memberships;
+    }
+
+    immer::flex_vector<Timestamp> timelineTsOf(const immer::flex_vector<std::string> &timeline,
+                                               const immer::map<std::string, Event> &messages)
+    {
+        return intoImmer(
+            immer::flex_vector<Timestamp>{},
+            zug::map([&](const auto &eventId) { return messages[eventId].originServerTs(); }),
+            timeline);
+    }
+
+    static immer::flex_vector<Timestamp> timestampsOf(const EventList &events)
+    {
+        return intoImmer(
+            immer::flex_vector<Timestamp>{},
+            zug::map([](const Event &e) { return e.originServerTs(); }),
+            events);
+    }
+
+    // sort first by timestamp, then by id
+    static bool timelineKeyLess(Timestamp aTs, const std::string &aId, Timestamp bTs, const std::string &bId)
+    {
+        return aTs < bTs || (aTs == bTs && aId < bId);
+    }
+
+    /// @return the first index in [from, size) whose key is not less than (ts, id)
+    static std::size_t timelineLowerBound(const RoomModel &r, std::size_t from, Timestamp ts, const std::string &id)
+    {
+        auto lo = from;
+        auto hi = r.timeline.size();
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (timelineKeyLess(r.timelineTs[mid], r.timeline[mid], ts, id)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    /// @return the first index in [from, size) whose key is greater than (ts, id)
+    static std::size_t timelineUpperBound(const RoomModel &r, std::size_t from, Timestamp ts, const std::string &id)
+    {
+        auto lo = from;
+        auto hi = r.timeline.size();
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (timelineKeyLess(ts, id, r.timelineTs[mid], r.timeline[mid])) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        return lo;
+    }
+
+    /**
+     * Merge `items`, sorted by key, into the timeline of `r`.
+     *
+     * Items go after existing events with the same key. The existing
+     * timeline is copied over in slices between the insertion points,
+     * so the cost does not depend on how many events are between them.
+     */
+    static RoomModel mergeIntoTimeline(RoomModel r, const std::vector<std::pair<Timestamp, std::string>> &items)
+    {
+        auto timeline = immer::flex_vector<std::string>{};
+        auto timelineTs = immer::flex_vector<Timestamp>{};
+        auto pos = std::size_t{};
+
+        for (const auto &[ts, id] : items) {
+            auto next = timelineUpperBound(r, pos, ts, id);
+            if (next > pos) {
+                timeline = std::move(timeline) + r.timeline.take(next).drop(pos);
+                timelineTs = std::move(timelineTs) + r.timelineTs.take(next).drop(pos);
+                pos = next;
+            }
+            timeline = std::move(timeline).push_back(id);
+            timelineTs = std::move(timelineTs).push_back(ts);
+        }
+        timeline = std::move(timeline) + r.timeline.drop(pos);
+        timelineTs = std::move(timelineTs) + r.timelineTs.drop(pos);
+
+        r.timeline = std::move(timeline);
+        r.timelineTs = std::move(timelineTs);
+        return r;
+    }
+
+    static std::string stateStringField(const RoomModel &r, KeyOfState k, std::string field)
+    {
+        auto content = r.stateEvents[k].content().get();
+        if (content.contains(field) && content[field].is_string()) {
+            return content[field].get<std::string>();
+        }
+        return "";
+    }
+
+    static std::string memberNameOf(const RoomModel &r, std::string userId)
+    {
+        auto name = stateStringField(r, KeyOfState{"m.room.member", userId}, "displayname");
+        return name.empty() ? userId : name;
+    }
+
+    /// "A", "A and B", "A, B and C"
+    static std::string joinNames(const std::vector<std::string> &names)
+    {
+        auto ret = std::string{};
+        for (auto i = std::size_t{}; i < names.size(); ++i) {
+            if (i > 0) {
+                ret += (i + 1 == names.size()) ? " and " : ", ";
+            }
+            ret += names[i];
+        }
+        return ret;
+    }
+
+    static std::string displayNameOf(const RoomModel &r, const RoomSummary &summary)
+    {
+        auto name = stateStringField(r, KeyOfState{"m.room.name", ""}, "name");
+        if (! name.empty()) {
+            return name;
+        }
+
+        auto alias = stateStringField(r, KeyOfState{"m.room.canonical_alias", ""}, "alias");
+        if (! alias.empty()) {
+            return alias;
+        }
+
+        auto heroNames = std::vector<std::string>{};
+        for (const auto &hero : summary.heroes) {
+            heroNames.push_back(memberNameOf(r, hero));
+        }
+
+        // Excluding ourselves
+        auto numOthers = summary.joinedMemberCount + summary.invitedMemberCount - 1;
+        if (numOthers <= 0 || heroNames.empty()) {
+            return heroNames.empty()
+                ? "Empty Room"
+                : "Empty Room (was " + joinNames(heroNames) + ")";
+        }
+
+        if (static_cast<std::size_t>(numOthers) > heroNames.size()) {
+            auto numNotNamed = numOthers - static_cast<int>(heroNames.size());
+            auto ret = std::string{};
+            for (const auto &heroName : heroNames) {
+                ret += heroName + ", ";
+            }
+            ret.resize(ret.size() - 2);
+            return ret + " and " + std::to_string(numNotNamed) + (numNotNamed == 1 ? " other" : " others");
+        }
+
+        return joinNames(heroNames);
+    }
+
+    RoomSummary summaryOf(const RoomModel &r, RoomSummary summary)
+    {
+        if (! summary.memberCountsFromServer) {
+            summary.joinedMemberCount = 0;
+            summary.invitedMemberCount = 0;
+            for (const auto &[userId, membership] : r.memberships) {
+                if (membership == "join") {
+                    ++summary.joinedMemberCount;
+                } else if (membership == "invite") {
+                    ++summary.invitedMemberCount;
+                }
+            }
+        }
+
+        summary.displayName = displayNameOf(r, summary);
+        summary.avatarMxcUri = stateStringField(r, KeyOfState{"m.room.avatar", ""}, "url");
+        return summary;
+    }
+
+    PushRuleContext pushRuleContextOf(const RoomModel &r, std::string userId)
+    {
+        auto ctx = PushRuleContext{};
+        ctx.displayName = stateStringField(r, KeyOfState{"m.room.member", userId}, "displayname");
+        ctx.userId = std::move(userId);
+        ctx.memberCount = r.summary.joinedMemberCount;
+        ctx.powerLevels = r.stateEvents[KeyOfState{"m.room.power_levels", ""}].content();
+        return ctx;
+    }
+
+    SearchIndex searchIndexOf(const RoomModel &r)
+    {
+        return SearchIndex::addEvents(
+            SearchIndex{},
+            intoImmer(EventList{},
+                      zug::map([&](const auto &eventId) { return r.messages[eventId]; }),
+                      r.timeline));
+    }
+
+    RelationsIndex relationsIndexOf(const RoomModel &r)
+    {
+        // The events redacted have been pruned of their relations
+        return RelationsIndex::addEvents(
+            RelationsIndex{},
+            intoImmer(EventList{},
+                      zug::map([](const auto &p) { return p.second; }),
+                      r.messages));
+    }
+
+    std::optional<Event> latestEditOf(const RelationsIndex &relations,
+                                      const immer::map<std::string, Event> &messages,
+                                      const std::string &eventId)
+    {
+        auto original = messages.find(eventId);
+        auto edits = relations.childrenOf(eventId, "m.replace");
+        for (auto i = edits.size(); i > 0; --i) {
+            auto edit = messages.find(edits[i - 1]);
+            if (edit && (! original || edit->sender() == original->sender())) {
+                return *edit;
+            }
+        }
+        return std::nullopt;
+    }
+
+    EventList threadOf(const RelationsIndex &relations,
+                       const immer::map<std::string, Event> &messages,
+                       const std::string &threadRootId)
+    {
+        auto events = EventList{}.transient();
+        for (const auto &eventId : relations.childrenOf(threadRootId, "m.thread")) {
+            if (auto e = messages.find(eventId); e) {
+                events.push_back(*e);
+            }
+        }
+        return events.persistent();
+    }
+
+    /// @return whether any of `events` may change the summary of `r`
+    static bool affectsSummary(const RoomModel &r, const EventList &events)
+    {
+        for (const auto &e : events) {
+            const auto &type = e.type();
+            if (type == "m.room.name" || type == "m.room.canonical_alias" || type == "m.room.avatar") {
+                return true;
+            }
+            if (type == "m.room.member"
+                && (! r.summary.memberCountsFromServer
+                    || std::find(r.summary.heroes.begin(), r.summary.heroes.end(), e.stateKey())
+                    != r.summary.heroes.end())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// @return the id of the event of the read marker of `r`, or empty if none
+    static std::string readMarkerOf(const RoomModel &r)
+    {
+        auto content = r.accountData["m.fully_read"].content().get();
+        if (content.contains("event_id") && content["event_id"].is_string()) {
+            return content["event_id"].get<std::string>();
+        }
+        return "";
+    }
+
+    static RoomModel setReadReceipt(RoomModel r, const std::string &userId, ReadReceipt receipt)
+    {
+        if (auto old = r.readReceipts.find(userId); old) {
+            if (*old == receipt || old->timestamp > receipt.timestamp) {
+                return r;
+            }
+            auto readers = r.eventReaders[old->eventId].erase(userId);
+            r.eventReaders = readers.empty()
+                ? std::move(r.eventReaders).erase(old->eventId)
+                : std::move(r.eventReaders).set(old->eventId, std::move(readers));
+        }
+
+        r.eventReaders = std::move(r.eventReaders).update(
+            receipt.eventId,
+            [&](immer::set<std::string> readers) {
+                return std::move(readers).insert(userId);
+            });
+        r.readReceipts = std::move(r.readReceipts).set(userId, std::move(receipt));
+        return r;
+    }
+
+    RoomModel addReadReceipts(RoomModel r, const EventList &events)
+    {
+        for (const auto &e : events) {
+            if (e.type() != "m.receipt") {
+                continue;
+            }
+            auto content = e.content().get();
+            if (! content.is_object()) {
+                continue;
+            }
+
+            for (const auto &item : content.items()) {
+                const auto &receipts = item.value();
+                if (! receipts.is_object()) {
+                    continue;
+                }
+                for (const auto receiptType : {"m.read", "m.read.private"}) {
+                    if (! receipts.contains(receiptType) || ! receipts[receiptType].is_object()) {
+                        continue;
+                    }
+                    for (const auto &userReceipt : receipts[receiptType].items()) {
+                        const auto &data = userReceipt.value();
+                        if (! data.is_object()) {
+                            continue;
+                        }
+                        // Receipts in threads do not say where the user has read up to in the room
+                        if (data.contains("thread_id") && data["thread_id"] != "main") {
+                            continue;
+                        }
+                        auto ts = data.contains("ts") && data["ts"].is_number()
+                            ? data["ts"].get<Timestamp>()
+                            : Timestamp{0};
+                        r = setReadReceipt(std::move(r), userReceipt.key(), ReadReceipt{item.key(), ts});
+                    }
+                }
+            }
+        }
+        return r;
+    }
+
+    static bool isMessage(const Event &e)
+    {
+        const auto &type = e.type();
+        return type == "m.room.message"
+            || type == "m.room.encrypted"
+            || type == "m.sticker";
+    }
+
+    bool countsAsUnread(const Event &e, const std::string &userId)
+    {
+        return isMessage(e) && e.sender() != userId;
+    }
+
+    /**
+     * Add the messages that are new in `r` and after the read
+     * marker to the local unread count of `r`.
+     *
+     * @param r The room, with the new events already added.
+     * @param oldMessages The messages of `r` before they are added.
+     * @param oldTimeline The timeline of `r` before they are added.
+     * @param userId The id of the current user.
+     */
+    static RoomModel countNewUnread(RoomModel r,
+                                    const immer::map<std::string, Event> &oldMessages,
+                                    const immer::flex_vector<std::string> &oldTimeline,
+                                    const std::string &userId)
+    {
+        auto markerId = readMarkerOf(r);
+        auto marker = markerId.empty() ? nullptr : r.messages.find(markerId);
+        auto appended = r.timeline.size() >= oldTimeline.size()
+            && (oldTimeline.empty() || r.timeline[oldTimeline.size() - 1] == oldTimeline.back());
+        if ((marker && ! oldMessages.find(markerId)) || ! appended) {
+            // We did not know which messages were before the marker,
+            // or some are before the latest message of the user
+            r.localUnreadCount = localUnreadCountOf(r, userId);
+            return r;
+        }
+
+        // The new events are all after the marker
+        for (const auto &eventId : r.timeline.drop(oldTimeline.size())) {
+            const auto &e = r.messages[eventId];
+            if (! isMessage(e)) {
+                continue;
+            }
+            if (e.sender() == userId) {
+                r.localUnreadCount = 0;
+            } else {
+                ++r.localUnreadCount;
+            }
+        }
+        return r;
+    }
+
+    std::string roomVersionOf(const RoomModel &r)
+    {
+        auto version = stateStringField(r, KeyOfState{"m.room.create", ""}, "room_version");
+        // Rooms created before room versions existed are version 1
+        return version.empty() ? "1" : version;
+    }
+
+    RoomModel applyRedactions(RoomModel r, const EventList &events)
+    {
+        auto roomVersion = std::optional<std::string>{};
+        auto redactedState = EventList{};
+
+        for (const auto &e : events) {
+            auto redactedId = redactedEventIdOf(e);
+            if (! redactedId) {
+                continue;
+            }
+            auto target = r.messages.find(redactedId.value());
+            auto targetSender = target
+                ? std::optional<std::string>(target->sender())
+                : std::nullopt;
+            if (! isRedactionAllowed(e, targetSender,
+                                     r.stateEvents[KeyOfState{"m.room.power_levels", ""}],
+                                     r.stateEvents[KeyOfState{"m.room.create", ""}])) {
+                continue;
+            }
+
+            // The event may have been spilled out of the messages,
+            // but it is still in the search index. Its sender is not
+            // known then, so only redactions by members who can redact
+            // others' events remove it.
+            r.searchIndex = SearchIndex::remove(std::move(r.searchIndex), redactedId.value());
+            r.relations = RelationsIndex::remove(std::move(r.relations), redactedId.value());
+            if (! target || isRedacted(*target)) {
+                continue;
+            }
+
+            if (! roomVersion) {
+                roomVersion = roomVersionOf(r);
+            }
+            auto redacted = redactedEventOf(*target, e, roomVersion.value());
+
+            if (redacted.isState()) {
+                auto k = keyOfState(redacted);
+                auto current = r.stateEvents.find(k);
+                if (current && current->id() == redacted.id()) {
+                    r.stateEvents = std::move(r.stateEvents).set(k, redacted);
+                    redactedState = std::move(redactedState).push_back(redacted);
+                }
+            }
+
+            r.messages = std::move(r.messages).set(redactedId.value(), std::move(redacted));
+        }
+
+        if (! redactedState.empty()) {
+            r.memberships = addMemberships(std::move(r.memberships), redactedState);
+            if (affectsSummary(r, redactedState)) {
+                r.summary = summaryOf(r, std::move(r.summary));
+            }
+        }
+
+        return r;
+    }
+
     RoomModel RoomModel::update(RoomModel r, Action a)
     {
         return lager::match(std::move(a))(
             [&](AddStateEventsAction a) {
                 r.stateEvents = merge(std::move(r.stateEvents), a.stateEvents, keyOfState);
+                r.memberships = addMemberships(std::move(r.memberships), a.stateEvents);
+
+                if (affectsSummary(r, a.stateEvents)) {
+                    r.summary = summaryOf(r, std::move(r.summary));
+                }
 
                 // If m.room.encryption state event appears,
                 // configure the room to use encryption.
@@ -37,15 +515,29 @@ namespace Kazv
             [&](AppendTimelineAction a) {
                 auto eventIds = intoImmer(immer::flex_vector<std::string>(),
                                           zug::map(keyOfTimeline), a.events);
+                auto oldMessages = r.messages;
+                auto oldTimeline = r.timeline;
                 r.timeline = r.timeline + eventIds;
+                r.timelineTs = r.timelineTs + timestampsOf(a.events);
                 r.messages = merge(std::move(r.messages), a.events, keyOfTimeline);
+                r.searchIndex = SearchIndex::addEvents(std::move(r.searchIndex), a.events);
+                r.relations = RelationsIndex::addEvents(std::move(r.relations), a.events);
+                r = applyRedactions(std::move(r), a.events);
+                r = countNewUnread(std::move(r), oldMessages, oldTimeline, a.userId);
                 return r;
             },
             [&](PrependTimelineAction a) {
                 auto eventIds = intoImmer(immer::flex_vector<std::string>(),
                                           zug::map(keyOfTimeline), a.events);
+                auto oldMessages = r.messages;
+                auto oldTimeline = r.timeline;
                 r.timeline = eventIds + r.timeline;
+                r.timelineTs = timestampsOf(a.events) + r.timelineTs;
                 r.messages = merge(std::move(r.messages), a.events, keyOfTimeline);
+                r.searchIndex = SearchIndex::addEvents(std::move(r.searchIndex), a.events);
+                r.relations = RelationsIndex::addEvents(std::move(r.relations), a.events);
+                r = applyRedactions(std::move(r), a.events);
+                r = countNewUnread(std::move(r), oldMessages, oldTimeline, a.userId);
                 r.paginateBackToken = a.paginateBackToken;
                 // if there are no more events we should not allow further paginating
                 r.canPaginateBack = a.events.size() != 0;
@@ -55,19 +547,35 @@ namespace Kazv
                 auto eventIds = intoImmer(immer::flex_vector<std::string>(),
                                           zug::map(keyOfTimeline), a.events);
 
+                // The timeline may have been assigned without its keys
+                if (r.timelineTs.size() != r.timeline.size()) {
+                    r.timelineTs = timelineTsOf(r.timeline, r.messages);
+                }
+
                 auto oldMessages = r.messages;
+                auto oldTimeline = r.timeline;
                 r.messages = merge(std::move(r.messages), a.events, keyOfTimeline);
-                auto exists =
-                    [=](auto eventId) -> bool {
-                        return !! oldMessages.find(eventId);
-                    };
-                auto key =
-                    [=](auto eventId) {
-                        // sort first by timestamp, then by id
-                        return std::make_tuple(r.messages[eventId].originServerTs(), eventId);
-                    };
-
-                r.timeline = sortedUniqueMerge(r.timeline, eventIds, exists, key);
+                r.searchIndex = SearchIndex::addEvents(std::move(r.searchIndex), a.events);
+                r.relations = RelationsIndex::addEvents(std::move(r.relations), a.events);
+                r = applyRedactions(std::move(r), a.events);
+
+                auto needToAdd = std::vector<std::pair<Timestamp, std::string>>{};
+                for (const auto &e : a.events) {
+                    if (! oldMessages.find(e.id())) {
+                        needToAdd.emplace_back(r.messages[e.id()].originServerTs(), e.id());
+                    }
+                }
+                std::stable_sort(needToAdd.begin(), needToAdd.end(),
+                                 [](const auto &x, const auto &y) {
+                                     return timelineKeyLess(x.first, x.second, y.first, y.second);
+                                 });
+                // An event may appear twice in one batch, e.g. when a gappy
+                // sync overlaps a pagination. Its copies are now adjacent.
+                needToAdd.erase(std::unique(needToAdd.begin(), needToAdd.end(),
+                                            [](const auto &x, const auto &y) { return x.second == y.second; }),
+                                needToAdd.end());
+
+                r = mergeIntoTimeline(std::move(r), needToAdd);
 
                 // TODO need other way to determine whether it is limited
                 // in a pagination request (/messages does not have that field)
@@ -86,22 +594,26 @@ namespace Kazv
 
                 // remove all Gaps between the gapped event and the first event in this batch
                 if (!eventIds.empty() && a.gapEventId.has_value()) {
-                    auto cmp = [=](auto a, auto b) {
-                                   return key(a) < key(b);
-                               };
-                    auto thisBatchStart = std::equal_range(r.timeline.begin(), r.timeline.end(), eventIds[0], cmp).first;
-                    auto origBatchStart = std::equal_range(thisBatchStart, r.timeline.end(), a.gapEventId.value(), cmp).first;
+                    const auto &gapEventId = a.gapEventId.value();
+                    auto thisBatchStart = timelineLowerBound(
+                        r, 0, r.messages[eventIds[0]].originServerTs(), eventIds[0]);
+                    auto origBatchStart = timelineLowerBound(
+                        r, thisBatchStart, r.messages[gapEventId].originServerTs(), gapEventId);
 
-                    std::for_each(thisBatchStart + 1, origBatchStart,
-                                  [&](auto eventId) {
-                                      r.timelineGaps = std::move(r.timelineGaps).erase(eventId);
-                                  });
+                    for (auto i = thisBatchStart + 1; i < origBatchStart; ++i) {
+                        r.timelineGaps = std::move(r.timelineGaps).erase(r.timeline[i]);
+                    }
                 }
 
+                r = countNewUnread(std::move(r), oldMessages, oldTimeline, a.userId);
                 return r;
             },
             [&](AddAccountDataAction a) {
+                auto oldReadMarker = readMarkerOf(r);
                 r.accountData = merge(std::move(r.accountData), a.events, keyOfAccountData);
+                if (readMarkerOf(r) != oldReadMarker) {
+                    r.localUnreadCount = localUnreadCountOf(r, a.userId);
+                }
                 return r;
             },
             [&](ChangeMembershipAction a) {
@@ -114,6 +626,7 @@ namespace Kazv
             },
             [&](AddEphemeralAction a) {
                 r.ephemeral = merge(std::move(r.ephemeral), a.events, keyOfEphemeral);
+                r = addReadReceipts(std::move(r), a.events);
                 return r;
             },
             [&](SetLocalDraftAction a) {
@@ -127,6 +640,26 @@ namespace Kazv
             [&](MarkMembersFullyLoadedAction) {
                 r.membersFullyLoaded = true;
                 return r;
+            },
+            [&](UpdateSummaryAction a) {
+                auto summary = r.summary;
+                if (a.heroes) {
+                    summary.heroes = a.heroes.value();
+                }
+                if (a.joinedMemberCount || a.invitedMemberCount) {
+                    summary.memberCountsFromServer = true;
+                    summary.joinedMemberCount = a.joinedMemberCount.value_or(summary.joinedMemberCount);
+                    summary.invitedMemberCount = a.invitedMemberCount.value_or(summary.invitedMemberCount);
+                }
+                if (summary != r.summary) {
+                    r.summary = summaryOf(r, std::move(summary));
+                }
+                return r;
+            },
+            [&](SetUnreadNotificationCountsAction a) {
+                r.summary.highlightCount = a.highlightCount.value_or(r.summary.highlightCount);
+                r.summary.notificationCount = a.notificationCount.value_or(r.summary.notificationCount);
+                return r;
             }
             );
     }
@@ -135,50 +668,258 @@ namespace Kazv
     {
         return lager::match(std::move(a))(
             [&](UpdateRoomAction a) {
-                l.rooms = std::move(l.rooms)
-                    .update(a.roomId,
-                            [=](RoomModel oldRoom) {
-                                oldRoom.roomId = a.roomId; // in case it is a new room
-                                return RoomModel::update(std::move(oldRoom), a.roomAction);
-                            });
+                auto room = l.rooms[a.roomId];
+                room.roomId = a.roomId; // in case it is a new room
+                room = RoomModel::update(std::move(room), a.roomAction);
+                return setRoom(std::move(l), std::move(room));
+            },
+            [&](UpdateRoomBatchAction a) {
+                auto room = l.rooms[a.roomId];
+                room.roomId = a.roomId; // in case it is a new room
+                for (auto roomAction : a.roomActions) {
+                    room = RoomModel::update(std::move(room), std::move(roomAction));
+                }
+                return setRoom(std::move(l), std::move(room));
+            },
+            [&](SetRoomListOrderAction a) {
+                if (a.order != l.order) {
+                    l.order = a.order;
+                    l.sortedRooms = sortedRoomsOf(l.rooms, l.order);
+                }
                 return l;
             }
             );
     }
 
-    immer::flex_vector<std::string> RoomModel::joinedMemberIds() const
+    RoomListEntry roomListEntryOf(const RoomModel &r)
+    {
+        auto favourite = false;
+        if (auto tagEvent = r.accountData.find("m.tag"); tagEvent) {
+            auto content = tagEvent->content().get();
+            favourite = content.contains("tags")
+                && content["tags"].is_object()
+                && content["tags"].contains("m.favourite");
+        }
+
+        return RoomListEntry{
+            r.roomId,
+            r.timelineTs.empty() ? Timestamp{0} : r.timelineTs.back(),
+            r.summary.notificationCount > 0 || r.summary.highlightCount > 0,
+            favourite,
+        };
+    }
+
+    bool roomListEntryBefore(const RoomListOrder &order, const RoomListEntry &a, const RoomListEntry &b)
+    {
+        if (order.favouritesFirst && a.favourite != b.favourite) {
+            return a.favourite;
+        }
+        if (order.unreadFirst && a.unread != b.unread) {
+            return a.unread;
+        }
+        if (a.lastActivity != b.lastActivity) {
+            return a.lastActivity > b.lastActivity;
+        }
+        return a.roomId < b.roomId;
+    }
+
+    /// @return the first index in `rooms` whose entry does not come before `e`
+    static std::size_t sortedRoomsLowerBound(const immer::flex_vector<RoomListEntry> &rooms, const RoomListOrder &order, const RoomListEntry &e)
+    {
+        auto lo = std::size_t{};
+        auto hi = rooms.size();
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (roomListEntryBefore(order, rooms[mid], e)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    static JoinedRoomsIndex addJoinedRoom(JoinedRoomsIndex index, std::string userId, std::string roomId)
+    {
+        return std::move(index).update(
+            userId,
+            [&](immer::set<std::string> roomIds) {
+                return std::move(roomIds).insert(roomId);
+            });
+    }
+
+    static JoinedRoomsIndex removeJoinedRoom(JoinedRoomsIndex index, std::string userId, std::string roomId)
+    {
+        auto roomIds = index[userId].erase(roomId);
+        if (roomIds.empty()) {
+            return std::move(index).erase(userId);
+        }
+        return std::move(index).set(userId, std::move(roomIds));
+    }
+
+    RoomListModel RoomListModel::setRoom(RoomListModel l, RoomModel room)
+    {
+        auto roomId = room.roomId;
+
+        auto newEntry = roomListEntryOf(room);
+        auto oldRoom = l.rooms.find(roomId);
+        auto oldEntry = oldRoom ? std::optional<RoomListEntry>(roomListEntryOf(*oldRoom)) : std::nullopt;
+        if (oldEntry != newEntry) {
+            auto sorted = std::move(l.sortedRooms);
+            if (oldEntry) {
+                auto i = sortedRoomsLowerBound(sorted, l.order, oldEntry.value());
+                if (i < sorted.size() && sorted[i] == oldEntry.value()) {
+                    sorted = std::move(sorted).erase(i);
+                }
+            }
+            auto i = sortedRoomsLowerBound(sorted, l.order, newEntry);
+            l.sortedRooms = std::move(sorted).insert(i, std::move(newEntry));
+        }
+
+        auto oldMemberships = l.rooms[roomId].memberships;
+        const auto &newMemberships = room.memberships;
+
+        if (oldMemberships != newMemberships) {
+            auto index = std::move(l.joinedRoomsByUser);
+            // Those who join need the session key, and those who
+            // leave must not be able to read later messages
+            auto joined = [&](const std::string &userId) {
+                index = addJoinedRoom(std::move(index), userId, roomId);
+                room.shouldShareSessionKey = true;
+            };
+            auto left = [&](const std::string &userId) {
+                index = removeJoinedRoom(std::move(index), userId, roomId);
+                if (room.sessionKeyRecipients.find(userId)) {
+                    room.shouldRotateSessionKey = true;
+                }
+            };
+            auto add = [&](const auto &p) {
+                if (p.second == "join") {
+                    joined(p.first);
+                }
+            };
+            auto remove = [&](const auto &p) {
+                if (p.second == "join") {
+                    left(p.first);
+                }
+            };
+            auto change = [&](const auto &oldP, const auto &newP) {
+                if (oldP.second == "join" && newP.second != "join") {
+                    left(oldP.first);
+                } else if (oldP.second != "join" && newP.second == "join") {
+                    joined(newP.first);
+                }
+            };
+            immer::diff(oldMemberships, newMemberships, add, remove, change);
+            l.joinedRoomsByUser = std::move(index);
+        }
+
+        l.rooms = std::move(l.rooms).set(roomId, std::move(room));
+        return l;
+    }
+
+    JoinedRoomsIndex RoomListModel::joinedRoomsIndexOf(const immer::map<std::string, RoomModel> &rooms)
+    {
+        auto index = JoinedRoomsIndex{};
+        for (const auto &[roomId, room] : rooms) {
+            for (const auto &[userId, membership] : room.memberships) {
+                if (membership == "join") {
+                    index = addJoinedRoom(std::move(index), userId, roomId);
+                }
+            }
+        }
+        return index;
+    }
+
+    immer::set<std::string> RoomListModel::joinedRoomIdsOf(std::string userId) const
+    {
+        return joinedRoomsByUser[userId];
+    }
+
+    immer::flex_vector<RoomListEntry> RoomListModel::sortedRoomsOf(const immer::map<std::string, RoomModel> &rooms, const RoomListOrder &order)
     {
-        using MemberNode = std::pair<std::string, Kazv::Event>;
+        auto entries = std::vector<RoomListEntry>{};
+        entries.reserve(rooms.size());
+        for (const auto &[roomId, room] : rooms) {
+            entries.push_back(roomListEntryOf(room));
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [&](const auto &a, const auto &b) { return roomListEntryBefore(order, a, b); });
+        return immer::flex_vector<RoomListEntry>(entries.begin(), entries.end());
+    }
+
+    immer::flex_vector<SearchHit> RoomListModel::search(std::string_view query, std::size_t limit) const
+    {
+        if (limit == 0) {
+            return {};
+        }
+
+        // Search the rooms that may have the best matches first
+        auto bounds = std::vector<std::tuple<double, const std::string *, const RoomModel *>>{};
+        for (const auto &[roomId, room] : rooms) {
+            if (auto bound = room.searchIndex.maxScore(query); bound > 0) {
+                bounds.emplace_back(bound, &roomId, &room);
+            }
+        }
+        std::sort(bounds.begin(), bounds.end(),
+                  [](const auto &a, const auto &b) { return std::get<0>(a) > std::get<0>(b); });
+
+        auto better = [](const SearchHit &a, const SearchHit &b) { return a.score > b.score; };
+        // The worst hit is on the top
+        auto top = std::priority_queue<SearchHit, std::vector<SearchHit>, decltype(better)>(better);
+        for (const auto &[bound, roomId, room] : bounds) {
+            // No room left can beat the hits we have
+            if (top.size() == limit && bound <= top.top().score) {
+                break;
+            }
+            for (const auto &res : room->searchIndex.search(query, limit)) {
+                auto hit = SearchHit{*roomId, res.eventId, res.score};
+                if (top.size() < limit) {
+                    top.push(std::move(hit));
+                } else if (better(hit, top.top())) {
+                    top.pop();
+                    top.push(std::move(hit));
+                } else {
+                    // The rest of the results of this room are worse
+                    break;
+                }
+            }
+        }
 
+        auto hits = std::vector<SearchHit>{};
+        while (! top.empty()) {
+            hits.push_back(top.top());
+            top.pop();
+        }
+        return immer::flex_vector<SearchHit>(hits.rbegin(), hits.rend());
+    }
+
+    immer::flex_vector<std::string> RoomListModel::sortedRoomIds(std::size_t offset, std::size_t count) const
+    {
+        return intoImmer(
+            immer::flex_vector<std::string>{},
+            zug::map([](const auto &e) { return e.roomId; }),
+            sortedRooms.drop(offset).take(count));
+    }
+
+    immer::flex_vector<std::string> RoomModel::joinedMemberIds() const
+    {
         auto memberNameTransducer =
             zug::filter(
                 [](auto val) {
-                    auto [k, v] = val;
-                    auto [type, stateKey] = k;
-                    return type == "m.room.member"s;
-                })
-            | zug::map(
-                [](auto val) {
-                    auto [k, v] = val;
-                    auto [type, stateKey] = k;
-                    return MemberNode{stateKey, v};
-                })
-            | zug::filter(
-                [](auto val) {
-                    auto [stateKey, ev] = val;
-                    return ev.content().get()
-                        .at("membership"s) == "join"s;
+                    auto [userId, membership] = val;
+                    return membership == "join"s;
                 })
             | zug::map(
                 [](auto val) {
-                    auto [stateKey, ev] = val;
-                    return stateKey;
+                    auto [userId, membership] = val;
+                    return userId;
                 });
 
         return intoImmer(
             immer::flex_vector<std::string>{},
             memberNameTransducer,
-            stateEvents);
+            memberships);
     }
 
     static Timestamp defaultRotateMs = 604800000;
@@ -199,14 +940,269 @@ namespace Kazv
 
     bool RoomModel::hasUser(std::string userId) const
     {
-        try {
-            auto ev = stateEvents.at(KeyOfState{"m.room.member", userId});
-            if (ev.content().get().at("membership") == "join") {
-                return true;
+        auto membership = memberships.find(userId);
+        return membership && *membership == "join";
+    }
+
+    static std::optional<std::size_t> indexInTimeline(const RoomModel &r, const std::string &eventId)
+    {
+        if (r.timelineTs.size() == r.timeline.size()) {
+            auto i = timelineLowerBound(r, 0, r.messages[eventId].originServerTs(), eventId);
+            if (i < r.timeline.size() && r.timeline[i] == eventId) {
+                return i;
             }
-        } catch (const std::exception &) {
-            return false;
         }
-        return false;
+
+        // The timeline is not sorted by the keys
+        auto it = std::find(r.timeline.begin(), r.timeline.end(), eventId);
+        if (it == r.timeline.end()) {
+            return std::nullopt;
+        }
+        return it.index();
+    }
+
+    static std::vector<std::size_t> indicesInTimeline(const RoomModel &r, const std::vector<std::string> &eventIds)
+    {
+        auto indices = std::vector<std::size_t>{};
+        for (const auto &eventId : eventIds) {
+            auto i = indexInTimeline(r, eventId);
+            if (i) {
+                indices.push_back(i.value());
+            }
+        }
+        std::sort(indices.begin(), indices.end());
+        return indices;
+    }
+
+    /// Call `func(start, count)` with each run of consecutive indices in `indices`
+    template<class Func>
+    static void forEachRun(const std::vector<std::size_t> &indices, Func func)
+    {
+        for (auto i = std::size_t{}; i < indices.size();) {
+            auto j = i + 1;
+            while (j < indices.size() && indices[j] == indices[j - 1] + 1) {
+                ++j;
+            }
+            func(indices[i], j - i);
+            i = j;
+        }
+    }
+
+    static immer::flex_vector<Event> eventsAt(const RoomModel &r, std::size_t start, std::size_t count)
+    {
+        return intoImmer(
+            immer::flex_vector<Event>{},
+            zug::map([&](const auto &eventId) { return r.messages[eventId]; }),
+            r.timeline.drop(start).take(count));
+    }
+
+    TimelineDiff diffTimeline(const RoomModel &oldRoom, const RoomModel &newRoom)
+    {
+        auto diff = TimelineDiff{};
+        if (oldRoom.timeline == newRoom.timeline && oldRoom.messages == newRoom.messages) {
+            return diff;
+        }
+
+        auto added = std::vector<std::string>{};
+        auto removed = std::vector<std::string>{};
+        auto changed = std::vector<std::string>{};
+        immer::diff(
+            oldRoom.messages, newRoom.messages,
+            [&](const auto &p) { added.push_back(p.first); },
+            [&](const auto &p) { removed.push_back(p.first); },
+            [&](const auto &oldP, const auto &newP) {
+                if (oldP.second != newP.second) {
+                    changed.push_back(newP.first);
+                }
+            });
+
+        auto removedIndices = indicesInTimeline(oldRoom, removed);
+        auto addedIndices = indicesInTimeline(newRoom, added);
+
+        if (oldRoom.timeline.size() - removedIndices.size() + addedIndices.size()
+            != newRoom.timeline.size()) {
+            // The timeline changed without the messages changing accordingly
+            diff.reset = true;
+            return diff;
+        }
+
+        auto changes = immer::flex_vector_transient<TimelineChange>{};
+
+        auto removals = std::vector<TimelineChange>{};
+        forEachRun(removedIndices, [&](auto start, auto count) {
+            removals.push_back(TimelineChange{TimelineChange::Remove, start, eventsAt(oldRoom, start, count)});
+        });
+        // From the end, so the indices of the remaining removals stay valid
+        for (auto it = removals.rbegin(); it != removals.rend(); ++it) {
+            changes.push_back(std::move(*it));
+        }
+
+        forEachRun(addedIndices, [&](auto start, auto count) {
+            auto kind = start + count == newRoom.timeline.size() ? TimelineChange::Append
+                : start == 0 ? TimelineChange::Prepend
+                : TimelineChange::Insert;
+            changes.push_back(TimelineChange{kind, start, eventsAt(newRoom, start, count)});
+        });
+
+        for (auto index : indicesInTimeline(newRoom, changed)) {
+            changes.push_back(TimelineChange{TimelineChange::Replace, index, eventsAt(newRoom, index, 1)});
+        }
+
+        diff.changes = changes.persistent();
+        return diff;
+    }
+
+    int localUnreadCountOf(const RoomModel &r, const std::string &userId)
+    {
+        auto marker = readMarkerOf(r);
+        auto count = 0;
+        // Walk back to the read marker or the latest message of the user
+        for (auto i = r.timeline.size(); i > 0; --i) {
+            const auto &eventId = r.timeline[i - 1];
+            if (eventId == marker) {
+                break;
+            }
+            auto e = r.messages.find(eventId);
+            if (! e || ! isMessage(*e)) {
+                continue;
+            }
+            if (e->sender() == userId) {
+                break;
+            }
+            ++count;
+        }
+        return count;
+    }
+
+    SpilledEvents eventsToSpill(const RoomModel &r, std::size_t windowSize)
+    {
+        if (r.timeline.size() <= windowSize) {
+            return SpilledEvents{};
+        }
+
+        auto numToSpill = r.timeline.size() - windowSize;
+
+        if (auto readMarker = readMarkerOf(r); ! readMarker.empty()) {
+            auto index = indexInTimeline(r, readMarker);
+            if (index) {
+                numToSpill = std::min(numToSpill, index.value() + 1);
+            }
+        }
+
+        // Keep one event to put the Gap at
+        numToSpill = std::min(numToSpill, r.timeline.size() - 1);
+        if (numToSpill == 0) {
+            return SpilledEvents{};
+        }
+
+        auto spilled = SpilledEvents{};
+        auto spilledEvents = immer::flex_vector_transient<Event>{};
+        for (const auto &eventId : r.timeline.take(numToSpill)) {
+            spilledEvents.push_back(r.messages[eventId]);
+            // The marker of the previous spill is not a real Gap
+            if (auto gap = r.timelineGaps.find(eventId);
+                gap && ! (eventId == r.spilledGapEventId && gap->empty())) {
+                spilled.gaps = std::move(spilled.gaps).set(eventId, *gap);
+            }
+        }
+        spilled.events = spilledEvents.persistent();
+
+        auto boundary = r.timeline[numToSpill];
+        if (auto gap = r.timelineGaps.find(boundary); gap && ! gap->empty()) {
+            spilled.gaps = std::move(spilled.gaps).set(boundary, *gap);
+        }
+
+        return spilled;
+    }
+
+    std::optional<RoomModel> dropSpilledEvents(RoomModel r, const SpilledEvents &spilled)
+    {
+        auto numToSpill = spilled.events.size();
+        if (numToSpill == 0 || r.timeline.size() <= numToSpill) {
+            return std::nullopt;
+        }
+        for (std::size_t i = 0; i < numToSpill; ++i) {
+            if (r.timeline[i] != spilled.events[i].id()) {
+                return std::nullopt;
+            }
+        }
+
+        auto pinned = immer::set<std::string>{};
+        auto pinnedContent = r.stateEvents[KeyOfState{"m.room.pinned_events", ""}].content().get();
+        if (pinnedContent.contains("pinned") && pinnedContent["pinned"].is_array()) {
+            for (const auto &id : pinnedContent["pinned"]) {
+                if (id.is_string()) {
+                    pinned = std::move(pinned).insert(id.get<std::string>());
+                }
+            }
+        }
+
+        // The marker of the previous spill is not a real Gap
+        if (auto gap = r.timelineGaps.find(r.spilledGapEventId); gap && gap->empty()) {
+            r.timelineGaps = std::move(r.timelineGaps).erase(r.spilledGapEventId);
+        }
+
+        for (const auto &eventId : r.timeline.take(numToSpill)) {
+            r.timelineGaps = std::move(r.timelineGaps).erase(eventId);
+            if (! pinned.count(eventId)) {
+                r.messages = std::move(r.messages).erase(eventId);
+            }
+        }
+
+        r.timeline = std::move(r.timeline).drop(numToSpill);
+        r.timelineTs = std::move(r.timelineTs).drop(numToSpill);
+
+        auto boundary = r.timeline[0];
+        // Keep the Gap from the server, so we can still paginate
+        // from it if the spilled events are lost
+        if (! r.timelineGaps.find(boundary)) {
+            r.timelineGaps = std::move(r.timelineGaps).set(boundary, "");
+        }
+        r.spilledGapEventId = boundary;
+
+        return r;
+    }
+
+    std::pair<RoomModel, SpilledEvents> spillTimeline(RoomModel r, std::size_t windowSize)
+    {
+        auto spilled = eventsToSpill(r, windowSize);
+        if (spilled.events.empty()) {
+            return {std::move(r), std::move(spilled)};
+        }
+        auto dropped = dropSpilledEvents(r, spilled);
+        return {std::move(dropped.value()), std::move(spilled)};
+    }
+
+    RoomModel restoreSpilledEvents(RoomModel r, SpilledEvents spilled, bool hasMore, const std::string &userId)
+    {
+        if (! r.spilledGapEventId.empty()) {
+            r.timelineGaps = std::move(r.timelineGaps).erase(r.spilledGapEventId);
+            r.spilledGapEventId = "";
+        }
+
+        // Pinned events were kept in messages, but they need
+        // to go back into the timeline
+        for (const auto &e : spilled.events) {
+            if (r.messages.find(e.id()) && ! indexInTimeline(r, e.id())) {
+                r.messages = std::move(r.messages).erase(e.id());
+            }
+        }
+
+        r = RoomModel::update(std::move(r), AddToTimelineAction{spilled.events, std::nullopt, false, std::nullopt, userId});
+
+        for (const auto &[eventId, prevBatch] : spilled.gaps) {
+            r.timelineGaps = std::move(r.timelineGaps).set(eventId, prevBatch);
+        }
+
+        if (hasMore && ! r.timeline.empty()) {
+            auto boundary = r.timeline[0];
+            // Keep the Gap from the server, if any
+            if (! r.timelineGaps.find(boundary)) {
+                r.timelineGaps = std::move(r.timelineGaps).set(boundary, "");
+            }
+            r.spilledGapEventId = boundary;
+        }
+
+        return r;
     }
 }
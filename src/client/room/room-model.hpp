@@ -12,18 +12,23 @@
 #include <variant>
 #include <immer/flex_vector.hpp>
 #include <immer/map.hpp>
+#include <immer/set.hpp>
 
 #include <serialization/immer-flex-vector.hpp>
 #include <serialization/immer-box.hpp>
 #include <serialization/immer-map.hpp>
 #include <serialization/immer-array.hpp>
+#include <serialization/immer-set.hpp>
 
 #include <csapi/sync.hpp>
 #include <event.hpp>
+#include <push-rules.hpp>
 
 #include <crypto.hpp>
 
 #include "clientutil.hpp"
+#include "search-index.hpp"
+#include "relations-index.hpp"
 
 namespace Kazv
 {
@@ -35,12 +40,16 @@ namespace Kazv
     struct AppendTimelineAction
     {
         immer::flex_vector<Event> events;
+        /// The id of the current user, whose messages are not unread
+        std::string userId{};
     };
 
     struct PrependTimelineAction
     {
         immer::flex_vector<Event> events;
         std::string paginateBackToken;
+        /// The id of the current user, whose messages are not unread
+        std::string userId{};
     };
 
     struct AddToTimelineAction
@@ -50,11 +59,15 @@ namespace Kazv
         std::optional<std::string> prevBatch;
         std::optional<bool> limited;
         std::optional<std::string> gapEventId;
+        /// The id of the current user, whose messages are not unread
+        std::string userId{};
     };
 
     struct AddAccountDataAction
     {
         immer::flex_vector<Event> events;
+        /// The id of the current user, whose messages are not unread
+        std::string userId{};
     };
 
     struct ChangeMembershipAction
@@ -85,16 +98,125 @@ namespace Kazv
     {
     };
 
+    /// Update the heroes and member counts the server sent in a sync response
+    struct UpdateSummaryAction
+    {
+        std::optional<immer::flex_vector<std::string>> heroes;
+        std::optional<int> joinedMemberCount;
+        std::optional<int> invitedMemberCount;
+    };
+
+    struct SetUnreadNotificationCountsAction
+    {
+        std::optional<int> highlightCount;
+        std::optional<int> notificationCount;
+    };
+
+    /**
+     * What a room list needs to show a room.
+     *
+     * It is kept up to date by RoomModel::update(), and only computed
+     * again when the state it depends on changes.
+     */
+    struct RoomSummary
+    {
+        /// The display name of the room, computed as in the spec
+        std::string displayName;
+        /// The url in m.room.avatar
+        std::string avatarMxcUri;
+        /// The users to name the room after, as sent by the server
+        immer::flex_vector<std::string> heroes;
+        int joinedMemberCount{0};
+        int invitedMemberCount{0};
+        /// Whether the member counts are from the server, instead of
+        /// counted from the member events we have
+        bool memberCountsFromServer{false};
+        int highlightCount{0};
+        int notificationCount{0};
+    };
+
+    inline bool operator==(const RoomSummary &a, const RoomSummary &b)
+    {
+        return a.displayName == b.displayName
+            && a.avatarMxcUri == b.avatarMxcUri
+            && a.heroes == b.heroes
+            && a.joinedMemberCount == b.joinedMemberCount
+            && a.invitedMemberCount == b.invitedMemberCount
+            && a.memberCountsFromServer == b.memberCountsFromServer
+            && a.highlightCount == b.highlightCount
+            && a.notificationCount == b.notificationCount;
+    }
+
+    inline bool operator!=(const RoomSummary &a, const RoomSummary &b)
+    {
+        return !(a == b);
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, RoomSummary &s, std::uint32_t const /*version*/)
+    {
+        ar
+            & s.displayName
+            & s.avatarMxcUri
+            & s.heroes
+            & s.joinedMemberCount
+            & s.invitedMemberCount
+            & s.memberCountsFromServer
+            & s.highlightCount
+            & s.notificationCount
+            ;
+    }
+
+    /// Where a user has read up to, as in an `m.receipt` event
+    struct ReadReceipt
+    {
+        std::string eventId;
+        Timestamp timestamp{0};
+    };
+
+    inline bool operator==(const ReadReceipt &a, const ReadReceipt &b)
+    {
+        return a.eventId == b.eventId && a.timestamp == b.timestamp;
+    }
+
+    inline bool operator!=(const ReadReceipt &a, const ReadReceipt &b)
+    {
+        return !(a == b);
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, ReadReceipt &r, std::uint32_t const /*version*/)
+    {
+        ar & r.eventId & r.timestamp;
+    }
+
+    /// userId -> membership of the user, as in the content of m.room.member
+    using MembershipMap = immer::map<std::string, std::string>;
+
+    /// @return the memberships of the users in `stateEvents`
+    MembershipMap membershipsFromState(const immer::map<KeyOfState, Event> &stateEvents);
+
+    /// @return the origin_server_ts of each event in `timeline`
+    immer::flex_vector<Timestamp> timelineTsOf(const immer::flex_vector<std::string> &timeline,
+                                               const immer::map<std::string, Event> &messages);
+
+    /// userId -> deviceId -> the curve25519 key of the device
+    using SessionKeyRecipients = immer::map<std::string, immer::map<std::string, std::string>>;
+
     struct RoomModel
     {
         using Membership = RoomMembership;
 
         std::string roomId;
         immer::map<KeyOfState, Event> stateEvents;
+        /// Memberships of the users in stateEvents, kept in sync with it
+        MembershipMap memberships;
         immer::map<KeyOfState, Event> inviteState;
         // Smaller indices mean earlier events
         // (oldest) 0 --------> n (latest)
         immer::flex_vector<std::string> timeline;
+        /// The origin_server_ts of the event at the same index in timeline
+        immer::flex_vector<Timestamp> timelineTs;
         immer::map<std::string, Event> messages;
         immer::map<std::string, Event> accountData;
         Membership membership{};
@@ -103,6 +225,9 @@ namespace Kazv
         bool canPaginateBack{true};
 
         immer::map<std::string /* eventId */, std::string /* prevBatch */> timelineGaps;
+        /// The event before which the timeline has been spilled,
+        /// or empty if none. It has a Gap with empty prevBatch.
+        std::string spilledGapEventId;
 
         immer::map<std::string, Event> ephemeral;
 
@@ -111,12 +236,45 @@ namespace Kazv
         bool encrypted{false};
         /// a marker to indicate whether we need to rotate
         /// the session key earlier than it expires
-        /// (e.g. when a user in the room's device list changed
-        /// or when someone joins or leaves)
+        /// (e.g. when a device that has the session key is removed
+        /// or when someone who has it leaves)
         bool shouldRotateSessionKey{true};
+        /// a marker to indicate whether some devices may not have
+        /// the key of the current session yet (e.g. when a user
+        /// in the room added a device or when someone joins)
+        bool shouldShareSessionKey{false};
+        /// The id of the current outbound megolm session
+        std::string outboundSessionId;
+        /// The devices that have been sent the key of the
+        /// current outbound megolm session
+        SessionKeyRecipients sessionKeyRecipients;
+        /// userId -> the devices being sent the key of the current
+        /// outbound megolm session. Not serialized.
+        immer::map<std::string, immer::set<std::string>> sessionKeyPendingRecipients;
 
         bool membersFullyLoaded{false};
 
+        RoomSummary summary;
+
+        /// Full-text index of the messages, kept in sync with
+        /// the events added to the timeline. Events spilled out
+        /// of memory stay in it, so they can still be found.
+        SearchIndex searchIndex;
+
+        /// Relations between the events, kept in sync with
+        /// the events added to the timeline
+        RelationsIndex relations;
+
+        /// userId -> the latest unthreaded read receipt of the user
+        immer::map<std::string, ReadReceipt> readReceipts;
+        /// eventId -> ids of the users whose read receipt is at the event,
+        /// kept in sync with readReceipts
+        immer::map<std::string, immer::set<std::string>> eventReaders;
+
+        /// The number of messages after the read marker, counted
+        /// from the timeline we have
+        int localUnreadCount{0};
+
         immer::flex_vector<std::string> joinedMemberIds() const;
 
         MegOlmSessionRotateDesc sessionRotateDesc() const;
@@ -134,7 +292,9 @@ namespace Kazv
             AddEphemeralAction,
             SetLocalDraftAction,
             SetRoomEncryptionAction,
-            MarkMembersFullyLoadedAction
+            MarkMembersFullyLoadedAction,
+            UpdateSummaryAction,
+            SetUnreadNotificationCountsAction
             >;
 
         static RoomModel update(RoomModel r, Action a);
@@ -142,22 +302,147 @@ namespace Kazv
 
     using RoomAction = RoomModel::Action;
 
+    /**
+     * Compute the summary of `r` from its state.
+     *
+     * @param r The room.
+     * @param summary The summary with the heroes, and the member and
+     * notification counts the server sent.
+     *
+     * @return `summary` with the display name and avatar, and the member
+     * counts if they are not from the server, computed.
+     */
+    RoomSummary summaryOf(const RoomModel &r, RoomSummary summary);
+
+    /**
+     * Get what the push rules need to know about a room.
+     *
+     * @param r The room.
+     * @param userId The id of the current user.
+     *
+     * @return The context to evaluate push rules for events in `r`.
+     */
+    PushRuleContext pushRuleContextOf(const RoomModel &r, std::string userId);
+
+    /// @return the search index of the events in the timeline of `r`
+    SearchIndex searchIndexOf(const RoomModel &r);
+
+    /// @return the version of `r`, as in its `m.room.create` event
+    std::string roomVersionOf(const RoomModel &r);
+
+    /**
+     * Apply the redactions in `events` to `r`.
+     *
+     * Each event redacted is replaced by its redacted form in the
+     * messages, and in the state if it is the current state event,
+     * and is removed from the search index. Events not in the
+     * messages, or already redacted, are only removed from the
+     * search index.
+     *
+     * @param r The room.
+     * @param events The events, some of which may be redactions.
+     *
+     * @return The room with the redactions applied.
+     */
+    RoomModel applyRedactions(RoomModel r, const EventList &events);
+
+    /**
+     * Merge the read receipts in `m.receipt` events into `r`.
+     *
+     * Only unthreaded and main-thread receipts are kept, and a later
+     * receipt of a user replaces the earlier one.
+     *
+     * @param r The room.
+     * @param events The ephemeral events, some of which may be
+     * `m.receipt` events.
+     *
+     * @return The room with the receipts in `events`.
+     */
+    RoomModel addReadReceipts(RoomModel r, const EventList &events);
+
+    /// @return whether `e` counts in the local unread count of `userId`
+    bool countsAsUnread(const Event &e, const std::string &userId);
+
+    /**
+     * Count the messages after the read marker of `r`.
+     *
+     * If the event of the read marker is not in the timeline, all
+     * messages in the timeline are counted, as they are later than it.
+     *
+     * Messages of `userId` are not counted. As on the server, the user
+     * has read everything before their latest message, so only the
+     * messages after both it and the read marker are counted.
+     *
+     * @param r The room.
+     * @param userId The id of the current user.
+     *
+     * @return The local unread count of `r`.
+     */
+    int localUnreadCountOf(const RoomModel &r, const std::string &userId);
+
+    /// @return the relations index of the events in the messages of `r`
+    RelationsIndex relationsIndexOf(const RoomModel &r);
+
+    /**
+     * Get the latest edit of an event.
+     *
+     * Edits sent by someone other than the sender of the original
+     * event are ignored.
+     *
+     * @param relations The relations index of the room.
+     * @param messages The messages of the room.
+     * @param eventId The id of the original event.
+     *
+     * @return The latest `m.replace` event of `eventId` in `messages`,
+     * if any.
+     */
+    std::optional<Event> latestEditOf(const RelationsIndex &relations,
+                                      const immer::map<std::string, Event> &messages,
+                                      const std::string &eventId);
+
+    /**
+     * Get the events in a thread.
+     *
+     * @param relations The relations index of the room.
+     * @param messages The messages of the room.
+     * @param threadRootId The id of the root event of the thread.
+     *
+     * @return The events in `messages` with an `m.thread` relation
+     * to `threadRootId`, from oldest to latest.
+     */
+    EventList threadOf(const RelationsIndex &relations,
+                       const immer::map<std::string, Event> &messages,
+                       const std::string &threadRootId);
+
     inline bool operator==(RoomModel a, RoomModel b)
     {
         return a.roomId == b.roomId
             && a.stateEvents == b.stateEvents
+            && a.memberships == b.memberships
             && a.inviteState == b.inviteState
             && a.timeline == b.timeline
+            && a.timelineTs == b.timelineTs
             && a.messages == b.messages
             && a.accountData == b.accountData
             && a.membership == b.membership
             && a.paginateBackToken == b.paginateBackToken
             && a.canPaginateBack == b.canPaginateBack
             && a.timelineGaps == b.timelineGaps
+            && a.spilledGapEventId == b.spilledGapEventId
             && a.ephemeral == b.ephemeral
             && a.localDraft == b.localDraft
             && a.encrypted == b.encrypted
             && a.shouldRotateSessionKey == b.shouldRotateSessionKey
+            && a.shouldShareSessionKey == b.shouldShareSessionKey
+            && a.outboundSessionId == b.outboundSessionId
+            && a.sessionKeyRecipients == b.sessionKeyRecipients
+            && a.sessionKeyPendingRecipients == b.sessionKeyPendingRecipients
+            && a.summary == b.summary
+            && a.searchIndex == b.searchIndex
+            && a.relations == b.relations
+            && a.readReceipts == b.readReceipts
+            && a.eventReaders == b.eventReaders
+            && a.localUnreadCount == b.localUnreadCount
             && a.membersFullyLoaded == b.membersFullyLoaded;
     }
 
@@ -167,16 +452,271 @@ namespace Kazv
         RoomAction roomAction;
     };
 
+    /**
+     * Apply several actions to one room.
+     *
+     * The room is only taken out of and written back to the list once,
+     * instead of once per action.
+     */
+    struct UpdateRoomBatchAction
+    {
+        std::string roomId;
+        /// Actions to apply, in order
+        immer::flex_vector<RoomAction> roomActions;
+    };
+
+    /**
+     * One change to a timeline.
+     *
+     * `index` is the position in the timeline at the time the change
+     * is applied, i.e. after all previous changes in the same
+     * TimelineDiff are applied.
+     */
+    struct TimelineChange
+    {
+        enum Kind
+        {
+            /// `events` are added to the end
+            Append,
+            /// `events` are added to the beginning
+            Prepend,
+            /// `events` are inserted before `index`
+            Insert,
+            /// the events starting at `index` are replaced by `events`, e.g. when decrypted
+            Replace,
+            /// `events`, which start at `index`, are removed
+            Remove,
+        };
+
+        Kind kind;
+        std::size_t index;
+        immer::flex_vector<Event> events;
+    };
+
+    inline bool operator==(const TimelineChange &a, const TimelineChange &b)
+    {
+        return a.kind == b.kind
+            && a.index == b.index
+            && a.events == b.events;
+    }
+
+    inline bool operator!=(const TimelineChange &a, const TimelineChange &b)
+    {
+        return !(a == b);
+    }
+
+    /// The changes between two versions of a timeline
+    struct TimelineDiff
+    {
+        /// Whether the timeline cannot be described by `changes`
+        /// and must be read again as a whole
+        bool reset{false};
+        /// The changes, to be applied in order
+        immer::flex_vector<TimelineChange> changes;
+    };
+
+    inline bool operator==(const TimelineDiff &a, const TimelineDiff &b)
+    {
+        return a.reset == b.reset
+            && a.changes == b.changes;
+    }
+
+    inline bool operator!=(const TimelineDiff &a, const TimelineDiff &b)
+    {
+        return !(a == b);
+    }
+
+    /**
+     * Compute the changes from the timeline of `oldRoom` to that of `newRoom`.
+     *
+     * The changed events are found by diffing the messages of the two rooms,
+     * so the cost mostly depends on the number of changed events.
+     *
+     * Removals come first, from the end of the timeline to the beginning,
+     * then additions, from the beginning to the end, then replacements.
+     */
+    TimelineDiff diffTimeline(const RoomModel &oldRoom, const RoomModel &newRoom);
+
+    /// Timeline events moved out of memory
+    struct SpilledEvents
+    {
+        /// The events, from oldest to latest
+        EventList events;
+        /// The Gaps at these events, and the original Gap, if any,
+        /// at the event after them
+        immer::map<std::string /* eventId */, std::string /* prevBatch */> gaps;
+    };
+
+    /**
+     * Find the oldest events to move out of the timeline of `r`, so that
+     * at most `windowSize` events are left.
+     *
+     * Unread events, i.e. those after the read marker, are kept.
+     *
+     * @return The events to move out of `r`, to be saved before
+     * dropSpilledEvents() drops them.
+     */
+    SpilledEvents eventsToSpill(const RoomModel &r, std::size_t windowSize);
+
+    /**
+     * Drop the events found by eventsToSpill() from the timeline of `r`.
+     *
+     * Pinned events are kept in `messages`, though not in `timeline`.
+     * The oldest event left gets a Gap and becomes `spilledGapEventId`.
+     * If it already had a Gap from the server, the Gap is kept as is.
+     *
+     * @return The room without `spilled`, or std::nullopt if its
+     * timeline no longer starts with them.
+     */
+    std::optional<RoomModel> dropSpilledEvents(RoomModel r, const SpilledEvents &spilled);
+
+    /**
+     * Move the oldest events out of the timeline of `r`, so that at most
+     * `windowSize` events are left.
+     *
+     * This is eventsToSpill() followed by dropSpilledEvents().
+     *
+     * @return The room and the events moved out of it.
+     */
+    std::pair<RoomModel, SpilledEvents> spillTimeline(RoomModel r, std::size_t windowSize);
+
+    /**
+     * Put the events spilled last back into the timeline of `r`.
+     *
+     * @param r The room.
+     * @param spilled The events spilled last.
+     * @param hasMore Whether there are events spilled before these.
+     * @param userId The id of the current user.
+     *
+     * @return The room with `spilled` in its timeline.
+     */
+    RoomModel restoreSpilledEvents(RoomModel r, SpilledEvents spilled, bool hasMore, const std::string &userId);
+
+    /// userId -> ids of the rooms the user has joined
+    using JoinedRoomsIndex = immer::map<std::string, immer::set<std::string>>;
+
+    /// How the sorted room list is ordered
+    struct RoomListOrder
+    {
+        /// Put the rooms tagged with `m.favourite` before the others
+        bool favouritesFirst{false};
+        /// Put the rooms with unread notifications before the others
+        bool unreadFirst{false};
+    };
+
+    inline bool operator==(const RoomListOrder &a, const RoomListOrder &b)
+    {
+        return a.favouritesFirst == b.favouritesFirst
+            && a.unreadFirst == b.unreadFirst;
+    }
+
+    inline bool operator!=(const RoomListOrder &a, const RoomListOrder &b)
+    {
+        return !(a == b);
+    }
+
+    /**
+     * The sort key of a room in the sorted room list.
+     *
+     * Within the same favourite and unread groups (if the order
+     * uses them), rooms with more recent activity come first.
+     * Ties are broken by room id.
+     */
+    struct RoomListEntry
+    {
+        std::string roomId;
+        /// The timestamp of the last event in the timeline
+        Timestamp lastActivity{0};
+        bool unread{false};
+        bool favourite{false};
+    };
+
+    inline bool operator==(const RoomListEntry &a, const RoomListEntry &b)
+    {
+        return a.roomId == b.roomId
+            && a.lastActivity == b.lastActivity
+            && a.unread == b.unread
+            && a.favourite == b.favourite;
+    }
+
+    inline bool operator!=(const RoomListEntry &a, const RoomListEntry &b)
+    {
+        return !(a == b);
+    }
+
+    /// @return the sort key of `r` in the sorted room list
+    RoomListEntry roomListEntryOf(const RoomModel &r);
+
+    /// @return whether `a` comes before `b` in a room list ordered by `order`
+    bool roomListEntryBefore(const RoomListOrder &order, const RoomListEntry &a, const RoomListEntry &b);
+
+    /// Change the order of the sorted room list
+    struct SetRoomListOrderAction
+    {
+        RoomListOrder order;
+    };
+
     struct RoomListModel
     {
         immer::map<std::string, RoomModel> rooms;
+        /// Reverse index of the joined members of the rooms,
+        /// kept in sync with rooms by update() and setRoom()
+        JoinedRoomsIndex joinedRoomsByUser;
+        /// The order of sortedRooms
+        RoomListOrder order;
+        /// All rooms, sorted by order, kept in sync with rooms
+        /// by update() and setRoom()
+        immer::flex_vector<RoomListEntry> sortedRooms;
 
         inline auto at(std::string id) const { return rooms.at(id); }
         inline auto operator[](std::string id) const { return rooms[id]; }
         inline bool has(std::string id) const { return rooms.find(id); }
 
+        /// @return the ids of the rooms `userId` has joined
+        immer::set<std::string> joinedRoomIdsOf(std::string userId) const;
+
+        /**
+         * Get a page of the ids of the rooms in sorted order.
+         *
+         * @param offset The position of the first room in the page.
+         * @param count The maximum number of rooms in the page.
+         *
+         * @return The ids of at most `count` rooms, starting from
+         * the `offset`-th room in sortedRooms.
+         */
+        immer::flex_vector<std::string> sortedRoomIds(std::size_t offset, std::size_t count) const;
+
+        /**
+         * Search the messages of all rooms.
+         *
+         * Rooms are searched in decreasing order of
+         * SearchIndex::maxScore(), and the search stops once no
+         * room left can beat the matches found.
+         *
+         * The matches include events spilled out of memory by
+         * SetTimelineWindowAction. They are not in the `messages`
+         * of their rooms until they are restored by paginating back.
+         *
+         * @param query The query. See SearchIndex::search().
+         * @param limit The maximum number of results.
+         *
+         * @return The matches, best first.
+         */
+        immer::flex_vector<SearchHit> search(std::string_view query, std::size_t limit) const;
+
+        /// Put `room` into `l`, replacing the room with the same id if any
+        static RoomListModel setRoom(RoomListModel l, RoomModel room);
+
+        /// @return the index of joined members of `rooms`
+        static JoinedRoomsIndex joinedRoomsIndexOf(const immer::map<std::string, RoomModel> &rooms);
+
+        /// @return the entries of `rooms`, sorted by `order`
+        static immer::flex_vector<RoomListEntry> sortedRoomsOf(const immer::map<std::string, RoomModel> &rooms, const RoomListOrder &order);
+
         using Action = std::variant<
-            UpdateRoomAction
+            UpdateRoomAction,
+            UpdateRoomBatchAction,
+            SetRoomListOrderAction
             >;
         static RoomListModel update(RoomListModel l, Action a);
     };
@@ -185,11 +725,26 @@ namespace Kazv
 
     inline bool operator==(RoomListModel a, RoomListModel b)
     {
-        return a.rooms == b.rooms;
+        return a.rooms == b.rooms
+            && a.joinedRoomsByUser == b.joinedRoomsByUser
+            && a.order == b.order
+            && a.sortedRooms == b.sortedRooms;
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, RoomListOrder &o, std::uint32_t const /*version*/)
+    {
+        ar & o.favouritesFirst & o.unreadFirst;
     }
 
     template<class Archive>
-    void serialize(Archive &ar, RoomModel &r, std::uint32_t const /*version*/)
+    void serialize(Archive &ar, RoomListEntry &e, std::uint32_t const /*version*/)
+    {
+        ar & e.roomId & e.lastActivity & e.unread & e.favourite;
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar, RoomModel &r, std::uint32_t const version)
     {
         ar
             & r.roomId
@@ -213,14 +768,83 @@ namespace Kazv
 
             & r.membersFullyLoaded
             ;
+
+        if (version >= 1) {
+            ar & r.memberships;
+        } else if constexpr (Archive::is_loading::value) {
+            r.memberships = membershipsFromState(r.stateEvents);
+        }
+
+        if (version >= 2) {
+            ar & r.timelineTs;
+        } else if constexpr (Archive::is_loading::value) {
+            r.timelineTs = timelineTsOf(r.timeline, r.messages);
+        }
+
+        if (version >= 3) {
+            ar & r.spilledGapEventId;
+        }
+
+        if (version >= 4) {
+            ar & r.summary;
+        } else if constexpr (Archive::is_loading::value) {
+            r.summary = summaryOf(r, RoomSummary{});
+        }
+
+        if (version >= 5) {
+            ar & r.searchIndex;
+        } else if constexpr (Archive::is_loading::value) {
+            r.searchIndex = searchIndexOf(r);
+        }
+
+        if (version >= 6) {
+            ar & r.relations;
+        } else if constexpr (Archive::is_loading::value) {
+            r.relations = relationsIndexOf(r);
+        }
+
+        if (version >= 7) {
+            ar & r.readReceipts & r.eventReaders & r.localUnreadCount;
+        } else if constexpr (Archive::is_loading::value) {
+            // Only the latest m.receipt event was kept before
+            if (auto receipt = r.ephemeral.find("m.receipt"); receipt) {
+                r = addReadReceipts(std::move(r), EventList{*receipt});
+            }
+            // The user is not known here. It is counted again
+            // when the read marker changes.
+            r.localUnreadCount = localUnreadCountOf(r, std::string{});
+        }
+
+        if (version >= 8) {
+            ar & r.shouldShareSessionKey & r.outboundSessionId & r.sessionKeyRecipients;
+        } else if constexpr (Archive::is_loading::value) {
+            // We do not know who has the key of the current session
+            r.shouldRotateSessionKey = true;
+        }
     }
 
     template<class Archive>
-    void serialize(Archive &ar, RoomListModel &l, std::uint32_t const /*version*/)
+    void serialize(Archive &ar, RoomListModel &l, std::uint32_t const version)
     {
         ar & l.rooms;
+
+        if (version >= 1) {
+            ar & l.joinedRoomsByUser;
+        } else if constexpr (Archive::is_loading::value) {
+            l.joinedRoomsByUser = RoomListModel::joinedRoomsIndexOf(l.rooms);
+        }
+
+        if (version >= 2) {
+            ar & l.order & l.sortedRooms;
+        } else if constexpr (Archive::is_loading::value) {
+            l.sortedRooms = RoomListModel::sortedRoomsOf(l.rooms, l.order);
+        }
     }
 }
 
-BOOST_CLASS_VERSION(Kazv::RoomModel, 0)
-BOOST_CLASS_VERSION(Kazv::RoomListModel, 0)
+BOOST_CLASS_VERSION(Kazv::RoomSummary, 0)
+BOOST_CLASS_VERSION(Kazv::ReadReceipt, 0)
+BOOST_CLASS_VERSION(Kazv::RoomModel, 8)
+BOOST_CLASS_VERSION(Kazv::RoomListOrder, 0)
+BOOST_CLASS_VERSION(Kazv::RoomListEntry, 0)
+BOOST_CLASS_VERSION(Kazv::RoomListModel, 2)
@@ -6,8 +6,12 @@
 
 #include <libkazv-config.hpp>
 
+#include <memory>
+#include <optional>
+
 #include <immer/algorithm.hpp>
 #include <debug.hpp>
+#include <time-util.hpp>
 
 #include "room.hpp"
 
@@ -92,6 +96,107 @@ namespace Kazv
         return m_ctx.dispatch(UpdateRoomAction{+roomId(), SetLocalDraftAction{localDraft}});
     }
 
+    /**
+     * Send the key of the megolm session `sessionId` of `roomId` to
+     * those of `devicesToSend` we have olm sessions with, and record
+     * them as its recipients.
+     *
+     * `devicesToSend` are no longer pending recipients once it finishes,
+     * whether it succeeds or not.
+     *
+     * If successful, `r.dataJson("devices")` of the result `r` contains
+     * the devices the key is sent to.
+     */
+    static auto shareSessionKey(Room::ContextT ctx, Room::DepsT deps, std::string roomId,
+                                std::string sessionId, std::string key,
+                                ClientModel::UserIdToDeviceIdMap devicesToSend)
+        -> Room::PromiseT
+    {
+        kzo.client.dbg() << "sending megolm session key" << std::endl;
+
+        auto &rg = lager::get<RandomInterface &>(deps);
+
+        return ctx.dispatch(ClaimKeysAction{
+                roomId, sessionId, key, devicesToSend,
+                rg.generateRange<RandomData>(ClaimKeysAction::randomSize(devicesToSend))
+            })
+            .then([ctx, deps, devicesToSend](auto status) {
+                      if (! status) { return ctx.createResolvedPromise(status); }
+
+                      kzo.client.dbg() << "olm-encrypting key event" << std::endl;
+
+                      auto keyEv = status.dataJson("keyEvent");
+                      auto &rg = lager::get<RandomInterface &>(deps);
+
+                      return ctx.dispatch(EncryptOlmEventAction{
+                              devicesToSend, keyEv,
+                              rg.generateRange<RandomData>(EncryptOlmEventAction::randomSize(devicesToSend))
+                          });
+                  })
+            .then([ctx](auto status) {
+                      if (! status) { return ctx.createResolvedPromise(status); }
+
+                      // Only the devices we have olm sessions with can decrypt the key
+                      auto devices = ClientModel::UserIdToDeviceIdMap(status.dataJson("devices"));
+                      if (devices.empty()) {
+                          kzo.client.dbg() << "no device to send the key event to" << std::endl;
+                          return ctx.createResolvedPromise(EffectStatus(true, json{{"devices", json::object()}}));
+                      }
+
+                      kzo.client.dbg() << "sending key event as to-device message" << std::endl;
+
+                      auto event = Event(status.dataJson("encrypted"));
+                      return ctx.dispatch(SendToDeviceMessageAction{event, devices})
+                          .then([devices](auto status) {
+                                    if (! status) { return status; }
+                                    return EffectStatus(true, json{{"devices", devices}});
+                                });
+                  })
+            .then([ctx, roomId, sessionId, devicesToSend](auto status) {
+                      auto devices = status
+                          ? ClientModel::UserIdToDeviceIdMap(status.dataJson("devices"))
+                          : ClientModel::UserIdToDeviceIdMap{};
+                      return ctx.dispatch(AddSessionKeyRecipientsAction{roomId, sessionId, devices, devicesToSend})
+                          .then([status](auto recordStatus) {
+                                    if (! recordStatus) { return recordStatus; }
+                                    return status;
+                                });
+                  });
+    }
+
+    auto Room::loadMembersForEncryption() const
+        -> PromiseT
+    {
+        using namespace CursorOp;
+        auto rid = +roomId();
+        auto ctx = m_ctx;
+
+        if (+roomCursor()[&RoomModel::membersFullyLoaded]) {
+            return ctx.createResolvedPromise(true);
+        }
+
+        kzo.client.dbg() << "The members of " << rid
+                         << " are not fully loaded." << std::endl;
+
+        return ctx.dispatch(GetRoomStatesAction{rid})
+            .then([ctx, rid](auto succ) {
+                      if (! succ) {
+                          kzo.client.warn() << "Loading members of " << rid
+                                            << " failed." << std::endl;
+                          return ctx.createResolvedPromise(false);
+                      } else {
+                          // XXX remove the hard-coded initialSync parameter
+                          return ctx.dispatch(QueryKeysAction{true})
+                              .then([](auto succ) {
+                                        if (! succ) {
+                                            kzo.client.warn() << "Query keys failed" << std::endl;
+                                        }
+                                        return succ;
+                                    });
+                      }
+                  });
+    }
+
     auto Room::sendMessage(Event msg) const
         -> PromiseT
     {
@@ -100,8 +205,6 @@ namespace Kazv
                                         return sdk.c().crypto.has_value();
                                     });
         auto roomEncrypted = ~roomCursor()[&RoomModel::encrypted];
-        auto noFullMembers = ~roomCursor()[&RoomModel::membersFullyLoaded]
-            .map([](auto b) { return !b; });
 
         auto rid = +roomId();
 
@@ -129,38 +232,18 @@ namespace Kazv
 
         auto deps = m_deps.value();
 
-        // If the room member list is not complete, load it fully first.
-        if (+allCursors(hasCrypto, roomEncrypted, noFullMembers)) {
-            kzo.client.dbg() << "The members of " << rid
-                             << " are not fully loaded." << std::endl;
-
-            promise = promise
-                .then([ctx, rid](auto) {
-                          return ctx.dispatch(GetRoomStatesAction{rid});
-                      })
-                .then([ctx, rid](auto succ) {
-                          if (! succ) {
-                              kzo.client.warn() << "Loading members of " << rid
-                                                << " failed." << std::endl;
-                              return ctx.createResolvedPromise(false);
-                          } else {
-                              // XXX remove the hard-coded initialSync parameter
-                              return ctx.dispatch(QueryKeysAction{true})
-                                  .then([](auto succ) {
-                                            if (! succ) {
-                                                kzo.client.warn() << "Query keys failed" << std::endl;
-                                            }
-                                            return succ;
-                                        });
-                          }
-                      });
-        }
+        // Filled in as each phase finishes, and emitted when the message is sent
+        auto metrics = std::make_shared<SendMessageMetrics>();
+        auto startUs = nowUs();
 
-        return promise
+        // If the room member list is not complete, load it fully first.
+        return loadMembersForEncryption()
             // Encrypt the event and see whether the session was rotated.
-            .then([ctx, rid, msg, deps](auto &&status) {
+            .then([ctx, rid, msg, deps, metrics, startUs](auto &&status) {
                       if (! status) { return ctx.createResolvedPromise(status); }
 
+                      metrics->loadMembersUs = nowUs() - startUs;
+
                       kzo.client.dbg() << "encrypting megolm" << std::endl;
 
                       auto &rg = lager::get<RandomInterface &>(deps);
@@ -172,56 +255,27 @@ namespace Kazv
                               rg.generateRange<RandomData>(EncryptMegOlmEventAction::maxRandomSize())
                           });
                   })
-            // If the session was rotated, send the corresponding session key to other devices
-            .then([ctx, rid, r=toEventLoop(), deps](auto status) {
+            // If the session was rotated, or some devices do not have its key,
+            // send the corresponding session key to them
+            .then([ctx, rid, deps, metrics, startUs](auto status) {
                       if (! status) { return ctx.createResolvedPromise(status); }
 
+                      metrics->encryptUs = nowUs() - startUs - metrics->loadMembersUs;
+
                       auto encryptedEvent = status.dataJson("encrypted");
                       auto content = encryptedEvent.at("content");
 
                       auto ret = ctx.createResolvedPromise({});
                       if (status.data().get().contains("key")) {
-                          kzo.client.dbg() << "megolm session rotated, sending session key" << std::endl;
-
-                          auto key = status.dataStr("key");
-                          ret = ret
-                              .then([rid, r, key, ctx, deps, sessionId=content.at("session_id")](auto &&) {
-                                        auto members = (+r.roomCursor()).joinedMemberIds();
-                                        auto client = (+r.sdkCursor()).c();
-                                        using DeviceMapT = immer::map<std::string, immer::flex_vector<std::string>>;
-
-                                        auto devicesToSend = accumulate(
-                                            members, DeviceMapT{}, [client](auto map, auto uid) {
-                                                                       return std::move(map)
-                                                                           .set(uid, client.devicesToSendKeys(uid));
-                                                                   });
-                                        auto &rg = lager::get<RandomInterface &>(deps);
-
-                                        return ctx.dispatch(ClaimKeysAction{
-                                                rid, sessionId, key, devicesToSend,
-                                                rg.generateRange<RandomData>(ClaimKeysAction::randomSize(devicesToSend))
-                                            })
-                                            .then([ctx, deps, devicesToSend](auto status) {
-                                                      if (! status) { return ctx.createResolvedPromise({}); }
-
-                                                      kzo.client.dbg() << "olm-encrypting key event" << std::endl;
-
-                                                      auto keyEv = status.dataJson("keyEvent");
-                                                      auto &rg = lager::get<RandomInterface &>(deps);
-
-                                                      return ctx.dispatch(EncryptOlmEventAction{
-                                                              devicesToSend, keyEv,
-                                                              rg.generateRange<RandomData>(EncryptOlmEventAction::randomSize(devicesToSend))
-                                                          });
-                                                  })
-                                            .then([ctx, devicesToSend](auto status) {
-                                                      if (! status) { return ctx.createResolvedPromise({}); }
-
-                                                      kzo.client.dbg() << "sending key event as to-device message" << std::endl;
-
-                                                      auto event = Event(status.dataJson("encrypted"));
-                                                      return ctx.dispatch(SendToDeviceMessageAction{event, devicesToSend});
-                                                  });
+                          auto devicesToSend = ClientModel::UserIdToDeviceIdMap(status.dataJson("devicesToSend"));
+                          ret = shareSessionKey(ctx, deps, rid, content.at("session_id").get<std::string>(), status.dataStr("key"), devicesToSend)
+                              .then([metrics](auto status) {
+                                        if (status) {
+                                            metrics->devicesSentSessionKey = accumulate(
+                                                ClientModel::UserIdToDeviceIdMap(status.dataJson("devices")), std::size_t{},
+                                                [](auto counter, auto pair) { return counter + pair.second.size(); });
+                                        }
+                                        return status;
                                     });
                       }
                       return ret
@@ -231,14 +285,63 @@ namespace Kazv
                                 });
                   })
             // Send the just encrypted event
-            .then([ctx, rid](auto status) {
+            .then([ctx, rid, metrics, startUs](auto status) {
                       if (! status) { return ctx.createResolvedPromise(status); }
 
                       kzo.client.dbg() << "sending encrypted message" << std::endl;
 
+                      metrics->totalUs = nowUs() - startUs;
+                      metrics->shareSessionKeyUs = metrics->totalUs - metrics->loadMembersUs - metrics->encryptUs;
+
                       auto ev = Event(status.dataJson("encrypted"));
 
-                      return ctx.dispatch(SendMessageAction{rid, ev});
+                      return ctx.dispatch(SendMessageAction{rid, ev, *metrics});
+                  });
+    }
+
+    auto Room::prepareEncryption() const
+        -> PromiseT
+    {
+        using namespace CursorOp;
+        auto hasCrypto = ~sdkCursor().map([](const auto &sdk) -> bool {
+                                        return sdk.c().crypto.has_value();
+                                    });
+        auto roomEncrypted = ~roomCursor()[&RoomModel::encrypted];
+
+        auto rid = +roomId();
+        auto ctx = m_ctx;
+
+        if (! +allCursors(hasCrypto, roomEncrypted)) {
+            return ctx.createResolvedPromise(true);
+        }
+
+        if (! m_deps) {
+            return ctx.createResolvedPromise({false, json{{"error", "missing-deps"}}});
+        }
+
+        auto deps = m_deps.value();
+
+        return loadMembersForEncryption()
+            // Rotate the session now if it is going to be
+            .then([ctx, rid, deps](auto &&status) {
+                      if (! status) { return ctx.createResolvedPromise(status); }
+
+                      auto &rg = lager::get<RandomInterface &>(deps);
+
+                      return ctx.dispatch(PrepareMegOlmSessionAction{
+                              rid,
+                              currentTimeMs(),
+                              rg.generateRange<RandomData>(PrepareMegOlmSessionAction::maxRandomSize())
+                          });
+                  })
+            .then([ctx, rid, deps](auto status) {
+                      if (! status || ! status.data().get().contains("key")) {
+                          return ctx.createResolvedPromise(status);
+                      }
+
+                      return shareSessionKey(
+                          ctx, deps, rid, status.dataStr("sessionId"), status.dataStr("key"),
+                          ClientModel::UserIdToDeviceIdMap(status.dataJson("devicesToSend")));
                   });
     }
 
@@ -317,6 +420,10 @@ namespace Kazv
         -> PromiseT
     {
         using namespace CursorOp;
+        if (typing) {
+            // The user is going to send a message soon
+            prepareEncryption();
+        }
         return m_ctx.dispatch(SetTypingAction{+roomId(), typing, timeoutMs});
     }
 
@@ -355,6 +462,19 @@ namespace Kazv
         return roomCursor()[&RoomModel::timelineGaps];
     }
 
+    lager::reader<TimelineDiff> Room::timelineDiff() const
+    {
+        auto prev = std::make_shared<std::optional<RoomModel>>();
+        return roomCursor()
+            .map([prev](const RoomModel &room) {
+                     auto diff = prev->has_value()
+                         ? diffTimeline(prev->value(), room)
+                         : TimelineDiff{true, {}};
+                     *prev = room;
+                     return diff;
+                 }).make();
+    }
+
     auto Room::paginateBackFromEvent(std::string eventId) const
         -> PromiseT
     {
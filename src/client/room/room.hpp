@@ -151,35 +151,127 @@ namespace Kazv
                                 }));
         }
 
-        /* lager::reader<std::string> */
-        inline auto name() const {
-            using namespace lager::lenses;
-            return stateEvents()
-                [KeyOfState{"m.room.name", ""}]
-                [or_default]
-                .xform(zug::map([](Event ev) {
-                                    auto content = ev.content().get();
-                                    return
-                                        content.contains("name")
-                                        ? std::string(content["name"])
-                                        // TODO: use heroes to generate a name
-                                        : "<no name>";
+        /**
+         * Get the changes of the timeline of this room.
+         *
+         * Each time the timeline changes, the returned reader contains
+         * the changes from the previous value of the timeline to the
+         * current one, so that a list model can apply them instead of
+         * reading the whole `timelineEvents()` again.
+         *
+         * The first value of the reader, and any value whose `reset`
+         * is true, means the whole `timelineEvents()` needs to be read.
+         *
+         * Each returned reader remembers its own previous value,
+         * so do not share it between several list models.
+         *
+         * @return A lager::reader<TimelineDiff> that contains the
+         * latest changes of the timeline.
+         */
+        lager::reader<TimelineDiff> timelineDiff() const;
+
+        /**
+         * Search the messages in this room.
+         *
+         * Messages are indexed on this device as they arrive and as
+         * they are decrypted, so encrypted messages can be found too.
+         *
+         * @param query The query. A message matches if it contains
+         * all terms in it.
+         * @param limit The maximum number of results.
+         *
+         * @return A lager::reader<immer::flex_vector<std::string>> of
+         * the ids of the matching events, best first.
+         */
+        inline auto search(std::string query, std::size_t limit) const {
+            return roomCursor()
+                [&RoomModel::searchIndex]
+                .xform(zug::map([=](const SearchIndex &index) {
+                                    return intoImmer(
+                                        immer::flex_vector<std::string>{},
+                                        zug::map([](const SearchResult &r) { return r.eventId; }),
+                                        index.search(query, limit));
                                 }));
         }
 
+        /**
+         * Get the latest edit of an event.
+         *
+         * @param eventId The id of the original event.
+         *
+         * @return A lager::reader<std::optional<Event>> of the latest
+         * `m.replace` event of `eventId` from its sender, if any.
+         *
+         * @sa latestEditOf()
+         */
+        inline auto latestEdit(std::string eventId) const {
+            return lager::with(roomCursor()[&RoomModel::relations], roomCursor()[&RoomModel::messages])
+                .xform(zug::map([=](const auto &relations, const auto &messages) {
+                                    return latestEditOf(relations, messages, eventId);
+                                }));
+        }
+
+        /**
+         * Get the reactions to an event.
+         *
+         * @param eventId The id of the event.
+         *
+         * @return A lager::reader<ReactionCounts> of the number of
+         * annotations of `eventId` by their keys.
+         */
+        inline auto reactionCounts(std::string eventId) const {
+            return roomCursor()
+                [&RoomModel::relations]
+                .xform(zug::map([=](const RelationsIndex &relations) {
+                                    return relations.reactionCountsOf(eventId);
+                                }));
+        }
+
+        /**
+         * Get the events in a thread.
+         *
+         * @param threadRootId The id of the root event of the thread.
+         *
+         * @return A lager::reader<EventList> of the events in the
+         * thread, from oldest to latest, not including the root.
+         */
+        inline auto thread(std::string threadRootId) const {
+            return lager::with(roomCursor()[&RoomModel::relations], roomCursor()[&RoomModel::messages])
+                .xform(zug::map([=](const auto &relations, const auto &messages) {
+                                    return threadOf(relations, messages, threadRootId);
+                                }));
+        }
+
+        /**
+         * Get the summary of this room.
+         *
+         * The summary is kept up to date when the state it depends on
+         * changes, so it is cheap to read for many rooms.
+         *
+         * @return A lager::reader<RoomSummary> of this room.
+         */
+        inline auto summary() const {
+            return roomCursor()
+                [&RoomModel::summary];
+        }
+
+        /**
+         * Get the display name of this room.
+         *
+         * It is the name of the room if it has one, or its canonical
+         * alias, or is made from the names of the heroes in the summary.
+         *
+         * @return A lager::reader<std::string> of the display name.
+         */
+        inline auto name() const {
+            return summary()
+                [&RoomSummary::displayName];
+        }
+
         /* lager::reader<std::string> */
         inline auto avatarMxcUri() const {
-            using namespace lager::lenses;
-            return stateEvents()
-                [KeyOfState{"m.room.avatar", ""}]
-                [or_default]
-                .xform(zug::map([](Event ev) {
-                                    auto content = ev.content().get();
-                                    return
-                                        content.contains("avatar")
-                                        ? std::string(content["avatar"])
-                                        : "";
-                                }));
+            return summary()
+                [&RoomSummary::avatarMxcUri];
         }
 
         /* lager::reader<RangeT<std::string>> */
@@ -239,12 +331,31 @@ namespace Kazv
         /**
          * Send an event to this room.
          *
+         * If the room is encrypted, its members are loaded and the
+         * key of its megolm session is shared first, if needed.
+         * SendMessageMetrics will be emitted when the event is sent.
+         *
          * @param msg The message to send
          * @return A Promise that resolves when the event has been sent,
          * or when there is an error.
          */
         PromiseT sendMessage(Event msg) const;
 
+        /**
+         * Get ready to send encrypted events to this room.
+         *
+         * This loads the members of the room, queries their keys,
+         * rotates the megolm session if needed and shares its key
+         * with the devices that do not have it, so that the next
+         * `sendMessage()` only needs to encrypt and send the event.
+         *
+         * It does nothing if the room is not encrypted.
+         *
+         * @return A Promise that resolves when the room is ready,
+         * or when there is an error.
+         */
+        PromiseT prepareEncryption() const;
+
         /**
          * Send a text message to this room.
          *
@@ -360,6 +471,8 @@ namespace Kazv
         /**
          * Set the typing status of the current user in this room.
          *
+         * If `typing` is true, this also calls `prepareEncryption()`.
+         *
          * @param typing Whether the user is now typing.
          * @param timeoutMs How long this typing status should last,
          * in milliseconds.
@@ -389,6 +502,41 @@ namespace Kazv
                 [lager::lenses::or_default];
         }
 
+        /**
+         * Get the read receipts in this room.
+         *
+         * @return A lager::reader<immer::map<std::string, ReadReceipt>>
+         * of the latest read receipt of each user.
+         */
+        KAZV_WRAP_ATTR(RoomModel, roomCursor(), readReceipts);
+
+        /**
+         * Get the users who have read up to an event.
+         *
+         * @param eventId The id of the event.
+         *
+         * @return A lager::reader<immer::set<std::string>> of the ids of
+         * the users whose read receipt is at `eventId`.
+         */
+        inline auto eventReaders(std::string eventId) const {
+            return roomCursor()
+                [&RoomModel::eventReaders]
+                [eventId]
+                [lager::lenses::or_default];
+        }
+
+        /**
+         * Get the number of unread messages in this room, counted
+         * on this device.
+         *
+         * Unlike the notification count from the server, it is
+         * updated as soon as the read marker moves.
+         *
+         * @return A lager::reader<int> of the number of messages
+         * after the read marker.
+         */
+        KAZV_WRAP_ATTR(RoomModel, roomCursor(), localUnreadCount);
+
         /* lager::reader<std::string> */
         inline auto readMarker() const {
             using namespace lager::lenses;
@@ -468,6 +616,8 @@ namespace Kazv
         const lager::reader<SdkModel> &sdkCursor() const;
         lager::reader<RoomModel> roomCursor() const;
         std::string currentRoomId() const;
+        /// Load the members of this room and query their keys, if not yet
+        PromiseT loadMembersForEncryption() const;
 
         std::optional<lager::reader<SdkModel>> m_sdk;
         std::variant<lager::reader<std::string>, std::string> m_roomId;
@@ -32,6 +32,7 @@ namespace Kazv
 
                 auto jobs = s.client.popAllJobs();
                 auto triggers = s.client.popAllTriggers();
+                auto subscribedTriggers = s.client.subscribedTriggers;
 
                 auto eff =
                     [=](auto &&ctx) {
@@ -60,6 +61,14 @@ namespace Kazv
                         for (auto t : triggers) {
                             ee.emit(t);
                         }
+
+                        // Let the client know if the subscriptions have changed,
+                        // so it can skip generating unwanted triggers
+                        auto subscribed = ee.subscribedEvents().value_or(allKazvEventTypes);
+                        if (subscribed != subscribedTriggers) {
+                            ctx.dispatch(SetSubscribedTriggersAction{subscribed});
+                        }
+
                         return combinedPromise;
                     };
 
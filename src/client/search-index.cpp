@@ -0,0 +1,365 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <queue>
+#include <unordered_map>
+
+#include <immer/flex_vector_transient.hpp>
+
+#include "search-index.hpp"
+
+namespace Kazv
+{
+    // Parameters of BM25
+    static constexpr double bm25K1 = 1.2;
+    static constexpr double bm25B = 0.75;
+
+    static bool isTermChar(unsigned char c)
+    {
+        return std::isalnum(c) || c >= 0x80;
+    }
+
+    std::vector<std::string> searchTermsOf(std::string_view text)
+    {
+        auto terms = std::vector<std::string>{};
+        auto i = std::size_t{};
+        while (i < text.size()) {
+            while (i < text.size() && ! isTermChar(text[i])) {
+                ++i;
+            }
+            auto start = i;
+            while (i < text.size() && isTermChar(text[i])) {
+                ++i;
+            }
+            if (i > start) {
+                auto term = std::string(text.substr(start, i - start));
+                std::transform(term.begin(), term.end(), term.begin(),
+                               [](unsigned char c) { return c < 0x80 ? std::tolower(c) : c; });
+                terms.push_back(std::move(term));
+            }
+        }
+        return terms;
+    }
+
+    std::optional<std::string> searchableTextOf(const Event &e)
+    {
+        if (e.type() != "m.room.message") {
+            return std::nullopt;
+        }
+        auto content = e.content().get();
+        // Index the new content of edits, not the fallback
+        if (content.contains("m.new_content") && content["m.new_content"].is_object()) {
+            content = content["m.new_content"];
+        }
+        if (! content.contains("body") || ! content["body"].is_string()) {
+            return std::nullopt;
+        }
+        return content["body"].get<std::string>();
+    }
+
+    bool SearchIndex::has(const std::string &eventId) const
+    {
+        return docNumbers.find(eventId);
+    }
+
+    SearchIndex SearchIndex::addEvents(SearchIndex index, const EventList &events)
+    {
+        // Group the postings of all events by term, so that each term
+        // is only updated once in the index
+        auto newPostings = std::unordered_map<std::string, std::vector<SearchPosting>>{};
+        auto eventIds = index.eventIds.transient();
+        auto docLengths = index.docLengths.transient();
+
+        for (const auto &e : events) {
+            const auto &eventId = e.id();
+            if (eventId.empty() || index.has(eventId)) {
+                continue;
+            }
+            auto text = searchableTextOf(e);
+            if (! text) {
+                continue;
+            }
+            auto terms = searchTermsOf(text.value());
+            if (terms.empty()) {
+                continue;
+            }
+
+            auto doc = static_cast<std::uint32_t>(eventIds.size());
+            std::sort(terms.begin(), terms.end());
+            for (auto it = terms.begin(); it != terms.end();) {
+                auto next = std::find_if(it, terms.end(), [&](const auto &t) { return t != *it; });
+                newPostings[*it].push_back(SearchPosting{doc, static_cast<std::uint32_t>(next - it)});
+                it = next;
+            }
+
+            eventIds.push_back(eventId);
+            docLengths.push_back(static_cast<std::uint32_t>(terms.size()));
+            index.docNumbers = std::move(index.docNumbers).set(eventId, doc);
+            index.totalLength += terms.size();
+        }
+
+        index.eventIds = eventIds.persistent();
+        index.docLengths = docLengths.persistent();
+
+        for (auto &[term, postings] : newPostings) {
+            index.postings = std::move(index.postings).update(
+                term,
+                [&postings=postings](auto old) {
+                    auto t = std::move(old).transient();
+                    for (const auto &p : postings) {
+                        t.push_back(p);
+                    }
+                    return t.persistent();
+                });
+        }
+
+        return index;
+    }
+
+    SearchIndex SearchIndex::remove(SearchIndex index, const std::string &eventId)
+    {
+        auto docPtr = index.docNumbers.find(eventId);
+        if (! docPtr) {
+            return index;
+        }
+        auto doc = *docPtr;
+        index.totalLength -= index.docLengths[doc];
+        index.docLengths = std::move(index.docLengths).set(doc, 0);
+        index.eventIds = std::move(index.eventIds).set(doc, std::string{});
+        index.docNumbers = std::move(index.docNumbers).erase(eventId);
+
+        // The terms of the document are not kept, so look in every list
+        auto postings = index.postings;
+        for (const auto &[term, list] : index.postings) {
+            auto it = std::lower_bound(
+                list.begin(), list.end(), doc,
+                [](const auto &posting, auto doc) { return posting.doc < doc; });
+            if (it == list.end() || it->doc != doc) {
+                continue;
+            }
+            auto remaining = list.erase(static_cast<std::size_t>(it - list.begin()));
+            postings = remaining.empty()
+                ? std::move(postings).erase(term)
+                : std::move(postings).set(term, std::move(remaining));
+        }
+        index.postings = std::move(postings);
+        return index;
+    }
+
+    SearchIndex compactSearchIndex(SearchIndex index)
+    {
+        auto removed = [&](std::uint32_t doc) { return ! index.docLengths[doc]; };
+
+        auto eventIds = index.eventIds.transient();
+        for (auto doc = std::uint32_t{}; doc < eventIds.size(); ++doc) {
+            if (removed(doc) && ! eventIds[doc].empty()) {
+                eventIds.set(doc, std::string{});
+            }
+        }
+
+        auto postings = index.postings;
+        for (const auto &[term, list] : index.postings) {
+            if (std::none_of(list.begin(), list.end(), [&](const auto &p) { return removed(p.doc); })) {
+                continue;
+            }
+            auto remaining = immer::flex_vector<SearchPosting>{}.transient();
+            for (const auto &p : list) {
+                if (! removed(p.doc)) {
+                    remaining.push_back(p);
+                }
+            }
+            postings = remaining.empty()
+                ? std::move(postings).erase(term)
+                : std::move(postings).set(term, remaining.persistent());
+        }
+
+        index.eventIds = eventIds.persistent();
+        index.postings = std::move(postings);
+        return index;
+    }
+
+    using PostingLists = std::vector<const immer::flex_vector<SearchPosting> *>;
+
+    /// @return the postings of the terms in `query`, shortest first,
+    /// or an empty list if some term is in no document
+    static PostingLists postingListsOf(const SearchIndex &index, std::string_view query)
+    {
+        auto terms = searchTermsOf(query);
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        if (terms.empty() || index.docNumbers.empty()) {
+            return {};
+        }
+
+        auto lists = PostingLists{};
+        for (const auto &term : terms) {
+            auto list = index.postings.find(term);
+            if (! list) {
+                return {};
+            }
+            lists.push_back(list);
+        }
+        std::sort(lists.begin(), lists.end(),
+                  [](auto a, auto b) { return a->size() < b->size(); });
+        return lists;
+    }
+
+    static std::vector<double> idfsOf(const SearchIndex &index, const PostingLists &lists)
+    {
+        auto numDocs = static_cast<double>(index.docNumbers.size());
+        auto idfs = std::vector<double>{};
+        for (auto list : lists) {
+            auto df = static_cast<double>(list->size());
+            idfs.push_back(std::log(1 + (numDocs - df + 0.5) / (df + 0.5)));
+        }
+        return idfs;
+    }
+
+    double SearchIndex::maxScore(std::string_view query) const
+    {
+        auto lists = postingListsOf(*this, query);
+        auto ret = 0.0;
+        // The score of a term approaches idf * (k1 + 1)
+        // as the term frequency grows
+        for (auto idf : idfsOf(*this, lists)) {
+            ret += idf * (bm25K1 + 1);
+        }
+        return ret;
+    }
+
+    immer::flex_vector<SearchResult> SearchIndex::search(std::string_view query, std::size_t limit) const
+    {
+        if (limit == 0) {
+            return {};
+        }
+        // Walk the shortest list and look up the others
+        auto lists = postingListsOf(*this, query);
+        if (lists.empty()) {
+            return {};
+        }
+
+        auto numDocs = static_cast<double>(docNumbers.size());
+        auto avgLength = static_cast<double>(totalLength) / numDocs;
+        auto idfs = idfsOf(*this, lists);
+
+        using Candidate = std::pair<double, std::uint32_t>;
+        // The worst candidate is on the top
+        auto better = [](const Candidate &a, const Candidate &b) {
+            return a.first > b.first || (a.first == b.first && a.second > b.second);
+        };
+        auto top = std::priority_queue<Candidate, std::vector<Candidate>, decltype(better)>(better);
+
+        auto cursors = std::vector<decltype(lists[0]->begin())>{};
+        for (auto list : lists) {
+            cursors.push_back(list->begin());
+        }
+
+        for (const auto &p : *lists[0]) {
+            auto length = docLengths[p.doc];
+            if (! length) {
+                continue;
+            }
+
+            auto score = 0.0;
+            auto matches = true;
+            for (auto i = std::size_t{}; i < lists.size(); ++i) {
+                auto tf = p.termFrequency;
+                if (i > 0) {
+                    cursors[i] = std::lower_bound(
+                        cursors[i], lists[i]->end(), p.doc,
+                        [](const auto &posting, auto doc) { return posting.doc < doc; });
+                    if (cursors[i] == lists[i]->end() || cursors[i]->doc != p.doc) {
+                        matches = false;
+                        break;
+                    }
+                    tf = cursors[i]->termFrequency;
+                }
+                score += idfs[i] * tf * (bm25K1 + 1)
+                    / (tf + bm25K1 * (1 - bm25B + bm25B * length / avgLength));
+            }
+            if (! matches) {
+                continue;
+            }
+
+            if (top.size() < limit) {
+                top.emplace(score, p.doc);
+            } else if (better(Candidate{score, p.doc}, top.top())) {
+                top.pop();
+                top.emplace(score, p.doc);
+            }
+        }
+
+        auto results = std::vector<SearchResult>{};
+        while (! top.empty()) {
+            auto [score, doc] = top.top();
+            top.pop();
+            results.push_back(SearchResult{eventIds[doc], score});
+        }
+        return immer::flex_vector<SearchResult>(results.rbegin(), results.rend());
+    }
+
+    bool operator==(const SearchIndex &a, const SearchIndex &b)
+    {
+        return a.eventIds == b.eventIds
+            && a.docLengths == b.docLengths
+            && a.totalLength == b.totalLength
+            && a.postings == b.postings;
+    }
+
+    static void putVarint(std::string &out, std::uint32_t v)
+    {
+        while (v >= 0x80) {
+            out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+
+    static std::uint32_t getVarint(const std::string &in, std::size_t &pos)
+    {
+        auto v = std::uint32_t{};
+        auto shift = 0;
+        while (pos < in.size()) {
+            auto byte = static_cast<unsigned char>(in[pos++]);
+            v |= static_cast<std::uint32_t>(byte & 0x7f) << shift;
+            if (! (byte & 0x80)) {
+                break;
+            }
+            shift += 7;
+        }
+        return v;
+    }
+
+    std::string encodeSearchPostings(const immer::flex_vector<SearchPosting> &postings)
+    {
+        auto out = std::string{};
+        auto lastDoc = std::uint32_t{};
+        for (const auto &p : postings) {
+            putVarint(out, p.doc - lastDoc);
+            putVarint(out, p.termFrequency);
+            lastDoc = p.doc;
+        }
+        return out;
+    }
+
+    immer::flex_vector<SearchPosting> decodeSearchPostings(const std::string &encoded)
+    {
+        auto postings = immer::flex_vector<SearchPosting>{}.transient();
+        auto pos = std::size_t{};
+        auto doc = std::uint32_t{};
+        while (pos < encoded.size()) {
+            doc += getVarint(encoded, pos);
+            auto tf = getVarint(encoded, pos);
+            postings.push_back(SearchPosting{doc, tf});
+        }
+        return postings.persistent();
+    }
+}
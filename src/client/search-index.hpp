@@ -0,0 +1,211 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include <libkazv-config.hpp>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/serialization/split_free.hpp>
+#include <boost/serialization/string.hpp>
+
+#include <immer/flex_vector.hpp>
+#include <immer/map.hpp>
+
+#include <serialization/immer-flex-vector.hpp>
+#include <serialization/immer-map.hpp>
+
+#include <event.hpp>
+
+namespace Kazv
+{
+    /**
+     * Split a text into search terms.
+     *
+     * Terms are runs of letters, digits and non-ASCII characters,
+     * with ASCII letters lowercased.
+     *
+     * @param text The text.
+     *
+     * @return The terms in `text`, in order.
+     */
+    std::vector<std::string> searchTermsOf(std::string_view text);
+
+    /// @return the text of `e` to index for search, if any
+    std::optional<std::string> searchableTextOf(const Event &e);
+
+    /// One document containing a term
+    struct SearchPosting
+    {
+        /// The number of the document in the index
+        std::uint32_t doc;
+        /// How many times the term appears in the document
+        std::uint32_t termFrequency;
+    };
+
+    inline bool operator==(const SearchPosting &a, const SearchPosting &b)
+    {
+        return a.doc == b.doc && a.termFrequency == b.termFrequency;
+    }
+
+    struct SearchResult
+    {
+        std::string eventId;
+        double score;
+    };
+
+    inline bool operator==(const SearchResult &a, const SearchResult &b)
+    {
+        return a.eventId == b.eventId && a.score == b.score;
+    }
+
+    /// A match in the messages of any room
+    struct SearchHit
+    {
+        std::string roomId;
+        std::string eventId;
+        double score;
+    };
+
+    inline bool operator==(const SearchHit &a, const SearchHit &b)
+    {
+        return a.roomId == b.roomId && a.eventId == b.eventId && a.score == b.score;
+    }
+
+    /**
+     * An inverted index of the messages of one room.
+     *
+     * Each indexed event is a document, numbered in the order it
+     * is added. For each term, the index keeps the postings of the
+     * documents containing it, in increasing document numbers.
+     *
+     * Removing an event drops its postings and its event id, but
+     * keeps its document number, so that the numbers of the other
+     * documents do not change.
+     */
+    struct SearchIndex
+    {
+        /// Document number -> event id, or empty if removed
+        immer::flex_vector<std::string> eventIds;
+        /// Document number -> number of terms in it, or 0 if removed
+        immer::flex_vector<std::uint32_t> docLengths;
+        /// Event id -> document number, for documents not removed
+        immer::map<std::string, std::uint32_t> docNumbers;
+        /// Term -> postings
+        immer::map<std::string, immer::flex_vector<SearchPosting>> postings;
+        /// The number of terms in all documents not removed
+        std::uint64_t totalLength{0};
+
+        /// @return whether the event with `eventId` is in the index
+        bool has(const std::string &eventId) const;
+
+        /**
+         * Search the index.
+         *
+         * A document matches if it contains all terms in `query`.
+         * Matches are ranked by BM25, and newer events come first
+         * among those of the same score.
+         *
+         * @param query The query.
+         * @param limit The maximum number of results.
+         *
+         * @return The matches, best first.
+         */
+        immer::flex_vector<SearchResult> search(std::string_view query, std::size_t limit) const;
+
+        /**
+         * Get an upper bound of the scores of the results of search().
+         *
+         * It is much cheaper than search(), so when searching several
+         * indexes, those that cannot beat the results found so far
+         * can be skipped.
+         *
+         * @param query The query.
+         *
+         * @return The upper bound, or 0 if nothing matches `query`.
+         */
+        double maxScore(std::string_view query) const;
+
+        /**
+         * Add the searchable events in `events` to `index`.
+         *
+         * Events already in the index are skipped.
+         */
+        static SearchIndex addEvents(SearchIndex index, const EventList &events);
+
+        /**
+         * Remove the event with `eventId` from `index`, if it is there.
+         *
+         * It looks up the document in the postings of every term, so
+         * it is much slower than addEvents().
+         */
+        static SearchIndex remove(SearchIndex index, const std::string &eventId);
+    };
+
+    bool operator==(const SearchIndex &a, const SearchIndex &b);
+
+    inline bool operator!=(const SearchIndex &a, const SearchIndex &b)
+    {
+        return !(a == b);
+    }
+
+    /**
+     * Encode postings compactly, as varints of the differences
+     * between document numbers, each followed by the term frequency.
+     */
+    std::string encodeSearchPostings(const immer::flex_vector<SearchPosting> &postings);
+
+    /// @return the postings encoded in `encoded` by encodeSearchPostings()
+    immer::flex_vector<SearchPosting> decodeSearchPostings(const std::string &encoded);
+
+    /**
+     * @return `index` without anything left of the documents removed,
+     * which indexes loaded from older snapshots may still have
+     */
+    SearchIndex compactSearchIndex(SearchIndex index);
+
+    template<class Archive>
+    void save(Archive &ar, const SearchIndex &origIndex, std::uint32_t const /*version*/)
+    {
+        auto index = compactSearchIndex(origIndex);
+        ar << index.eventIds << index.docLengths << index.totalLength;
+
+        auto numTerms = index.postings.size();
+        ar << numTerms;
+        for (const auto &[term, postings] : index.postings) {
+            ar << term << encodeSearchPostings(postings);
+        }
+    }
+
+    template<class Archive>
+    void load(Archive &ar, SearchIndex &index, std::uint32_t const /*version*/)
+    {
+        index = SearchIndex{};
+        ar >> index.eventIds >> index.docLengths >> index.totalLength;
+
+        for (auto doc = std::uint32_t{}; doc < index.eventIds.size(); ++doc) {
+            if (index.docLengths[doc]) {
+                index.docNumbers = std::move(index.docNumbers).set(index.eventIds[doc], doc);
+            }
+        }
+
+        auto numTerms = decltype(index.postings.size()){};
+        ar >> numTerms;
+        for (auto i = decltype(numTerms){}; i < numTerms; ++i) {
+            auto term = std::string{};
+            auto encoded = std::string{};
+            ar >> term >> encoded;
+            index.postings = std::move(index.postings).set(std::move(term), decodeSearchPostings(encoded));
+        }
+    }
+}
+
+BOOST_SERIALIZATION_SPLIT_FREE(Kazv::SearchIndex)
+BOOST_CLASS_VERSION(Kazv::SearchIndex, 0)
@@ -0,0 +1,168 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <fstream>
+#include <optional>
+
+#include <immer/flex_vector_transient.hpp>
+
+#include <debug.hpp>
+
+#include "timeline-spill-store.hpp"
+
+namespace Kazv
+{
+    namespace fs = std::filesystem;
+
+    static std::string hexOf(const std::string &s)
+    {
+        static const char digits[] = "0123456789abcdef";
+        auto ret = std::string{};
+        ret.reserve(s.size() * 2);
+        for (unsigned char c : s) {
+            ret.push_back(digits[c >> 4]);
+            ret.push_back(digits[c & 0xf]);
+        }
+        return ret;
+    }
+
+    /// @return the number of the latest file in `dir`
+    static std::optional<unsigned long> latestChunk(const fs::path &dir)
+    {
+        auto ec = std::error_code{};
+        auto latest = std::optional<unsigned long>{};
+        for (const auto &entry : fs::directory_iterator(dir, ec)) {
+            // Skip files left by failed pushes
+            if (entry.path().extension() != ".json") {
+                continue;
+            }
+            auto stem = entry.path().stem().string();
+            try {
+                auto num = std::stoul(stem);
+                if (! latest || num > latest.value()) {
+                    latest = num;
+                }
+            } catch (const std::exception &) {
+                // Not one of ours
+            }
+        }
+        return latest;
+    }
+
+    static fs::path chunkPath(const fs::path &dir, unsigned long num)
+    {
+        return dir / (std::to_string(num) + ".json");
+    }
+
+    FileTimelineSpillStore::FileTimelineSpillStore(fs::path dir)
+        : m_dir(std::move(dir))
+    {
+        auto ec = std::error_code{};
+        fs::create_directories(m_dir, ec);
+    }
+
+    fs::path FileTimelineSpillStore::roomDir(const std::string &roomId) const
+    {
+        return m_dir / hexOf(roomId);
+    }
+
+    bool FileTimelineSpillStore::push(const std::string &roomId, const SpilledEvents &spilled)
+    {
+        auto dir = roomDir(roomId);
+        auto ec = std::error_code{};
+        fs::create_directories(dir, ec);
+        if (ec) {
+            kzo.client.dbg() << "Cannot create " << dir << ": " << ec.message() << std::endl;
+            return false;
+        }
+
+        auto latest = latestChunk(dir);
+        auto num = latest ? latest.value() + 1 : 0;
+
+        auto events = json::array();
+        for (const auto &e : spilled.events) {
+            events.push_back(e.originalJson().get());
+        }
+        auto gaps = json::object();
+        for (const auto &[eventId, prevBatch] : spilled.gaps) {
+            gaps[eventId] = prevBatch;
+        }
+
+        auto path = chunkPath(dir, num);
+        auto tmpPath = fs::path(path).concat(".tmp");
+        {
+            auto stream = std::ofstream(tmpPath);
+            stream << json{{"events", std::move(events)}, {"gaps", std::move(gaps)}}.dump();
+            stream.close();
+            if (! stream) {
+                kzo.client.dbg() << "Cannot write spilled events of " << roomId << std::endl;
+                fs::remove(tmpPath, ec);
+                return false;
+            }
+        }
+
+        fs::rename(tmpPath, path, ec);
+        if (ec) {
+            kzo.client.dbg() << "Cannot write spilled events of " << roomId << ": " << ec.message() << std::endl;
+            fs::remove(tmpPath, ec);
+            return false;
+        }
+        return true;
+    }
+
+    std::optional<SpilledEvents> FileTimelineSpillStore::pop(const std::string &roomId)
+    {
+        auto dir = roomDir(roomId);
+        auto latest = latestChunk(dir);
+        if (! latest) {
+            return std::nullopt;
+        }
+
+        auto path = chunkPath(dir, latest.value());
+        auto stream = std::ifstream(path);
+        auto j = json::parse(stream, nullptr, /* allow_exceptions = */ false);
+        stream.close();
+
+        if (! j.is_object()) {
+            // Keep the file, so the events are not lost for good
+            kzo.client.dbg() << "Spilled events of " << roomId << " are corrupted" << std::endl;
+            return std::nullopt;
+        }
+
+        auto spilled = SpilledEvents{};
+        auto events = immer::flex_vector_transient<Event>{};
+        if (j.contains("events") && j["events"].is_array()) {
+            for (const auto &e : j["events"]) {
+                events.push_back(Event(e));
+            }
+        }
+        spilled.events = events.persistent();
+
+        if (j.contains("gaps") && j["gaps"].is_object()) {
+            for (const auto &[eventId, prevBatch] : j["gaps"].items()) {
+                if (prevBatch.is_string()) {
+                    spilled.gaps = std::move(spilled.gaps).set(eventId, prevBatch.get<std::string>());
+                }
+            }
+        }
+
+        auto ec = std::error_code{};
+        fs::remove(path, ec);
+        if (ec) {
+            kzo.client.dbg() << "Cannot remove spilled events of " << roomId << ": " << ec.message() << std::endl;
+            return std::nullopt;
+        }
+
+        return spilled;
+    }
+
+    bool FileTimelineSpillStore::has(const std::string &roomId) const
+    {
+        return latestChunk(roomDir(roomId)).has_value();
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include <libkazv-config.hpp>
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include "room/room-model.hpp"
+
+namespace Kazv
+{
+    /**
+     * Storage of timeline events moved out of memory.
+     *
+     * For each room, it is a stack of SpilledEvents. As the oldest events
+     * in memory are spilled first, each push contains events later than
+     * those already in the stack, and the latest are put back first.
+     */
+    class TimelineSpillStore
+    {
+    public:
+        virtual ~TimelineSpillStore() = default;
+
+        /**
+         * Save events spilled from a room.
+         *
+         * @param roomId The id of the room.
+         * @param spilled The events, which are later than all events
+         * saved for the room.
+         *
+         * @return Whether the events are saved. If not, nothing is
+         * saved, and the events should be kept in memory.
+         */
+        virtual bool push(const std::string &roomId, const SpilledEvents &spilled) = 0;
+
+        /**
+         * Take the events saved last for a room out of the store.
+         *
+         * If they cannot be read, they are left in the store.
+         *
+         * @param roomId The id of the room.
+         *
+         * @return The events saved last, or std::nullopt if there are
+         * none or they cannot be read.
+         */
+        virtual std::optional<SpilledEvents> pop(const std::string &roomId) = 0;
+
+        /// @return whether there are events saved for the room
+        virtual bool has(const std::string &roomId) const = 0;
+    };
+
+    /**
+     * A TimelineSpillStore that saves the events in files under a directory.
+     *
+     * Each push of each room goes into its own file. A file is
+     * written under a temporary name first, so a failed push
+     * leaves nothing behind.
+     */
+    class FileTimelineSpillStore : public TimelineSpillStore
+    {
+    public:
+        /**
+         * Constructor.
+         *
+         * @param dir The directory to put the files in. It is created
+         * if it does not exist.
+         */
+        explicit FileTimelineSpillStore(std::filesystem::path dir);
+
+        bool push(const std::string &roomId, const SpilledEvents &spilled) override;
+        std::optional<SpilledEvents> pop(const std::string &roomId) override;
+        bool has(const std::string &roomId) const override;
+
+    private:
+        std::filesystem::path roomDir(const std::string &roomId) const;
+
+        std::filesystem::path m_dir;
+    };
+}
@@ -9,7 +9,8 @@
 
 #include <olm/olm.h>
 
-#include <unordered_map>
+#include <immer/map.hpp>
+#include <immer/box.hpp>
 
 #include "crypto.hpp"
 #include "crypto-util.hpp"
@@ -32,10 +33,14 @@ namespace Kazv
         OlmAccount *account;
         immer::map<std::string /* algorithm */, int> uploadedOneTimeKeysCount;
         int numUnpublishedKeys{0};
-        std::unordered_map<std::string /* theirCurve25519IdentityKey */, Session> knownSessions;
-        std::unordered_map<KeyOfGroupSession, InboundGroupSession> inboundGroupSessions;
-
-        std::unordered_map<std::string /* roomId */, OutboundGroupSession> outboundGroupSessions;
+        // The sessions are shared between copies of a CryptoPrivate,
+        // so that copying it only copies the account. To change a
+        // session, use updateSession(), which copies it only if it
+        // is shared.
+        immer::map<std::string /* theirCurve25519IdentityKey */, immer::box<Session>> knownSessions;
+        immer::map<KeyOfGroupSession, immer::box<InboundGroupSession>> inboundGroupSessions;
+
+        immer::map<std::string /* roomId */, immer::box<OutboundGroupSession>> outboundGroupSessions;
 
         ByteArray utilityData;
         OlmUtility *utility;
@@ -15,6 +15,8 @@
 #include <nlohmann/json.hpp>
 
 #include <boost/container_hash/hash.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/version.hpp>
 
 namespace Kazv
 {
@@ -57,6 +59,16 @@ namespace Kazv
             && a.sessionId == b.sessionId;
     }
 
+    template<class Archive>
+    void serialize(Archive &ar, KeyOfGroupSession &k, std::uint32_t const /*version*/)
+    {
+        ar
+            & k.roomId
+            & k.senderKey
+            & k.sessionId
+            ;
+    }
+
     struct KeyOfOutboundSession
     {
         std::string userId;
@@ -97,6 +109,8 @@ namespace Kazv
     }
 }
 
+BOOST_CLASS_VERSION(Kazv::KeyOfGroupSession, 0)
+
 namespace std
 {
     template<> struct hash<Kazv::KeyOfGroupSession>
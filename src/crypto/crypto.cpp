@@ -6,7 +6,10 @@
 
 #include <libkazv-config.hpp>
 
+#include <optional>
+#include <unordered_map>
 #include <vector>
+#include <type_traits>
 
 #include <zug/transducer/filter.hpp>
 
@@ -18,6 +21,7 @@
 #include <event.hpp>
 #include <cursorutil.hpp>
 #include <types.hpp>
+#include <parallel.hpp>
 
 #include "crypto-p.hpp"
 #include "session-p.hpp"
@@ -29,6 +33,48 @@ namespace Kazv
 {
     using namespace CryptoConstants;
 
+    /**
+     * Call `func` with the session stored under `key`, then store the
+     * (possibly modified) session back.
+     *
+     * If no one else holds the session, it is modified in place.
+     * Otherwise, e.g. if a copy of the Crypto shares it, `func` is
+     * called with a copy, and the others are not affected.
+     */
+    template<class MapT, class KeyT, class Func>
+    static auto updateSession(MapT &sessions, const KeyT &key, Func &&func)
+    {
+        using SessionT = typename MapT::mapped_type::value_type;
+        using RetT = std::invoke_result_t<Func, SessionT &>;
+
+        auto box = sessions.at(key);
+        // Drop the reference of the map, so that the box is only
+        // shared if someone else holds it
+        sessions = std::move(sessions).erase(key);
+
+        auto ret = std::optional<RetT>{};
+        try {
+            box = std::move(box).update(
+                [&](auto &&stored) -> SessionT {
+                    // The box hands out its value as an rvalue only
+                    // if no one else holds it
+                    if constexpr (std::is_rvalue_reference_v<decltype(stored)>) {
+                        ret.emplace(std::forward<Func>(func)(stored));
+                        return std::move(stored);
+                    } else {
+                        auto session = SessionT(stored);
+                        ret.emplace(std::forward<Func>(func)(session));
+                        return session;
+                    }
+                });
+        } catch (...) {
+            sessions = std::move(sessions).set(key, std::move(box));
+            throw;
+        }
+        sessions = std::move(sessions).set(key, std::move(box));
+        return std::move(ret).value();
+    }
+
     CryptoPrivate::CryptoPrivate()
         : accountData(olm_account_size(), 0)
         , account(olm_account(accountData.data()))
@@ -114,14 +160,17 @@ namespace Kazv
         auto type = content.at("ciphertext").at(ourCurve25519IdentityKey).at("type").get<int>();
         auto body = content.at("ciphertext").at(ourCurve25519IdentityKey).at("body").get<std::string>();
 
-        auto hasKnownSession = knownSessions.find(theirCurve25519IdentityKey) != knownSessions.end();
+        auto hasKnownSession = !! knownSessions.find(theirCurve25519IdentityKey);
+
+        auto decryptWithSession =
+            [&](auto &session) { return session.decrypt(type, body); };
 
         if (type == 0) { // pre-key message
             bool shouldCreateNewSession =
                 // there is no possible session
                 (! hasKnownSession)
                 // the possible session does not match this message
-                || (! knownSessions.at(theirCurve25519IdentityKey).matches(body));
+                || (! knownSessions.at(theirCurve25519IdentityKey).get().matches(body));
 
             if (shouldCreateNewSession) {
                 auto created = createInboundSession(theirCurve25519IdentityKey, body);
@@ -130,16 +179,13 @@ namespace Kazv
                 }
             }
 
-            auto &session = knownSessions.at(theirCurve25519IdentityKey);
-
-            return session.decrypt(type, body);
+            return updateSession(knownSessions, theirCurve25519IdentityKey, decryptWithSession);
         } else {
             if (! hasKnownSession) {
                 return NotBut("No available session");
             }
 
-            auto &session = knownSessions.at(theirCurve25519IdentityKey);
-            return session.decrypt(type, body);
+            return updateSession(knownSessions, theirCurve25519IdentityKey, decryptWithSession);
         }
     }
 
@@ -153,15 +199,16 @@ namespace Kazv
 
         auto k = KeyOfGroupSession{roomId, senderKey, sessionId};
 
-        if (inboundGroupSessions.find(k) == inboundGroupSessions.end()) {
+        if (! inboundGroupSessions.find(k)) {
             return NotBut("We do not have the keys for this");
         } else {
             auto msg = content.at("ciphertext").get<std::string>();
             auto eventId = eventJson.at("event_id").get<std::string>();
             auto originServerTs = eventJson.at("origin_server_ts").get<Timestamp>();
-            auto &session = inboundGroupSessions.at(k);
 
-            return session.decrypt(msg, eventId, originServerTs);
+            return updateSession(
+                inboundGroupSessions, k,
+                [&](auto &session) { return session.decrypt(msg, eventId, originServerTs); });
         }
     }
 
@@ -173,7 +220,8 @@ namespace Kazv
 
         if (s.valid()) {
             checkError(olm_remove_one_time_keys(account, s.m_d->session));
-            knownSessions.insert_or_assign(theirCurve25519IdentityKey, std::move(s));
+            knownSessions = std::move(knownSessions)
+                .set(theirCurve25519IdentityKey, immer::box<Session>(std::move(s)));
             return true;
         }
 
@@ -188,11 +236,11 @@ namespace Kazv
         if (! desc.has_value()) { // force rotate
             valid = false;
         } else {
-            auto it = outboundGroupSessions.find(roomId);
-            if (it == outboundGroupSessions.end()) {
+            auto sessionPtr = outboundGroupSessions.find(roomId);
+            if (! sessionPtr) {
                 valid = false;
             } else {
-                auto &session = it->second;
+                const auto &session = sessionPtr->get();
                 if (timeMs - session.creationTimeMs() >= desc.value().ms) {
                     valid = false;
                 } else if (session.messageIndex() >= desc.value().messages) {
@@ -202,8 +250,7 @@ namespace Kazv
         }
 
         if (! valid) {
-            outboundGroupSessions.insert_or_assign(roomId, OutboundGroupSession(RandomTag{}, random, timeMs));
-            auto &session = outboundGroupSessions.at(roomId);
+            auto session = OutboundGroupSession(RandomTag{}, random, timeMs);
             auto sessionId = session.sessionId();
             auto sessionKey = session.sessionKey();
             auto senderKey = curve25519IdentityKey();
@@ -213,6 +260,9 @@ namespace Kazv
             if (! createInboundGroupSession(k, sessionKey, ed25519IdentityKey())) {
                 kzo.client.warn() << "Create inbound group session from outbound group session failed. We may not be able to read our own messages." << std::endl;
             }
+
+            outboundGroupSessions = std::move(outboundGroupSessions)
+                .set(roomId, immer::box<OutboundGroupSession>(std::move(session)));
         }
         return valid;
     }
@@ -230,19 +280,19 @@ namespace Kazv
     }
 
     Crypto::Crypto()
-        : m_d(new CryptoPrivate{})
+        : m_d(std::make_shared<CryptoPrivate>())
     {
     }
 
     Crypto::Crypto(RandomTag, RandomData data)
-        : m_d(new CryptoPrivate(RandomTag{}, std::move(data)))
+        : m_d(std::make_shared<CryptoPrivate>(RandomTag{}, std::move(data)))
     {
     }
 
     Crypto::~Crypto() = default;
 
     Crypto::Crypto(const Crypto &that)
-        : m_d(new CryptoPrivate(*that.m_d))
+        : m_d(that.m_d)
     {
     }
 
@@ -253,7 +303,7 @@ namespace Kazv
 
     Crypto &Crypto::operator=(const Crypto &that)
     {
-        m_d.reset(new CryptoPrivate(*that.m_d));
+        m_d = that.m_d;
         return *this;
     }
 
@@ -263,6 +313,15 @@ namespace Kazv
         return *this;
     }
 
+    CryptoPrivate &Crypto::detach()
+    {
+        if (m_d.use_count() > 1) {
+            // Only the account is copied here, the sessions are shared
+            m_d = std::make_shared<CryptoPrivate>(*m_d);
+        }
+        return *m_d;
+    }
+
     bool Crypto::valid() const
     {
         return m_d->valid;
@@ -321,7 +380,7 @@ namespace Kazv
 
     void Crypto::setUploadedOneTimeKeysCount(immer::map<std::string /* algorithm */, int> uploadedOneTimeKeysCount)
     {
-        m_d->uploadedOneTimeKeysCount = uploadedOneTimeKeysCount;
+        detach().uploadedOneTimeKeysCount = uploadedOneTimeKeysCount;
     }
 
     std::size_t Crypto::maxNumberOfOneTimeKeys() const
@@ -345,14 +404,16 @@ namespace Kazv
     {
         assert(random.size() >= genOneTimeKeysRandomSize(num));
 
-        auto res = m_d->checkError(
+        auto &d = detach();
+
+        auto res = d.checkError(
             olm_account_generate_one_time_keys(
-                m_d->account,
+                d.account,
                 num,
                 random.data(), random.size()));
 
         if (res != olm_error()) {
-            m_d->numUnpublishedKeys += num;
+            d.numUnpublishedKeys += num;
         }
     }
 
@@ -367,9 +428,10 @@ namespace Kazv
 
     void Crypto::markOneTimeKeysAsPublished()
     {
-        auto ret = m_d->checkError(olm_account_mark_keys_as_published(m_d->account));
+        auto &d = detach();
+        auto ret = d.checkError(olm_account_mark_keys_as_published(d.account));
         if (ret != olm_error()) {
-            m_d->numUnpublishedKeys = 0;
+            d.numUnpublishedKeys = 0;
         }
     }
 
@@ -388,23 +450,120 @@ namespace Kazv
         auto content = eventJson.at("content");
         auto algo = content.at("algorithm").get<std::string>();
         if (algo == olmAlgo) {
-            return m_d->decryptOlm(std::move(content));
+            return detach().decryptOlm(std::move(content));
         } else if (algo == megOlmAlgo) {
-            return m_d->decryptMegOlm(eventJson);
+            return detach().decryptMegOlm(eventJson);
         }
         return NotBut("Algorithm " + algo + " not supported");
     }
 
+    namespace
+    {
+        /// The megolm events in a batch that use the same inbound group session
+        struct DecryptGroup
+        {
+            KeyOfGroupSession key;
+            InboundGroupSession session;
+            std::vector<std::size_t> eventIndices;
+        };
+    }
+
+    static Maybe<nlohmann::json> parsePlainText(const MaybeString &plainText)
+    {
+        if (! plainText) {
+            return NotBut(plainText.reason());
+        }
+        return nlohmann::json::parse(plainText.value());
+    }
+
+    static void decryptGroup(DecryptGroup &group, const std::vector<nlohmann::json> &eventJsons,
+                             std::vector<BatchDecryptResult> &results)
+    {
+        auto ed25519Key = group.session.ed25519Key();
+        for (auto i : group.eventIndices) {
+            auto &result = results[i];
+            result.sessionEd25519Key = ed25519Key;
+            try {
+                const auto &eventJson = eventJsons[i];
+                auto plainJson = parsePlainText(group.session.decrypt(
+                    eventJson.at("content").at("ciphertext").get<std::string>(),
+                    eventJson.at("event_id").get<std::string>(),
+                    eventJson.at("origin_server_ts").get<Timestamp>()));
+                result.roomIdMatches = plainJson
+                    && plainJson.value().contains("room_id")
+                    && plainJson.value()["room_id"] == group.key.roomId;
+                result.plainJson = std::move(plainJson);
+            } catch (const std::exception &e) {
+                result.plainJson = NotBut(std::string("Malformed event: ") + e.what());
+            }
+        }
+    }
+
+    std::vector<BatchDecryptResult> Crypto::decryptBatch(const std::vector<nlohmann::json> &eventJsons, WorkerPool *pool)
+    {
+        auto results = std::vector<BatchDecryptResult>(eventJsons.size());
+        auto groups = std::vector<DecryptGroup>{};
+        auto groupIndices = std::unordered_map<KeyOfGroupSession, std::size_t>{};
+
+        auto &d = detach();
+
+        for (std::size_t i = 0; i < eventJsons.size(); ++i) {
+            try {
+                const auto &eventJson = eventJsons[i];
+                const auto &content = eventJson.at("content");
+                auto algo = content.at("algorithm").get<std::string>();
+                if (algo == olmAlgo) {
+                    results[i].plainJson = parsePlainText(d.decryptOlm(content));
+                } else if (algo == megOlmAlgo) {
+                    auto k = KeyOfGroupSession{
+                        eventJson.at("room_id").get<std::string>(),
+                        content.at("sender_key").get<std::string>(),
+                        content.at("session_id").get<std::string>(),
+                    };
+                    auto it = groupIndices.find(k);
+                    if (it == groupIndices.end()) {
+                        auto sessionPtr = d.inboundGroupSessions.find(k);
+                        if (! sessionPtr) {
+                            results[i].plainJson = NotBut("We do not have the keys for this");
+                            continue;
+                        }
+                        it = groupIndices.emplace(k, groups.size()).first;
+                        groups.push_back(DecryptGroup{k, sessionPtr->get(), {}});
+                    }
+                    groups[it->second].eventIndices.push_back(i);
+                } else {
+                    results[i].plainJson = NotBut("Algorithm " + algo + " not supported");
+                }
+            } catch (const std::exception &e) {
+                results[i].plainJson = NotBut(std::string("Malformed event: ") + e.what());
+            }
+        }
+
+        // Each group only touches its own copy of the session and
+        // the results of its own events, so they need no locking.
+        runInParallel(pool, groups.size(), [&](std::size_t g) {
+            decryptGroup(groups[g], eventJsons, results);
+        });
+
+        for (auto &group : groups) {
+            d.inboundGroupSessions = std::move(d.inboundGroupSessions)
+                .set(group.key, immer::box<InboundGroupSession>(std::move(group.session)));
+        }
+
+        return results;
+    }
+
     bool Crypto::createInboundGroupSession(KeyOfGroupSession k, std::string sessionKey, std::string ed25519Key)
     {
-        return m_d->createInboundGroupSession(std::move(k), std::move(sessionKey), std::move(ed25519Key));
+        return detach().createInboundGroupSession(std::move(k), std::move(sessionKey), std::move(ed25519Key));
     }
 
     bool CryptoPrivate::createInboundGroupSession(KeyOfGroupSession k, std::string sessionKey, std::string ed25519Key)
     {
         auto session = InboundGroupSession(sessionKey, ed25519Key);
         if (session.valid()) {
-            inboundGroupSessions.insert_or_assign(k, std::move(session));
+            inboundGroupSessions = std::move(inboundGroupSessions)
+                .set(k, immer::box<InboundGroupSession>(std::move(session)));
             return true;
         }
         return false;
@@ -445,11 +604,11 @@ namespace Kazv
 
         auto k = KeyOfGroupSession{roomId, senderKey, sessionId};
 
-        if (m_d->inboundGroupSessions.find(k) == m_d->inboundGroupSessions.end()) {
+        auto sessionPtr = m_d->inboundGroupSessions.find(k);
+        if (! sessionPtr) {
             return NotBut("We do not have the keys for this");
         } else {
-            auto &session = m_d->inboundGroupSessions.at(k);
-            return session.ed25519Key();
+            return sessionPtr->get().ed25519Key();
         }
     }
 
@@ -486,8 +645,10 @@ namespace Kazv
     {
         assert(random.size() >= encryptOlmRandomSize(theirCurve25519IdentityKey));
         try {
-            auto &session = m_d->knownSessions.at(theirCurve25519IdentityKey);
-            auto [type, body] = session.encryptWithRandom(random, eventJson.dump());
+            auto &d = detach();
+            auto [type, body] = updateSession(
+                d.knownSessions, theirCurve25519IdentityKey,
+                [&](auto &session) { return session.encryptWithRandom(random, eventJson.dump()); });
             return nlohmann::json{
                 {
                     theirCurve25519IdentityKey, {
@@ -514,16 +675,21 @@ namespace Kazv
 
         auto textToEncrypt = std::move(jsonToEncrypt).dump();
 
-        auto &session = m_d->outboundGroupSessions.at(roomId);
+        auto &d = detach();
 
-        auto ciphertext = session.encrypt(std::move(textToEncrypt));
+        auto [ciphertext, sessionId] = updateSession(
+            d.outboundGroupSessions, roomId,
+            [&](auto &session) {
+                auto ciphertext = session.encrypt(std::move(textToEncrypt));
+                return std::make_pair(std::move(ciphertext), session.sessionId());
+            });
 
         return
             json{
                 {"algorithm", CryptoConstants::megOlmAlgo},
                 {"sender_key", curve25519IdentityKey()},
                 {"ciphertext", ciphertext},
-                {"session_id", session.sessionId()},
+                {"session_id", sessionId},
             };
     }
 
@@ -534,7 +700,7 @@ namespace Kazv
 
     std::string Crypto::rotateMegOlmSessionWithRandom(RandomData random, Timestamp timeMs, std::string roomId)
     {
-        m_d->reuseOrCreateOutboundGroupSession(
+        detach().reuseOrCreateOutboundGroupSession(
             random, timeMs,
             roomId, std::nullopt);
         return outboundGroupSessionCurrentKey(roomId);
@@ -544,22 +710,28 @@ namespace Kazv
         RandomData random, Timestamp timeMs,
         std::string roomId, MegOlmSessionRotateDesc desc)
     {
-        auto oldSessionValid = m_d->reuseOrCreateOutboundGroupSession(random, timeMs, roomId, std::move(desc));
+        auto oldSessionValid = detach().reuseOrCreateOutboundGroupSession(random, timeMs, roomId, std::move(desc));
         return oldSessionValid ? std::nullopt : std::optional(outboundGroupSessionCurrentKey(roomId));
     }
 
     std::string Crypto::outboundGroupSessionInitialKey(std::string roomId)
     {
-        auto &session = m_d->outboundGroupSessions.at(roomId);
+        const auto &session = m_d->outboundGroupSessions.at(roomId).get();
         return session.initialSessionKey();
     }
 
     std::string Crypto::outboundGroupSessionCurrentKey(std::string roomId)
     {
-        auto &session = m_d->outboundGroupSessions.at(roomId);
+        const auto &session = m_d->outboundGroupSessions.at(roomId).get();
         return session.sessionKey();
     }
 
+    std::string Crypto::outboundGroupSessionId(std::string roomId)
+    {
+        const auto &session = m_d->outboundGroupSessions.at(roomId).get();
+        return session.sessionId();
+    }
+
     auto Crypto::devicesMissingOutboundSessionKey(
         immer::map<std::string, immer::map<std::string /* deviceId */,
         std::string /* curve25519IdentityKey */>> keyMap) const -> UserIdToDeviceIdMap
@@ -570,8 +742,7 @@ namespace Kazv
                 intoImmer(immer::flex_vector<std::string>{},
                           zug::filter([=](auto kv) {
                                           auto [deviceId, theirCurve25519IdentityKey] = kv;
-                                          return m_d->knownSessions.find(theirCurve25519IdentityKey)
-                                              == m_d->knownSessions.end();
+                                          return ! m_d->knownSessions.find(theirCurve25519IdentityKey);
                                       })
                           | zug::map([=](auto kv) {
                                          auto [deviceId, key] = kv;
@@ -599,14 +770,56 @@ namespace Kazv
         auto session = Session(OutboundSessionTag{},
                                RandomTag{},
                                random,
-                               m_d->account,
+                               detach().account,
                                theirIdentityKey,
                                theirOneTimeKey);
 
         if (session.valid()) {
-            m_d->knownSessions.insert_or_assign(theirIdentityKey,
-                                                std::move(session));
+            auto &d = detach();
+            d.knownSessions = std::move(d.knownSessions)
+                .set(theirIdentityKey, immer::box<Session>(std::move(session)));
+        }
+    }
+
+    // The formats below are the same as those of the std::unordered_map's
+    // we used to store the sessions in: an object for string keys,
+    // and an array of [key, value] pairs for other keys.
+    template<class MapT>
+    static nlohmann::json sessionsToJson(const MapT &sessions)
+    {
+        using KeyT = typename MapT::key_type;
+        auto j = std::is_same_v<KeyT, std::string>
+            ? nlohmann::json::object()
+            : nlohmann::json::array();
+        for (const auto &[k, session] : sessions) {
+            if constexpr (std::is_same_v<KeyT, std::string>) {
+                j[k] = session.get();
+            } else {
+                j.push_back(nlohmann::json::array({k, session.get()}));
+            }
+        }
+        return j;
+    }
+
+    template<class MapT>
+    static MapT sessionsFromJson(const nlohmann::json &j)
+    {
+        using KeyT = typename MapT::key_type;
+        using SessionT = typename MapT::mapped_type::value_type;
+        auto sessions = MapT{};
+        if constexpr (std::is_same_v<KeyT, std::string>) {
+            for (const auto &item : j.items()) {
+                sessions = std::move(sessions)
+                    .set(item.key(), typename MapT::mapped_type(item.value().template get<SessionT>()));
+            }
+        } else {
+            for (const auto &pair : j) {
+                sessions = std::move(sessions)
+                    .set(pair.at(0).template get<KeyT>(),
+                         typename MapT::mapped_type(pair.at(1).template get<SessionT>()));
+            }
         }
+        return sessions;
     }
 
     nlohmann::json Crypto::toJson() const
@@ -617,9 +830,9 @@ namespace Kazv
                 {"account", std::move(pickledData)},
                 {"uploadedOneTimeKeysCount", m_d->uploadedOneTimeKeysCount},
                 {"numUnpublishedKeys", m_d->numUnpublishedKeys},
-                {"knownSessions", nlohmann::json(m_d->knownSessions)},
-                {"inboundGroupSessions", nlohmann::json(m_d->inboundGroupSessions)},
-                {"outboundGroupSessions", nlohmann::json(m_d->outboundGroupSessions)},
+                {"knownSessions", sessionsToJson(m_d->knownSessions)},
+                {"inboundGroupSessions", sessionsToJson(m_d->inboundGroupSessions)},
+                {"outboundGroupSessions", sessionsToJson(m_d->outboundGroupSessions)},
             });
 
         return j;
@@ -627,14 +840,15 @@ namespace Kazv
 
     void Crypto::loadJson(const nlohmann::json &j)
     {
-        m_d->valid = j.contains("valid") ? j["valid"].template get<bool>() : true;
+        auto &d = detach();
+        d.valid = j.contains("valid") ? j["valid"].template get<bool>() : true;
         const auto &pickledData = j.at("account").template get<std::string>();
-        if (m_d->valid) { m_d->unpickle(pickledData); }
+        if (d.valid) { d.unpickle(pickledData); }
 
-        m_d->uploadedOneTimeKeysCount = j.at("uploadedOneTimeKeysCount");
-        m_d->numUnpublishedKeys = j.at("numUnpublishedKeys");
-        m_d->knownSessions = j.at("knownSessions").template get<decltype(m_d->knownSessions)>();
-        m_d->inboundGroupSessions = j.at("inboundGroupSessions").template get<decltype(m_d->inboundGroupSessions)>();
-        m_d->outboundGroupSessions = j.at("outboundGroupSessions").template get<decltype(m_d->outboundGroupSessions)>();
+        d.uploadedOneTimeKeysCount = j.at("uploadedOneTimeKeysCount");
+        d.numUnpublishedKeys = j.at("numUnpublishedKeys");
+        d.knownSessions = sessionsFromJson<decltype(d.knownSessions)>(j.at("knownSessions"));
+        d.inboundGroupSessions = sessionsFromJson<decltype(d.inboundGroupSessions)>(j.at("inboundGroupSessions"));
+        d.outboundGroupSessions = sessionsFromJson<decltype(d.outboundGroupSessions)>(j.at("outboundGroupSessions"));
     }
 }
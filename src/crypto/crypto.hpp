@@ -8,6 +8,7 @@
 #include <libkazv-config.hpp>
 
 #include <memory>
+#include <vector>
 
 #include <nlohmann/json.hpp>
 
@@ -15,6 +16,7 @@
 #include <immer/flex_vector.hpp>
 
 #include <maybe.hpp>
+#include <worker-pool.hpp>
 
 #include "crypto-util.hpp"
 #include "time-util.hpp"
@@ -31,6 +33,18 @@ namespace Kazv
         int messages{};
     };
 
+    /// The result of decrypting one event with `Crypto::decryptBatch()`
+    struct BatchDecryptResult
+    {
+        /// The decrypted event json, or the reason it cannot be decrypted
+        Maybe<nlohmann::json> plainJson{NotBut("Not decrypted")};
+        /// For megolm events, the ed25519 key of the session that decrypted it
+        std::string sessionEd25519Key;
+        /// For megolm events, whether the room id in the decrypted
+        /// event is that of the encrypted one
+        bool roomIdMatches{false};
+    };
+
     struct CryptoPrivate;
     class Crypto
     {
@@ -114,6 +128,28 @@ namespace Kazv
         /// otherwise returns the error
         MaybeString decrypt(nlohmann::json eventJson);
 
+        /**
+         * Decrypt many events at once.
+         *
+         * Megolm events are grouped by their inbound group session,
+         * and the groups are decrypted on the threads of `pool` and
+         * the current thread. Each session is copied once per
+         * batch rather than once per event. Olm events are decrypted
+         * on the current thread.
+         *
+         * The decrypted events are parsed, and for megolm events,
+         * the room id in them is checked. Whether the sender device
+         * owns the session is not checked here, as it requires the
+         * device lists.
+         *
+         * @param eventJsons The encrypted events.
+         * @param pool The pool to decrypt on, or nullptr to decrypt
+         * on the current thread only.
+         *
+         * @return The results, in the order of `eventJsons`.
+         */
+        std::vector<BatchDecryptResult> decryptBatch(const std::vector<nlohmann::json> &eventJsons, WorkerPool *pool);
+
         /**
          * @return The size of random data needed to encrypt a message
          * for the session identified with `theirCurve25519IdentityKey`.
@@ -157,6 +193,9 @@ namespace Kazv
 
         std::string outboundGroupSessionCurrentKey(std::string roomId);
 
+        /// @return The id of the outbound megolm session of `roomId`.
+        std::string outboundGroupSessionId(std::string roomId);
+
         /// Check whether the signature of userId/deviceId is valid in object
         bool verify(nlohmann::json object, std::string userId, std::string deviceId, std::string ed25519Key);
 
@@ -251,7 +290,17 @@ namespace Kazv
 
         friend class Session;
         friend class SessionPrivate;
-        std::unique_ptr<CryptoPrivate> m_d;
+
+        /**
+         * Make sure this Crypto is the only owner of its private data,
+         * so that it can be modified.
+         *
+         * Copies of a Crypto share the same private data until
+         * one of them is modified.
+         */
+        CryptoPrivate &detach();
+
+        std::shared_ptr<CryptoPrivate> m_d;
     };
 }
 
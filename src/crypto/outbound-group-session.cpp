@@ -167,7 +167,7 @@ namespace Kazv
         return std::string(keyBuf.begin(), keyBuf.begin() + actualSize);
     }
 
-    std::string OutboundGroupSession::sessionKey()
+    std::string OutboundGroupSession::sessionKey() const
     {
         return m_d->sessionKey();
     }
@@ -177,7 +177,7 @@ namespace Kazv
         return m_d->initialSessionKey;
     }
 
-    std::string OutboundGroupSession::sessionId()
+    std::string OutboundGroupSession::sessionId() const
     {
         auto size = olm_outbound_group_session_id_length(m_d->session);
         auto idBuf = ByteArray(size, '\0');
@@ -187,7 +187,7 @@ namespace Kazv
         return std::string(idBuf.begin(), idBuf.begin() + actualSize);
     }
 
-    int OutboundGroupSession::messageIndex()
+    int OutboundGroupSession::messageIndex() const
     {
         return olm_outbound_group_session_message_index(m_d->session);
     }
@@ -48,11 +48,11 @@ namespace Kazv
 
         bool valid() const;
 
-        std::string sessionKey();
+        std::string sessionKey() const;
         std::string initialSessionKey() const;
-        std::string sessionId();
+        std::string sessionId() const;
 
-        int messageIndex();
+        int messageIndex() const;
 
         Timestamp creationTimeMs() const;
     private:
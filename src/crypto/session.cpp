@@ -198,7 +198,7 @@ namespace Kazv
     }
 
 
-    bool Session::matches(std::string message)
+    bool Session::matches(std::string message) const
     {
         auto res = m_d->checkError(
             olm_matches_inbound_session(m_d->session, message.data(), message.size()));
@@ -66,7 +66,7 @@ namespace Kazv
         Session &operator=(Session &&that);
         ~Session();
 
-        bool matches(std::string message);
+        bool matches(std::string message) const;
 
         bool valid() const;
 
@@ -8,6 +8,7 @@
 #include <libkazv-config.hpp>
 
 #include <chrono>
+#include <cstdint>
 
 #include <event.hpp>
 
@@ -23,4 +24,11 @@ namespace Kazv
         auto now = detail::ClockT::now();
         return std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
     }
+
+    /// A monotonic timestamp in microseconds, for measuring durations
+    inline std::int64_t nowUs()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 }
@@ -8,6 +8,7 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <mutex>
 
 
 #include <lager/store.hpp>
@@ -40,11 +41,20 @@ namespace Kazv
                 }
             }
 
-            void connect(SlotT slot) {
+            void connect(SlotT slot, KazvEventTypes types) {
                 m_slots.push_back(std::move(slot));
+                std::lock_guard<std::mutex> lock(m_typesMutex);
+                m_types |= types;
+            }
+
+            KazvEventTypes types() const {
+                std::lock_guard<std::mutex> lock(m_typesMutex);
+                return m_types;
             }
 
             std::vector<SlotT> m_slots;
+            mutable std::mutex m_typesMutex;
+            KazvEventTypes m_types;
         };
 
         using ListenerSP = std::shared_ptr<Listener>;
@@ -106,6 +116,42 @@ namespace Kazv
             m_store.dispatch(Action{e});
         }
 
+        /**
+         * Get the types of events the living watchables listen to.
+         *
+         * This returns std::nullopt, i.e. all events are needed, unless
+         * publishing subscriptions is turned on with publishSubscriptions().
+         */
+        std::optional<KazvEventTypes> subscribedEvents() const override {
+            std::lock_guard<std::mutex> lock(m_subscribersMutex);
+            if (! m_publishSubscriptions) {
+                return std::nullopt;
+            }
+
+            auto types = KazvEventTypes{};
+            for (const auto &listener : m_subscribers) {
+                auto strongListener = listener.lock();
+                if (strongListener) {
+                    types |= strongListener->types();
+                }
+            }
+            return types;
+        }
+
+        /**
+         * Turn on or off publishing which types of events are listened to.
+         *
+         * When it is on, clients using this event emitter stop generating
+         * the events nobody listens to. The client only learns about
+         * a new subscription when it processes its next action, so
+         * set up the watchables before starting to sync, and events fired
+         * right after a new subscription may not reach it.
+         */
+        void publishSubscriptions(bool publish) {
+            std::lock_guard<std::mutex> lock(m_subscribersMutex);
+            m_publishSubscriptions = publish;
+        }
+
         class Watchable
         {
         public:
@@ -120,7 +166,8 @@ namespace Kazv
                         if (std::holds_alternative<EventType>(e)) {
                             f(std::get<EventType>(e));
                         }
-                    });
+                    },
+                    KazvEventTypes{}.set(kazvEventIndex<EventType>));
             }
 
             template<class Func>
@@ -128,7 +175,8 @@ namespace Kazv
                 m_listener->connect(
                     [f=std::forward<Func>(func)](KazvEvent e) {
                         f(e);
-                    });
+                    },
+                    allKazvEventTypes);
             }
 
         private:
@@ -150,6 +198,14 @@ namespace Kazv
 
     private:
         void addListener(ListenerSP listener) {
+            {
+                std::lock_guard<std::mutex> lock(m_subscribersMutex);
+                m_subscribers.erase(
+                    std::remove_if(m_subscribers.begin(), m_subscribers.end(),
+                                   [](auto ptr) { return ptr.expired(); }),
+                    m_subscribers.end());
+                m_subscribers.push_back(listener);
+            }
             m_postingFunc([=]() {
                               m_holder.m_listeners.push_back(listener);
                           });
@@ -167,6 +223,10 @@ namespace Kazv
         ListenerHolder m_holder;
         StoreT m_store;
         PostingFunc m_postingFunc;
+
+        mutable std::mutex m_subscribersMutex;
+        std::vector<ListenerWSP> m_subscribers;
+        bool m_publishSubscriptions{false};
     };
 
 }
@@ -0,0 +1,51 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#pragma once
+#include <libkazv-config.hpp>
+
+#include <memory>
+
+#include "kazvevents.hpp"
+
+namespace Kazv
+{
+    /**
+     * Receiver of the metrics of each applied sync response.
+     *
+     * Implement this to export the numbers to a metrics system,
+     * and connect it with connectSyncMetricsSink().
+     */
+    class SyncMetricsSink
+    {
+    public:
+        virtual ~SyncMetricsSink() = default;
+
+        /**
+         * Record the metrics of one sync response.
+         *
+         * This is called on the thread of the event emitter.
+         */
+        virtual void record(const SyncMetrics &metrics) = 0;
+    };
+
+    /**
+     * Send every SyncMetrics event seen by `watchable` to `sink`.
+     *
+     * @param watchable An object to watch for events, e.g. one returned
+     * by LagerStoreEventEmitter::watchable(). The sink stays connected
+     * as long as `watchable` lives.
+     * @param sink The sink to send the metrics to.
+     */
+    template<class Watchable>
+    void connectSyncMetricsSink(Watchable &watchable, std::shared_ptr<SyncMetricsSink> sink)
+    {
+        watchable.template after<SyncMetrics>(
+            [sink=std::move(sink)](const SyncMetrics &metrics) {
+                sink->record(metrics);
+            });
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <intern.hpp>
+
+using namespace Kazv;
+
+TEST_CASE("intern() should give the same object for equal strings", "[base][intern]")
+{
+    auto a = intern("m.room.message");
+    auto b = intern(std::string("m.room.") + "message");
+    auto c = intern("m.room.member");
+
+    REQUIRE(*a == "m.room.message");
+    REQUIRE(a == b);
+    REQUIRE(a != c);
+}
+
+TEST_CASE("intern() should free strings no one holds", "[base][intern]")
+{
+    auto before = internPoolSize();
+
+    auto held = std::vector<InternedString>{};
+    for (auto i = 0; i < 1000; ++i) {
+        held.push_back(intern("@intern-test-" + std::to_string(i) + ":example.com"));
+    }
+    REQUIRE(internPoolSize() >= before + 1000);
+
+    held.clear();
+    // Only the strings cached by this thread may be left
+    REQUIRE(internPoolSize() <= before + 64);
+
+    auto again = intern("@intern-test-0:example.com");
+    REQUIRE(*again == "@intern-test-0:example.com");
+}
+
+TEST_CASE("intern() should give the same object across threads", "[base][intern]")
+{
+    auto held = intern("@intern-test-threads:example.com");
+
+    auto results = std::vector<InternedString>(4);
+    auto threads = std::vector<std::thread>{};
+    for (auto i = 0; i < 4; ++i) {
+        threads.emplace_back([&results, i] {
+            for (auto j = 0; j < 1000; ++j) {
+                intern("@intern-test-threads-" + std::to_string(j) + ":example.com");
+            }
+            results[i] = intern("@intern-test-threads:example.com");
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (const auto &r : results) {
+        REQUIRE(r == held);
+    }
+}
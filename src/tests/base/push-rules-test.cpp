@@ -0,0 +1,156 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <push-rules.hpp>
+
+using namespace Kazv;
+
+static Event pushRulesEvent(json global)
+{
+    return Event(json{
+            {"type", "m.push_rules"},
+            {"content", {{"global", global}}},
+        });
+}
+
+static Event messageEvent(std::string body, std::string sender = "@bob:example.org")
+{
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", "$1"},
+            {"room_id", "!room:example.org"},
+            {"sender", sender},
+            {"origin_server_ts", 1},
+            {"content", {{"msgtype", "m.text"}, {"body", body}}},
+        });
+}
+
+static const auto notifyActions = json::array({"notify"});
+static const auto highlightActions = json::array({
+        "notify",
+        {{"set_tweak", "sound"}, {"value", "default"}},
+        {{"set_tweak", "highlight"}},
+    });
+
+static PushRuleContext testContext()
+{
+    return PushRuleContext{"@alice:example.org", "Alice", 3, JsonWrap(json{
+                {"users", {{"@bob:example.org", 50}}},
+                {"users_default", 0},
+            })};
+}
+
+TEST_CASE("Push rules without any rule should not notify", "[base][push-rules]")
+{
+    REQUIRE(PushRulesDesc().handle(messageEvent("hi"), testContext()) == PushAction{});
+}
+
+TEST_CASE("Content rules should match words case-insensitively", "[base][push-rules]")
+{
+    auto rules = PushRulesDesc(pushRulesEvent({
+                {"content", {
+                        {{"rule_id", "alice"}, {"pattern", "alice"}, {"actions", highlightActions}, {"enabled", true}},
+                        {{"rule_id", "cake"}, {"pattern", "ch?c*ate"}, {"actions", notifyActions}, {"enabled", true}},
+                        {{"rule_id", "off"}, {"pattern", "hello"}, {"actions", notifyActions}, {"enabled", false}},
+                    }},
+            }));
+    auto ctx = testContext();
+
+    auto res = rules.handle(messageEvent("Hey ALICE!"), ctx);
+    REQUIRE(res.notify);
+    REQUIRE(res.highlight);
+    REQUIRE(res.sound == "default");
+    REQUIRE(res.ruleId == "alice");
+
+    REQUIRE(rules.handle(messageEvent("malice"), ctx) == PushAction{});
+    REQUIRE(rules.handle(messageEvent("I like Chocolate cake"), ctx).ruleId == "cake");
+    REQUIRE(rules.handle(messageEvent("chocolates"), ctx) == PushAction{});
+    REQUIRE(rules.handle(messageEvent("hello"), ctx) == PushAction{});
+}
+
+TEST_CASE("Push rules should be evaluated in order of kinds", "[base][push-rules]")
+{
+    auto rules = PushRulesDesc(pushRulesEvent({
+                {"override", {
+                        {{"rule_id", ".m.rule.suppress_notices"}, {"actions", json::array({"dont_notify"})},
+                         {"conditions", {{{"kind", "event_match"}, {"key", "content.msgtype"}, {"pattern", "m.notice"}}}}},
+                    }},
+                {"room", {
+                        {{"rule_id", "!room:example.org"}, {"actions", json::array()}},
+                    }},
+                {"sender", {
+                        {{"rule_id", "@bob:example.org"}, {"actions", highlightActions}},
+                    }},
+                {"underride", {
+                        {{"rule_id", ".m.rule.message"}, {"actions", notifyActions},
+                         {"conditions", {{{"kind", "event_match"}, {"key", "type"}, {"pattern", "m.room.message"}}}}},
+                    }},
+            }));
+    auto ctx = testContext();
+
+    REQUIRE(rules.handle(messageEvent("hi"), ctx).ruleId == "!room:example.org");
+
+    auto notice = Event(json{
+            {"type", "m.room.message"},
+            {"room_id", "!other:example.org"},
+            {"sender", "@bob:example.org"},
+            {"content", {{"msgtype", "m.notice"}, {"body", "beep"}}},
+        });
+    REQUIRE(rules.handle(notice, ctx) == PushAction{false, false, std::nullopt, ".m.rule.suppress_notices"});
+
+    auto other = Event(json{
+            {"type", "m.room.message"},
+            {"room_id", "!other:example.org"},
+            {"sender", "@carol:example.org"},
+            {"content", {{"msgtype", "m.text"}, {"body", "hi"}}},
+        });
+    REQUIRE(rules.handle(other, ctx) == PushAction{true, false, std::nullopt, ".m.rule.message"});
+
+    REQUIRE(rules.handle(messageEvent("hi", "@alice:example.org"), ctx) == PushAction{});
+}
+
+TEST_CASE("Push rule conditions should use the room context", "[base][push-rules]")
+{
+    auto rule = [](json conditions) {
+        return PushRulesDesc(pushRulesEvent({
+                    {"override", {
+                            {{"rule_id", "r"}, {"actions", notifyActions}, {"conditions", conditions}},
+                        }},
+                }));
+    };
+    auto matches = [&](json conditions, Event e) {
+        return rule(conditions).handle(e, testContext()).ruleId == "r";
+    };
+
+    REQUIRE(matches({{{"kind", "contains_display_name"}}}, messageEvent("hi alice")));
+    REQUIRE(! matches({{{"kind", "contains_display_name"}}}, messageEvent("hi alicea")));
+
+    REQUIRE(matches({{{"kind", "room_member_count"}, {"is", "3"}}}, messageEvent("hi")));
+    REQUIRE(matches({{{"kind", "room_member_count"}, {"is", ">=3"}}}, messageEvent("hi")));
+    REQUIRE(! matches({{{"kind", "room_member_count"}, {"is", "<3"}}}, messageEvent("hi")));
+    REQUIRE(! matches({{{"kind", "room_member_count"}, {"is", "lots"}}}, messageEvent("hi")));
+
+    REQUIRE(matches({{{"kind", "sender_notification_permission"}, {"key", "room"}}}, messageEvent("@room")));
+    REQUIRE(! matches({{{"kind", "sender_notification_permission"}, {"key", "room"}}}, messageEvent("@room", "@carol:example.org")));
+
+    REQUIRE(matches({{{"kind", "event_property_is"}, {"key", "content.msgtype"}, {"value", "m.text"}}}, messageEvent("hi")));
+    REQUIRE(matches({{{"kind", "event_match"}, {"key", "room_id"}, {"pattern", "!room:*"}}}, messageEvent("hi")));
+    REQUIRE(! matches({{{"kind", "event_match"}, {"key", "room_id"}, {"pattern", "room"}}}, messageEvent("hi")));
+
+    auto mentions = Event(json{
+            {"type", "m.room.message"},
+            {"room_id", "!room:example.org"},
+            {"sender", "@bob:example.org"},
+            {"content", {{"body", "hi"}, {"m.mentions", {{"user_ids", {"@alice:example.org"}}}}}},
+        });
+    REQUIRE(matches({{{"kind", "event_property_contains"}, {"key", "content.m\\.mentions.user_ids"}, {"value", "@alice:example.org"}}}, mentions));
+
+    REQUIRE(! matches({{{"kind", "some_future_kind"}}}, messageEvent("hi")));
+}
@@ -0,0 +1,89 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <parallel.hpp>
+#include <worker-pool.hpp>
+
+using namespace Kazv;
+
+TEST_CASE("runInParallel() should run every task once on the threads of the pool", "[base][worker-pool]")
+{
+    auto pool = WorkerPool(3);
+    REQUIRE(pool.size() == 3);
+
+    for (auto round = 0; round < 10; ++round) {
+        auto runs = std::vector<std::atomic<int>>(100);
+        auto threadsMutex = std::mutex{};
+        auto threadIds = std::set<std::thread::id>{};
+
+        runInParallel(&pool, runs.size(), [&](std::size_t i) {
+            ++runs[i];
+            std::lock_guard<std::mutex> lock(threadsMutex);
+            threadIds.insert(std::this_thread::get_id());
+        });
+
+        for (const auto &r : runs) {
+            REQUIRE(r == 1);
+        }
+        // The pool threads and this one
+        REQUIRE(threadIds.size() <= 4);
+    }
+}
+
+TEST_CASE("runInParallel() should run on the current thread without a pool", "[base][worker-pool]")
+{
+    auto threadIds = std::set<std::thread::id>{};
+    runInParallel(nullptr, 10, [&](std::size_t) {
+        threadIds.insert(std::this_thread::get_id());
+    });
+
+    REQUIRE(threadIds == std::set<std::thread::id>{std::this_thread::get_id()});
+    REQUIRE(makeWorkerPool(0) == nullptr);
+    REQUIRE(makeWorkerPool(1) == nullptr);
+    REQUIRE(makeWorkerPool(4)->size() == 3);
+}
+
+TEST_CASE("runInParallel() should finish when the threads of the pool are busy", "[base][worker-pool]")
+{
+    auto pool = WorkerPool(1);
+    auto unblock = std::promise<void>{};
+    auto blocked = unblock.get_future().share();
+    pool.post([blocked] { blocked.wait(); });
+
+    auto count = 0;
+    runInParallel(&pool, 10, [&](std::size_t) { ++count; });
+    REQUIRE(count == 10);
+
+    unblock.set_value();
+}
+
+TEST_CASE("runInParallel() should rethrow an exception after all tasks have finished", "[base][worker-pool]")
+{
+    auto pool = WorkerPool(2);
+    auto count = std::atomic<int>{0};
+
+    REQUIRE_THROWS_AS(
+        runInParallel(&pool, 20, [&](std::size_t i) {
+            ++count;
+            if (i == 5) {
+                throw std::runtime_error("failed");
+            }
+        }),
+        std::runtime_error);
+    REQUIRE(count == 20);
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <crypto.hpp>
+
+#include "../client/client-test-util.hpp"
+
+static Crypto cryptoWithInboundGroupSessions(int num)
+{
+    auto crypto = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto sessionKey = crypto.rotateMegOlmSessionWithRandom(
+        genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, "!bench:example.com");
+    auto senderKey = crypto.curve25519IdentityKey();
+    auto ed25519Key = crypto.ed25519IdentityKey();
+
+    for (auto i = 0; i < num; ++i) {
+        crypto.createInboundGroupSession(
+            KeyOfGroupSession{"!room" + std::to_string(i) + ":example.com", senderKey, "session"},
+            sessionKey, ed25519Key);
+    }
+    return crypto;
+}
+
+TEST_CASE("ClientModel::update latency with many inbound group sessions", "[!benchmark][client][crypto]")
+{
+    auto m = createTestClientModel();
+    m.crypto = cryptoWithInboundGroupSessions(10000);
+
+    BENCHMARK("Copy Crypto with 10000 inbound group sessions") {
+        return Crypto(m.crypto.value());
+    };
+
+    BENCHMARK("SetTypingAction with 10000 inbound group sessions") {
+        return ClientModel::update(m, SetTypingAction{"!bench:example.com", true, std::nullopt});
+    };
+}
+
+TEST_CASE("Per-message cost of megolm encryption", "[!benchmark][crypto]")
+{
+    auto roomId = std::string("!bench:example.com");
+    auto crypto = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    crypto.rotateMegOlmSessionWithRandom(
+        genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId);
+    auto eventJson = json{
+        {"room_id", roomId},
+        {"type", "m.room.message"},
+        {"content", {{"msgtype", "m.text"}, {"body", "bench"}}},
+    };
+
+    BENCHMARK("Encrypt 100 messages with a session no one else holds") {
+        for (auto i = 0; i < 100; ++i) {
+            crypto.encryptMegOlm(eventJson);
+        }
+        return crypto.outboundGroupSessionCurrentKey(roomId);
+    };
+
+    // As in the reducer, where the previous model still holds
+    // the Crypto: the session has to be copied for each message
+    BENCHMARK("Encrypt 100 messages with a session shared with a copy") {
+        for (auto i = 0; i < 100; ++i) {
+            auto previous = crypto;
+            crypto.encryptMegOlm(eventJson);
+        }
+        return crypto.outboundGroupSessionCurrentKey(roomId);
+    };
+}
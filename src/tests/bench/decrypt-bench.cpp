@@ -0,0 +1,175 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <crypto.hpp>
+
+#include "../client/client-test-util.hpp"
+
+using namespace Kazv::CryptoConstants;
+
+static const std::string roomId = "!bench:example.com";
+
+static json encryptedEventJson(int i)
+{
+    return json{
+        {"type", "m.room.encrypted"},
+        {"event_id", "$" + std::to_string(i)},
+        {"sender", "@alice:example.com"},
+        {"origin_server_ts", i},
+        {"content", {
+                {"algorithm", megOlmAlgo},
+                {"sender_key", "aliceCurve25519Key"},
+                // Sessions are rotated every 100 messages
+                {"session_id", "session" + std::to_string(i / 100)},
+                {"device_id", "ALICEDEVICE"},
+                {"ciphertext", "AwgAEnACgAkLmt6qF84IK++J7UDH2Za1YVchHyprqTqsg2yyOwAtHaZTwyNg37afzg8f3r9IsN9r4"},
+            }},
+    };
+}
+
+static json syncJson(int from, int to)
+{
+    auto events = json::array();
+    for (auto i = from; i < to; ++i) {
+        events.push_back(encryptedEventJson(i));
+    }
+
+    return json{
+        {"next_batch", "s" + std::to_string(to)},
+        {"rooms", {
+                {"join", {
+                        {roomId, {
+                                {"state", {
+                                        {"events", json::array({
+                                                    {
+                                                        {"type", "m.room.encryption"},
+                                                        {"state_key", ""},
+                                                        {"event_id", "$encryption"},
+                                                        {"sender", "@alice:example.com"},
+                                                        {"origin_server_ts", 0},
+                                                        {"content", {{"algorithm", megOlmAlgo}}},
+                                                    },
+                                                })},
+                                    }},
+                                {"timeline", {
+                                        {"events", events},
+                                        {"limited", false},
+                                        {"prev_batch", "p" + std::to_string(from)},
+                                    }},
+                            }},
+                    }},
+            }},
+    };
+}
+
+TEST_CASE("Incremental sync cost with undecryptable encrypted history", "[!benchmark][client][encryption]")
+{
+    // The cost of an incremental sync carrying one new encrypted event
+    // should not depend on how many undecryptable events we already have.
+    for (auto historySize : {100, 1000, 10000}) {
+        auto m = createTestClientModel();
+        m.crypto = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+        auto initialResp = createResponse("Sync", syncJson(0, historySize), json{{"is", "initial"}});
+        std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{initialResp});
+
+        auto resp = createResponse("Sync", syncJson(historySize, historySize + 1), json{{"is", "incremental"}});
+
+        BENCHMARK("Incremental sync with " + std::to_string(historySize) + " undecryptable events") {
+            return ClientModel::update(m, ProcessResponseAction{resp});
+        };
+    }
+}
+
+/// A receiver with the keys of `numSessions` sessions, and `numEvents` events encrypted with them
+static std::pair<Crypto, std::vector<json>> megOlmEvents(int numSessions, int numEvents)
+{
+    auto sender = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto receiver = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto sessionKeys = std::vector<std::string>{};
+    for (auto s = 0; s < numSessions; ++s) {
+        sessionKeys.push_back(sender.rotateMegOlmSessionWithRandom(
+            genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0,
+            "!room" + std::to_string(s) + ":example.com"));
+    }
+
+    auto eventJsons = std::vector<json>{};
+    for (auto i = 0; i < numEvents; ++i) {
+        auto s = i % numSessions;
+        auto roomId = "!room" + std::to_string(s) + ":example.com";
+        auto eventJson = megOlmEventJson(sender, roomId, "$" + std::to_string(i), "Message " + std::to_string(i));
+        if (i < numSessions) {
+            receiver.createInboundGroupSession(
+                KeyOfGroupSession{roomId, sender.curve25519IdentityKey(), eventJson["content"]["session_id"]},
+                sessionKeys[s], sender.ed25519IdentityKey());
+        }
+        eventJsons.push_back(std::move(eventJson));
+    }
+
+    return {receiver, eventJsons};
+}
+
+TEST_CASE("Throughput of batch megolm decryption", "[!benchmark][crypto][encryption]")
+{
+    const auto numSessions = 32;
+    const auto numEvents = 32000;
+    auto events = megOlmEvents(numSessions, numEvents);
+    const auto &receiver = events.first;
+    const auto &eventJsons = events.second;
+
+    {
+        auto crypto = receiver;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &eventJson : eventJsons) {
+            crypto.decrypt(eventJson);
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "One by one: " << numEvents / seconds << " events/s" << std::endl;
+    }
+
+    auto threadCounts = std::vector<std::size_t>{1, 2, 4, 8};
+    auto cores = std::max(static_cast<std::size_t>(std::thread::hardware_concurrency()), std::size_t{1});
+    if (std::find(threadCounts.begin(), threadCounts.end(), cores) == threadCounts.end()) {
+        threadCounts.push_back(cores);
+    }
+
+    for (auto numThreads : threadCounts) {
+        // As in the client, the threads are started before decrypting
+        auto pool = makeWorkerPool(static_cast<int>(numThreads));
+        auto crypto = receiver;
+        auto start = std::chrono::steady_clock::now();
+        crypto.decryptBatch(eventJsons, pool.get());
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Batch of " << numSessions << " sessions on " << numThreads << " threads: "
+                  << numEvents / seconds << " events/s" << std::endl;
+    }
+
+    auto batch = std::vector<json>(eventJsons.begin(), eventJsons.begin() + 1000);
+    auto pool = makeWorkerPool(static_cast<int>(cores));
+    BENCHMARK("Decrypt 1000 events one by one") {
+        auto crypto = receiver;
+        for (const auto &eventJson : batch) {
+            crypto.decrypt(eventJson);
+        }
+        return crypto;
+    };
+
+    BENCHMARK("Decrypt 1000 events in a batch on " + std::to_string(cores) + " threads") {
+        auto crypto = receiver;
+        return crypto.decryptBatch(batch, pool.get());
+    };
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <push-rules.hpp>
+
+using namespace Kazv;
+
+static json condition(std::string key, std::string pattern)
+{
+    return json{{"kind", "event_match"}, {"key", key}, {"pattern", pattern}};
+}
+
+static json rule(std::string id, json conditions, json actions)
+{
+    return json{{"rule_id", id}, {"default", true}, {"enabled", true},
+                {"conditions", conditions}, {"actions", actions}};
+}
+
+/// Rules like the server defaults, with some keywords of the user
+static Event pushRulesEvent()
+{
+    auto notify = json::array({"notify"});
+    auto sound = json::array({"notify", {{"set_tweak", "sound"}, {"value", "default"}}});
+    auto highlight = json::array({"notify", {{"set_tweak", "sound"}, {"value", "default"}}, {{"set_tweak", "highlight"}}});
+
+    auto overrideRules = json::array({
+            {{"rule_id", ".m.rule.master"}, {"enabled", false}, {"conditions", json::array()}, {"actions", json::array()}},
+            rule(".m.rule.suppress_notices", json::array({condition("content.msgtype", "m.notice")}), json::array()),
+            rule(".m.rule.invite_for_me", json::array({
+                        condition("type", "m.room.member"),
+                        condition("content.membership", "invite"),
+                        condition("state_key", "@alice:example.org")}), sound),
+            rule(".m.rule.member_event", json::array({condition("type", "m.room.member")}), json::array()),
+            rule(".m.rule.is_user_mention", json::array({
+                        {{"kind", "event_property_contains"}, {"key", "content.m\\.mentions.user_ids"}, {"value", "@alice:example.org"}}}), highlight),
+            rule(".m.rule.contains_display_name", json::array({{{"kind", "contains_display_name"}}}), highlight),
+            rule(".m.rule.is_room_mention", json::array({
+                        {{"kind", "event_property_is"}, {"key", "content.m\\.mentions.room"}, {"value", true}},
+                        {{"kind", "sender_notification_permission"}, {"key", "room"}}}), highlight),
+            rule(".m.rule.roomnotif", json::array({
+                        {{"kind", "sender_notification_permission"}, {"key", "room"}},
+                        condition("content.body", "@room")}), highlight),
+            rule(".m.rule.tombstone", json::array({
+                        condition("type", "m.room.tombstone"), condition("state_key", "")}), highlight),
+            rule(".m.rule.reaction", json::array({condition("type", "m.reaction")}), json::array()),
+            rule(".m.rule.server_acl", json::array({
+                        condition("type", "m.room.server_acl"), condition("state_key", "")}), json::array()),
+        });
+
+    auto content = json::array({
+            {{"rule_id", ".m.rule.contains_user_name"}, {"pattern", "alice"}, {"actions", highlight}},
+        });
+    for (auto keyword : {"libkazv", "kazv*", "matrix", "release?", "deploy*", "urgent", "lunch", "review*"}) {
+        content.push_back({{"rule_id", keyword}, {"pattern", keyword}, {"actions", sound}});
+    }
+
+    auto underride = json::array({
+            rule(".m.rule.call", json::array({condition("type", "m.call.invite")}), sound),
+            rule(".m.rule.encrypted_room_one_to_one", json::array({
+                        {{"kind", "room_member_count"}, {"is", "2"}},
+                        condition("type", "m.room.encrypted")}), sound),
+            rule(".m.rule.room_one_to_one", json::array({
+                        {{"kind", "room_member_count"}, {"is", "2"}},
+                        condition("type", "m.room.message")}), sound),
+            rule(".m.rule.message", json::array({condition("type", "m.room.message")}), notify),
+            rule(".m.rule.encrypted", json::array({condition("type", "m.room.encrypted")}), notify),
+        });
+
+    return Event(json{
+            {"type", "m.push_rules"},
+            {"content", {{"global", {
+                            {"override", overrideRules},
+                            {"content", content},
+                            {"room", json::array()},
+                            {"sender", json::array()},
+                            {"underride", underride},
+                        }}}},
+        });
+}
+
+static std::vector<Event> messageEvents(int count)
+{
+    auto bodies = std::vector<std::string>{
+        "Did anyone look at the latest release notes?",
+        "I will be late for lunch today, sorry",
+        "Hey Alice, can you take a look at this?",
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.",
+        "@room the server will be down for maintenance",
+        "ok",
+    };
+
+    auto events = std::vector<Event>{};
+    events.reserve(count);
+    for (auto i = 0; i < count; ++i) {
+        events.push_back(Event(json{
+                    {"type", i % 10 == 0 ? "m.reaction" : "m.room.message"},
+                    {"event_id", "$" + std::to_string(i)},
+                    {"room_id", "!room:example.org"},
+                    {"sender", "@user" + std::to_string(i % 20) + ":example.org"},
+                    {"origin_server_ts", i},
+                    {"content", {{"msgtype", "m.text"}, {"body", bodies[i % bodies.size()]}}},
+                }));
+    }
+    return events;
+}
+
+TEST_CASE("Throughput of push rule evaluation", "[!benchmark][base][push-rules]")
+{
+    auto rulesEvent = pushRulesEvent();
+    auto rules = PushRulesDesc(rulesEvent);
+    auto ctx = PushRuleContext{"@alice:example.org", "Alice Margatroid", 20, JsonWrap(json{
+            {"users", {{"@user0:example.org", 100}}},
+            {"users_default", 0},
+        })};
+
+    const auto count = 100000;
+    auto events = messageEvents(count);
+
+    auto start = std::chrono::steady_clock::now();
+    auto numHighlights = 0;
+    for (const auto &e : events) {
+        numHighlights += rules.handle(e, ctx).highlight;
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Compiled rules: " << count / seconds << " events/s ("
+              << numHighlights << " highlights)" << std::endl;
+
+    BENCHMARK("Evaluate compiled rules on 1000 events") {
+        auto n = 0;
+        for (auto i = 0; i < 1000; ++i) {
+            n += rules.handle(events[i], ctx).notify;
+        }
+        return n;
+    };
+
+    // What we would pay if the rules were interpreted from the
+    // account data event for every event
+    BENCHMARK("Compile and evaluate rules on 1000 events") {
+        auto n = 0;
+        for (auto i = 0; i < 1000; ++i) {
+            n += PushRulesDesc(rulesEvent).handle(events[i], ctx).notify;
+        }
+        return n;
+    };
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <search-index.hpp>
+
+using namespace Kazv;
+
+/// A message of 5 to 20 words, from a vocabulary of 5000 words of a skewed distribution
+static Event messageEvent(int i, std::mt19937 &gen)
+{
+    auto numWords = std::uniform_int_distribution<int>(5, 20)(gen);
+    auto word = std::geometric_distribution<int>(0.002);
+    auto body = std::string{};
+    for (auto j = 0; j < numWords; ++j) {
+        body += "w" + std::to_string(word(gen) % 5000) + " ";
+    }
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", "$message" + std::to_string(i) + ":example.com"},
+            {"room_id", "!bench:example.com"},
+            {"sender", "@user" + std::to_string(i % 20) + ":example.com"},
+            {"origin_server_ts", i},
+            {"content", {{"msgtype", "m.text"}, {"body", body}}},
+        });
+}
+
+TEST_CASE("Search index over 1M messages", "[!benchmark][client][search]")
+{
+    const auto count = 1000000;
+    const auto batchSize = 100;
+
+    auto gen = std::mt19937(42);
+    auto batches = std::vector<EventList>{};
+    for (auto i = 0; i < count; i += batchSize) {
+        auto batch = EventList{}.transient();
+        for (auto j = i; j < i + batchSize; ++j) {
+            batch.push_back(messageEvent(j, gen));
+        }
+        batches.push_back(batch.persistent());
+    }
+
+    // Like events arriving in sync responses
+    auto start = std::chrono::steady_clock::now();
+    auto index = SearchIndex{};
+    for (const auto &batch : batches) {
+        index = SearchIndex::addEvents(std::move(index), batch);
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Indexed " << count << " messages in batches of " << batchSize << ": "
+              << count / seconds << " messages/s, "
+              << index.postings.size() << " terms" << std::endl;
+
+    BENCHMARK("Search a common term") {
+        return index.search("w1", 20);
+    };
+
+    BENCHMARK("Search a rare term") {
+        return index.search("w4000", 20);
+    };
+
+    BENCHMARK("Search two common terms") {
+        return index.search("w1 w2", 20);
+    };
+
+    BENCHMARK("Search a common and a rare term") {
+        return index.search("w1 w3000", 20);
+    };
+
+    auto newBatch = EventList{}.transient();
+    for (auto j = count; j < count + batchSize; ++j) {
+        newBatch.push_back(messageEvent(j, gen));
+    }
+    auto newEvents = newBatch.persistent();
+
+    BENCHMARK("Index a batch of " + std::to_string(batchSize) + " messages into 1M") {
+        return SearchIndex::addEvents(index, newEvents);
+    };
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+
+#include "../client/client-test-util.hpp"
+
+static std::string syntheticSyncBody(std::size_t targetSize)
+{
+    auto body = std::string(R"({"next_batch":"s1","rooms":{"join":{)");
+    auto roomIndex = 0;
+    while (body.size() < targetSize) {
+        auto roomId = "!room" + std::to_string(roomIndex) + ":example.com";
+        if (roomIndex) {
+            body += ",";
+        }
+        body += "\"" + roomId + "\":{\"state\":{\"events\":[";
+        for (auto i = 0; i < 20; ++i) {
+            body += (i ? "," : "") + json{
+                {"type", "m.room.member"},
+                {"state_key", "@user" + std::to_string(i) + ":example.com"},
+                {"event_id", "$member" + std::to_string(i) + roomId},
+                {"sender", "@user" + std::to_string(i) + ":example.com"},
+                {"origin_server_ts", i},
+                {"content", {{"membership", "join"}, {"displayname", "User " + std::to_string(i)}}},
+            }.dump();
+        }
+        body += "]},\"timeline\":{\"limited\":true,\"prev_batch\":\"p1\",\"events\":[";
+        for (auto i = 0; i < 100; ++i) {
+            body += (i ? "," : "") + json{
+                {"type", "m.room.message"},
+                {"event_id", "$message" + std::to_string(i) + roomId},
+                {"sender", "@user" + std::to_string(i % 20) + ":example.com"},
+                {"origin_server_ts", 1000 + i},
+                {"content", {{"msgtype", "m.text"}, {"body", std::string(200, 'x')}}},
+            }.dump();
+        }
+        body += "]}}";
+        ++roomIndex;
+    }
+    body += "}}}";
+    return body;
+}
+
+struct ChildUsage
+{
+    long maxRssKb;
+    double wallSeconds;
+};
+
+/// Run `func` in a child process and report its peak RSS and wall time
+static ChildUsage measureInChild(std::function<void()> func)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto pid = fork();
+    if (pid == 0) {
+        func();
+        _exit(0);
+    }
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    auto end = std::chrono::steady_clock::now();
+
+    return {
+        usage.ru_maxrss,
+        std::chrono::duration<double>(end - start).count(),
+    };
+}
+
+TEST_CASE("Peak memory and time of parsing a 50MB sync response", "[!benchmark][client][sync]")
+{
+    auto body = syntheticSyncBody(50 * 1024 * 1024);
+    auto m = createTestClientModel();
+
+    auto baseline = measureInChild([] {});
+
+    auto dom = measureInChild(
+        [&] {
+            // What the job handler does for a Json job, then process it
+            auto resp = createResponse("Sync", json::parse(body), json{{"is", "initial"}});
+            ClientModel::update(m, ProcessResponseAction{std::move(resp)});
+        });
+
+    auto streaming = measureInChild(
+        [&] {
+            auto resp = createResponse("Sync", body, json{{"is", "initial"}});
+            ClientModel::update(m, ProcessResponseAction{std::move(resp)});
+        });
+
+    std::cout << "Sync body size: " << body.size() / 1024 << " KiB" << std::endl
+              << "Baseline: peak RSS " << baseline.maxRssKb << " KiB" << std::endl
+              << "Full DOM: peak RSS " << dom.maxRssKb << " KiB, "
+              << dom.wallSeconds << " s" << std::endl
+              << "Streaming: peak RSS " << streaming.maxRssKb << " KiB, "
+              << streaming.wallSeconds << " s" << std::endl;
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include "../client/client-test-util.hpp"
+
+static const std::string roomId = "!bench:example.com";
+
+static Event messageEvent(int i, Timestamp ts)
+{
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", "$message" + std::to_string(i) + ":example.com"},
+            {"room_id", roomId},
+            {"sender", "@user" + std::to_string(i % 20) + ":example.com"},
+            {"origin_server_ts", ts},
+            {"content", {{"msgtype", "m.text"}, {"body", "foo"}}},
+        });
+}
+
+/// Events [from, to), with `step` ms between each of them, starting at `start`
+static EventList messageEvents(int from, int to, Timestamp start, Timestamp step)
+{
+    auto events = EventList{};
+    for (auto i = from; i < to; ++i) {
+        events = std::move(events).push_back(messageEvent(i, start + (i - from) * step));
+    }
+    return events;
+}
+
+TEST_CASE("Timeline merge", "[!benchmark][client][room]")
+{
+    for (auto timelineSize : {1000, 10000}) {
+        auto r = RoomModel{};
+        r.roomId = roomId;
+        r = RoomModel::update(std::move(r), AddToTimelineAction{
+                messageEvents(0, timelineSize, 0, 10), std::nullopt, false, std::nullopt});
+
+        // Interleave with the existing timeline, like a back-paginated batch
+        auto batch = messageEvents(timelineSize, timelineSize + 100, 5, timelineSize / 10);
+
+        BENCHMARK("Merge 100 events into a timeline of " + std::to_string(timelineSize)) {
+            return RoomModel::update(r, AddToTimelineAction{batch, std::nullopt, false, std::nullopt});
+        };
+
+        auto events = std::vector<Event>(r.messages.size());
+        std::transform(r.messages.begin(), r.messages.end(), events.begin(),
+                       [](const auto &p) { return p.second; });
+
+        // What the accessors did before the header fields were cached
+        BENCHMARK("Sort keys of " + std::to_string(timelineSize) + " events read from json") {
+            auto keys = std::vector<std::tuple<Timestamp, std::string>>{};
+            keys.reserve(events.size());
+            for (const auto &e : events) {
+                const auto &j = e.originalJson().get();
+                keys.emplace_back(
+                    j.contains("origin_server_ts") ? j.at("origin_server_ts").get<Timestamp>() : 0,
+                    j.contains("event_id") ? j.at("event_id").get<std::string>() : "");
+            }
+            return keys;
+        };
+
+        BENCHMARK("Sort keys of " + std::to_string(timelineSize) + " events from the cached header") {
+            auto keys = std::vector<std::tuple<Timestamp, std::string>>{};
+            keys.reserve(events.size());
+            for (const auto &e : events) {
+                keys.emplace_back(e.originServerTs(), e.id());
+            }
+            return keys;
+        };
+    }
+}
@@ -25,3 +25,36 @@ bool hasAccessToken(const BaseJob &job)
     auto header = job.requestHeader();
     return header->find("Authorization") != header->end();
 }
+
+json signedDeviceKeysJson(Crypto &crypto, std::string userId, std::string deviceId, std::string curve25519Key)
+{
+    using namespace CryptoConstants;
+    auto j = json{
+        {"user_id", userId},
+        {"device_id", deviceId},
+        {"algorithms", {olmAlgo, megOlmAlgo}},
+        {"keys", {
+                {ed25519 + ":" + deviceId, crypto.ed25519IdentityKey()},
+                {curve25519 + ":" + deviceId, curve25519Key},
+            }},
+    };
+    j["signatures"][userId][ed25519 + ":" + deviceId] = crypto.sign(j);
+    return j;
+}
+
+json megOlmEventJson(Crypto &sender, std::string roomId, std::string eventId, std::string body)
+{
+    auto content = sender.encryptMegOlm(json{
+            {"room_id", roomId},
+            {"type", "m.room.message"},
+            {"content", {{"body", body}}},
+        });
+    return json{
+        {"type", "m.room.encrypted"},
+        {"event_id", eventId},
+        {"room_id", roomId},
+        {"sender", "@a:example.com"},
+        {"origin_server_ts", 1000},
+        {"content", content},
+    };
+}
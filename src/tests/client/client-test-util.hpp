@@ -53,3 +53,9 @@ inline auto createTestClientStoreFrom(ClientModel m, SingleTypePromiseInterface<
 }
 
 bool hasAccessToken(const BaseJob &job);
+
+/// @return the device keys of `userId`/`deviceId`, signed by the ed25519 key of `crypto`
+json signedDeviceKeysJson(Crypto &crypto, std::string userId, std::string deviceId, std::string curve25519Key);
+
+/// @return a megolm event in `roomId`, encrypted with the current outbound session of `sender`
+json megOlmEventJson(Crypto &sender, std::string roomId, std::string eventId, std::string body);
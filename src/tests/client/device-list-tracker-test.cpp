@@ -0,0 +1,117 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+
+#include <device-list-tracker.hpp>
+
+#include "client-test-util.hpp"
+
+using namespace Kazv;
+
+using IAr = boost::archive::text_iarchive;
+using OAr = boost::archive::text_oarchive;
+
+static Api::QueryKeysJob::DeviceInformation signedDeviceInfo(
+    Crypto &crypto, std::string userId, std::string deviceId, std::string curve25519Key)
+{
+    return signedDeviceKeysJson(crypto, userId, deviceId, curve25519Key)
+        .get<Api::QueryKeysJob::DeviceInformation>();
+}
+
+TEST_CASE("DeviceListTracker should find devices by their keys", "[client][device-list]")
+{
+    auto alice1 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto alice2 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto bob = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto tracker = DeviceListTracker{};
+    REQUIRE(tracker.addDevice("@alice:example.org", "A1",
+            signedDeviceInfo(alice1, "@alice:example.org", "A1", alice1.curve25519IdentityKey()), alice1));
+    REQUIRE(tracker.addDevice("@alice:example.org", "A2",
+            signedDeviceInfo(alice2, "@alice:example.org", "A2", alice2.curve25519IdentityKey()), alice2));
+    REQUIRE(tracker.addDevice("@bob:example.org", "B1",
+            signedDeviceInfo(bob, "@bob:example.org", "B1", bob.curve25519IdentityKey()), bob));
+
+    auto byCurve = tracker.findByCurve25519Key("@alice:example.org", alice2.curve25519IdentityKey());
+    REQUIRE(byCurve);
+    REQUIRE(byCurve->deviceId == "A2");
+
+    auto byEd = tracker.findByEd25519Key("@alice:example.org", alice1.ed25519IdentityKey());
+    REQUIRE(byEd);
+    REQUIRE(byEd->deviceId == "A1");
+
+    // Keys are only found among the devices of the given user
+    REQUIRE(! tracker.findByCurve25519Key("@bob:example.org", alice1.curve25519IdentityKey()));
+    REQUIRE(! tracker.findByEd25519Key("@carol:example.org", bob.ed25519IdentityKey()));
+
+    WHEN("the curve25519 key of a device changes")
+    {
+        REQUIRE(tracker.addDevice("@alice:example.org", "A1",
+                signedDeviceInfo(alice1, "@alice:example.org", "A1", "newCurve25519Key"), alice1));
+
+        THEN("it should be found by the new key only")
+        {
+            REQUIRE(! tracker.findByCurve25519Key("@alice:example.org", alice1.curve25519IdentityKey()));
+            auto info = tracker.findByCurve25519Key("@alice:example.org", "newCurve25519Key");
+            REQUIRE(info);
+            REQUIRE(info->deviceId == "A1");
+        }
+    }
+
+    WHEN("the tracker is serialized")
+    {
+        auto loaded = DeviceListTracker{};
+        std::stringstream stream;
+        {
+            auto ar = OAr(stream);
+            ar << tracker;
+        }
+        {
+            auto ar = IAr(stream);
+            ar >> loaded;
+        }
+
+        THEN("the key indexes should be rebuilt")
+        {
+            REQUIRE(loaded.ed25519KeyOwners == tracker.ed25519KeyOwners);
+            REQUIRE(loaded.curve25519KeyOwners == tracker.curve25519KeyOwners);
+        }
+    }
+}
+
+TEST_CASE("DeviceListTracker should record the users whose devices changed", "[client][device-list]")
+{
+    auto alice = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto bob = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto tracker = DeviceListTracker{};
+    REQUIRE(tracker.takeChangedUsers().empty());
+
+    tracker.addDevice("@alice:example.org", "A1",
+        signedDeviceInfo(alice, "@alice:example.org", "A1", alice.curve25519IdentityKey()), alice);
+    tracker.addDevice("@bob:example.org", "B1",
+        signedDeviceInfo(bob, "@bob:example.org", "B1", bob.curve25519IdentityKey()), bob);
+
+    auto changed = tracker.takeChangedUsers();
+    REQUIRE(changed == immer::set<std::string>{}.insert("@alice:example.org").insert("@bob:example.org"));
+    REQUIRE(tracker.takeChangedUsers().empty());
+
+    // Adding the same device again changes nothing
+    tracker.addDevice("@alice:example.org", "A1",
+        signedDeviceInfo(alice, "@alice:example.org", "A1", alice.curve25519IdentityKey()), alice);
+    REQUIRE(tracker.takeChangedUsers().empty());
+
+    tracker.addDevice("@alice:example.org", "A1",
+        signedDeviceInfo(alice, "@alice:example.org", "A1", "newCurve25519Key"), alice);
+    REQUIRE(tracker.takeChangedUsers() == immer::set<std::string>{}.insert("@alice:example.org"));
+}
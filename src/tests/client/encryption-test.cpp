@@ -0,0 +1,677 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <algorithm>
+
+#include <catch2/catch.hpp>
+#include <boost/asio.hpp>
+
+#include <lager/event_loop/boost_asio.hpp>
+
+#include <asio-promise-handler.hpp>
+#include <crypto.hpp>
+#include <sdk.hpp>
+#include <lagerstoreeventemitter.hpp>
+
+#include "client-test-util.hpp"
+
+using namespace Kazv::CryptoConstants;
+
+static const std::string roomId = "!encrypted:example.com";
+static const std::string senderKey = "aliceCurve25519Key";
+
+static json encryptedEventJson(std::string eventId, std::string sessionId, Timestamp ts)
+{
+    return json{
+        {"type", "m.room.encrypted"},
+        {"event_id", eventId},
+        {"sender", "@alice:example.com"},
+        {"origin_server_ts", ts},
+        {"content", {
+                {"algorithm", megOlmAlgo},
+                {"sender_key", senderKey},
+                {"session_id", sessionId},
+                {"device_id", "ALICEDEVICE"},
+                {"ciphertext", "AwgAEnACgAkLmt6qF84IK++J7UDH2Za1YVchHyprqTqsg2yyOwAtHaZTwyNg37afzg8f3r9IsN9r4RNFg7MaZencUJe4qvELiDiopUjy5wYVDAtqdBzer5bWRD9ldxp1FLgbQvBcjkkywYjCsmsq6+hArLd9oAQZnGKn/qLsK+5uNX3PaWzDRC9wZPQvWYYPCTov3jCwXKTPsLKIiTrcCXDqMvnn8m+T3zF/I2zqxg158tnUwWWIw51UO"},
+            }},
+    };
+}
+
+static json syncWithEncryptedRoom(json timelineEvents)
+{
+    return json{
+        {"next_batch", "s1"},
+        {"rooms", {
+                {"join", {
+                        {roomId, {
+                                {"state", {
+                                        {"events", json::array({
+                                                    {
+                                                        {"type", "m.room.encryption"},
+                                                        {"state_key", ""},
+                                                        {"event_id", "$encryption"},
+                                                        {"sender", "@alice:example.com"},
+                                                        {"origin_server_ts", 1},
+                                                        {"content", {{"algorithm", megOlmAlgo}}},
+                                                    },
+                                                })},
+                                    }},
+                                {"timeline", {
+                                        {"events", timelineEvents},
+                                        {"limited", false},
+                                        {"prev_batch", "p1"},
+                                    }},
+                            }},
+                    }},
+            }},
+    };
+}
+
+static ClientModel createEncryptedTestClientModel()
+{
+    auto m = createTestClientModel();
+    m.crypto = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    return m;
+}
+
+TEST_CASE("Undecryptable events should be indexed by their megolm session", "[client][encryption]")
+{
+    auto m = createEncryptedTestClientModel();
+
+    auto initialResp = createResponse(
+        "Sync",
+        syncWithEncryptedRoom(json::array({
+                    encryptedEventJson("$1", "sessionA", 1000),
+                    encryptedEventJson("$2", "sessionA", 2000),
+                    encryptedEventJson("$3", "sessionB", 3000),
+                })),
+        json{{"is", "initial"}});
+
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{initialResp});
+
+    auto keyA = KeyOfGroupSession{roomId, senderKey, "sessionA"};
+    auto keyB = KeyOfGroupSession{roomId, senderKey, "sessionB"};
+
+    REQUIRE(m.undecryptedEvents.size() == 2);
+    REQUIRE(m.undecryptedEvents[keyA] == immer::set<std::string>{}.insert("$1").insert("$2"));
+    REQUIRE(m.undecryptedEvents[keyB] == immer::set<std::string>{}.insert("$3"));
+
+    auto incrementalResp = createResponse(
+        "Sync",
+        syncWithEncryptedRoom(json::array({
+                    encryptedEventJson("$4", "sessionA", 4000),
+                })),
+        json{{"is", "incremental"}});
+
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{incrementalResp});
+
+    REQUIRE(m.undecryptedEvents.size() == 2);
+    REQUIRE(m.undecryptedEvents[keyA].size() == 3);
+    REQUIRE(m.undecryptedEvents[keyA].count("$4"));
+    REQUIRE(m.roomList[roomId].messages["$4"].encrypted());
+    REQUIRE(! m.roomList[roomId].messages["$4"].decrypted());
+}
+
+TEST_CASE("Undecryptable events should be indexed when a room appears in several sections", "[client][encryption]")
+{
+    auto m = createEncryptedTestClientModel();
+
+    auto responseJson = syncWithEncryptedRoom(json::array({
+                encryptedEventJson("$1", "sessionA", 1000),
+            }));
+    responseJson["rooms"]["leave"][roomId] = json{
+        {"timeline", {
+                {"events", json::array({encryptedEventJson("$2", "sessionA", 2000)})},
+                {"limited", false},
+            }},
+    };
+
+    auto streaming = GENERATE(false, true);
+    auto numThreads = GENERATE(1, 4);
+    std::tie(m, std::ignore) = ClientModel::update(m, SetSyncThreadsAction{numThreads});
+    auto resp = streaming
+        ? createResponse("Sync", responseJson.dump(), json{{"is", "initial"}})
+        : createResponse("Sync", responseJson, json{{"is", "initial"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto keyA = KeyOfGroupSession{roomId, senderKey, "sessionA"};
+    REQUIRE(m.undecryptedEvents[keyA] == immer::set<std::string>{}.insert("$1").insert("$2"));
+}
+
+TEST_CASE("Undecryptable paginated events should be indexed", "[client][encryption]")
+{
+    auto m = createEncryptedTestClientModel();
+
+    auto initialResp = createResponse(
+        "Sync",
+        syncWithEncryptedRoom(json::array({
+                    encryptedEventJson("$2", "sessionA", 2000),
+                })),
+        json{{"is", "initial"}});
+
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{initialResp});
+
+    auto paginated = encryptedEventJson("$1", "sessionB", 1000);
+    paginated["room_id"] = roomId;
+
+    auto paginateResp = createResponse(
+        "GetRoomEvents",
+        json{
+            {"start", "p1"},
+            {"end", "p0"},
+            {"chunk", json::array({paginated})},
+        },
+        json{{"roomId", roomId}, {"gapEventId", "$2"}});
+
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{paginateResp});
+
+    auto keyB = KeyOfGroupSession{roomId, senderKey, "sessionB"};
+    REQUIRE(m.undecryptedEvents[keyB] == immer::set<std::string>{}.insert("$1"));
+}
+
+static Event memberEvent(std::string userId, std::string membership)
+{
+    return Event(json{
+            {"type", "m.room.member"},
+            {"state_key", userId},
+            {"event_id", "$member-" + userId + "-" + membership},
+            {"sender", userId},
+            {"origin_server_ts", 1},
+            {"content", {{"membership", membership}}},
+        });
+}
+
+static ClientModel withAliceDevices(ClientModel m, immer::flex_vector<std::pair<std::string, Crypto *>> devices)
+{
+    auto deviceKeys = json::object();
+    for (auto [deviceId, crypto] : devices) {
+        deviceKeys[deviceId] = signedDeviceKeysJson(
+            *crypto, "@alice:example.com", deviceId, crypto->curve25519IdentityKey());
+    }
+    m.deviceLists.track(immer::flex_vector<std::string>{"@alice:example.com"});
+    auto resp = createResponse("QueryKeys", json{{"device_keys", {{"@alice:example.com", deviceKeys}}}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+    return m;
+}
+
+static std::string sessionIdOf(const Event &e)
+{
+    return e.originalJson().get().at("content").at("session_id");
+}
+
+TEST_CASE("Megolm session keys should be shared with new devices and rotated when devices leave", "[client][encryption]")
+{
+    auto alice1 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto alice2 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto m = createEncryptedTestClientModel();
+    m.roomList = RoomListModel::update(m.roomList, UpdateRoomAction{roomId, AddStateEventsAction{{
+                    Event(json{
+                            {"type", "m.room.encryption"},
+                            {"state_key", ""},
+                            {"event_id", "$encryption"},
+                            {"sender", "@alice:example.com"},
+                            {"origin_server_ts", 1},
+                            {"content", {{"algorithm", megOlmAlgo}}},
+                        }),
+                    memberEvent("@alice:example.com", "join"),
+                }}});
+    m = withAliceDevices(std::move(m), {{"A1", &alice1}});
+
+    auto message = Event(json{{"type", "m.room.message"}, {"content", {{"body", "foo"}}}});
+    auto encrypt = [&] {
+        return m.megOlmEncrypt(message, roomId, 0, genRandomData(EncryptMegOlmEventAction::maxRandomSize()));
+    };
+    auto recordRecipients = [&](std::string sessionId) {
+        auto devices = m.devicesMissingSessionKey(roomId);
+        std::tie(m, std::ignore) = ClientModel::update(m, AddSessionKeyRecipientsAction{roomId, sessionId, devices});
+    };
+
+    // The first session is sent to all devices
+    auto [first, firstKey] = encrypt();
+    REQUIRE(firstKey.has_value());
+    REQUIRE(m.devicesMissingSessionKey(roomId)
+        == ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A1"}));
+    recordRecipients(sessionIdOf(first));
+    REQUIRE(m.devicesMissingSessionKey(roomId).empty());
+
+    auto [second, secondKey] = encrypt();
+    REQUIRE(! secondKey.has_value());
+    REQUIRE(sessionIdOf(second) == sessionIdOf(first));
+
+    WHEN("a device is added")
+    {
+        m = withAliceDevices(std::move(m), {{"A1", &alice1}, {"A2", &alice2}});
+
+        THEN("the session should be shared with the new device only")
+        {
+            auto [third, thirdKey] = encrypt();
+            REQUIRE(thirdKey.has_value());
+            REQUIRE(sessionIdOf(third) == sessionIdOf(first));
+            REQUIRE(m.devicesMissingSessionKey(roomId)
+                == ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A2"}));
+
+            // The new device can decrypt the event encrypted along with the key
+            alice2.createInboundGroupSession(
+                KeyOfGroupSession{roomId, m.crypto.value().curve25519IdentityKey(), sessionIdOf(third)},
+                thirdKey.value(), m.crypto.value().ed25519IdentityKey());
+            auto thirdJson = third.originalJson().get();
+            thirdJson["event_id"] = "$third";
+            thirdJson["origin_server_ts"] = 2;
+            REQUIRE(alice2.decrypt(thirdJson));
+        }
+    }
+
+    WHEN("a device that has the key is removed")
+    {
+        m = withAliceDevices(std::move(m), {{"A2", &alice2}});
+
+        THEN("the session should be rotated")
+        {
+            auto [third, thirdKey] = encrypt();
+            REQUIRE(thirdKey.has_value());
+            REQUIRE(sessionIdOf(third) != sessionIdOf(first));
+            REQUIRE(m.devicesMissingSessionKey(roomId)
+                == ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A2"}));
+        }
+    }
+
+    WHEN("a member that has the key leaves")
+    {
+        m.roomList = RoomListModel::update(m.roomList, UpdateRoomAction{roomId, AddStateEventsAction{{
+                        memberEvent("@alice:example.com", "leave"),
+                    }}});
+
+        THEN("the session should be rotated")
+        {
+            auto [third, thirdKey] = encrypt();
+            REQUIRE(thirdKey.has_value());
+            REQUIRE(sessionIdOf(third) != sessionIdOf(first));
+            REQUIRE(m.devicesMissingSessionKey(roomId).empty());
+        }
+    }
+
+    WHEN("the key is recorded for a session that is no longer current")
+    {
+        std::tie(m, std::ignore) = ClientModel::update(m, AddSessionKeyRecipientsAction{
+                roomId, "someOtherSession", ClientModel::UserIdToDeviceIdMap{}.set("@bob:example.com", {"exampledevice"})});
+
+        THEN("it should be ignored")
+        {
+            REQUIRE(! m.roomList[roomId].sessionKeyRecipients.find("@bob:example.com"));
+        }
+    }
+}
+
+TEST_CASE("Megolm sessions should be rotated and shared before encrypting with PrepareMegOlmSessionAction", "[client][encryption]")
+{
+    auto alice1 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto m = createEncryptedTestClientModel();
+    m.roomList = RoomListModel::update(m.roomList, UpdateRoomAction{roomId, AddStateEventsAction{{
+                    Event(json{
+                            {"type", "m.room.encryption"},
+                            {"state_key", ""},
+                            {"event_id", "$encryption"},
+                            {"sender", "@alice:example.com"},
+                            {"origin_server_ts", 1},
+                            {"content", {{"algorithm", megOlmAlgo}}},
+                        }),
+                    memberEvent("@alice:example.com", "join"),
+                }}});
+    m = withAliceDevices(std::move(m), {{"A1", &alice1}});
+
+    auto prepare = [&] {
+        return m.prepareMegOlmSession(roomId, 0, genRandomData(PrepareMegOlmSessionAction::maxRandomSize()));
+    };
+
+    auto key = prepare();
+    REQUIRE(key.has_value());
+    auto sessionId = m.roomList[roomId].outboundSessionId;
+    REQUIRE(sessionId == m.crypto.value().outboundGroupSessionId(roomId));
+
+    auto devices = m.devicesMissingSessionKey(roomId);
+    REQUIRE(devices == ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A1"}));
+    std::tie(m, std::ignore) = ClientModel::update(m, AddSessionKeyRecipientsAction{roomId, sessionId, devices});
+
+    // Nothing is left to do
+    REQUIRE(! prepare().has_value());
+
+    auto message = Event(json{{"type", "m.room.message"}, {"content", {{"body", "foo"}}}});
+    auto [encrypted, encryptedKey] = m.megOlmEncrypt(
+        message, roomId, 0, genRandomData(EncryptMegOlmEventAction::maxRandomSize()));
+    REQUIRE(! encryptedKey.has_value());
+    REQUIRE(sessionIdOf(encrypted) == sessionId);
+
+    // The device that got the key ahead of time can decrypt the event
+    alice1.createInboundGroupSession(
+        KeyOfGroupSession{roomId, m.crypto.value().curve25519IdentityKey(), sessionId},
+        key.value(), m.crypto.value().ed25519IdentityKey());
+    auto encryptedJson = encrypted.originalJson().get();
+    encryptedJson["event_id"] = "$encrypted";
+    encryptedJson["origin_server_ts"] = 2;
+    REQUIRE(alice1.decrypt(encryptedJson));
+}
+
+TEST_CASE("Megolm session keys being shared should not be shared again until the sharing finishes", "[client][encryption]")
+{
+    auto alice1 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto alice2 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto m = createEncryptedTestClientModel();
+    m.roomList = RoomListModel::update(m.roomList, UpdateRoomAction{roomId, AddStateEventsAction{{
+                    Event(json{
+                            {"type", "m.room.encryption"},
+                            {"state_key", ""},
+                            {"event_id", "$encryption"},
+                            {"sender", "@alice:example.com"},
+                            {"origin_server_ts", 1},
+                            {"content", {{"algorithm", megOlmAlgo}}},
+                        }),
+                    memberEvent("@alice:example.com", "join"),
+                }}});
+    m = withAliceDevices(std::move(m), {{"A1", &alice1}});
+
+    auto prepare = [&] {
+        std::tie(m, std::ignore) = ClientModel::update(m, PrepareMegOlmSessionAction{
+                roomId, 0, genRandomData(PrepareMegOlmSessionAction::maxRandomSize())});
+    };
+    auto a1 = ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A1"});
+    auto a2 = ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A2"});
+
+    prepare();
+    auto sessionId = m.roomList[roomId].outboundSessionId;
+    REQUIRE(m.devicesMissingSessionKey(roomId).empty());
+    std::tie(m, std::ignore) = ClientModel::update(m, AddSessionKeyRecipientsAction{roomId, sessionId, a1, a1});
+    REQUIRE(m.roomList[roomId].sessionKeyPendingRecipients.empty());
+
+    m = withAliceDevices(std::move(m), {{"A1", &alice1}, {"A2", &alice2}});
+    REQUIRE(m.roomList[roomId].shouldShareSessionKey);
+
+    prepare();
+    REQUIRE(m.roomList[roomId].outboundSessionId == sessionId);
+    REQUIRE(m.roomList[roomId].sessionKeyPendingRecipients["@alice:example.com"]
+        == immer::set<std::string>{}.insert("A2"));
+    // The preparation does not decide whether the key reaches A2
+    REQUIRE(m.roomList[roomId].shouldShareSessionKey);
+    REQUIRE(m.devicesMissingSessionKey(roomId).empty());
+
+    WHEN("the sharing fails")
+    {
+        std::tie(m, std::ignore) = ClientModel::update(m, AddSessionKeyRecipientsAction{
+                roomId, sessionId, ClientModel::UserIdToDeviceIdMap{}, a2});
+
+        THEN("the key should be shared with the device next time")
+        {
+            REQUIRE(m.roomList[roomId].sessionKeyPendingRecipients.empty());
+            REQUIRE(m.roomList[roomId].shouldShareSessionKey);
+            REQUIRE(m.devicesMissingSessionKey(roomId) == a2);
+
+            prepare();
+            REQUIRE(m.devicesMissingSessionKey(roomId).empty());
+            REQUIRE(m.roomList[roomId].sessionKeyPendingRecipients["@alice:example.com"]
+                == immer::set<std::string>{}.insert("A2"));
+        }
+    }
+
+    WHEN("the sharing succeeds")
+    {
+        std::tie(m, std::ignore) = ClientModel::update(m, AddSessionKeyRecipientsAction{roomId, sessionId, a2, a2});
+
+        THEN("the key should no longer need to be shared")
+        {
+            REQUIRE(m.roomList[roomId].sessionKeyPendingRecipients.empty());
+            REQUIRE(! m.roomList[roomId].shouldShareSessionKey);
+            REQUIRE(m.devicesMissingSessionKey(roomId).empty());
+        }
+    }
+}
+
+namespace
+{
+    /// Records the jobs submitted, and responds to them only when asked to
+    struct RecordingJobHandler : public JobInterface
+    {
+        void async(std::function<void()> func) override { func(); }
+        void setTimeout(std::function<void()>, int, std::optional<std::string>) override {}
+        void setInterval(std::function<void()>, int, std::optional<std::string>) override {}
+        void cancel(std::string) override {}
+        void submit(BaseJob job, std::function<void(Response)> callback) override
+        {
+            jobs.push_back({job, callback});
+        }
+
+        std::size_t count(std::string jobId) const
+        {
+            return std::count_if(jobs.begin(), jobs.end(),
+                [&](const auto &p) { return p.first.jobId() == jobId; });
+        }
+
+        std::vector<std::pair<BaseJob, std::function<void(Response)>>> jobs;
+    };
+}
+
+TEST_CASE("Typing repeatedly should share the megolm session key only once", "[client][encryption]")
+{
+    auto alice1 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto m = createEncryptedTestClientModel();
+    m.roomList = RoomListModel::update(m.roomList, UpdateRoomAction{roomId, AddStateEventsAction{{
+                    Event(json{
+                            {"type", "m.room.encryption"},
+                            {"state_key", ""},
+                            {"event_id", "$encryption"},
+                            {"sender", "@alice:example.com"},
+                            {"origin_server_ts", 1},
+                            {"content", {{"algorithm", megOlmAlgo}}},
+                        }),
+                    memberEvent("@alice:example.com", "join"),
+                }}});
+    m.roomList.rooms = std::move(m.roomList.rooms)
+        .update(roomId, [](auto r) { r.membersFullyLoaded = true; return r; });
+    m = withAliceDevices(std::move(m), {{"A1", &alice1}});
+
+    auto io = boost::asio::io_context{};
+    auto jh = RecordingJobHandler{};
+    auto ee = LagerStoreEventEmitter(lager::with_boost_asio_event_loop{io.get_executor()});
+    auto initModel = SdkModel{};
+    initModel.client = m;
+    auto sdk = makeSdk(initModel, jh, ee, AsioPromiseHandler{io.get_executor()}, zug::identity);
+    auto room = sdk.client().room(roomId);
+
+    room.setTyping(true);
+    io.run();
+    io.restart();
+    room.setTyping(true);
+    io.run();
+    io.restart();
+
+    // The first claim has not returned yet
+    REQUIRE(jh.count("ClaimKeys") == 1);
+
+    WHEN("the sharing fails")
+    {
+        auto [claim, callback] = *std::find_if(jh.jobs.begin(), jh.jobs.end(),
+            [](const auto &p) { return p.first.jobId() == "ClaimKeys"; });
+        auto resp = Response{};
+        resp.statusCode = 500;
+        resp.body = JsonWrap(json{{"errcode", "M_UNKNOWN"}, {"error", "Internal error"}});
+        callback(claim.genResponse(resp));
+        io.run();
+        io.restart();
+
+        THEN("typing again should share it again")
+        {
+            room.setTyping(true);
+            io.run();
+            REQUIRE(jh.count("ClaimKeys") == 2);
+        }
+    }
+}
+
+TEST_CASE("EncryptOlmEventAction should report the devices it encrypts for", "[client][encryption]")
+{
+    auto alice1 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    auto alice2 = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto m = createEncryptedTestClientModel();
+    m = withAliceDevices(std::move(m), {{"A1", &alice1}, {"A2", &alice2}});
+
+    // We only have an olm session with A1
+    alice1.genOneTimeKeysWithRandom(genRandomData(Crypto::genOneTimeKeysRandomSize(1)), 1);
+    auto oneTimeKey = std::string{};
+    for (auto [id, key] : alice1.unpublishedOneTimeKeys()[curve25519].items()) {
+        oneTimeKey = key;
+    }
+    m.crypto.value().createOutboundSessionWithRandom(
+        genRandomData(Crypto::createOutboundSessionRandomSize()), alice1.curve25519IdentityKey(), oneTimeKey);
+
+    auto devices = ClientModel::UserIdToDeviceIdMap{}
+        .set("@alice:example.com", {"A1", "A2"})
+        .set("@bob:example.com", {"B1"});
+    auto keyEvent = Event(json{{"type", "m.room_key"}, {"content", {{"session_id", "foo"}}}});
+
+    boost::asio::io_context io;
+    AsioPromiseHandler ph{io.get_executor()};
+    auto store = createTestClientStoreFrom(m, ph);
+
+    auto called = false;
+    store.dispatch(EncryptOlmEventAction{
+            devices, keyEvent, genRandomData(EncryptOlmEventAction::randomSize(devices))})
+        .then([&](auto status) {
+                  called = true;
+                  REQUIRE(status.success());
+
+                  auto ciphertext = status.dataJson("encrypted")["content"]["ciphertext"];
+                  REQUIRE(ciphertext.size() == 1);
+                  REQUIRE(ciphertext.contains(alice1.curve25519IdentityKey()));
+                  REQUIRE(ClientModel::UserIdToDeviceIdMap(status.dataJson("devices"))
+                      == ClientModel::UserIdToDeviceIdMap{}.set("@alice:example.com", {"A1"}));
+              });
+    io.run();
+    REQUIRE(called);
+}
+
+TEST_CASE("Sending messages with metrics should emit SendMessageMetrics", "[client][encryption]")
+{
+    auto m = createTestClientModel();
+
+    auto metrics = SendMessageMetrics{};
+    metrics.loadMembersUs = 1;
+    metrics.encryptUs = 2;
+    metrics.shareSessionKeyUs = 3;
+    metrics.totalUs = 6;
+    metrics.devicesSentSessionKey = 4;
+
+    auto message = Event(json{{"type", "m.room.encrypted"}, {"content", {{"ciphertext", "foo"}}}});
+    std::tie(m, std::ignore) = ClientModel::update(m, SendMessageAction{roomId, message, metrics});
+    REQUIRE(m.nextJobs.size() == 1);
+
+    auto job = m.nextJobs[0];
+    auto resp = createResponse("SendMessage", json{{"event_id", "$sent"}},
+        json{
+            {"roomId", job.dataStr("roomId")},
+            {"metrics", job.dataJson("metrics")},
+            {"sendStartedUs", job.dataJson("sendStartedUs")},
+        });
+    auto [next, effect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto triggers = next.nextTriggers;
+    REQUIRE(triggers.size() >= 2);
+    REQUIRE(std::holds_alternative<SendMessageSuccessful>(triggers[triggers.size() - 1]));
+    REQUIRE(std::holds_alternative<SendMessageMetrics>(triggers[triggers.size() - 2]));
+
+    auto sent = std::get<SendMessageMetrics>(triggers[triggers.size() - 2]);
+    REQUIRE(sent.roomId == roomId);
+    REQUIRE(sent.eventId == "$sent");
+    REQUIRE(sent.loadMembersUs == 1);
+    REQUIRE(sent.encryptUs == 2);
+    REQUIRE(sent.shareSessionKeyUs == 3);
+    REQUIRE(sent.devicesSentSessionKey == 4);
+    REQUIRE(sent.sendUs >= 0);
+    REQUIRE(sent.totalUs == 6 + sent.sendUs);
+}
+
+TEST_CASE("Undecrypted events should be decrypted when their megolm session arrives", "[client][encryption]")
+{
+    auto alice = Crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    auto m = createEncryptedTestClientModel();
+    m = withAliceDevices(std::move(m), {{"A1", &alice}});
+
+    auto sessionKey = alice.rotateMegOlmSessionWithRandom(
+        genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId);
+    auto eventJson = megOlmEventJson(alice, roomId, "$1", "hello");
+    eventJson["sender"] = "@alice:example.com";
+    eventJson["content"]["device_id"] = "A1";
+    auto sessionId = eventJson["content"]["session_id"].get<std::string>();
+
+    auto initialResp = createResponse("Sync", syncWithEncryptedRoom(json::array({eventJson})), json{{"is", "initial"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{initialResp});
+
+    auto k = KeyOfGroupSession{roomId, alice.curve25519IdentityKey(), sessionId};
+    REQUIRE(! m.roomList[roomId].messages["$1"].decrypted());
+    REQUIRE(m.undecryptedEvents[k] == immer::set<std::string>{}.insert("$1"));
+
+    WHEN("the index is rebuilt, as when loading an older snapshot")
+    {
+        auto index = m.undecryptedEvents;
+        m.undecryptedEvents = {};
+        m.indexUndecryptedEvents();
+        REQUIRE(m.undecryptedEvents == index);
+    }
+
+    // Alice sends us the session key through an olm session
+    auto &bob = m.crypto.value();
+    bob.genOneTimeKeysWithRandom(genRandomData(Crypto::genOneTimeKeysRandomSize(1)), 1);
+    auto oneTimeKey = std::string{};
+    for (auto [id, key] : bob.unpublishedOneTimeKeys()[curve25519].items()) {
+        oneTimeKey = key;
+    }
+    bob.markOneTimeKeysAsPublished();
+    alice.createOutboundSessionWithRandom(
+        genRandomData(Crypto::createOutboundSessionRandomSize()), bob.curve25519IdentityKey(), oneTimeKey);
+
+    auto roomKeyJson = json{
+        {"type", "m.room_key"},
+        {"content", {
+                {"algorithm", megOlmAlgo},
+                {"room_id", roomId},
+                {"session_id", sessionId},
+                {"session_key", sessionKey},
+            }},
+        {"sender", "@alice:example.com"},
+        {"recipient", m.userId},
+        {"recipient_keys", {{ed25519, bob.ed25519IdentityKey()}}},
+        {"keys", {{ed25519, alice.ed25519IdentityKey()}}},
+    };
+    auto toDeviceJson = json{
+        {"type", "m.room.encrypted"},
+        {"sender", "@alice:example.com"},
+        {"content", {
+                {"algorithm", olmAlgo},
+                {"sender_key", alice.curve25519IdentityKey()},
+                {"ciphertext", alice.encryptOlmWithRandom(
+                        genRandomData(Crypto::encryptOlmMaxRandomSize()), roomKeyJson, bob.curve25519IdentityKey())},
+            }},
+    };
+
+    auto resp = createResponse(
+        "Sync",
+        json{
+            {"next_batch", "s2"},
+            {"to_device", {{"events", json::array({toDeviceJson})}}},
+        },
+        json{{"is", "incremental"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto decrypted = m.roomList[roomId].messages["$1"];
+    REQUIRE(decrypted.decrypted());
+    REQUIRE(decrypted.content().get().at("body") == "hello");
+    REQUIRE(m.undecryptedEvents.empty());
+}
@@ -202,3 +202,211 @@ TEST_CASE("Pagination should erase all gaps in (start-of-fetched-batch, orig-gap
     REQUIRE(! timelineGaps.find("$second:example.org"));
     REQUIRE(timelineGaps.at("$first:example.org") == "anotherPrevBatch");
 }
+
+namespace
+{
+    struct MemoryTimelineSpillStore : public TimelineSpillStore
+    {
+        bool push(const std::string &roomId, const SpilledEvents &spilled) override
+        {
+            if (failPushes) {
+                return false;
+            }
+            stacks = std::move(stacks).update(roomId, [&](auto s) { return std::move(s).push_back(spilled); });
+            return true;
+        }
+
+        std::optional<SpilledEvents> pop(const std::string &roomId) override
+        {
+            auto s = stacks[roomId];
+            if (s.empty()) {
+                return std::nullopt;
+            }
+            auto spilled = s.back();
+            stacks = std::move(stacks).set(roomId, s.take(s.size() - 1));
+            return spilled;
+        }
+
+        bool has(const std::string &roomId) const override
+        {
+            return ! stacks[roomId].empty();
+        }
+
+        immer::map<std::string, immer::flex_vector<SpilledEvents>> stacks;
+        bool failPushes{false};
+    };
+
+    json syncWithEvents(int from, int to)
+    {
+        auto events = json::array();
+        for (auto i = from; i < to; ++i) {
+            events.push_back(json{
+                    {"type", "m.room.message"},
+                    {"event_id", "$" + std::to_string(i)},
+                    {"sender", "@example:example.org"},
+                    {"origin_server_ts", i},
+                    {"content", {{"msgtype", "m.text"}, {"body", "foo"}}},
+                });
+        }
+        return json{
+            {"next_batch", "s" + std::to_string(to)},
+            {"rooms", {{"join", {{"!foo:example.org", {{"timeline", {
+                                    {"events", events},
+                                    {"limited", false},
+                                }}}}}}}},
+        };
+    }
+}
+
+TEST_CASE("Timelines should be spilled beyond the window and restored when paginating back", "[client][paginate]")
+{
+    boost::asio::io_context io;
+    AsioPromiseHandler ph{io.get_executor()};
+
+    auto spillStore = std::make_shared<MemoryTimelineSpillStore>();
+    auto m = createTestClientModel();
+    m.timelineWindow = 3;
+    m.timelineSpillStore = spillStore;
+
+    auto store = createTestClientStoreFrom(m, ph);
+    auto roomId = "!foo:example.org"s;
+    auto room = [&] { return store.reader().get().roomList[roomId]; };
+
+    store.dispatch(ProcessResponseAction{createResponse("Sync", syncWithEvents(0, 5), json{{"is", "initial"}})});
+    io.run();
+
+    REQUIRE(room().timeline == immer::flex_vector<std::string>{"$2", "$3", "$4"});
+    REQUIRE(! room().messages.find("$0"));
+    REQUIRE(room().spilledGapEventId == "$2");
+    REQUIRE(room().timelineGaps.at("$2") == "");
+
+    io.restart();
+    store.dispatch(ProcessResponseAction{createResponse("Sync", syncWithEvents(5, 8), json{{"is", "incremental"}})});
+    io.run();
+
+    REQUIRE(room().timeline == immer::flex_vector<std::string>{"$5", "$6", "$7"});
+    REQUIRE(room().spilledGapEventId == "$5");
+    REQUIRE(! room().timelineGaps.count("$2"));
+    REQUIRE(spillStore->stacks[roomId].size() == 2);
+
+    io.restart();
+    store.dispatch(PaginateTimelineAction{roomId, "$5", std::nullopt});
+    io.run();
+
+    REQUIRE(room().timeline == immer::flex_vector<std::string>{"$2", "$3", "$4", "$5", "$6", "$7"});
+    REQUIRE(room().spilledGapEventId == "$2");
+    REQUIRE(room().timelineGaps.at("$2") == "");
+    REQUIRE(! room().timelineGaps.count("$5"));
+
+    io.restart();
+    store.dispatch(PaginateTimelineAction{roomId, "$2", std::nullopt});
+    io.run();
+
+    REQUIRE(room().timeline.size() == 8);
+    REQUIRE(room().spilledGapEventId == "");
+    REQUIRE(room().timelineGaps.empty());
+    REQUIRE(! spillStore->has(roomId));
+    REQUIRE(store.reader().get().nextJobs.empty());
+}
+
+TEST_CASE("Timelines should not be spilled if the events cannot be saved", "[client][paginate]")
+{
+    boost::asio::io_context io;
+    AsioPromiseHandler ph{io.get_executor()};
+
+    auto spillStore = std::make_shared<MemoryTimelineSpillStore>();
+    spillStore->failPushes = true;
+    auto m = createTestClientModel();
+    m.timelineWindow = 3;
+    m.timelineSpillStore = spillStore;
+
+    auto store = createTestClientStoreFrom(m, ph);
+    auto roomId = "!foo:example.org"s;
+    auto room = [&] { return store.reader().get().roomList[roomId]; };
+
+    store.dispatch(ProcessResponseAction{createResponse("Sync", syncWithEvents(0, 5), json{{"is", "initial"}})});
+    io.run();
+
+    REQUIRE(room().timeline.size() == 5);
+    REQUIRE(room().messages.find("$0"));
+    REQUIRE(room().spilledGapEventId == "");
+    REQUIRE(store.reader().get().spillingRoomIds.empty());
+
+    io.restart();
+    spillStore->failPushes = false;
+    store.dispatch(ProcessResponseAction{createResponse("Sync", syncWithEvents(5, 6), json{{"is", "incremental"}})});
+    io.run();
+
+    REQUIRE(room().timeline == immer::flex_vector<std::string>{"$3", "$4", "$5"});
+    REQUIRE(room().spilledGapEventId == "$3");
+    REQUIRE(spillStore->stacks[roomId].size() == 1);
+}
+
+TEST_CASE("Spilling should keep the Gap from the server at the oldest event left", "[client][paginate]")
+{
+    boost::asio::io_context io;
+    AsioPromiseHandler ph{io.get_executor()};
+
+    auto spillStore = std::make_shared<MemoryTimelineSpillStore>();
+    auto m = createTestClientModel();
+    m.timelineWindow = 3;
+    m.timelineSpillStore = spillStore;
+
+    auto store = createTestClientStoreFrom(m, ph);
+    auto roomId = "!foo:example.org"s;
+    auto room = [&] { return store.reader().get().roomList[roomId]; };
+
+    auto limitedSync = syncWithEvents(5, 8);
+    limitedSync["rooms"]["join"][roomId]["timeline"]["limited"] = true;
+    limitedSync["rooms"]["join"][roomId]["timeline"]["prev_batch"] = "prev5";
+
+    store.dispatch(ProcessResponseAction{createResponse("Sync", syncWithEvents(0, 2), json{{"is", "initial"}})});
+    io.run();
+    io.restart();
+    store.dispatch(ProcessResponseAction{createResponse("Sync", limitedSync, json{{"is", "incremental"}})});
+    io.run();
+
+    REQUIRE(room().timeline == immer::flex_vector<std::string>{"$5", "$6", "$7"});
+    REQUIRE(room().spilledGapEventId == "$5");
+    REQUIRE(room().timelineGaps.at("$5") == "prev5");
+
+    io.restart();
+    store.dispatch(PaginateTimelineAction{roomId, "$5", std::nullopt});
+    io.run();
+
+    REQUIRE(room().timeline == immer::flex_vector<std::string>{"$0", "$1", "$5", "$6", "$7"});
+    REQUIRE(room().spilledGapEventId == "");
+    REQUIRE(room().timelineGaps.at("$5") == "prev5");
+}
+
+TEST_CASE("Pagination should fail if the spilled events cannot be read", "[client][paginate]")
+{
+    boost::asio::io_context io;
+    AsioPromiseHandler ph{io.get_executor()};
+
+    auto spillStore = std::make_shared<MemoryTimelineSpillStore>();
+    auto m = createTestClientModel();
+    m.timelineWindow = 3;
+    m.timelineSpillStore = spillStore;
+
+    auto store = createTestClientStoreFrom(m, ph);
+    auto roomId = "!foo:example.org"s;
+    auto room = [&] { return store.reader().get().roomList[roomId]; };
+
+    store.dispatch(ProcessResponseAction{createResponse("Sync", syncWithEvents(0, 5), json{{"is", "initial"}})});
+    io.run();
+    REQUIRE(room().spilledGapEventId == "$2");
+
+    // Lost by the store
+    spillStore->stacks = spillStore->stacks.erase(roomId);
+
+    io.restart();
+    auto before = room();
+    store.dispatch(PaginateTimelineAction{roomId, "$2", std::nullopt});
+    io.run();
+
+    REQUIRE(room() == before);
+    auto triggers = store.reader().get().nextTriggers;
+    REQUIRE(std::any_of(triggers.begin(), triggers.end(),
+                        [](const auto &t) { return std::holds_alternative<PaginateFailed>(t); }));
+}
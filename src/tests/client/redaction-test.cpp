@@ -0,0 +1,144 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <redaction.hpp>
+
+using namespace Kazv;
+
+static Event redaction(std::string redacts)
+{
+    return Event(json{
+            {"type", "m.room.redaction"},
+            {"event_id", "$redaction"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 100},
+            {"redacts", redacts},
+            {"content", {{"reason", "spam"}}},
+        });
+}
+
+static Event stateEvent(std::string type, json content)
+{
+    return Event(json{
+            {"type", type},
+            {"event_id", "$state"},
+            {"room_id", "!foo:example.org"},
+            {"sender", "@a:example.org"},
+            {"state_key", ""},
+            {"origin_server_ts", 10},
+            {"origin", "example.org"},
+            {"content", content},
+        });
+}
+
+TEST_CASE("redactedEventIdOf should support all room versions", "[client][redaction]")
+{
+    REQUIRE(redactedEventIdOf(redaction("$1")) == "$1");
+
+    auto v11 = Event(json{
+            {"type", "m.room.redaction"},
+            {"event_id", "$r"},
+            {"content", {{"redacts", "$2"}}},
+        });
+    REQUIRE(redactedEventIdOf(v11) == "$2");
+    REQUIRE(redactedEventIdOf(stateEvent("m.room.name", {{"name", "foo"}})) == std::nullopt);
+}
+
+TEST_CASE("redactedEventOf should prune messages", "[client][redaction]")
+{
+    auto e = Event(json{
+            {"type", "m.room.message"},
+            {"event_id", "$1"},
+            {"room_id", "!foo:example.org"},
+            {"sender", "@b:example.org"},
+            {"origin_server_ts", 10},
+            {"unsigned", {{"age", 1234}}},
+            {"content", {{"msgtype", "m.image"}, {"body", "secret.png"}, {"url", "mxc://example.org/abc"}}},
+        });
+
+    REQUIRE(! isRedacted(e));
+    auto redacted = redactedEventOf(e, redaction("$1"), "10");
+    REQUIRE(isRedacted(redacted));
+    REQUIRE(redacted.id() == "$1");
+    REQUIRE(redacted.sender() == "@b:example.org");
+    REQUIRE(redacted.originServerTs() == 10);
+    REQUIRE(redacted.type() == "m.room.message");
+    REQUIRE(redacted.content().get() == json::object());
+    REQUIRE(redacted.originalJson().get()["unsigned"] == json{{"redacted_because", redaction("$1").originalJson().get()}});
+}
+
+TEST_CASE("redactedEventOf should follow the room version", "[client][redaction]")
+{
+    auto contentAfter = [](Event e, std::string roomVersion) {
+        return redactedEventOf(e, redaction("$state"), roomVersion).content().get();
+    };
+
+    auto create = stateEvent("m.room.create", {{"creator", "@a:example.org"}, {"room_version", "10"}});
+    REQUIRE(contentAfter(create, "10") == json{{"creator", "@a:example.org"}});
+    REQUIRE(contentAfter(create, "11") == create.content().get());
+
+    auto joinRules = stateEvent("m.room.join_rules", {{"join_rule", "restricted"}, {"allow", json::array()}, {"foo", 1}});
+    REQUIRE(contentAfter(joinRules, "7") == json{{"join_rule", "restricted"}});
+    REQUIRE(contentAfter(joinRules, "8") == json{{"join_rule", "restricted"}, {"allow", json::array()}});
+
+    auto powerLevels = stateEvent("m.room.power_levels", {{"ban", 50}, {"invite", 0}, {"notifications", {{"room", 50}}}});
+    REQUIRE(contentAfter(powerLevels, "10") == json{{"ban", 50}});
+    REQUIRE(contentAfter(powerLevels, "11") == json{{"ban", 50}, {"invite", 0}});
+
+    auto member = stateEvent("m.room.member", {
+            {"membership", "join"},
+            {"displayname", "B"},
+            {"join_authorised_via_users_server", "@a:example.org"},
+        });
+    REQUIRE(contentAfter(member, "8") == json{{"membership", "join"}});
+    REQUIRE(contentAfter(member, "9") == json{
+            {"membership", "join"}, {"join_authorised_via_users_server", "@a:example.org"}});
+
+    auto aliases = stateEvent("m.room.aliases", {{"aliases", {"#foo:example.org"}}});
+    REQUIRE(contentAfter(aliases, "5") == json{{"aliases", {"#foo:example.org"}}});
+    REQUIRE(contentAfter(aliases, "6") == json::object());
+
+    // Unknown versions use the latest algorithm we know
+    REQUIRE(contentAfter(create, "org.example.custom") == create.content().get());
+
+    REQUIRE(redactedEventOf(create, redaction("$state"), "10").originalJson().get().contains("origin"));
+    REQUIRE(! redactedEventOf(create, redaction("$state"), "11").originalJson().get().contains("origin"));
+    REQUIRE(redactedEventOf(create, redaction("$state"), "11").isState());
+}
+
+TEST_CASE("isRedactionAllowed should check the power level of the sender", "[client][redaction]")
+{
+    auto r = redaction("$1");
+    auto create = stateEvent("m.room.create", {{"room_version", "10"}});
+    auto powerLevels = [](json content) {
+        return stateEvent("m.room.power_levels", content);
+    };
+
+    // The sender can always redact their own events
+    REQUIRE(isRedactionAllowed(r, std::string("@a:example.org"), powerLevels({{"redact", 100}}), create));
+
+    // Without power levels, only the creator can redact others' events
+    REQUIRE(isRedactionAllowed(r, std::string("@b:example.org"), Event(), create));
+    REQUIRE(! isRedactionAllowed(r, std::string("@b:example.org"), Event(),
+                                 Event(json{{"type", "m.room.create"}, {"sender", "@c:example.org"}})));
+
+    REQUIRE(isRedactionAllowed(r, std::string("@b:example.org"),
+                               powerLevels({{"users", {{"@a:example.org", 50}}}}), create));
+    REQUIRE(! isRedactionAllowed(r, std::string("@b:example.org"),
+                                 powerLevels({{"users", {{"@a:example.org", 49}}}}), create));
+    REQUIRE(! isRedactionAllowed(r, std::string("@b:example.org"),
+                                 powerLevels({{"users", {{"@a:example.org", 50}}}, {"redact", 51}}), create));
+    REQUIRE(isRedactionAllowed(r, std::string("@b:example.org"),
+                               powerLevels({{"users_default", 10}, {"redact", 10}}), create));
+
+    // If the sender of the event is not known, the power level decides
+    REQUIRE(! isRedactionAllowed(r, std::nullopt, powerLevels(json::object()), create));
+    REQUIRE(isRedactionAllowed(r, std::nullopt, powerLevels({{"users", {{"@a:example.org", 100}}}}), create));
+}
@@ -0,0 +1,163 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+
+#include <relations-index.hpp>
+
+using namespace Kazv;
+
+using IAr = boost::archive::text_iarchive;
+using OAr = boost::archive::text_oarchive;
+
+static Event relatedEvent(std::string id, Timestamp ts, json relatesTo, std::string type = "m.room.message")
+{
+    return Event(json{
+            {"type", type},
+            {"event_id", id},
+            {"room_id", "!foo:example.org"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", ts},
+            {"content", {{"body", "foo"}, {"m.relates_to", relatesTo}}},
+        });
+}
+
+static Event reaction(std::string id, Timestamp ts, std::string parent, std::string key)
+{
+    return relatedEvent(id, ts, {{"rel_type", "m.annotation"}, {"event_id", parent}, {"key", key}}, "m.reaction");
+}
+
+TEST_CASE("relationsOf should read the relation and the reply", "[client][relations]")
+{
+    auto e = relatedEvent("$2", 2, {
+            {"rel_type", "m.thread"},
+            {"event_id", "$root"},
+            {"is_falling_back", true},
+            {"m.in_reply_to", {{"event_id", "$1"}}},
+        });
+    REQUIRE(relationsOf(e) == immer::flex_vector<EventRelation>{
+            {"m.thread", "$root", ""},
+            {"m.in_reply_to", "$1", ""},
+        });
+
+    REQUIRE(relationsOf(reaction("$3", 3, "$1", "👍")) == immer::flex_vector<EventRelation>{
+            {"m.annotation", "$1", "👍"},
+        });
+    REQUIRE(relationsOf(relatedEvent("$4", 4, {{"rel_type", "m.replace"}})).empty());
+}
+
+TEST_CASE("relationsOf should read the unencrypted relation of encrypted events", "[client][relations]")
+{
+    auto e = Event(json{
+            {"type", "m.room.encrypted"},
+            {"event_id", "$2"},
+            {"sender", "@a:example.org"},
+            {"content", {
+                    {"algorithm", "m.megolm.v1.aes-sha2"},
+                    {"ciphertext", "xxx"},
+                    {"m.relates_to", {{"rel_type", "m.replace"}, {"event_id", "$1"}}},
+                }},
+        });
+    REQUIRE(relationsOf(e) == immer::flex_vector<EventRelation>{{"m.replace", "$1", ""}});
+
+    auto decrypted = e.setDecryptedJson(json{
+            {"type", "m.room.message"},
+            {"content", {{"body", "* hi"}}},
+        }, Event::Decrypted);
+    REQUIRE(relationsOf(decrypted) == immer::flex_vector<EventRelation>{{"m.replace", "$1", ""}});
+}
+
+TEST_CASE("RelationsIndex should keep the children sorted and count reactions", "[client][relations]")
+{
+    auto index = RelationsIndex::addEvents(RelationsIndex{}, EventList{
+            relatedEvent("$e2", 20, {{"rel_type", "m.replace"}, {"event_id", "$1"}}),
+            reaction("$r1", 10, "$1", "a"),
+            reaction("$r2", 11, "$1", "b"),
+            reaction("$r3", 12, "$1", "a"),
+        });
+    // Out of order, as from back-pagination
+    index = RelationsIndex::addEvents(std::move(index), EventList{
+            relatedEvent("$e1", 15, {{"rel_type", "m.replace"}, {"event_id", "$1"}}),
+            relatedEvent("$e3", 30, {{"rel_type", "m.replace"}, {"event_id", "$1"}}),
+            reaction("$r1", 10, "$1", "a"),
+        });
+
+    REQUIRE(index.childrenOf("$1", "m.replace") == immer::flex_vector<std::string>{"$e1", "$e2", "$e3"});
+    REQUIRE(index.childrenOf("$1", "m.annotation") == immer::flex_vector<std::string>{"$r1", "$r2", "$r3"});
+    REQUIRE(index.childrenOf("$1", "m.thread").empty());
+    REQUIRE(index.childrenOf("$2", "m.replace").empty());
+    REQUIRE(index.reactionCountsOf("$1") == ReactionCounts{}.set("a", 2).set("b", 1));
+    REQUIRE(index.reactionCountsOf("$2").empty());
+}
+
+TEST_CASE("Removing events should remove their relations from RelationsIndex", "[client][relations]")
+{
+    auto orig = RelationsIndex::addEvents(RelationsIndex{}, EventList{
+            reaction("$r1", 10, "$1", "a"),
+            reaction("$r2", 11, "$1", "b"),
+            relatedEvent("$e1", 15, {{"rel_type", "m.replace"}, {"event_id", "$1"}}),
+        });
+
+    auto index = RelationsIndex::remove(RelationsIndex::remove(orig, "$r2"), "$e1");
+    REQUIRE(index.childrenOf("$1", "m.annotation") == immer::flex_vector<std::string>{"$r1"});
+    REQUIRE(index.childrenOf("$1", "m.replace").empty());
+    REQUIRE(index.reactionCountsOf("$1") == ReactionCounts{}.set("a", 1));
+
+    index = RelationsIndex::remove(std::move(index), "$r1");
+    REQUIRE(index == RelationsIndex{});
+
+    // Removing the parent keeps the relations to it
+    REQUIRE(RelationsIndex::remove(orig, "$1") == orig);
+}
+
+TEST_CASE("RelationsIndex should follow relations changed by decryption", "[client][relations]")
+{
+    auto encrypted = Event(json{
+            {"type", "m.room.encrypted"},
+            {"event_id", "$2"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 2},
+            {"content", {{"algorithm", "m.megolm.v1.aes-sha2"}, {"ciphertext", "xxx"}}},
+        });
+    auto index = RelationsIndex::addEvents(RelationsIndex{}, EventList{encrypted});
+    REQUIRE(index == RelationsIndex{});
+
+    auto decrypted = encrypted.setDecryptedJson(json{
+            {"type", "m.room.message"},
+            {"content", {{"body", "hi"}, {"m.relates_to", {{"m.in_reply_to", {{"event_id", "$1"}}}}}}},
+        }, Event::Decrypted);
+    index = RelationsIndex::addEvents(std::move(index), EventList{decrypted});
+    REQUIRE(index.childrenOf("$1", "m.in_reply_to") == immer::flex_vector<std::string>{"$2"});
+
+    REQUIRE(RelationsIndex::addEvents(index, EventList{decrypted}) == index);
+}
+
+TEST_CASE("Serialize RelationsIndex", "[client][relations][serialization]")
+{
+    auto in = RelationsIndex::addEvents(RelationsIndex{}, EventList{
+            reaction("$r1", 10, "$1", "a"),
+            relatedEvent("$t1", 15, {{"rel_type", "m.thread"}, {"event_id", "$1"}}),
+        });
+    auto out = RelationsIndex{};
+
+    std::stringstream stream;
+    {
+        auto ar = OAr(stream);
+        ar << in;
+    }
+    {
+        auto ar = IAr(stream);
+        ar >> out;
+    }
+
+    REQUIRE(in == out);
+}
@@ -63,3 +63,964 @@ TEST_CASE("Result of Room::toEventLoop() should not vary with the original curso
     REQUIRE(+room.roomId() == "!bar:example.org");
     REQUIRE(+roomInEventLoop.roomId() == "!foo:example.org");
 }
+
+TEST_CASE("UpdateRoomBatchAction should be the same as applying each action in order", "[client][room]")
+{
+    auto roomId = "!foo:example.org"s;
+    auto ev = Event(json{
+            {"type", "m.room.message"},
+            {"event_id", "$1"},
+            {"room_id", roomId},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 1},
+            {"content", {{"msgtype", "m.text"}, {"body", "foo"}}},
+        });
+    auto stateEv = Event(json{
+            {"type", "m.room.encryption"},
+            {"state_key", ""},
+            {"event_id", "$2"},
+            {"room_id", roomId},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 2},
+            {"content", {{"algorithm", "m.megolm.v1.aes-sha2"}}},
+        });
+
+    auto actions = immer::flex_vector<RoomAction>{
+        ChangeMembershipAction{RoomMembership::Join},
+        AddToTimelineAction{EventList{ev}, "prev"s, true, std::nullopt},
+        AddStateEventsAction{EventList{stateEv}},
+        SetLocalDraftAction{"draft"},
+    };
+
+    auto sequential = RoomListModel{};
+    for (auto a : actions) {
+        sequential = RoomListModel::update(std::move(sequential), UpdateRoomAction{roomId, a});
+    }
+
+    auto batched = RoomListModel::update(RoomListModel{}, UpdateRoomBatchAction{roomId, actions});
+
+    REQUIRE(batched == sequential);
+    REQUIRE(batched[roomId].roomId == roomId);
+    REQUIRE(batched[roomId].encrypted);
+    REQUIRE(batched[roomId].timeline == immer::flex_vector<std::string>{"$1"});
+}
+
+static Event memberEvent(std::string roomId, std::string userId, std::string membership)
+{
+    return Event(json{
+            {"type", "m.room.member"},
+            {"state_key", userId},
+            {"event_id", "$" + membership + userId},
+            {"room_id", roomId},
+            {"sender", userId},
+            {"origin_server_ts", 1},
+            {"content", {{"membership", membership}}},
+        });
+}
+
+TEST_CASE("AddStateEventsAction should maintain the memberships", "[client][room]")
+{
+    auto roomId = "!foo:example.org"s;
+    auto r = RoomModel{};
+    r = RoomModel::update(std::move(r), AddStateEventsAction{EventList{
+                memberEvent(roomId, "@a:example.org", "join"),
+                memberEvent(roomId, "@b:example.org", "invite"),
+                memberEvent(roomId, "@c:example.org", "join"),
+                memberEvent(roomId, "@c:example.org", "leave"),
+            }});
+
+    REQUIRE(r.memberships == MembershipMap{}
+            .set("@a:example.org", "join")
+            .set("@b:example.org", "invite")
+            .set("@c:example.org", "leave"));
+    REQUIRE(r.memberships == membershipsFromState(r.stateEvents));
+    REQUIRE(r.hasUser("@a:example.org"));
+    REQUIRE(! r.hasUser("@b:example.org"));
+    REQUIRE(! r.hasUser("@c:example.org"));
+    REQUIRE(! r.hasUser("@d:example.org"));
+    REQUIRE(r.joinedMemberIds() == immer::flex_vector<std::string>{"@a:example.org"});
+}
+
+TEST_CASE("RoomListModel should maintain the rooms each user has joined", "[client][room]")
+{
+    auto l = RoomListModel{};
+    auto join = [&](std::string roomId, std::string userId, std::string membership) {
+                    l = RoomListModel::update(
+                        std::move(l),
+                        UpdateRoomAction{roomId, AddStateEventsAction{EventList{memberEvent(roomId, userId, membership)}}});
+                };
+
+    join("!foo:example.org", "@a:example.org", "join");
+    join("!bar:example.org", "@a:example.org", "join");
+    join("!bar:example.org", "@b:example.org", "invite");
+
+    REQUIRE(l.joinedRoomIdsOf("@a:example.org") == immer::set<std::string>{}
+            .insert("!foo:example.org").insert("!bar:example.org"));
+    REQUIRE(l.joinedRoomIdsOf("@b:example.org").empty());
+
+    join("!bar:example.org", "@b:example.org", "join");
+    join("!foo:example.org", "@a:example.org", "leave");
+
+    REQUIRE(l.joinedRoomIdsOf("@a:example.org") == immer::set<std::string>{}.insert("!bar:example.org"));
+    REQUIRE(l.joinedRoomIdsOf("@b:example.org") == immer::set<std::string>{}.insert("!bar:example.org"));
+    REQUIRE(l.joinedRoomsByUser == RoomListModel::joinedRoomsIndexOf(l.rooms));
+
+    SECTION("setRoom() should keep the index in sync")
+    {
+        auto room = l["!bar:example.org"];
+        room = RoomModel::update(std::move(room), AddStateEventsAction{EventList{
+                    memberEvent("!bar:example.org", "@a:example.org", "leave"),
+                    memberEvent("!bar:example.org", "@b:example.org", "leave"),
+                }});
+        l = RoomListModel::setRoom(std::move(l), std::move(room));
+
+        REQUIRE(l.joinedRoomIdsOf("@a:example.org").empty());
+        REQUIRE(l.joinedRoomsByUser.empty());
+    }
+}
+
+static Event timelineEvent(std::string id, Timestamp ts)
+{
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", id},
+            {"room_id", "!foo:example.org"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", ts},
+            {"content", {{"msgtype", "m.text"}, {"body", "foo"}}},
+        });
+}
+
+TEST_CASE("AddToTimelineAction should keep the timeline sorted with its keys", "[client][room]")
+{
+    auto r = RoomModel{};
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{timelineEvent("$1", 10), timelineEvent("$2", 20), timelineEvent("$3", 30)},
+            std::nullopt, false, std::nullopt});
+
+    // Out of order, interleaved, with a duplicate and a tie
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{timelineEvent("$5", 25), timelineEvent("$4", 5), timelineEvent("$2", 20),
+                      timelineEvent("$0", 20), timelineEvent("$6", 40)},
+            std::nullopt, false, std::nullopt});
+
+    REQUIRE(r.timeline == immer::flex_vector<std::string>{"$4", "$1", "$0", "$2", "$5", "$3", "$6"});
+    REQUIRE(r.timelineTs == immer::flex_vector<Timestamp>{5, 10, 20, 20, 25, 30, 40});
+    REQUIRE(r.timelineTs == timelineTsOf(r.timeline, r.messages));
+}
+
+TEST_CASE("AddToTimelineAction should add an event repeated in one batch once", "[client][room]")
+{
+    auto r = RoomModel::update(RoomModel{}, AddToTimelineAction{
+            EventList{timelineEvent("$1", 10), timelineEvent("$3", 30)},
+            std::nullopt, false, std::nullopt});
+
+    // As when a gappy sync overlaps a pagination
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{timelineEvent("$2", 20), timelineEvent("$4", 40), timelineEvent("$2", 20),
+                      timelineEvent("$1", 10), timelineEvent("$4", 40)},
+            std::nullopt, false, std::nullopt});
+
+    REQUIRE(r.timeline == immer::flex_vector<std::string>{"$1", "$2", "$3", "$4"});
+    REQUIRE(r.timelineTs == immer::flex_vector<Timestamp>{10, 20, 30, 40});
+}
+
+TEST_CASE("Gap removal in AddToTimelineAction should behave as equal_range over the keys", "[client][room]")
+{
+    auto initialEvents = EventList{};
+    for (auto i = 0; i < 10; ++i) {
+        initialEvents = std::move(initialEvents).push_back(timelineEvent("$" + std::to_string(i * 10), i * 10));
+    }
+
+    auto r = RoomModel{};
+    r = RoomModel::update(std::move(r), AddToTimelineAction{initialEvents, std::nullopt, false, std::nullopt});
+    for (auto i = 0; i < 10; ++i) {
+        r.timelineGaps = std::move(r.timelineGaps).set("$" + std::to_string(i * 10), "gap" + std::to_string(i));
+    }
+
+    // Fill the gap before $70, with events older than it
+    auto batch = EventList{timelineEvent("$25", 25), timelineEvent("$35", 35)};
+    auto gapEventId = "$70"s;
+
+    auto expectedGaps = [&](RoomModel room) {
+        auto messages = room.messages;
+        for (auto e : batch) {
+            messages = std::move(messages).set(e.id(), e);
+        }
+        auto timeline = room.timeline;
+        timeline = std::move(timeline).insert(3, "$25").insert(5, "$35");
+        auto key = [=](auto eventId) {
+                       return std::make_tuple(messages[eventId].originServerTs(), eventId);
+                   };
+        auto cmp = [=](auto a, auto b) { return key(a) < key(b); };
+
+        auto gaps = room.timelineGaps.erase(gapEventId);
+        auto thisBatchStart = std::equal_range(timeline.begin(), timeline.end(), batch[0].id(), cmp).first;
+        auto origBatchStart = std::equal_range(thisBatchStart, timeline.end(), gapEventId, cmp).first;
+        std::for_each(thisBatchStart + 1, origBatchStart,
+                      [&](auto eventId) { gaps = std::move(gaps).erase(eventId); });
+        return gaps;
+    };
+
+    auto check = [&](RoomModel room) {
+        auto expected = expectedGaps(room);
+        auto res = RoomModel::update(room, AddToTimelineAction{batch, std::nullopt, false, gapEventId});
+
+        REQUIRE(res.timelineGaps == expected);
+        REQUIRE(res.timelineGaps.count("$0"));
+        REQUIRE(res.timelineGaps.count("$20"));
+        REQUIRE(! res.timelineGaps.count("$30"));
+        REQUIRE(! res.timelineGaps.count("$40"));
+        REQUIRE(! res.timelineGaps.count("$60"));
+        REQUIRE(! res.timelineGaps.count("$70"));
+        REQUIRE(res.timelineGaps.count("$80"));
+    };
+
+    SECTION("with timeline keys")
+    {
+        check(r);
+    }
+
+    SECTION("with a timeline assigned without its keys")
+    {
+        r.timelineTs = {};
+        check(r);
+    }
+}
+
+static EventList timelineEventsOf(RoomModel r)
+{
+    return intoImmer(EventList{}, zug::map([=](auto eventId) { return r.messages[eventId]; }), r.timeline);
+}
+
+TEST_CASE("diffTimeline should describe the changes of the timeline", "[client][room]")
+{
+    auto addToTimeline = [](RoomModel r, EventList events) {
+                             return RoomModel::update(std::move(r), AddToTimelineAction{events, std::nullopt, false, std::nullopt});
+                         };
+    auto r = addToTimeline(RoomModel{}, EventList{timelineEvent("$10", 10), timelineEvent("$20", 20), timelineEvent("$30", 30)});
+
+    SECTION("no changes")
+    {
+        auto res = diffTimeline(r, r);
+        REQUIRE(! res.reset);
+        REQUIRE(res.changes.empty());
+    }
+
+    SECTION("append")
+    {
+        auto next = addToTimeline(r, EventList{timelineEvent("$40", 40), timelineEvent("$50", 50)});
+        auto res = diffTimeline(r, next);
+        REQUIRE(! res.reset);
+        REQUIRE(res.changes == immer::flex_vector<TimelineChange>{
+                {TimelineChange::Append, 3, EventList{timelineEvent("$40", 40), timelineEvent("$50", 50)}},
+            });
+    }
+
+    SECTION("prepend and insert")
+    {
+        auto next = addToTimeline(r, EventList{timelineEvent("$5", 5), timelineEvent("$25", 25)});
+        auto res = diffTimeline(r, next);
+        REQUIRE(! res.reset);
+        REQUIRE(res.changes == immer::flex_vector<TimelineChange>{
+                {TimelineChange::Prepend, 0, EventList{timelineEvent("$5", 5)}},
+                {TimelineChange::Insert, 3, EventList{timelineEvent("$25", 25)}},
+            });
+    }
+
+    SECTION("replace")
+    {
+        auto decrypted = r.messages["$20"].setDecryptedJson(
+            json{{"type", "m.room.message"}, {"content", {{"body", "decrypted"}}}},
+            Event::Decrypted);
+        auto next = r;
+        next.messages = std::move(next.messages).set("$20", decrypted);
+        auto res = diffTimeline(r, next);
+        REQUIRE(! res.reset);
+        REQUIRE(res.changes == immer::flex_vector<TimelineChange>{
+                {TimelineChange::Replace, 1, EventList{decrypted}},
+            });
+    }
+
+    SECTION("remove")
+    {
+        auto next = r;
+        next.timeline = next.timeline.erase(1);
+        next.timelineTs = next.timelineTs.erase(1);
+        next.messages = std::move(next.messages).erase("$20");
+        auto res = diffTimeline(r, next);
+        REQUIRE(! res.reset);
+        REQUIRE(res.changes == immer::flex_vector<TimelineChange>{
+                {TimelineChange::Remove, 1, EventList{timelineEvent("$20", 20)}},
+            });
+    }
+
+    SECTION("applying the changes should give the new timeline")
+    {
+        auto next = addToTimeline(r, EventList{timelineEvent("$1", 1), timelineEvent("$15", 15),
+                                               timelineEvent("$16", 16), timelineEvent("$35", 35)});
+        next.timeline = next.timeline.erase(5);
+        next.timelineTs = next.timelineTs.erase(5);
+        next.messages = std::move(next.messages).erase("$30");
+
+        auto events = timelineEventsOf(r);
+        for (auto change : diffTimeline(r, next).changes) {
+            switch (change.kind) {
+            case TimelineChange::Remove:
+                events = events.take(change.index) + events.drop(change.index + change.events.size());
+                break;
+            case TimelineChange::Replace:
+                events = events.take(change.index) + change.events + events.drop(change.index + change.events.size());
+                break;
+            default:
+                events = events.take(change.index) + change.events + events.drop(change.index);
+            }
+        }
+        REQUIRE(events == timelineEventsOf(next));
+    }
+
+    SECTION("timeline changed without messages")
+    {
+        auto next = r;
+        next.timeline = next.timeline.push_back("$10");
+        auto res = diffTimeline(r, next);
+        REQUIRE(res.reset);
+    }
+}
+
+TEST_CASE("spillTimeline should keep unread and pinned events", "[client][room]")
+{
+    auto events = EventList{};
+    for (auto i = 0; i < 10; ++i) {
+        events = std::move(events).push_back(timelineEvent("$" + std::to_string(i), i));
+    }
+    auto r = RoomModel::update(RoomModel{}, AddToTimelineAction{events, std::nullopt, false, std::nullopt});
+    r.timelineGaps = std::move(r.timelineGaps).set("$1", "gap1").set("$8", "gap8");
+
+    SECTION("within the window")
+    {
+        auto [res, spilled] = spillTimeline(r, 10);
+        REQUIRE(res == r);
+        REQUIRE(spilled.events.empty());
+    }
+
+    SECTION("spill and restore")
+    {
+        r = RoomModel::update(std::move(r), AddStateEventsAction{EventList{Event(json{
+                        {"type", "m.room.pinned_events"},
+                        {"state_key", ""},
+                        {"event_id", "$pinned"},
+                        {"sender", "@a:example.org"},
+                        {"origin_server_ts", 1},
+                        {"content", {{"pinned", {"$0"}}}},
+                    })}});
+        auto [res, spilled] = spillTimeline(r, 2);
+
+        REQUIRE(res.timeline == immer::flex_vector<std::string>{"$8", "$9"});
+        REQUIRE(res.timelineTs == immer::flex_vector<Timestamp>{8, 9});
+        REQUIRE(spilled.events.size() == 8);
+        REQUIRE(res.messages.find("$0"));
+        REQUIRE(! res.messages.find("$1"));
+        REQUIRE(res.spilledGapEventId == "$8");
+        // The Gap from the server is kept
+        REQUIRE(res.timelineGaps == immer::map<std::string, std::string>{}.set("$8", "gap8"));
+        REQUIRE(spilled.gaps == immer::map<std::string, std::string>{}.set("$1", "gap1").set("$8", "gap8"));
+
+        auto restored = restoreSpilledEvents(res, spilled, false, std::string{});
+        REQUIRE(restored.timeline == r.timeline);
+        REQUIRE(restored.timelineTs == r.timelineTs);
+        REQUIRE(restored.messages == r.messages);
+        REQUIRE(restored.timelineGaps == r.timelineGaps);
+        REQUIRE(restored.spilledGapEventId == "");
+    }
+
+    SECTION("unread events")
+    {
+        r = RoomModel::update(std::move(r), AddAccountDataAction{EventList{Event(json{
+                        {"type", "m.fully_read"},
+                        {"content", {{"event_id", "$3"}}},
+                    })}});
+        auto [res, spilled] = spillTimeline(r, 2);
+
+        REQUIRE(res.timeline == immer::flex_vector<std::string>{"$4", "$5", "$6", "$7", "$8", "$9"});
+        REQUIRE(spilled.events.size() == 4);
+    }
+
+    SECTION("without a Gap from the server")
+    {
+        auto [res, spilled] = spillTimeline(r, 5);
+
+        REQUIRE(res.spilledGapEventId == "$5");
+        REQUIRE(res.timelineGaps == immer::map<std::string, std::string>{}.set("$5", "").set("$8", "gap8"));
+    }
+
+    SECTION("timeline changed before the events are dropped")
+    {
+        auto spilled = eventsToSpill(r, 2);
+        REQUIRE(spilled.events.size() == 8);
+
+        auto [res, resSpilled] = spillTimeline(r, 5);
+        REQUIRE(! dropSpilledEvents(res, spilled));
+        REQUIRE(dropSpilledEvents(r, spilled).value() == spillTimeline(r, 2).first);
+    }
+}
+
+static Event stateEvent(std::string type, json content)
+{
+    return Event(json{
+            {"type", type},
+            {"state_key", ""},
+            {"event_id", "$" + type},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 1},
+            {"content", content},
+        });
+}
+
+static Event namedMemberEvent(std::string userId, std::string displayName)
+{
+    return Event(json{
+            {"type", "m.room.member"},
+            {"state_key", userId},
+            {"event_id", "$name" + userId},
+            {"sender", userId},
+            {"origin_server_ts", 1},
+            {"content", {{"membership", "join"}, {"displayname", displayName}}},
+        });
+}
+
+TEST_CASE("The room summary should follow the display name algorithm", "[client][room]")
+{
+    auto roomId = "!foo:example.org"s;
+    auto r = RoomModel::update(RoomModel{}, AddStateEventsAction{EventList{
+                memberEvent(roomId, "@a:example.org", "join"),
+                namedMemberEvent("@b:example.org", "Bob"),
+                memberEvent(roomId, "@c:example.org", "invite"),
+            }});
+
+    SECTION("without heroes")
+    {
+        REQUIRE(r.summary.joinedMemberCount == 2);
+        REQUIRE(r.summary.invitedMemberCount == 1);
+        REQUIRE(! r.summary.memberCountsFromServer);
+        REQUIRE(r.summary.displayName == "Empty Room");
+    }
+
+    SECTION("with heroes")
+    {
+        r = RoomModel::update(std::move(r), UpdateSummaryAction{
+                immer::flex_vector<std::string>{"@b:example.org", "@c:example.org"}, 2, 1});
+        REQUIRE(r.summary.memberCountsFromServer);
+        REQUIRE(r.summary.displayName == "Bob and @c:example.org");
+
+        r = RoomModel::update(std::move(r), UpdateSummaryAction{std::nullopt, 5, std::nullopt});
+        REQUIRE(r.summary.joinedMemberCount == 5);
+        REQUIRE(r.summary.invitedMemberCount == 1);
+        REQUIRE(r.summary.displayName == "Bob, @c:example.org and 3 others");
+
+        r = RoomModel::update(std::move(r), UpdateSummaryAction{std::nullopt, 1, 0});
+        REQUIRE(r.summary.displayName == "Empty Room (was Bob and @c:example.org)");
+    }
+
+    SECTION("member events of heroes should update the name")
+    {
+        r = RoomModel::update(std::move(r), UpdateSummaryAction{
+                immer::flex_vector<std::string>{"@b:example.org"}, 2, 0});
+        REQUIRE(r.summary.displayName == "Bob");
+
+        r = RoomModel::update(std::move(r), AddStateEventsAction{EventList{
+                    namedMemberEvent("@b:example.org", "Robert"),
+                }});
+        REQUIRE(r.summary.displayName == "Robert");
+    }
+
+    SECTION("name and alias")
+    {
+        r = RoomModel::update(std::move(r), AddStateEventsAction{EventList{
+                    stateEvent("m.room.canonical_alias", {{"alias", "#foo:example.org"}}),
+                }});
+        REQUIRE(r.summary.displayName == "#foo:example.org");
+
+        r = RoomModel::update(std::move(r), AddStateEventsAction{EventList{
+                    stateEvent("m.room.name", {{"name", "Foo"}}),
+                    stateEvent("m.room.avatar", {{"url", "mxc://example.org/foo"}}),
+                }});
+        REQUIRE(r.summary.displayName == "Foo");
+        REQUIRE(r.summary.avatarMxcUri == "mxc://example.org/foo");
+    }
+
+    REQUIRE(r.summary == summaryOf(r, r.summary));
+}
+
+TEST_CASE("SetUnreadNotificationCountsAction should only change the given counts", "[client][room]")
+{
+    auto r = RoomModel::update(RoomModel{}, SetUnreadNotificationCountsAction{2, 5});
+    REQUIRE(r.summary.highlightCount == 2);
+    REQUIRE(r.summary.notificationCount == 5);
+
+    r = RoomModel::update(std::move(r), SetUnreadNotificationCountsAction{std::nullopt, 0});
+    REQUIRE(r.summary.highlightCount == 2);
+    REQUIRE(r.summary.notificationCount == 0);
+}
+
+TEST_CASE("RoomListModel should keep the rooms sorted", "[client][room]")
+{
+    auto addEvent = [](std::string roomId, std::string eventId, Timestamp ts) {
+        return UpdateRoomAction{roomId, AddToTimelineAction{
+                EventList{timelineEvent(eventId, ts)}, std::nullopt, false, std::nullopt}};
+    };
+
+    auto l = RoomListModel{};
+    l = RoomListModel::update(std::move(l), addEvent("!a:example.org", "$a1", 10));
+    l = RoomListModel::update(std::move(l), addEvent("!b:example.org", "$b1", 30));
+    l = RoomListModel::update(std::move(l), addEvent("!c:example.org", "$c1", 20));
+    l = RoomListModel::update(std::move(l), UpdateRoomAction{"!d:example.org", ChangeMembershipAction{RoomMembership::Invite}});
+
+    REQUIRE(l.sortedRoomIds(0, 10) == immer::flex_vector<std::string>{
+            "!b:example.org", "!c:example.org", "!a:example.org", "!d:example.org"});
+    REQUIRE(l.sortedRoomIds(1, 2) == immer::flex_vector<std::string>{"!c:example.org", "!a:example.org"});
+    REQUIRE(l.sortedRoomIds(3, 2) == immer::flex_vector<std::string>{"!d:example.org"});
+    REQUIRE(l.sortedRoomIds(5, 2).empty());
+
+    l = RoomListModel::update(std::move(l), addEvent("!a:example.org", "$a2", 40));
+    REQUIRE(l.sortedRoomIds(0, 3) == immer::flex_vector<std::string>{
+            "!a:example.org", "!b:example.org", "!c:example.org"});
+
+    l = RoomListModel::update(std::move(l), UpdateRoomAction{"!c:example.org", SetUnreadNotificationCountsAction{0, 1}});
+    l = RoomListModel::update(std::move(l), UpdateRoomAction{"!d:example.org", AddAccountDataAction{EventList{Event(json{
+                        {"type", "m.tag"},
+                        {"content", {{"tags", {{"m.favourite", {{"order", 0.5}}}}}}},
+                    })}}});
+    REQUIRE(l.sortedRooms == RoomListModel::sortedRoomsOf(l.rooms, l.order));
+
+    l = RoomListModel::update(std::move(l), SetRoomListOrderAction{RoomListOrder{false, true}});
+    REQUIRE(l.sortedRoomIds(0, 10) == immer::flex_vector<std::string>{
+            "!c:example.org", "!a:example.org", "!b:example.org", "!d:example.org"});
+
+    l = RoomListModel::update(std::move(l), SetRoomListOrderAction{RoomListOrder{true, true}});
+    REQUIRE(l.sortedRoomIds(0, 10) == immer::flex_vector<std::string>{
+            "!d:example.org", "!c:example.org", "!a:example.org", "!b:example.org"});
+
+    l = RoomListModel::update(std::move(l), UpdateRoomAction{"!c:example.org", SetUnreadNotificationCountsAction{0, 0}});
+    l = RoomListModel::update(std::move(l), addEvent("!b:example.org", "$b2", 50));
+    REQUIRE(l.sortedRoomIds(0, 10) == immer::flex_vector<std::string>{
+            "!d:example.org", "!b:example.org", "!a:example.org", "!c:example.org"});
+    REQUIRE(l.sortedRooms == RoomListModel::sortedRoomsOf(l.rooms, l.order));
+}
+
+TEST_CASE("Timeline actions should index the messages for search", "[client][room][search]")
+{
+    auto r = RoomModel::update(RoomModel{}, AddToTimelineAction{
+            EventList{timelineEvent("$1", 10), timelineEvent("$2", 20)},
+            std::nullopt, false, std::nullopt});
+    r = RoomModel::update(std::move(r), PrependTimelineAction{
+            EventList{timelineEvent("$0", 5)}, "prev"});
+    r = RoomModel::update(std::move(r), AppendTimelineAction{
+            EventList{timelineEvent("$3", 30)}});
+
+    for (auto id : {"$0", "$1", "$2", "$3"}) {
+        REQUIRE(r.searchIndex.has(id));
+    }
+    REQUIRE(r.searchIndex.search("foo", 10).size() == 4);
+    REQUIRE(searchIndexOf(r).search("foo", 10).size() == 4);
+
+    r.roomId = "!foo:example.org";
+    auto l = RoomListModel::setRoom(RoomListModel{}, r);
+    auto other = r;
+    other.roomId = "!bar:example.org";
+    l = RoomListModel::setRoom(std::move(l), other);
+    auto hits = l.search("foo", 5);
+    REQUIRE(hits.size() == 5);
+    REQUIRE(l.search("bar", 5).empty());
+}
+
+static Event textEvent(std::string id, Timestamp ts, std::string body)
+{
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", id},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", ts},
+            {"content", {{"msgtype", "m.text"}, {"body", body}}},
+        });
+}
+
+TEST_CASE("Searching all rooms should give the best matches of any room", "[client][room][search]")
+{
+    auto l = RoomListModel{};
+    auto expected = std::vector<SearchHit>{};
+    for (auto i = 0; i < 20; ++i) {
+        auto roomId = "!" + std::to_string(i) + ":example.org";
+        auto events = EventList{};
+        for (auto j = 0; j < 10; ++j) {
+            // Rooms differ in how common the term is, and in how
+            // many times a message contains it
+            auto body = std::string("matrix");
+            for (auto k = 0; k < (i * j) % 7; ++k) {
+                body += " matrix";
+            }
+            body += (j % (i % 3 + 1)) ? " bar" : " baz qux";
+            events = std::move(events).push_back(textEvent("$" + std::to_string(i) + "-" + std::to_string(j), j, body));
+        }
+        auto r = RoomModel::update(RoomModel{}, AddToTimelineAction{events, std::nullopt, false, std::nullopt});
+        r.roomId = roomId;
+        l = RoomListModel::setRoom(std::move(l), r);
+
+        for (const auto &res : r.searchIndex.search("matrix baz", 100)) {
+            REQUIRE(res.score <= r.searchIndex.maxScore("matrix baz"));
+            expected.push_back(SearchHit{roomId, res.eventId, res.score});
+        }
+    }
+    std::stable_sort(expected.begin(), expected.end(),
+                     [](const auto &a, const auto &b) { return a.score > b.score; });
+
+    auto limit = GENERATE(1, 5, 30);
+    auto hits = l.search("matrix baz", limit);
+    REQUIRE(hits.size() == std::min<std::size_t>(limit, expected.size()));
+    for (auto i = std::size_t{}; i < hits.size(); ++i) {
+        REQUIRE(hits[i].score == expected[i].score);
+    }
+
+    REQUIRE(l.search("matrix nothing", limit).empty());
+}
+
+TEST_CASE("Search should find events spilled out of memory", "[client][room][search]")
+{
+    auto events = EventList{};
+    for (auto i = 0; i < 10; ++i) {
+        events = std::move(events).push_back(timelineEvent("$" + std::to_string(i), i));
+    }
+    auto r = RoomModel::update(RoomModel{}, AddToTimelineAction{events, std::nullopt, false, std::nullopt});
+    r.roomId = "!foo:example.org";
+
+    auto [spilledRoom, spilled] = spillTimeline(r, 2);
+    REQUIRE(! spilledRoom.messages.find("$0"));
+
+    auto l = RoomListModel::setRoom(RoomListModel{}, spilledRoom);
+    auto hits = l.search("foo", 10);
+    REQUIRE(hits.size() == 10);
+    REQUIRE(std::any_of(hits.begin(), hits.end(), [](const auto &h) { return h.eventId == "$0"; }));
+
+    auto redaction = Event(json{
+            {"type", "m.room.redaction"},
+            {"event_id", "$redact0"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 20},
+            {"redacts", "$0"},
+            {"content", json::object()},
+        });
+    auto redact = [&](RoomModel room) {
+        return RoomModel::update(std::move(room), AddToTimelineAction{
+                EventList{redaction}, std::nullopt, false, std::nullopt});
+    };
+
+    WHEN("a spilled event is redacted by a member who can redact others' events")
+    {
+        auto withPower = RoomModel::update(spilledRoom, AddStateEventsAction{EventList{
+                    stateEvent("m.room.power_levels", {{"users", {{"@a:example.org", 50}}}}),
+                }});
+        l = RoomListModel::setRoom(std::move(l), redact(withPower));
+
+        THEN("it should no longer be found")
+        {
+            auto hits = l.search("foo", 10);
+            REQUIRE(hits.size() == 9);
+            REQUIRE(std::none_of(hits.begin(), hits.end(), [](const auto &h) { return h.eventId == "$0"; }));
+        }
+    }
+
+    WHEN("a spilled event is redacted by a member who cannot redact others' events")
+    {
+        l = RoomListModel::setRoom(std::move(l), redact(spilledRoom));
+
+        THEN("it should still be found, since its sender is not known")
+        {
+            REQUIRE(l.search("foo", 10).size() == 10);
+        }
+    }
+}
+
+TEST_CASE("Timeline actions should index the relations of events", "[client][room][relations]")
+{
+    auto edit = [](std::string id, Timestamp ts, std::string sender) {
+        return Event(json{
+                {"type", "m.room.message"},
+                {"event_id", id},
+                {"sender", sender},
+                {"origin_server_ts", ts},
+                {"content", {
+                        {"body", "* bar"},
+                        {"m.new_content", {{"body", "bar"}}},
+                        {"m.relates_to", {{"rel_type", "m.replace"}, {"event_id", "$1"}}},
+                    }},
+            });
+    };
+    auto threadReply = [](std::string id, Timestamp ts) {
+        return Event(json{
+                {"type", "m.room.message"},
+                {"event_id", id},
+                {"sender", "@b:example.org"},
+                {"origin_server_ts", ts},
+                {"content", {
+                        {"body", "reply"},
+                        {"m.relates_to", {{"rel_type", "m.thread"}, {"event_id", "$1"}}},
+                    }},
+            });
+    };
+
+    auto r = RoomModel::update(RoomModel{}, AddToTimelineAction{
+            EventList{timelineEvent("$1", 10), edit("$e1", 20, "@a:example.org"), threadReply("$t2", 40)},
+            std::nullopt, false, std::nullopt});
+    r = RoomModel::update(std::move(r), AppendTimelineAction{
+            EventList{edit("$e2", 50, "@b:example.org"), threadReply("$t1", 30)}});
+
+    REQUIRE(latestEditOf(r.relations, r.messages, "$1").value().id() == "$e1");
+    auto thread = threadOf(r.relations, r.messages, "$1");
+    REQUIRE(thread.size() == 2);
+    REQUIRE(thread[0].id() == "$t1");
+    REQUIRE(thread[1].id() == "$t2");
+    REQUIRE(r.relations == relationsIndexOf(r));
+
+    r = RoomModel::update(std::move(r), AppendTimelineAction{EventList{Event(json{
+                        {"type", "m.room.redaction"},
+                        {"event_id", "$x"},
+                        {"sender", "@a:example.org"},
+                        {"origin_server_ts", 60},
+                        {"redacts", "$e1"},
+                        {"content", json::object()},
+                    })}});
+    REQUIRE(latestEditOf(r.relations, r.messages, "$1") == std::nullopt);
+}
+
+TEST_CASE("Redactions should prune the events they redact", "[client][room][redaction]")
+{
+    auto member = namedMemberEvent("@b:example.org", "Bob");
+    auto r = RoomModel::update(RoomModel{}, AddStateEventsAction{EventList{
+                stateEvent("m.room.create", {{"room_version", "10"}}),
+                member,
+            }});
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{member, timelineEvent("$1", 10), timelineEvent("$2", 20)},
+            std::nullopt, false, std::nullopt});
+    r = RoomModel::update(std::move(r), UpdateSummaryAction{
+            immer::flex_vector<std::string>{"@b:example.org"}, 2, 0});
+    REQUIRE(r.summary.displayName == "Bob");
+
+    auto redaction = [](std::string id, std::string redacts) {
+        return Event(json{
+                {"type", "m.room.redaction"},
+                {"event_id", id},
+                {"sender", "@a:example.org"},
+                {"origin_server_ts", 30},
+                {"redacts", redacts},
+                {"content", json::object()},
+            });
+    };
+
+    auto next = RoomModel::update(r, AppendTimelineAction{EventList{redaction("$x1", "$1")}});
+    REQUIRE(isRedacted(next.messages["$1"]));
+    REQUIRE(next.messages["$1"].content().get() == json::object());
+    REQUIRE(! next.searchIndex.has("$1"));
+    REQUIRE(next.searchIndex.has("$2"));
+    REQUIRE(diffTimeline(r, next) == TimelineDiff{false, {
+                {TimelineChange::Append, 3, EventList{redaction("$x1", "$1")}},
+                {TimelineChange::Replace, 1, EventList{next.messages["$1"]}},
+            }});
+
+    // Redacting again does not change anything
+    auto again = RoomModel::update(next, AppendTimelineAction{EventList{redaction("$x2", "$1")}});
+    REQUIRE(again.messages["$1"] == next.messages["$1"]);
+
+    next = RoomModel::update(std::move(next), AppendTimelineAction{
+            EventList{redaction("$x3", member.id())}});
+    auto k = KeyOfState{"m.room.member", "@b:example.org"};
+    REQUIRE(next.stateEvents[k].content().get() == json{{"membership", "join"}});
+    REQUIRE(next.memberships["@b:example.org"] == "join");
+    REQUIRE(next.summary.displayName == "@b:example.org");
+}
+
+TEST_CASE("Redactions by members who cannot redact others' events should be ignored", "[client][room][redaction]")
+{
+    auto reaction = Event(json{
+            {"type", "m.reaction"},
+            {"event_id", "$r1"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 20},
+            {"content", {{"m.relates_to", {{"rel_type", "m.annotation"}, {"event_id", "$1"}, {"key", "a"}}}}},
+        });
+    auto r = RoomModel::update(RoomModel{}, AddStateEventsAction{EventList{
+                stateEvent("m.room.create", {{"room_version", "10"}}),
+            }});
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{timelineEvent("$1", 10), reaction}, std::nullopt, false, std::nullopt});
+
+    auto redaction = [](std::string id, std::string redacts, std::string sender) {
+        return Event(json{
+                {"type", "m.room.redaction"},
+                {"event_id", id},
+                {"sender", sender},
+                {"origin_server_ts", 30},
+                {"redacts", redacts},
+                {"content", json::object()},
+            });
+    };
+    auto redacted = [](const RoomModel &room, std::string id) {
+        return isRedacted(room.messages[id]);
+    };
+
+    auto powerLevels = GENERATE(
+        std::optional<json>{},
+        std::optional<json>(json{{"users", {{"@a:example.org", 100}, {"@b:example.org", 49}}}}));
+    if (powerLevels) {
+        r = RoomModel::update(std::move(r), AddStateEventsAction{EventList{
+                    stateEvent("m.room.power_levels", powerLevels.value()),
+                }});
+    }
+
+    auto next = RoomModel::update(r, AppendTimelineAction{EventList{
+                redaction("$x1", "$1", "@b:example.org"),
+                redaction("$x2", "$r1", "@b:example.org"),
+            }});
+    REQUIRE(! redacted(next, "$1"));
+    REQUIRE(! redacted(next, "$r1"));
+    REQUIRE(next.searchIndex.has("$1"));
+    REQUIRE(next.relations.reactionCountsOf("$1") == ReactionCounts{}.set("a", 1));
+    REQUIRE(next.relations == relationsIndexOf(next));
+
+    // Members can redact their own events
+    next = RoomModel::update(std::move(next), AppendTimelineAction{EventList{
+                redaction("$x3", "$r1", "@a:example.org"),
+            }});
+    REQUIRE(redacted(next, "$r1"));
+    REQUIRE(next.relations.reactionCountsOf("$1").empty());
+}
+
+static Event receiptEvent(json content)
+{
+    return Event(json{
+            {"type", "m.receipt"},
+            {"content", content},
+        });
+}
+
+TEST_CASE("AddEphemeralAction should merge read receipts", "[client][room][receipts]")
+{
+    auto r = RoomModel::update(RoomModel{}, AddEphemeralAction{EventList{receiptEvent({
+                    {"$1", {{"m.read", {
+                                    {"@a:example.org", {{"ts", 10}}},
+                                    {"@b:example.org", {{"ts", 11}}},
+                                }}}},
+                    {"$2", {{"m.read.private", {{"@c:example.org", {{"ts", 12}}}}}}},
+                })}});
+
+    REQUIRE(r.readReceipts["@a:example.org"] == ReadReceipt{"$1", 10});
+    REQUIRE(r.readReceipts["@c:example.org"] == ReadReceipt{"$2", 12});
+    REQUIRE(r.eventReaders["$1"] == immer::set<std::string>{}.insert("@a:example.org").insert("@b:example.org"));
+
+    // Only the receipt of @a moves; the others are kept
+    r = RoomModel::update(std::move(r), AddEphemeralAction{EventList{receiptEvent({
+                    {"$3", {{"m.read", {{"@a:example.org", {{"ts", 20}}}}}}},
+                    {"$4", {{"m.read", {{"@b:example.org", {{"ts", 21}, {"thread_id", "$thread"}}}}}}},
+                })}});
+    REQUIRE(r.readReceipts["@a:example.org"] == ReadReceipt{"$3", 20});
+    REQUIRE(r.readReceipts["@b:example.org"] == ReadReceipt{"$1", 11});
+    REQUIRE(r.eventReaders["$1"] == immer::set<std::string>{}.insert("@b:example.org"));
+    REQUIRE(r.eventReaders["$3"] == immer::set<std::string>{}.insert("@a:example.org"));
+    REQUIRE(! r.eventReaders.find("$4"));
+
+    // Earlier receipts do not replace later ones
+    auto again = RoomModel::update(r, AddEphemeralAction{EventList{receiptEvent({
+                    {"$1", {{"m.read", {{"@a:example.org", {{"ts", 10}}}}}}},
+                })}});
+    REQUIRE(again.readReceipts == r.readReceipts);
+    REQUIRE(again.eventReaders == r.eventReaders);
+}
+
+TEST_CASE("The local unread count should follow the read marker", "[client][room][receipts]")
+{
+    auto readMarker = [](std::string eventId) {
+        return AddAccountDataAction{EventList{Event(json{
+                        {"type", "m.fully_read"},
+                        {"content", {{"event_id", eventId}}},
+                    })}};
+    };
+    auto reaction = Event(json{
+            {"type", "m.reaction"},
+            {"event_id", "$r"},
+            {"origin_server_ts", 35},
+            {"content", json::object()},
+        });
+
+    auto r = RoomModel::update(RoomModel{}, readMarker("$2"));
+    // The marker is not known yet, so every message counts
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{timelineEvent("$3", 30), reaction, timelineEvent("$4", 40)},
+            std::nullopt, false, std::nullopt});
+    REQUIRE(r.localUnreadCount == 2);
+
+    r = RoomModel::update(std::move(r), AddToTimelineAction{
+            EventList{timelineEvent("$1", 10), timelineEvent("$2", 20)},
+            std::nullopt, false, std::nullopt});
+    REQUIRE(r.localUnreadCount == 2);
+
+    r = RoomModel::update(std::move(r), AppendTimelineAction{EventList{timelineEvent("$5", 50)}});
+    REQUIRE(r.localUnreadCount == 3);
+
+    r = RoomModel::update(std::move(r), readMarker("$4"));
+    REQUIRE(r.localUnreadCount == 1);
+
+    r = RoomModel::update(std::move(r), readMarker("$5"));
+    REQUIRE(r.localUnreadCount == 0);
+    REQUIRE(r.localUnreadCount == localUnreadCountOf(r, std::string{}));
+}
+
+TEST_CASE("The local unread count should not count the messages of the user", "[client][room][receipts]")
+{
+    auto userId = std::string("@me:example.org");
+    auto ownEvent = [&](std::string id, Timestamp ts) {
+        auto j = timelineEvent(id, ts).originalJson().get();
+        j["sender"] = userId;
+        return Event(j);
+    };
+    auto add = [&](RoomModel room, EventList events) {
+        return RoomModel::update(std::move(room), AddToTimelineAction{
+                events, std::nullopt, false, std::nullopt, userId});
+    };
+
+    // There is no read marker
+    auto r = add(RoomModel{}, EventList{timelineEvent("$1", 10), timelineEvent("$2", 20)});
+    REQUIRE(r.localUnreadCount == 2);
+
+    WHEN("the user sends a message")
+    {
+        r = add(std::move(r), EventList{ownEvent("$3", 30)});
+
+        THEN("everything before it should be read")
+        {
+            REQUIRE(r.localUnreadCount == 0);
+            REQUIRE(r.localUnreadCount == localUnreadCountOf(r, userId));
+
+            r = add(std::move(r), EventList{timelineEvent("$4", 40), ownEvent("$5", 50), timelineEvent("$6", 60)});
+            REQUIRE(r.localUnreadCount == 1);
+            REQUIRE(r.localUnreadCount == localUnreadCountOf(r, userId));
+
+            // Older messages from pagination are before it
+            r = add(std::move(r), EventList{timelineEvent("$0", 5)});
+            REQUIRE(r.localUnreadCount == 1);
+        }
+    }
+
+    WHEN("the read marker is after the latest message of the user")
+    {
+        r = add(std::move(r), EventList{ownEvent("$3", 30), timelineEvent("$4", 40), timelineEvent("$5", 50)});
+        r = RoomModel::update(std::move(r), AddAccountDataAction{EventList{Event(json{
+                        {"type", "m.fully_read"},
+                        {"content", {{"event_id", "$4"}}},
+                    })}, userId});
+
+        THEN("only the messages after the marker should be unread")
+        {
+            REQUIRE(r.localUnreadCount == 1);
+        }
+    }
+}
@@ -0,0 +1,193 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+
+#include <zug/transducer/map.hpp>
+
+#include <cursorutil.hpp>
+#include <search-index.hpp>
+
+using namespace Kazv;
+
+using IAr = boost::archive::text_iarchive;
+using OAr = boost::archive::text_oarchive;
+
+static Event messageEvent(std::string id, std::string body)
+{
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", id},
+            {"room_id", "!foo:example.org"},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 1},
+            {"content", {{"msgtype", "m.text"}, {"body", body}}},
+        });
+}
+
+static immer::flex_vector<std::string> eventIdsOf(immer::flex_vector<SearchResult> results)
+{
+    return intoImmer(immer::flex_vector<std::string>{},
+                     zug::map([](const SearchResult &r) { return r.eventId; }),
+                     results);
+}
+
+TEST_CASE("searchTermsOf should split and lowercase words", "[client][search]")
+{
+    REQUIRE(searchTermsOf("Hello, World! It's 2021...") == std::vector<std::string>{
+            "hello", "world", "it", "s", "2021"});
+    REQUIRE(searchTermsOf("  ") == std::vector<std::string>{});
+    REQUIRE(searchTermsOf("Grüße") == std::vector<std::string>{"grüße"});
+}
+
+TEST_CASE("searchableTextOf should take the body of messages", "[client][search]")
+{
+    REQUIRE(searchableTextOf(messageEvent("$1", "hi")) == "hi");
+
+    auto edit = Event(json{
+            {"type", "m.room.message"},
+            {"event_id", "$2"},
+            {"content", {
+                    {"body", "* hello"},
+                    {"m.new_content", {{"body", "hello"}}},
+                }},
+        });
+    REQUIRE(searchableTextOf(edit) == "hello");
+
+    auto reaction = Event(json{
+            {"type", "m.reaction"},
+            {"event_id", "$3"},
+            {"content", {{"body", "hi"}}},
+        });
+    REQUIRE(searchableTextOf(reaction) == std::nullopt);
+}
+
+TEST_CASE("SearchIndex should only return documents with all terms", "[client][search]")
+{
+    auto index = SearchIndex::addEvents(SearchIndex{}, EventList{
+            messageEvent("$1", "the quick brown fox"),
+            messageEvent("$2", "a lazy dog"),
+            messageEvent("$3", "the quick dog jumps over the lazy fox"),
+        });
+
+    REQUIRE(eventIdsOf(index.search("quick fox", 10)) == immer::flex_vector<std::string>{"$1", "$3"});
+    REQUIRE(eventIdsOf(index.search("Lazy DOG", 10)) == immer::flex_vector<std::string>{"$2", "$3"});
+    REQUIRE(index.search("quick cat", 10).empty());
+    REQUIRE(index.search("", 10).empty());
+    REQUIRE(index.search("fox", 0).empty());
+}
+
+TEST_CASE("SearchIndex should rank documents", "[client][search]")
+{
+    auto index = SearchIndex::addEvents(SearchIndex{}, EventList{
+            messageEvent("$1", "matrix"),
+            messageEvent("$2", "matrix matrix is a protocol"),
+            messageEvent("$3", "matrix"),
+            messageEvent("$4", "something else entirely"),
+        });
+
+    auto results = index.search("matrix", 10);
+    REQUIRE(results.size() == 3);
+    // Newer documents come first among equal scores
+    REQUIRE(eventIdsOf(results) == immer::flex_vector<std::string>{"$3", "$1", "$2"});
+    REQUIRE(results[0].score == results[1].score);
+    REQUIRE(results[1].score > results[2].score);
+
+    REQUIRE(eventIdsOf(index.search("matrix", 1)) == immer::flex_vector<std::string>{"$3"});
+}
+
+TEST_CASE("SearchIndex should skip indexed and removed events", "[client][search]")
+{
+    auto index = SearchIndex::addEvents(SearchIndex{}, EventList{
+            messageEvent("$1", "hello"),
+            messageEvent("$2", "hello there"),
+        });
+    auto again = SearchIndex::addEvents(index, EventList{messageEvent("$1", "hello")});
+    REQUIRE(again == index);
+
+    index = SearchIndex::remove(std::move(index), "$1");
+    REQUIRE(! index.has("$1"));
+    REQUIRE(index.has("$2"));
+    REQUIRE(index.totalLength == 2);
+    REQUIRE(eventIdsOf(index.search("hello", 10)) == immer::flex_vector<std::string>{"$2"});
+
+    REQUIRE(SearchIndex::remove(index, "$nonexistent") == index);
+}
+
+TEST_CASE("Search postings should be encoded and decoded", "[client][search]")
+{
+    auto postings = immer::flex_vector<SearchPosting>{
+        {0, 1}, {1, 3}, {200, 1}, {100000, 500},
+    };
+    auto encoded = encodeSearchPostings(postings);
+    // 1 byte each, except the delta of 199 and 99800, and the frequency of 500
+    REQUIRE(encoded.size() == 12);
+    REQUIRE(decodeSearchPostings(encoded) == postings);
+    REQUIRE(decodeSearchPostings(encodeSearchPostings({})).empty());
+}
+
+TEST_CASE("Serialize SearchIndex", "[client][search][serialization]")
+{
+    auto in = SearchIndex::addEvents(SearchIndex{}, EventList{
+            messageEvent("$1", "the quick brown fox"),
+            messageEvent("$2", "a lazy dog"),
+            messageEvent("$3", "the quick dog"),
+        });
+    in = SearchIndex::remove(std::move(in), "$2");
+    auto out = SearchIndex{};
+
+    std::stringstream stream;
+    {
+        auto ar = OAr(stream);
+        ar << in;
+    }
+    {
+        auto ar = IAr(stream);
+        ar >> out;
+    }
+
+    REQUIRE(in == out);
+    REQUIRE(! out.has("$2"));
+    REQUIRE(out.search("quick", 10) == in.search("quick", 10));
+
+    // Nothing of the removed event is stored
+    REQUIRE(stream.str().find("$2") == std::string::npos);
+    REQUIRE(stream.str().find("lazy") == std::string::npos);
+}
+
+TEST_CASE("Removing events should drop their postings", "[client][search]")
+{
+    auto index = SearchIndex::addEvents(SearchIndex{}, EventList{
+            messageEvent("$1", "the quick brown fox"),
+            messageEvent("$2", "a lazy dog"),
+            messageEvent("$3", "the quick dog"),
+        });
+    auto removed = SearchIndex::remove(index, "$2");
+
+    REQUIRE(removed.eventIds == immer::flex_vector<std::string>{"$1", "", "$3"});
+    REQUIRE(! removed.postings.find("lazy"));
+    REQUIRE(removed.postings["dog"] == immer::flex_vector<SearchPosting>{{2, 1}});
+    REQUIRE(removed.postings["quick"] == index.postings["quick"]);
+
+    WHEN("only the document is marked as removed, as in older snapshots")
+    {
+        auto old = index;
+        old.totalLength -= old.docLengths[1];
+        old.docLengths = std::move(old.docLengths).set(1, 0);
+        old.docNumbers = std::move(old.docNumbers).erase("$2");
+
+        THEN("compacting it should drop the postings and the event id")
+        {
+            REQUIRE(compactSearchIndex(old) == removed);
+        }
+    }
+}
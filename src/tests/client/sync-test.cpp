@@ -6,6 +6,7 @@
 
 #include <libkazv-config.hpp>
 
+#include <algorithm>
 
 #include <catch2/catch.hpp>
 
@@ -335,3 +336,476 @@ TEST_CASE("Sync should record state events in timeline", "[client][sync]")
     REQUIRE(stateOpt.has_value());
     REQUIRE(stateOpt.value().content().get().at("example") == "foo");
 }
+
+TEST_CASE("Streaming sync should give the same result as parsing the whole response", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto responseJson = GENERATE(syncResponseJson, stateInTimelineResponseJson);
+
+    auto domResp = createResponse("Sync", responseJson, json{{"is", "initial"}});
+    auto [domModel, domEffect] = ClientModel::update(m, ProcessResponseAction{domResp});
+
+    auto streamingResp = createResponse("Sync", responseJson.dump(), json{{"is", "initial"}});
+    auto [streamingModel, streamingEffect] = ClientModel::update(m, ProcessResponseAction{streamingResp});
+
+    REQUIRE(streamingModel.syncToken == domModel.syncToken);
+    REQUIRE(streamingModel.roomList == domModel.roomList);
+    REQUIRE(streamingModel.presence == domModel.presence);
+    REQUIRE(streamingModel.accountData == domModel.accountData);
+    REQUIRE(streamingModel.toDevice == domModel.toDevice);
+    REQUIRE(streamingModel.nextTriggers.size() == domModel.nextTriggers.size());
+}
+
+TEST_CASE("Streaming sync should fail on invalid json", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto resp = createResponse("Sync", std::string("{\"next_batch\": "), json{{"is", "initial"}});
+    auto [next, effect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    REQUIRE(! next.syncToken);
+}
+
+TEST_CASE("Streaming sync should not change the model if the response is truncated", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto firstRoom = json{
+        {"timeline", {
+                {"events", json::array({
+                            {
+                                {"type", "m.room.message"},
+                                {"event_id", "$first"},
+                                {"sender", "@example:localhost"},
+                                {"origin_server_ts", 1},
+                                {"content", {{"msgtype", "m.text"}, {"body", "first"}}},
+                            },
+                        })},
+                {"limited", false},
+            }},
+    };
+    auto responseJson = json{
+        {"next_batch", "s1"},
+        {"rooms", {
+                {"join", {
+                        {"!first:example.com", firstRoom},
+                        {"!second:example.com", firstRoom},
+                    }},
+            }},
+    };
+
+    // Cut right after the first joined room
+    auto body = responseJson.dump();
+    auto firstRoomStr = firstRoom.dump();
+    auto truncated = body.substr(0, body.find(firstRoomStr) + firstRoomStr.size());
+
+    auto resp = createResponse("Sync", truncated, json{{"is", "initial"}});
+    auto [next, effect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    REQUIRE(! next.syncToken);
+    REQUIRE(next.roomList == m.roomList);
+    REQUIRE(next.nextTriggers.size() == 1);
+    REQUIRE(std::holds_alternative<SyncFailed>(next.nextTriggers[0]));
+}
+
+TEST_CASE("Streaming sync should not load knocked rooms as left rooms", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto responseJson = syncResponseJson;
+    responseJson["rooms"]["knock"]["!knocked:example.com"] = json{
+        {"knock_state", {{"events", json::array()}}},
+    };
+
+    auto domResp = createResponse("Sync", responseJson, json{{"is", "initial"}});
+    auto [domModel, domEffect] = ClientModel::update(m, ProcessResponseAction{domResp});
+
+    auto streamingResp = createResponse("Sync", responseJson.dump(), json{{"is", "initial"}});
+    auto [streamingModel, streamingEffect] = ClientModel::update(m, ProcessResponseAction{streamingResp});
+
+    REQUIRE(! streamingModel.roomList.has("!knocked:example.com"));
+    REQUIRE(streamingModel.roomList == domModel.roomList);
+}
+
+TEST_CASE("SyncAction should request the unparsed body with streaming sync", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto [next, effect] = ClientModel::update(m, SyncAction{});
+    REQUIRE(next.nextJobs[0].returnType() == BaseJob::ReturnType::Json);
+
+    std::tie(m, std::ignore) = ClientModel::update(m, SetStreamingSyncAction{true});
+    std::tie(next, std::ignore) = ClientModel::update(m, SyncAction{});
+    REQUIRE(next.nextJobs[0].returnType() == BaseJob::ReturnType::File);
+}
+
+TEST_CASE("Loading rooms on several threads should give the same result as on one thread", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto joinedThenLeftJson = syncResponseJson;
+    joinedThenLeftJson["rooms"]["leave"]["!726s6s6q:example.com"] = json{
+        {"timeline", {{"events", json::array()}, {"limited", false}}},
+    };
+
+    auto responseJson = GENERATE_COPY(syncResponseJson, stateInTimelineResponseJson, joinedThenLeftJson);
+    auto resp = createResponse("Sync", responseJson, json{{"is", "initial"}});
+
+    auto [serialModel, serialEffect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    std::tie(m, std::ignore) = ClientModel::update(m, SetSyncThreadsAction{4});
+    auto [parallelModel, parallelEffect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    REQUIRE(parallelModel.syncToken == serialModel.syncToken);
+    REQUIRE(parallelModel.roomList == serialModel.roomList);
+    REQUIRE(parallelModel.nextTriggers.size() == serialModel.nextTriggers.size());
+}
+
+TEST_CASE("SetSyncThreadsAction should keep a worker pool of the right size", "[client][sync]")
+{
+    auto m = createTestClientModel();
+    REQUIRE(! m.workerPool);
+
+    std::tie(m, std::ignore) = ClientModel::update(m, SetSyncThreadsAction{4});
+    REQUIRE(m.workerPool);
+    REQUIRE(m.workerPool->size() == 3);
+    auto pool = m.workerPool;
+
+    std::tie(m, std::ignore) = ClientModel::update(m, SetSyncThreadsAction{4});
+    REQUIRE(m.workerPool == pool);
+
+    std::tie(m, std::ignore) = ClientModel::update(m, SetSyncThreadsAction{2});
+    REQUIRE(m.workerPool->size() == 1);
+
+    std::tie(m, std::ignore) = ClientModel::update(m, SetSyncThreadsAction{1});
+    REQUIRE(! m.workerPool);
+}
+
+TEST_CASE("Pipelined sync should apply responses only when asked to", "[client][sync]")
+{
+    auto m = createTestClientModel();
+    std::tie(m, std::ignore) = ClientModel::update(m, SetPipelinedSyncAction{true, 2});
+
+    auto resp = createResponse("Sync", syncResponseJson, json{{"is", "initial"}});
+    auto [pendingModel, pendingEffect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    REQUIRE(pendingModel.pendingSyncResponses.size() == 1);
+    REQUIRE(pendingModel.syncToken == m.syncToken);
+    REQUIRE(pendingModel.roomList == m.roomList);
+    REQUIRE(pendingModel.sinceToken() == syncResponseJson["next_batch"].get<std::string>());
+
+    WHEN("we start the next sync") {
+        auto [next, effect] = ClientModel::update(pendingModel, SyncAction{});
+        auto query = next.nextJobs[0].requestQuery();
+        auto since = std::find_if(query.begin(), query.end(), [](auto p) { return p.first == "since"; });
+        THEN("it should continue from the pending response") {
+            REQUIRE(since != query.end());
+            REQUIRE(since->second == syncResponseJson["next_batch"].get<std::string>());
+        }
+    }
+
+    WHEN("we apply the pending response") {
+        auto [applied, effect] = ClientModel::update(pendingModel, ApplyPendingSyncResponseAction{});
+        auto [direct, directEffect] = ClientModel::update(createTestClientModel(), ProcessResponseAction{resp});
+
+        THEN("it should be the same as processing it without pipelining") {
+            REQUIRE(applied.pendingSyncResponses.empty());
+            REQUIRE(applied.syncToken == direct.syncToken);
+            REQUIRE(applied.roomList == direct.roomList);
+            REQUIRE(applied.nextTriggers.size() == direct.nextTriggers.size());
+        }
+    }
+}
+
+TEST_CASE("Pipelined sync should not sync when too many responses are pending", "[client][sync]")
+{
+    auto m = createTestClientModel();
+    std::tie(m, std::ignore) = ClientModel::update(m, SetPipelinedSyncAction{true, 1});
+
+    auto resp = createResponse("Sync", syncResponseJson, json{{"is", "initial"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+    REQUIRE(m.pendingSyncResponses.size() == 2);
+
+    auto [next, effect] = ClientModel::update(m, SyncAction{});
+    REQUIRE(next.nextJobs.empty());
+}
+
+TEST_CASE("Pipelined sync should report a full queue as busy, not as a failure", "[client][sync]")
+{
+    auto m = createTestClientModel();
+    std::tie(m, std::ignore) = ClientModel::update(m, SetPipelinedSyncAction{true, 2});
+
+    auto resp = createResponse("Sync", syncResponseJson, json{{"is", "initial"}, {"since", nullptr}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+
+    // There is room for one more response
+    auto [syncing, syncingEffect] = ClientModel::update(m, SyncAction{});
+    REQUIRE(syncing.nextJobs.size() == 1);
+
+    auto nextResp = createResponse("Sync", syncResponseJson, json{{"is", "incremental"}, {"since", syncResponseJson["next_batch"]}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{nextResp});
+    REQUIRE(m.pendingSyncResponses.size() == 2);
+
+    boost::asio::io_context io;
+    AsioPromiseHandler ph{io.get_executor()};
+    auto store = createTestClientStoreFrom(m, ph);
+
+    auto called = false;
+    store.dispatch(SyncAction{})
+        .then([&](auto stat) {
+                  called = true;
+                  REQUIRE(stat.success());
+                  REQUIRE(stat.dataJson("busy") == true);
+              });
+    io.run();
+    REQUIRE(called);
+    REQUIRE(store.reader().get().nextJobs.empty());
+    REQUIRE(store.reader().get().pendingSyncResponses.size() == 2);
+}
+
+TEST_CASE("Pipelined sync should start over from syncToken when a pending response fails to apply", "[client][sync]")
+{
+    auto m = createTestClientModel();
+    std::tie(m, std::ignore) = ClientModel::update(m, SetPipelinedSyncAction{true, 2});
+
+    auto invalidBody = json{
+        {"next_batch", "s1"},
+        {"rooms", {{"join", {{"!a:example.com", {{"timeline", {{"events", json::array()}}}}}}}}},
+    }.dump();
+    invalidBody = invalidBody.substr(0, invalidBody.size() - 3);
+
+    auto invalidResp = createResponse("Sync", invalidBody, json{{"is", "initial"}, {"since", nullptr}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{invalidResp});
+    auto nextResp = createResponse("Sync", syncResponseJson, json{{"is", "incremental"}, {"since", "s1"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{nextResp});
+    REQUIRE(m.pendingSyncResponses.size() == 2);
+    REQUIRE(m.sinceToken() == syncResponseJson["next_batch"].get<std::string>());
+
+    auto [next, effect] = ClientModel::update(m, ApplyPendingSyncResponseAction{});
+
+    REQUIRE(! next.syncToken);
+    REQUIRE(next.pendingSyncResponses.empty());
+    REQUIRE(! next.sinceToken());
+
+    WHEN("a response of a request started from the failed one arrives")
+    {
+        auto staleResp = createResponse("Sync", syncResponseJson, json{{"is", "incremental"}, {"since", "s1"}});
+        std::tie(next, std::ignore) = ClientModel::update(next, ProcessResponseAction{staleResp});
+
+        THEN("it should be dropped")
+        {
+            REQUIRE(next.pendingSyncResponses.empty());
+            REQUIRE(! next.sinceToken());
+        }
+    }
+
+    WHEN("we sync again")
+    {
+        std::tie(next, std::ignore) = ClientModel::update(next, SyncAction{});
+        auto query = next.nextJobs[0].requestQuery();
+
+        THEN("it should fetch the failed response again")
+        {
+            auto since = std::find_if(query.begin(), query.end(), [](auto p) { return p.first == "since"; });
+            REQUIRE(since == query.end());
+        }
+    }
+}
+
+TEST_CASE("Sync should emit SyncMetrics before SyncSuccessful", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto body = syncResponseJson.dump();
+    auto resp = createResponse("Sync", body, json{{"is", "initial"}});
+    auto [next, effect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto triggers = next.nextTriggers;
+    REQUIRE(triggers.size() >= 2);
+    REQUIRE(std::holds_alternative<SyncSuccessful>(triggers[triggers.size() - 1]));
+    REQUIRE(std::holds_alternative<SyncMetrics>(triggers[triggers.size() - 2]));
+
+    auto metrics = std::get<SyncMetrics>(triggers[triggers.size() - 2]);
+    REQUIRE(metrics.nextToken == syncResponseJson["next_batch"].get<std::string>());
+    REQUIRE(metrics.roomsTouched == 2);
+    REQUIRE(metrics.eventsIngested > 0);
+    REQUIRE(metrics.bytesReceived == body.size());
+    REQUIRE(metrics.triggersEmitted == triggers.size() - 2);
+}
+
+TEST_CASE("Sync metrics should take the size of a parsed response from Content-Length", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto resp = createResponse("Sync", syncResponseJson, json{{"is", "initial"}});
+    resp.header = std::map<std::string, std::string>{{"Content-Length", "1234"}};
+    auto [next, effect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto triggers = next.nextTriggers;
+    REQUIRE(triggers.size() >= 2);
+    REQUIRE(std::holds_alternative<SyncMetrics>(triggers[triggers.size() - 2]));
+
+    auto metrics = std::get<SyncMetrics>(triggers[triggers.size() - 2]);
+    REQUIRE(metrics.bytesReceived == 1234);
+    REQUIRE(metrics.roomsTouched == 2);
+
+    WHEN("the server does not send Content-Length")
+    {
+        resp.header = std::map<std::string, std::string>{};
+        std::tie(next, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+        auto triggers = next.nextTriggers;
+
+        THEN("the size should be unknown")
+        {
+            REQUIRE(std::get<SyncMetrics>(triggers[triggers.size() - 2]).bytesReceived == 0);
+        }
+    }
+}
+
+TEST_CASE("Sync should only generate triggers someone listens to", "[client][sync]")
+{
+    auto m = createTestClientModel();
+    std::tie(m, std::ignore) = ClientModel::update(
+        m, SetSubscribedTriggersAction{KazvEventTypes{}.set(kazvEventIndex<ReceivingRoomTimelineEvent>)});
+
+    auto resp = createResponse("Sync", syncResponseJson, json{{"is", "initial"}});
+    auto [next, effect] = ClientModel::update(m, ProcessResponseAction{resp});
+
+    REQUIRE(next.nextTriggers.size() > 0);
+    REQUIRE(std::all_of(next.nextTriggers.begin(), next.nextTriggers.end(),
+                        [](const auto &t) { return std::holds_alternative<ReceivingRoomTimelineEvent>(t); }));
+
+    auto [allModel, allEffect] = ClientModel::update(createTestClientModel(), ProcessResponseAction{resp});
+    REQUIRE(allModel.roomList == next.roomList);
+}
+
+TEST_CASE("Sync should update the room summary", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto responseJson = syncResponseJson;
+    auto roomId = std::string("!726s6s6q:example.com");
+    responseJson["rooms"]["join"][roomId]["unread_notifications"] = json{
+        {"highlight_count", 1},
+        {"notification_count", 3},
+    };
+
+    auto streaming = GENERATE(false, true);
+    auto resp = streaming
+        ? createResponse("Sync", responseJson.dump(), json{{"is", "initial"}})
+        : createResponse("Sync", responseJson, json{{"is", "initial"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto summary = m.roomList.rooms[roomId].summary;
+    REQUIRE(summary.heroes == immer::flex_vector<std::string>{"@alice:example.com", "@bob:example.com"});
+    REQUIRE(summary.joinedMemberCount == 2);
+    REQUIRE(summary.invitedMemberCount == 0);
+    REQUIRE(summary.memberCountsFromServer);
+    REQUIRE(summary.displayName == "@alice:example.com and @bob:example.com");
+    REQUIRE(summary.highlightCount == 1);
+    REQUIRE(summary.notificationCount == 3);
+}
+
+static const json examplePushRulesEventJson = {
+    {"type", "m.push_rules"},
+    {"content", {{"global", {
+                    {"content", json::array({
+                                {{"rule_id", "example"}, {"pattern", "EXAMPLE"},
+                                 {"actions", json::array({"notify", {{"set_tweak", "highlight"}}})}},
+                            })},
+                    {"underride", json::array({
+                                {{"rule_id", ".m.rule.message"}, {"actions", json::array({"notify"})},
+                                 {"conditions", {{{"kind", "event_match"}, {"key", "type"}, {"pattern", "m.room.message"}}}}},
+                            })},
+                }}}},
+};
+
+static std::vector<ReceivingRoomTimelineEvent> timelineTriggers(const ClientModel &m)
+{
+    auto res = std::vector<ReceivingRoomTimelineEvent>{};
+    for (const auto &t : m.nextTriggers) {
+        if (std::holds_alternative<ReceivingRoomTimelineEvent>(t)) {
+            res.push_back(std::get<ReceivingRoomTimelineEvent>(t));
+        }
+    }
+    return res;
+}
+
+/// @return the body of `responseJson`, with account_data after rooms. dump() would sort the keys.
+static std::string bodyWithAccountDataLast(const json &responseJson)
+{
+    auto others = responseJson;
+    others.erase("rooms");
+    others.erase("account_data");
+    auto othersStr = others.dump();
+    return "{\"rooms\":" + responseJson["rooms"].dump()
+        + "," + othersStr.substr(1, othersStr.size() - 2)
+        + ",\"account_data\":" + responseJson["account_data"].dump() + "}";
+}
+
+TEST_CASE("Sync should annotate timeline events with push rule actions", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto responseJson = syncResponseJson;
+    responseJson["account_data"]["events"].push_back(examplePushRulesEventJson);
+    auto streaming = GENERATE(false, true);
+
+    // Rules in a response apply to the rooms in the same response,
+    // even if they come after the rooms
+    auto resp = streaming
+        ? createResponse("Sync", bodyWithAccountDataLast(responseJson), json{{"is", "initial"}})
+        : createResponse("Sync", responseJson, json{{"is", "initial"}});
+    std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{resp});
+
+    auto triggers = timelineTriggers(m);
+    REQUIRE(triggers.size() == 2);
+    // m.room.member
+    REQUIRE(triggers[0].pushAction == PushAction{});
+    REQUIRE(triggers[1].pushAction == PushAction{true, true, std::nullopt, "example"});
+
+    WHEN("the next response does not change the rules")
+    {
+        auto nextJson = syncResponseJson;
+        nextJson["account_data"]["events"] = json::array();
+        m.nextTriggers = {};
+        auto nextResp = streaming
+            ? createResponse("Sync", nextJson.dump(), json{{"is", "incremental"}})
+            : createResponse("Sync", nextJson, json{{"is", "incremental"}});
+        std::tie(m, std::ignore) = ClientModel::update(m, ProcessResponseAction{nextResp});
+
+        auto nextTriggers = timelineTriggers(m);
+        REQUIRE(nextTriggers.size() == 2);
+        REQUIRE(nextTriggers[1].pushAction.ruleId == "example");
+    }
+}
+
+TEST_CASE("Streaming sync should apply the push rules in the response to its rooms", "[client][sync]")
+{
+    auto m = createTestClientModel();
+
+    auto responseJson = syncResponseJson;
+    responseJson["account_data"]["events"].push_back(examplePushRulesEventJson);
+
+    auto domResp = createResponse("Sync", responseJson, json{{"is", "initial"}});
+    auto [domModel, domEffect] = ClientModel::update(m, ProcessResponseAction{domResp});
+
+    auto body = bodyWithAccountDataLast(responseJson);
+    REQUIRE(json::parse(body) == responseJson);
+
+    auto accountDataFirst = GENERATE(false, true);
+    auto streamingResp = createResponse("Sync", accountDataFirst ? responseJson.dump() : body, json{{"is", "initial"}});
+    auto [streamingModel, streamingEffect] = ClientModel::update(m, ProcessResponseAction{streamingResp});
+
+    auto domTriggers = timelineTriggers(domModel);
+    auto streamingTriggers = timelineTriggers(streamingModel);
+    REQUIRE(streamingTriggers.size() == domTriggers.size());
+    for (std::size_t i = 0; i < domTriggers.size(); ++i) {
+        REQUIRE(streamingTriggers[i].event.id() == domTriggers[i].event.id());
+        REQUIRE(streamingTriggers[i].pushAction == domTriggers[i].pushAction);
+    }
+    REQUIRE(streamingTriggers[1].pushAction == PushAction{true, true, std::nullopt, "example"});
+    REQUIRE(streamingModel.accountData == domModel.accountData);
+}
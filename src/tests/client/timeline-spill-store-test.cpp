@@ -0,0 +1,95 @@
+/*
+ * This file is part of libkazv.
+ * SPDX-FileCopyrightText: 2021 Tusooa Zhu <tusooa@kazv.moe>
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ */
+
+#include <libkazv-config.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <timeline-spill-store.hpp>
+
+#include "kazvtest-respath.hpp"
+
+using namespace Kazv;
+
+static Event spilledEvent(std::string id)
+{
+    return Event(json{
+            {"type", "m.room.message"},
+            {"event_id", id},
+            {"sender", "@a:example.org"},
+            {"origin_server_ts", 1},
+            {"content", {{"msgtype", "m.text"}, {"body", "foo"}}},
+        });
+}
+
+TEST_CASE("FileTimelineSpillStore should pop what is pushed last", "[client][timeline-spill-store]")
+{
+    auto dir = std::filesystem::path(resPath) / "timeline-spill-store-tmp";
+    std::filesystem::remove_all(dir);
+
+    auto first = SpilledEvents{EventList{spilledEvent("$1"), spilledEvent("$2")},
+                               immer::map<std::string, std::string>{}.set("$1", "gap1")};
+    auto second = SpilledEvents{EventList{spilledEvent("$3")}, {}};
+
+    {
+        auto store = FileTimelineSpillStore(dir);
+        REQUIRE(! store.has("!foo:example.org"));
+        REQUIRE(store.push("!foo:example.org", first));
+        REQUIRE(store.push("!foo:example.org", second));
+        REQUIRE(store.push("!bar:example.org", second));
+    }
+
+    // Another store with the same directory sees the same events
+    auto store = FileTimelineSpillStore(dir);
+    REQUIRE(store.has("!foo:example.org"));
+
+    auto popped = store.pop("!foo:example.org");
+    REQUIRE(popped);
+    REQUIRE(popped->events == second.events);
+    REQUIRE(popped->gaps.empty());
+
+    popped = store.pop("!foo:example.org");
+    REQUIRE(popped);
+    REQUIRE(popped->events == first.events);
+    REQUIRE(popped->gaps == first.gaps);
+
+    REQUIRE(! store.has("!foo:example.org"));
+    REQUIRE(! store.pop("!foo:example.org"));
+    REQUIRE(store.has("!bar:example.org"));
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("FileTimelineSpillStore should keep events it cannot read", "[client][timeline-spill-store]")
+{
+    auto dir = std::filesystem::path(resPath) / "timeline-spill-store-tmp";
+    std::filesystem::remove_all(dir);
+
+    auto store = FileTimelineSpillStore(dir);
+    REQUIRE(store.push("!foo:example.org", SpilledEvents{EventList{spilledEvent("$1")}, {}}));
+
+    auto files = std::vector<std::filesystem::path>{};
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(dir)) {
+        if (entry.is_regular_file()) {
+            files.push_back(entry.path());
+        }
+    }
+    // No temporary file is left
+    REQUIRE(files.size() == 1);
+    {
+        auto stream = std::ofstream(files[0], std::ios::trunc);
+        stream << "{\"events\": [";
+    }
+
+    REQUIRE(! store.pop("!foo:example.org"));
+    REQUIRE(store.has("!foo:example.org"));
+
+    std::filesystem::remove_all(dir);
+}
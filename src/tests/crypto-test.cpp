@@ -20,6 +20,8 @@
 #include <base64.hpp>
 #include <sha256.hpp>
 
+#include "client/client-test-util.hpp"
+
 using namespace Kazv;
 using namespace Kazv::CryptoConstants;
 
@@ -68,6 +70,59 @@ TEST_CASE("Crypto should be copyable", "[crypto]")
     REQUIRE(crypto.numUnpublishedOneTimeKeys() == cryptoClone.numUnpublishedOneTimeKeys());
 }
 
+TEST_CASE("Modifying a copy of Crypto should not affect the original", "[crypto]")
+{
+    Crypto crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    std::string roomId = "!example:example.com";
+    crypto.rotateMegOlmSessionWithRandom(genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId);
+    auto origKey = crypto.outboundGroupSessionCurrentKey(roomId);
+
+    Crypto cryptoClone(crypto);
+
+    cryptoClone.genOneTimeKeysWithRandom(genRandomData(Crypto::genOneTimeKeysRandomSize(1)), 1);
+    REQUIRE(crypto.numUnpublishedOneTimeKeys() == 0);
+    REQUIRE(cryptoClone.numUnpublishedOneTimeKeys() == 1);
+
+    cryptoClone.encryptMegOlm(json{
+            {"room_id", roomId},
+            {"type", "m.room.message"},
+            {"content", {{"body", "test"}}},
+        });
+    REQUIRE(crypto.outboundGroupSessionCurrentKey(roomId) == origKey);
+    REQUIRE(cryptoClone.outboundGroupSessionCurrentKey(roomId) != origKey);
+
+    std::string roomId2 = "!example2:example.com";
+    cryptoClone.rotateMegOlmSessionWithRandom(genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId2);
+    REQUIRE_THROWS(crypto.outboundGroupSessionCurrentKey(roomId2));
+}
+
+TEST_CASE("Modifying a session in place should not affect earlier copies", "[crypto]")
+{
+    Crypto crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    std::string roomId = "!example:example.com";
+    crypto.rotateMegOlmSessionWithRandom(genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId);
+    auto eventJson = json{
+        {"room_id", roomId},
+        {"type", "m.room.message"},
+        {"content", {{"body", "test"}}},
+    };
+
+    // No one else holds the session now
+    crypto.encryptMegOlm(eventJson);
+    crypto.encryptMegOlm(eventJson);
+
+    Crypto cryptoClone(crypto);
+    auto keyAtCopy = crypto.outboundGroupSessionCurrentKey(roomId);
+
+    crypto.encryptMegOlm(eventJson);
+    crypto.encryptMegOlm(eventJson);
+    REQUIRE(cryptoClone.outboundGroupSessionCurrentKey(roomId) == keyAtCopy);
+    REQUIRE(crypto.outboundGroupSessionCurrentKey(roomId) != keyAtCopy);
+
+    cryptoClone.encryptMegOlm(eventJson);
+    REQUIRE(cryptoClone.outboundGroupSessionCurrentKey(roomId) != keyAtCopy);
+}
+
 TEST_CASE("Crypto should be serializable", "[crypto]")
 {
     Crypto crypto(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
@@ -185,6 +240,75 @@ TEST_CASE("Should reuse existing inbound session to encrypt", "[crypto]")
     REQUIRE(devicesAClone == expected);
 }
 
+TEST_CASE("decryptBatch() should decrypt events of many sessions", "[crypto]")
+{
+    Crypto a(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+    Crypto b(RandomTag{}, genRandomData(Crypto::constructRandomSize()));
+
+    std::string roomId1 = "!example1:example.com";
+    std::string roomId2 = "!example2:example.com";
+    auto sessionKey1 = a.rotateMegOlmSessionWithRandom(genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId1);
+    auto sessionKey2 = a.rotateMegOlmSessionWithRandom(genRandomData(Crypto::rotateMegOlmSessionRandomSize()), 0, roomId2);
+
+    auto eventJsons = std::vector<json>{
+        megOlmEventJson(a, roomId1, "$1", "first"),
+        megOlmEventJson(a, roomId2, "$2", "second"),
+        megOlmEventJson(a, roomId1, "$3", "third"),
+    };
+    auto sessionId1 = eventJsons[0]["content"]["session_id"].get<std::string>();
+    auto sessionId2 = eventJsons[1]["content"]["session_id"].get<std::string>();
+
+    b.createInboundGroupSession(KeyOfGroupSession{roomId1, a.curve25519IdentityKey(), sessionId1},
+        sessionKey1, a.ed25519IdentityKey());
+    b.createInboundGroupSession(KeyOfGroupSession{roomId2, a.curve25519IdentityKey(), sessionId2},
+        sessionKey2, a.ed25519IdentityKey());
+    // An event of room 1 claiming to be in room 2
+    b.createInboundGroupSession(KeyOfGroupSession{roomId2, a.curve25519IdentityKey(), sessionId1},
+        sessionKey1, a.ed25519IdentityKey());
+    auto misplaced = megOlmEventJson(a, roomId1, "$4", "fourth");
+    misplaced["room_id"] = roomId2;
+    eventJsons.push_back(misplaced);
+
+    // An event we do not have the keys for
+    auto unknown = megOlmEventJson(a, roomId1, "$5", "fifth");
+    unknown["content"]["session_id"] = "unknown";
+    eventJsons.push_back(unknown);
+
+    auto unsupported = eventJsons[0];
+    unsupported["content"]["algorithm"] = "moe.kazv.unknown";
+    eventJsons.push_back(unsupported);
+
+    for (auto numThreads : {1, 4}) {
+        auto pool = makeWorkerPool(numThreads);
+        auto c = b;
+        auto results = c.decryptBatch(eventJsons, pool.get());
+
+        REQUIRE(results.size() == eventJsons.size());
+        auto bodies = std::vector<std::string>{"first", "second", "third", "fourth"};
+        for (std::size_t i = 0; i < bodies.size(); ++i) {
+            REQUIRE(results[i].plainJson);
+            REQUIRE(results[i].plainJson.value()["content"]["body"] == bodies[i]);
+            REQUIRE(results[i].sessionEd25519Key == a.ed25519IdentityKey());
+        }
+        REQUIRE(results[0].roomIdMatches);
+        REQUIRE(results[1].roomIdMatches);
+        REQUIRE(results[2].roomIdMatches);
+        REQUIRE(! results[3].roomIdMatches);
+        REQUIRE(! results[4].plainJson);
+        REQUIRE(! results[5].plainJson);
+
+        // The same as decrypting them one by one
+        auto d = b;
+        for (std::size_t i = 0; i < eventJsons.size(); ++i) {
+            auto plainText = d.decrypt(eventJsons[i]);
+            REQUIRE(bool(plainText) == bool(results[i].plainJson));
+            if (plainText) {
+                REQUIRE(json::parse(plainText.value()) == results[i].plainJson.value());
+            }
+        }
+    }
+}
+
 TEST_CASE("Encrypt and decrypt AES-256-CTR", "[crypto][aes256ctr]")
 {
     auto r = genRandom(AES256CTRDesc::randomSize);
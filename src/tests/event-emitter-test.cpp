@@ -11,6 +11,7 @@
 #include <catch2/catch.hpp>
 
 #include <eventemitter/lagerstoreeventemitter.hpp>
+#include <eventemitter/sync-metrics-sink.hpp>
 
 #include <lager/event_loop/boost_asio.hpp>
 
@@ -81,3 +82,68 @@ TEST_CASE("Event emitter should work normally", "[eventemitter]")
         REQUIRE(counter2 == 1);
     }
 }
+
+namespace
+{
+    struct CountingSyncMetricsSink : public SyncMetricsSink
+    {
+        void record(const SyncMetrics &metrics) override
+        {
+            ++count;
+            lastToken = metrics.nextToken;
+        }
+
+        int count{0};
+        std::string lastToken;
+    };
+}
+
+TEST_CASE("Sync metrics sink should receive SyncMetrics events", "[eventemitter]")
+{
+    boost::asio::io_context ioContext;
+
+    LagerStoreEventEmitter ee{lager::with_boost_asio_event_loop{ioContext.get_executor()}};
+
+    auto watchable = ee.watchable();
+    auto sink = std::make_shared<CountingSyncMetricsSink>();
+    connectSyncMetricsSink(watchable, sink);
+
+    auto metrics = SyncMetrics{};
+    metrics.nextToken = "s1";
+    ee.emit(metrics);
+    ee.emit(SyncSuccessful{"s1"});
+
+    ioContext.run();
+
+    REQUIRE(sink->count == 1);
+    REQUIRE(sink->lastToken == "s1");
+}
+
+TEST_CASE("Event emitter should publish the types of events listened to", "[eventemitter]")
+{
+    boost::asio::io_context ioContext;
+
+    LagerStoreEventEmitter ee{lager::with_boost_asio_event_loop{ioContext.get_executor()}};
+
+    auto watchable = ee.watchable();
+    watchable.after<SyncSuccessful>([](auto) {});
+
+    REQUIRE(! ee.subscribedEvents().has_value());
+
+    ee.publishSubscriptions(true);
+    REQUIRE(ee.subscribedEvents() == KazvEventTypes{}.set(kazvEventIndex<SyncSuccessful>));
+
+    {
+        auto watchable2 = ee.watchable();
+        watchable2.after<SyncFailed>([](auto) {});
+        REQUIRE(ee.subscribedEvents().value().test(kazvEventIndex<SyncFailed>));
+    }
+
+    // Let the event loop drop its references to the listeners
+    ioContext.run();
+
+    REQUIRE(! ee.subscribedEvents().value().test(kazvEventIndex<SyncFailed>));
+
+    watchable.afterAll([](auto) {});
+    REQUIRE(ee.subscribedEvents().value().all());
+}
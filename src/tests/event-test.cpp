@@ -36,3 +36,78 @@ TEST_CASE("Should distinguish between state events and other events", "[base][ev
 
     REQUIRE(!nonState.isState());
 }
+
+TEST_CASE("Event should read the header fields from the json", "[base][event]")
+{
+    Event e = R"({
+    "state_key": "@foo:example.org",
+    "sender": "@example:example.org",
+    "type": "m.room.member",
+    "event_id": "$some-event",
+    "room_id": "!some-room:example.org",
+    "origin_server_ts": 1234,
+    "content": {}
+})"_json;
+
+    REQUIRE(e.id() == "$some-event");
+    REQUIRE(e.sender() == "@example:example.org");
+    REQUIRE(e.type() == "m.room.member");
+    REQUIRE(e.stateKey() == "@foo:example.org");
+    REQUIRE(e.roomId() == "!some-room:example.org");
+    REQUIRE(e.originServerTs() == 1234);
+
+    Event empty;
+    REQUIRE(empty.id() == "");
+    REQUIRE(empty.sender() == "");
+    REQUIRE(empty.type() == "");
+    REQUIRE(empty.stateKey() == "");
+    REQUIRE(empty.roomId() == "");
+    REQUIRE(empty.originServerTs() == 0);
+    REQUIRE(! empty.isState());
+}
+
+TEST_CASE("Event should intern type and sender", "[base][event]")
+{
+    auto j = R"({
+    "sender": "@example:example.org",
+    "type": "m.room.message",
+    "event_id": "$1",
+    "room_id": "!some-room:example.org",
+    "origin_server_ts": 1234,
+    "content": {}
+})"_json;
+    Event a = j;
+    j["event_id"] = "$2";
+    Event b = j;
+
+    REQUIRE(&a.type() == &b.type());
+    REQUIRE(&a.sender() == &b.sender());
+    REQUIRE(a.roomId() == b.roomId());
+    REQUIRE(a.id() != b.id());
+}
+
+TEST_CASE("Event should take type and state key from the decrypted json", "[base][event]")
+{
+    Event e = R"({
+    "sender": "@example:example.org",
+    "type": "m.room.encrypted",
+    "event_id": "$1",
+    "origin_server_ts": 1234,
+    "content": {}
+})"_json;
+
+    REQUIRE(e.type() == "m.room.message");
+
+    auto decrypted = e.setDecryptedJson(R"({
+    "type": "moe.kazv.mxc.custom.state.type",
+    "state_key": "foo",
+    "content": {}
+})"_json, Event::Decrypted);
+
+    REQUIRE(decrypted.type() == "moe.kazv.mxc.custom.state.type");
+    REQUIRE(decrypted.stateKey() == "foo");
+    REQUIRE(decrypted.isState());
+    REQUIRE(decrypted.id() == "$1");
+    REQUIRE(decrypted.sender() == "@example:example.org");
+    REQUIRE(decrypted.originServerTs() == 1234);
+}